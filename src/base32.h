@@ -45,6 +45,13 @@
  */
 #define UNBASE32_LEN(len)  (((len)/8)*5)
 
+/**
+ * Returns the size of the output buffer base32_decode() writes to for a string
+ * of up to len characters. It is one byte more than the decoded length, when
+ * the string ends with a full sequence, since the terminator starts another.
+ */
+#define BASE32_DECODE_SIZE(len)  (UNBASE32_LEN((len) + 7) + 1)
+
 /**
  * Encode the data pointed to by plain into base32 and store the
  * result at the address pointed to by coded. The "coded" argument
@@ -0,0 +1,70 @@
+/*
+ * Copyright (c) 2023 Nitrokey GmbH
+ *
+ * This file is part of Nitrokey HOTP verification project.
+ *
+ * Nitrokey HOTP verification is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * Nitrokey HOTP verification is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Nitrokey HOTP verification. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0
+ */
+
+#include "buffer.h"
+#include "min.h"
+#include "return_codes.h"
+#include "settings.h"
+#include "utils.h"
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+
+int buffer_reserve(struct Buffer *buffer, size_t size) {
+    if (size <= buffer->capacity) {
+        return RET_NO_ERROR;
+    }
+    if (size > MAX_CCID_BUFFER_SIZE) {
+        return RET_NO_MEMORY;
+    }
+    // not realloc(), which would leave the frames written so far behind in the freed block
+    uint8_t *data = malloc(size);
+    if (data == NULL) {
+        return RET_NO_MEMORY;
+    }
+    if (buffer->data != NULL) {
+        memcpy(data, buffer->data, buffer->capacity);
+        secure_zero(buffer->data, buffer->dirty);
+        free(buffer->data);
+    }
+    memset(data + buffer->capacity, 0, size - buffer->capacity);
+    buffer->data = data;
+    buffer->capacity = size;
+    return RET_NO_ERROR;
+}
+
+void buffer_mark(struct Buffer *buffer, size_t used) {
+    buffer->dirty = MAX(buffer->dirty, min(used, buffer->capacity));
+}
+
+void buffer_clean(struct Buffer *buffer) {
+    if (buffer->data != NULL) {
+        secure_zero(buffer->data, buffer->dirty);
+    }
+    buffer->dirty = 0;
+}
+
+void buffer_free(struct Buffer *buffer) {
+    buffer_clean(buffer);
+    free(buffer->data);
+    buffer->data = NULL;
+    buffer->capacity = 0;
+}
@@ -0,0 +1,51 @@
+/*
+ * Copyright (c) 2023 Nitrokey GmbH
+ *
+ * This file is part of Nitrokey HOTP verification project.
+ *
+ * Nitrokey HOTP verification is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * Nitrokey HOTP verification is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Nitrokey HOTP verification. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0
+ */
+
+#ifndef NITROKEY_HOTP_VERIFICATION_BUFFER_H
+#define NITROKEY_HOTP_VERIFICATION_BUFFER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Heap buffer, which grows to the largest frame it had to hold, and remembers how much of it was written.
+ * Only the written part is zeroed on cleaning.
+ */
+struct Buffer {
+    uint8_t *data;
+    size_t capacity;
+    // bytes [0, dirty) might contain data
+    size_t dirty;
+};
+
+/**
+ * Make sure the buffer can hold at least size bytes. Newly allocated memory is zeroed.
+ * @return RET_NO_ERROR, or RET_NO_MEMORY if the allocation failed or size is over MAX_CCID_BUFFER_SIZE
+ */
+int buffer_reserve(struct Buffer *buffer, size_t size);
+// Record, that the first used bytes of the buffer were written
+void buffer_mark(struct Buffer *buffer, size_t used);
+// Zero the written part of the buffer
+void buffer_clean(struct Buffer *buffer);
+// Zero and release the memory
+void buffer_free(struct Buffer *buffer);
+
+#endif//NITROKEY_HOTP_VERIFICATION_BUFFER_H
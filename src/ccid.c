@@ -20,11 +20,17 @@
  */
 
 #include "ccid.h"
+#include "buffer.h"
+#include "ctaphid.h"
+#include "flight_recorder.h"
 #include "min.h"
 #include "operations_ccid.h"
+#include "pcsc.h"
 #include "return_codes.h"
+#include "session.h"
 #include "settings.h"
 #include "tlv.h"
+#include "trace.h"
 #include "utils.h"
 #include <libusb.h>
 #include <stdbool.h>
@@ -40,28 +46,27 @@ static const int WRITE_ENDPOINT = 0x01;
 
 static const int TIMEOUT = 2 * 1000;
 
+static int ccid_receive_matching(struct Device *dev, const uint8_t awaited[], int awaited_count, int *awaited_index,
+                                 int *actual_length, struct Buffer *buffer, size_t offset);
+static int ccid_receive_response(struct Device *dev, uint8_t awaited_seq, int *actual_length, struct Buffer *buffer);
 
-uint32_t icc_compose(uint8_t *buf, uint32_t buffer_length, uint8_t msg_type, size_t data_len, uint8_t slot, uint8_t seq, uint16_t param, uint8_t *data) {
-    static int _seq = 0;
-    if (seq == 0) {
-        seq = _seq++;
-    }
 
+uint32_t icc_compose(uint8_t *buf, uint32_t buffer_length, uint8_t msg_type, size_t data_len, uint8_t slot, uint8_t seq, uint16_t param, uint8_t *data) {
     size_t i = 0;
     buf[i++] = msg_type;
 
     rassert(data_len < INT32_MAX);
-    int32_t _data_len = (int32_t) data_len;
-    buf[i++] = _data_len << 0;
-    buf[i++] = _data_len << 8;
-    buf[i++] = _data_len << 16;
-    buf[i++] = _data_len << 24;
+    const uint32_t _data_len = (uint32_t) data_len;
+    buf[i++] = (uint8_t) (_data_len >> 0);
+    buf[i++] = (uint8_t) (_data_len >> 8);
+    buf[i++] = (uint8_t) (_data_len >> 16);
+    buf[i++] = (uint8_t) (_data_len >> 24);
 
     buf[i++] = slot;
     buf[i++] = seq;
     buf[i++] = 0;
-    buf[i++] = param << 0;
-    buf[i++] = param << 8;
+    buf[i++] = (uint8_t) (param >> 0);
+    buf[i++] = (uint8_t) (param >> 8);
     const size_t final_data_length = min(data_len, buffer_length - i);
     memmove(buf + i, data, final_data_length);
     i += final_data_length;
@@ -69,20 +74,55 @@ uint32_t icc_compose(uint8_t *buf, uint32_t buffer_length, uint8_t msg_type, siz
 }
 
 
-uint32_t iso7816_compose(uint8_t *buf, uint32_t buffer_length, uint8_t ins, uint8_t p1, uint8_t p2, uint8_t cls, uint8_t le, uint8_t *data, uint8_t data_len) {
+static bool iso7816_extended(size_t data_len, uint32_t le) {
+    return data_len > ISO7816_SHORT_MAX_LC || le > ISO7816_SHORT_MAX_LE;
+}
+
+uint32_t iso7816_lc_size(size_t data_len, uint32_t le) {
+    if (data_len == 0) {
+        return 0;
+    }
+    return iso7816_extended(data_len, le) ? 3 : 1;
+}
+
+uint32_t iso7816_compose(uint8_t *buf, uint32_t buffer_length, uint8_t ins, uint8_t p1, uint8_t p2, uint8_t cls, uint32_t le, uint8_t *data, size_t data_len) {
+    if (data == NULL) {
+        data_len = 0;
+    }
+    if (data_len > ISO7816_EXTENDED_MAX_LC || le > ISO7816_EXTENDED_MAX_LE) {
+        return 0;
+    }
+    // the extended form of Lc and Le is used for both, once one of them does not fit in a byte
+    const bool extended = iso7816_extended(data_len, le);
+    const uint32_t lc_size = iso7816_lc_size(data_len, le);
+    const uint32_t le_size = le == 0 ? 0 : !extended ? 1 : data_len != 0 ? 2 : 3;
+    if (buffer_length < 4 + lc_size + data_len + le_size) {
+        return 0;
+    }
+
     size_t i = 0;
     buf[i++] = cls;
     buf[i++] = ins;
     buf[i++] = p1;
     buf[i++] = p2;
-    if (data != NULL && data_len != 0) {
-        buf[i++] = data_len;
-        const size_t data_length = min(data_len, buffer_length - i - 1);
-        memmove(buf + i, data, data_length);
-        i += data_length;
+    if (data_len != 0) {
+        if (extended) {
+            buf[i++] = 0;
+            buf[i++] = (uint8_t) (data_len >> 8);
+        }
+        buf[i++] = (uint8_t) data_len;
+        memmove(buf + i, data, data_len);
+        i += data_len;
     }
     if (le != 0) {
-        buf[i++] = le;
+        // the maximum, 256 or 65536, is encoded as zero
+        if (extended) {
+            if (data_len == 0) {
+                buf[i++] = 0;
+            }
+            buf[i++] = (uint8_t) (le >> 8);
+        }
+        buf[i++] = (uint8_t) le;
     }
     return i;
 }
@@ -90,10 +130,11 @@ uint32_t iso7816_compose(uint8_t *buf, uint32_t buffer_length, uint8_t ins, uint
 
 IccResult parse_icc_result(uint8_t *buf, size_t buf_len) {
     rassert(buf_len >= 10);
-    unused(buf_len);
-    const uint8_t data_len = buf[1] | (buf[2] << 8) | (buf[3] << 16) | (buf[4] << 24);
+    const uint32_t data_len = buf[1] | (buf[2] << 8) | (buf[3] << 16) | ((uint32_t) buf[4] << 24);
+    // Make sure the response do not contain overread attempts
+    rassert(data_len <= buf_len - 10);
     // take last 2 bytes as the status code, if there is any data returned
-    const uint16_t data_status_code = (data_len >= 2) ? be16toh(*(uint16_t *) &buf[10 + data_len - 2]) : 0;
+    const uint16_t data_status_code = (data_len >= 2) ? load_be16(&buf[10 + data_len - 2]) : 0;
     const IccResult i = {
             .status = buf[7],
             .chain = buf[9],
@@ -103,23 +144,47 @@ IccResult parse_icc_result(uint8_t *buf, size_t buf_len) {
             //            .buffer = buf,
             //            .buffer_len = buf_len
     };
-    // Make sure the response do not contain overread attempts
-    rassert(i.data_len <= buf_len - 10);
     return i;
 }
 
-libusb_device_handle *get_device(libusb_context *ctx, const struct VidPid pPid[], int devices_count) {
+// Finish opening the claimed interface. The handle is closed on failure.
+static libusb_device_handle *select_alt_setting(libusb_device_handle *handle) {
+    LOG("set alt interface\n");
+    const int r = libusb_set_interface_alt_setting(handle, 0, 0);
+    if (r < 0) {
+        message_print(MESSAGE_INFO, "Error set alt interface: %s\n", libusb_strerror(r));
+        libusb_release_interface(handle, 0);
+        libusb_close(handle);
+        return NULL;
+    }
+    return handle;
+}
+
+// Lock of the device at its USB bus and address, which stay the same until it is unplugged
+static int lock_usb_device(struct DeviceLock *lock, libusb_device *dev) {
+    char key[DEVICE_LOCK_KEY_SIZE];
+    device_lock_usb_key(key, libusb_get_bus_number(dev), libusb_get_device_address(dev));
+    return device_lock_try(lock, key);
+}
+
+libusb_device_handle *get_device(libusb_context *ctx, const struct VidPid pPid[], int devices_count,
+                                 struct DeviceLock *lock, bool *busy) {
     int r;
+    *busy = false;
     libusb_device **devs;
-    size_t count = libusb_get_device_list(ctx, &devs);
-    if (count == 0) {
-        printf("Error getting device list\n");
+    const ssize_t count = libusb_get_device_list(ctx, &devs);
+    if (count <= 0) {
+        if (count == 0) {
+            // the empty list is allocated as well
+            libusb_free_device_list(devs, 1);
+        }
+        message_print(MESSAGE_INFO, "Error getting device list\n");
         return NULL;
     }
 
     rassert(devices_count == 1);
     libusb_device_handle *handle = NULL;
-    for (size_t i = 0; i < count; i++) {
+    for (ssize_t i = 0; i < count; i++) {
         libusb_device *dev = devs[i];
         struct libusb_device_descriptor desc;
         if (libusb_get_device_descriptor(devs[i], &desc) >= 0) {
@@ -129,106 +194,275 @@ libusb_device_handle *get_device(libusb_context *ctx, const struct VidPid pPid[]
             }
         }
 
+        // Another Device instance or process might be using this key already - try the next one
+        if (lock_usb_device(lock, dev) == RET_DEVICE_BUSY) {
+            *busy = true;
+            continue;
+        }
+
         r = libusb_open(dev, &handle);
+        if (r != LIBUSB_SUCCESS) {
+            message_print(MESSAGE_INFO, "Error opening device: %s\n", libusb_strerror(r));
+            device_lock_release(lock);
+            handle = NULL;
+            continue;
+        }
+        LOG("open\n");
+
+        r = libusb_claim_interface(handle, 0);
         if (r == LIBUSB_SUCCESS) {
-            LOG("open\n");
             break;
-        } else {
-            printf("Error opening device: %s\n", libusb_strerror(r));
         }
+        // claimed by a process, which does not take the locks
+        *busy = *busy || r == LIBUSB_ERROR_BUSY;
+        LOG("Error claiming interface: %s\n", libusb_strerror(r));
+        libusb_close(handle);
+        device_lock_release(lock);
+        handle = NULL;
     }
     libusb_free_device_list(devs, 1);
     if (handle == NULL) {
-        printf("No working device found\n");
+        if (!*busy) {
+            message_print(MESSAGE_INFO, "No working device found\n");
+        }
         return NULL;
     }
 
-    r = libusb_claim_interface(handle, 0);
-    if (r < 0) {
-        printf("Error claiming interface: %s\n", libusb_strerror(r));
+    return select_alt_setting(handle);
+}
+
+libusb_device_handle *get_device_from_fd(libusb_context *ctx, int fd, const struct VidPid pPid[], int devices_count,
+                                         struct DeviceLock *lock, bool *busy) {
+    *busy = false;
+#if defined(LIBUSB_API_VERSION) && LIBUSB_API_VERSION >= 0x01000107
+    libusb_device_handle *handle = NULL;
+    int r = libusb_wrap_sys_device(ctx, (intptr_t) fd, &handle);
+    if (r != LIBUSB_SUCCESS) {
+        message_print(MESSAGE_INFO, "Error opening device from the file descriptor: %s\n", libusb_strerror(r));
         return NULL;
     }
 
-    LOG("set alt interface\n");
-    r = libusb_set_interface_alt_setting(handle, 0, 0);
-    if (r < 0) {
-        printf("Error set alt interface: %s\n", libusb_strerror(r));
+    struct libusb_device_descriptor desc;
+    r = libusb_get_device_descriptor(libusb_get_device(handle), &desc);
+    bool known = false;
+    for (int i = 0; r >= 0 && i < devices_count; ++i) {
+        known = known || (desc.idVendor == pPid[i].vid && desc.idProduct == pPid[i].pid);
+    }
+    if (!known) {
+        message_print(MESSAGE_INFO, "Not a supported device: %04x:%04x\n", desc.idVendor, desc.idProduct);
+        libusb_close(handle);
         return NULL;
     }
 
-    return handle;
+    if (lock_usb_device(lock, libusb_get_device(handle)) == RET_DEVICE_BUSY) {
+        *busy = true;
+        libusb_close(handle);
+        return NULL;
+    }
+    r = libusb_claim_interface(handle, 0);
+    if (r != LIBUSB_SUCCESS) {
+        *busy = r == LIBUSB_ERROR_BUSY;
+        if (!*busy) {
+            message_print(MESSAGE_INFO, "Error claiming interface: %s\n", libusb_strerror(r));
+        }
+        libusb_close(handle);
+        device_lock_release(lock);
+        return NULL;
+    }
+    return select_alt_setting(handle);
+#else
+    unused(ctx);
+    unused(fd);
+    unused(pPid);
+    unused(devices_count);
+    unused(lock);
+    message_print(MESSAGE_INFO, "Opening device from the file descriptor requires libusb 1.0.23 or newer\n");
+    return NULL;
+#endif
 }
 
 
-int ccid_process_single(libusb_device_handle *handle, uint8_t *receiving_buffer, uint32_t receiving_buffer_length, const uint8_t *sending_buffer,
-                        const uint32_t sending_buffer_length, IccResult *result) {
-    rassert(handle != NULL);
-    int actual_length = 0, r;
+static void report_touch(struct Device *dev, TouchEvent event) {
+    if (event == TOUCH_REQUIRED) {
+        TRACE_PROBE(touch_wait_start, dev->ccid_backend_connected);
+        flight_record(dev->flight_id, "touch_wait_start", NULL, 0, NULL, 0, 0);
+    } else if (event == TOUCH_RECEIVED) {
+        TRACE_PROBE(touch_wait_end, RET_NO_ERROR);
+        flight_record(dev->flight_id, "touch_wait_end", NULL, RET_NO_ERROR, NULL, 0, 0);
+    }
+    if (dev->touch_callback != NULL) {
+        dev->touch_callback(event, dev->touch_callback_data);
+    }
+}
+
+// Remember the message waiting for touch, to recognize it when the operation is called again
+static int touch_pending_store(struct Device *dev, const uint8_t *message, uint32_t length) {
+    struct Buffer *pending = &dev->touch_pending_message;
+    buffer_clean(pending);
+    if (buffer_reserve(pending, length) != RET_NO_ERROR) {
+        return RET_NO_MEMORY;
+    }
+    memmove(pending->data, message, length);
+    buffer_mark(pending, length);
+    dev->touch_pending = true;
+    return RET_NO_ERROR;
+}
+
+static void touch_pending_clear(struct Device *dev) {
+    buffer_clean(&dev->touch_pending_message);
+    dev->touch_pending = false;
+}
+
+// The message is the one waiting for touch, if only its bSeq differs
+static bool touch_pending_matches(struct Device *dev, const uint8_t *message, uint32_t length) {
+    const struct Buffer *pending = &dev->touch_pending_message;
+    if (!dev->touch_pending || pending->dirty != length || length <= CCID_HEADER_SEQ_OFFSET) {
+        return false;
+    }
+    const size_t after_seq = CCID_HEADER_SEQ_OFFSET + 1;
+    return memcmp(message, pending->data, CCID_HEADER_SEQ_OFFSET) == 0 &&
+           memcmp(message + after_seq, pending->data + after_seq, length - after_seq) == 0;
+}
+
+// A different message is about to be sent, while the previous one waits for touch.
+// Its response is dropped if the touch came meanwhile, otherwise the device is still busy.
+static int touch_pending_drop(struct Device *dev) {
+    int actual_length = 0;
+    const uint8_t pending_seq = dev->touch_pending_message.data[CCID_HEADER_SEQ_OFFSET];
+    const int r = ccid_receive_response(dev, pending_seq, &actual_length, &dev->ccid_buffer_in);
+    if (r != 0) {
+        return r;
+    }
+    const IccResult iccResult = parse_icc_result(dev->ccid_buffer_in.data, actual_length);
+    if (iccResult.status == AWAITING_FOR_TOUCH_STATUS_CODE) {
+        report_touch(dev, TOUCH_WAITING);
+        return RET_TOUCH_REQUIRED;
+    }
+    report_touch(dev, TOUCH_RECEIVED);
+    touch_pending_clear(dev);
+    return 0;
+}
+
+/**
+ * Fetch the data left by the response with the status 61xx, and append it to the data received so far
+ * in dev->ccid_buffer_in at offset, in place of that status. The result is parsed again from the joined response,
+ * which has to be the last one in the buffer.
+ */
+static int ccid_get_response(struct Device *dev, size_t offset, IccResult *iccResult) {
+    // SW2 is the length of the remaining data, or 0 for 256 bytes and more
+    const uint8_t remaining = (uint8_t) iccResult->data_status_code;
+    uint8_t apdu[ISO7816_HEADER_SIZE] = {};
+    const uint32_t apdu_length = iso7816_compose(apdu, sizeof apdu, Ins_GetResponse, 0, 0, 0,
+                                                 remaining == 0 ? ISO7816_SHORT_MAX_LE : remaining, NULL, 0);
+    uint8_t message[CCID_HEADER_SIZE + ISO7816_HEADER_SIZE] = {};
+    const uint32_t message_length = icc_compose(message, sizeof message, 0x6F, apdu_length, 0, 0, 0, apdu);
+    int actual_length = 0;
+    int r = ccid_send(dev, &actual_length, message, message_length);
+    if (r != 0) {
+        return r;
+    }
 
-    r = ccid_send(handle, &actual_length, sending_buffer, sending_buffer_length);
+    // the next part is received over the status word of the data so far
+    const size_t kept = offset + CCID_HEADER_SIZE + iccResult->data_len - 2;
+    int index = 0;
+    const uint8_t awaited_seq = message[CCID_HEADER_SEQ_OFFSET];
+    r = ccid_receive_matching(dev, &awaited_seq, 1, &index, &actual_length, &dev->ccid_buffer_in, kept);
     if (r != 0) {
         return r;
     }
+    uint8_t *response = dev->ccid_buffer_in.data + offset;
+    const IccResult part = parse_icc_result(dev->ccid_buffer_in.data + kept, actual_length);
+    if (part.data_len <= 2 && (part.data_status_code >> 8) == DATA_REMAINING_STATUS_CODE) {
+        LOG("GET RESPONSE returned no data\n");
+        return RET_COMM_ERROR;
+    }
+    memmove(dev->ccid_buffer_in.data + kept, part.data, part.data_len);
+    const uint32_t data_len = (uint32_t) (kept - offset - CCID_HEADER_SIZE + part.data_len);
+    response[1] = (uint8_t) data_len;
+    response[2] = (uint8_t) (data_len >> 8);
+    response[3] = (uint8_t) (data_len >> 16);
+    response[4] = (uint8_t) (data_len >> 24);
+    *iccResult = parse_icc_result(response, CCID_HEADER_SIZE + data_len);
+    LOG("Status code: %s\n", ccid_error_message(iccResult->data_status_code));
+    return 0;
+}
+
+static int ccid_exchange(struct Device *dev, uint8_t *sending_buffer, const uint32_t sending_buffer_length, IccResult *result) {
+    int actual_length = 0, r;
+
+    bool awaiting_touch = false;
+    if (dev->touch_pending) {
+        if (touch_pending_matches(dev, sending_buffer, sending_buffer_length)) {
+            // resume the exchange instead of sending the message again
+            awaiting_touch = true;
+        } else {
+            r = touch_pending_drop(dev);
+            if (r != 0) {
+                return r;
+            }
+        }
+    }
+
+    uint8_t awaited_seq;
+    if (awaiting_touch) {
+        awaited_seq = dev->touch_pending_message.data[CCID_HEADER_SEQ_OFFSET];
+    } else {
+        r = ccid_send(dev, &actual_length, sending_buffer, sending_buffer_length);
+        if (r != 0) {
+            return r;
+        }
+        awaited_seq = sending_buffer[CCID_HEADER_SEQ_OFFSET];
+    }
 
-    int prev_status = 0;
     while (true) {
-        usleep(10 * 1000);
-        r = ccid_receive(handle, &actual_length, receiving_buffer, receiving_buffer_length);
+        // only polling for the touch confirmation is paused, the response is read right away otherwise
+        if (awaiting_touch && !deadline_sleep(dev->deadline, 10 * 1000)) {
+            LOG("Timeout while waiting for the device response\n");
+            TRACE_PROBE(touch_wait_end, RET_TIMEOUT);
+            flight_record(dev->flight_id, "touch_wait_end", NULL, RET_TIMEOUT, NULL, 0, 0);
+            return RET_TIMEOUT;
+        }
+        r = ccid_receive_response(dev, awaited_seq, &actual_length, &dev->ccid_buffer_in);
         if (r != 0) {
+            if (awaiting_touch) {
+                TRACE_PROBE(touch_wait_end, r);
+                flight_record(dev->flight_id, "touch_wait_end", NULL, r, NULL, 0, 0);
+            }
             return r;
         }
 
-        IccResult iccResult = parse_icc_result(receiving_buffer, receiving_buffer_length);
+        IccResult iccResult = parse_icc_result(dev->ccid_buffer_in.data, actual_length);
         LOG("status %d, chain %d\n", iccResult.status, iccResult.chain);
         if (iccResult.data_len > 0) {
             print_buffer(iccResult.data, iccResult.data_len, "    returned data");
             LOG("Status code: %s\n", ccid_error_message(iccResult.data_status_code));
         }
-        if (iccResult.data[0] == DATA_REMAINING_STATUS_CODE) {
-            // 0x61 status code means data remaining, make another receive call
-
-            uint8_t buf_sr[SMALL_CCID_BUFFER_SIZE] = {};
-            uint32_t send_rem_length = iso7816_compose(buf_sr, sizeof buf_sr,
-                                                       Ins_GetResponse, 0, 0, 0, 0xFF, NULL, 0);
-            uint8_t buf_sr_2[SMALL_CCID_BUFFER_SIZE] = {};
-            uint32_t send_rem_icc_len = icc_compose(buf_sr_2, sizeof buf_sr_2,
-                                                    0x6F, send_rem_length,
-                                                    0, 0, 0, buf_sr);
-            int actual_length_sr = 0;
-            r = ccid_send(handle, &actual_length_sr, buf_sr_2, send_rem_icc_len);
-            if (r != 0) {
-                return r;
-            }
-
-            memset(receiving_buffer, 0, receiving_buffer_length);
-            r = ccid_receive(handle, &actual_length_sr, receiving_buffer, receiving_buffer_length);
+        // the status 61xx tells more data is waiting, fetched with GET RESPONSE
+        while ((iccResult.data_status_code >> 8) == DATA_REMAINING_STATUS_CODE) {
+            r = ccid_get_response(dev, 0, &iccResult);
             if (r != 0) {
                 return r;
             }
-
-            iccResult = parse_icc_result(receiving_buffer, receiving_buffer_length);
-            LOG("status %d, chain %d\n", iccResult.status, iccResult.chain);
-            if (iccResult.data_len > 0) {
-                print_buffer(iccResult.data, iccResult.data_len, "    returned data");
-                LOG("Status code: %s\n", ccid_error_message(iccResult.data_status_code));
-            }
         }
         if (iccResult.status == AWAITING_FOR_TOUCH_STATUS_CODE) {
-            if (prev_status != iccResult.status) {
-                printf("Please touch the USB security key if it blinks ");
-                fflush(stdout);
-                prev_status = iccResult.status;
-            } else {
-                printf(".");
-                fflush(stdout);
+            report_touch(dev, awaiting_touch ? TOUCH_WAITING : TOUCH_REQUIRED);
+            awaiting_touch = true;
+            if (dev->touch_non_blocking) {
+                if (!dev->touch_pending) {
+                    r = touch_pending_store(dev, sending_buffer, sending_buffer_length);
+                    if (r != RET_NO_ERROR) {
+                        return r;
+                    }
+                }
+                return RET_TOUCH_REQUIRED;
             }
             continue;
-        } else if (prev_status == AWAITING_FOR_TOUCH_STATUS_CODE){
-            printf("\n");
-            fflush(stdout);
+        } else if (awaiting_touch) {
+            report_touch(dev, TOUCH_RECEIVED);
+            touch_pending_clear(dev);
+            awaiting_touch = false;
         }
 
-        prev_status = iccResult.status;
         if (iccResult.chain == 0 || iccResult.chain == 2) {
             if (result != NULL) {
                 memmove(result, &iccResult, sizeof iccResult);
@@ -240,230 +474,559 @@ int ccid_process_single(libusb_device_handle *handle, uint8_t *receiving_buffer,
             case 3:
                 continue;
             default:
-                printf("Invalid value for chain: %d\n", iccResult.chain);
+                message_print(MESSAGE_INFO, "Invalid value for chain: %d\n", iccResult.chain);
                 return RET_COMM_ERROR;
         }
     }
     return 0;
 }
 
-int ccid_process(libusb_device_handle *handle, uint8_t *buf, uint32_t buf_length, const uint8_t **data_to_send,
-                 int data_to_send_count, const uint32_t *data_to_send_sizes, bool continue_on_errors,
-                 IccResult *result) {
+int ccid_process_single(struct Device *dev, uint8_t *sending_buffer, const uint32_t sending_buffer_length, IccResult *result) {
+    rassert(dev != NULL);
+    const CommandKind kind = retry_classify_ccid_message(sending_buffer, sending_buffer_length);
+    int r = ccid_exchange(dev, sending_buffer, sending_buffer_length, result);
+    // the response to the failed attempt, if it comes after all, is dropped as a stale one
+    for (int attempt = 1; r != 0 && retry_next_attempt(dev, device_retry_policy(dev), "ccid_exchange", kind, r, attempt); ++attempt) {
+        r = ccid_exchange(dev, sending_buffer, sending_buffer_length, result);
+    }
+    return r;
+}
+
+// Length of the CCID message from its header, or 0 if it does not fit in the available bytes
+static uint32_t icc_message_length(const uint8_t *message, uint32_t available) {
+    if (available < CCID_HEADER_SIZE) {
+        return 0;
+    }
+    const uint32_t data_length = message[1] | (message[2] << 8) | (message[3] << 16) | ((uint32_t) message[4] << 24);
+    if (data_length > available - CCID_HEADER_SIZE) {
+        return 0;
+    }
+    return CCID_HEADER_SIZE + data_length;
+}
+
+static int ccid_exchange_batch(struct Device *dev, uint8_t *messages, uint32_t messages_length, const uint32_t message_offset[],
+                               IccResult results[], int count) {
     int r;
-    rassert(buf != NULL);
-    rassert(buf_length >= 270);
 
-    for (int i = 0; i < data_to_send_count; ++i) {
-        const unsigned char *d = data_to_send[i];
-        const int length = (int) data_to_send_sizes[i];
+    if (dev->touch_pending) {
+        r = touch_pending_drop(dev);
+        if (r != 0) {
+            return r;
+        }
+    }
+
+    // the CCID specification allows a single command per slot in flight, unless configured otherwise
+    const int depth = dev->ccid_pipeline_depth == 0 ? 1 : (int) min(dev->ccid_pipeline_depth, CCID_BATCH_MAX_MESSAGES);
 
-        r = ccid_process_single(handle, buf, buf_length, d, length, result);
+    // responses are stored one after another, and parsed once all arrived - the buffer might be moved while growing
+    buffer_clean(&dev->ccid_buffer_in);
+    uint32_t response_offset[CCID_BATCH_MAX_MESSAGES] = {};
+    int response_length[CCID_BATCH_MAX_MESSAGES] = {};
+    uint32_t responses_length = 0;
+
+    // messages sent and not answered yet, the oldest first
+    uint8_t awaited_seq[CCID_BATCH_MAX_MESSAGES] = {};
+    int awaited_message[CCID_BATCH_MAX_MESSAGES] = {};
+    int awaited_count = 0;
+
+    int sent = 0;
+    bool awaiting_touch = false;
+    while (sent < count || awaited_count > 0) {
+        while (sent < count && awaited_count < depth) {
+            uint8_t *message = messages + message_offset[sent];
+            const uint32_t length = (sent + 1 < count ? message_offset[sent + 1] : messages_length) - message_offset[sent];
+            int actual_length = 0;
+            r = ccid_send(dev, &actual_length, message, length);
+            if (r != 0) {
+                return r;
+            }
+            awaited_seq[awaited_count] = message[CCID_HEADER_SEQ_OFFSET];
+            awaited_message[awaited_count] = sent;
+            awaited_count++;
+            sent++;
+        }
+
+        if (awaiting_touch && !deadline_sleep(dev->deadline, 10 * 1000)) {
+            LOG("Timeout while waiting for the device response\n");
+            TRACE_PROBE(touch_wait_end, RET_TIMEOUT);
+            flight_record(dev->flight_id, "touch_wait_end", NULL, RET_TIMEOUT, NULL, 0, 0);
+            return RET_TIMEOUT;
+        }
+        int index = 0, actual_length = 0;
+        r = ccid_receive_matching(dev, awaited_seq, awaited_count, &index, &actual_length, &dev->ccid_buffer_in, responses_length);
         if (r != 0) {
-            if (continue_on_errors) {
-                // ignore error, continue with sending the next record
-                continue;
-            } else {
+            if (awaiting_touch) {
+                TRACE_PROBE(touch_wait_end, r);
+                flight_record(dev->flight_id, "touch_wait_end", NULL, r, NULL, 0, 0);
+            }
+            return r;
+        }
+
+        const uint8_t *response = dev->ccid_buffer_in.data + responses_length;
+        if (response[7] == AWAITING_FOR_TOUCH_STATUS_CODE) {
+            report_touch(dev, awaiting_touch ? TOUCH_WAITING : TOUCH_REQUIRED);
+            awaiting_touch = true;
+            continue;
+        }
+        if (awaiting_touch) {
+            report_touch(dev, TOUCH_RECEIVED);
+            awaiting_touch = false;
+        }
+        if (response[9] != 0) {
+            LOG("Chained response is not supported in a batch: %d\n", response[9]);
+            return RET_COMM_ERROR;
+        }
+        IccResult part = parse_icc_result(dev->ccid_buffer_in.data + responses_length, actual_length);
+        while ((part.data_status_code >> 8) == DATA_REMAINING_STATUS_CODE) {
+            // the device would take GET RESPONSE for the message sent last
+            if (awaited_count > 1) {
+                LOG("Remaining response data is not supported with the messages sent ahead\n");
+                return RET_COMM_ERROR;
+            }
+            r = ccid_get_response(dev, responses_length, &part);
+            if (r != 0) {
                 return r;
             }
+            actual_length = (int) (CCID_HEADER_SIZE + part.data_len);
         }
 
-    }// end for
+        const int message = awaited_message[index];
+        response_offset[message] = responses_length;
+        response_length[message] = actual_length;
+        responses_length += actual_length;
+        for (int i = index; i + 1 < awaited_count; ++i) {
+            awaited_seq[i] = awaited_seq[i + 1];
+            awaited_message[i] = awaited_message[i + 1];
+        }
+        awaited_count--;
+    }
+
+    for (int i = 0; i < count; ++i) {
+        results[i] = parse_icc_result(dev->ccid_buffer_in.data + response_offset[i], response_length[i]);
+        LOG("batch response %d: status %d, %s\n", i, results[i].status, ccid_error_message(results[i].data_status_code));
+    }
     return 0;
 }
 
-int send_select_ccid(libusb_device_handle *handle, uint8_t buf[], size_t buf_size, IccResult *iccResult) {
-    unsigned char cmd_select[] = {
-            0x6f,
-            0x0c,
-            0x00,
-            0x00,
-            0x00,
-            0x00,
-            0x00,
-            0x00,
-            0x00,
-            0x00,
-            0x00,
-            0xa4,
-            0x04,
-            0x00,
-            0x07,
-            0xa0,
-            0x00,
-            0x00,
-            0x05,
-            0x27,
-            0x21,
-            0x01,
-    };
+int ccid_process_batch(struct Device *dev, uint8_t *messages, uint32_t messages_length, IccResult results[], int count) {
+    rassert(dev != NULL);
+    rassert(messages != NULL);
+    rassert(results != NULL);
+    rassert(count > 0 && count <= CCID_BATCH_MAX_MESSAGES);
 
-    check_ret(
-            ccid_process_single(handle, buf, buf_size, cmd_select, sizeof cmd_select, iccResult),
-            RET_COMM_ERROR);
+    uint32_t message_offset[CCID_BATCH_MAX_MESSAGES] = {};
+    uint32_t offset = 0;
+    // the batch is sent again as a whole, so only if each of its messages can be
+    CommandKind kind = COMMAND_IDEMPOTENT;
+    for (int i = 0; i < count; ++i) {
+        const uint32_t length = icc_message_length(messages + offset, messages_length - offset);
+        rassert(length > 0);
+        message_offset[i] = offset;
+        if (retry_classify_ccid_message(messages + offset, length) == COMMAND_NOT_IDEMPOTENT) {
+            kind = COMMAND_NOT_IDEMPOTENT;
+        }
+        offset += length;
+    }
+    rassert(offset == messages_length);
 
+    int r = ccid_exchange_batch(dev, messages, messages_length, message_offset, results, count);
+    for (int attempt = 1; r != 0 && retry_next_attempt(dev, device_retry_policy(dev), "ccid_batch", kind, r, attempt); ++attempt) {
+        r = ccid_exchange_batch(dev, messages, messages_length, message_offset, results, count);
+    }
+    return r;
+}
 
-    return RET_NO_ERROR;
+// Take the PIN state from the Secrets App SELECT response, which has the PIN counter only if the PIN is set
+static void secrets_app_state_update(struct Device *dev, const IccResult *iccResult) {
+    dev->secrets_app.known = false;
+    if (iccResult == NULL || iccResult->data_len == 0 || iccResult->data_status_code != 0x9000) {
+        return;
+    }
+    TLV counter_tlv = {};
+    const int r = get_tlv(iccResult->data, iccResult->data_len, Tag_PINCounter, &counter_tlv);
+    dev->secrets_app.pin_set = r == RET_NO_ERROR && counter_tlv.tag == Tag_PINCounter;
+    dev->secrets_app.known = true;
+    TLV serial_tlv = {};
+    if (get_tlv(iccResult->data, iccResult->data_len, Tag_SerialNumber, &serial_tlv) == RET_NO_ERROR &&
+        serial_tlv.tag == Tag_SerialNumber && serial_tlv.length >= 4) {
+        dev->card_serial = load_be32(serial_tlv.v_data);
+    }
 }
 
-int send_select_nk3_admin_ccid(libusb_device_handle *handle, uint8_t buf[], size_t buf_size, IccResult *iccResult) {
-    unsigned char cmd_select[] = {
-            0x6f,
-            0x0E,
-            0x00,
-            0x00,
-            0x00,
-            0x00,
-            0x00,
-            0x00,
-            0x00,
-            0x00,
-            0x00,
-            0xa4,
-            0x04,
-            0x00,
-            0x09,
-            0xa0,
-            0x00,
-            0x00,
-            0x08,
-            0x47,
-            0x00,
-            0x00,
-            0x00,
-            0x01,
-    };
+// SELECT messages of the applications, indexed by enum SelectedApplication
+static const unsigned char SELECT_SECRETS[] = {
+        0x6f, 0x0c, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+        0x00, 0xa4, 0x04, 0x00, 0x07,
+        0xa0, 0x00, 0x00, 0x05, 0x27, 0x21, 0x01};
 
-    check_ret(
-            ccid_process_single(handle, buf, buf_size, cmd_select, sizeof cmd_select, iccResult),
-            RET_COMM_ERROR);
+static const unsigned char SELECT_NK3_ADMIN[] = {
+        0x6f, 0x0E, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+        0x00, 0xa4, 0x04, 0x00, 0x09,
+        0xa0, 0x00, 0x00, 0x08, 0x47, 0x00, 0x00, 0x00, 0x01};
 
+static const unsigned char SELECT_NK3_PGP[] = {
+        0x6f, 0x0C, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+        0x00, 0xA4, 0x04, 0x00, 0x06,
+        0xD2, 0x76, 0x00, 0x01, 0x24, 0x01, 0x00};
 
-    return RET_NO_ERROR;
+static const struct {
+    const unsigned char *message;
+    uint32_t length;
+} SELECT_MESSAGES[] = {
+        [Application_Secrets] = {SELECT_SECRETS, sizeof SELECT_SECRETS},
+        [Application_Admin] = {SELECT_NK3_ADMIN, sizeof SELECT_NK3_ADMIN},
+        [Application_Pgp] = {SELECT_NK3_PGP, sizeof SELECT_NK3_PGP},
+};
+
+uint32_t icc_append_select(uint8_t *buf, uint32_t buffer_length, uint32_t offset, enum SelectedApplication application) {
+    rassert(application < ARR_LEN(SELECT_MESSAGES));
+    const uint32_t length = SELECT_MESSAGES[application].length;
+    if (offset > buffer_length || buffer_length - offset < length) {
+        return 0;
+    }
+    memmove(buf + offset, SELECT_MESSAGES[application].message, length);
+    return offset + length;
 }
 
-int send_select_nk3_pgp_ccid(libusb_device_handle *handle, uint8_t buf[], size_t buf_size, IccResult *iccResult) {
-    unsigned char cmd_select[] = {
-            0x6f,
-            0x0C,
-            0x00,
-            0x00,
-            0x00,
-            0x00,
-            0x00,
-            0x00,
-            0x00,
-            0x00,
-            0x00,
-            0xA4,
-            0x04,
-            0x00,
-            0x06,
-            0xD2,
-            0x76,
-            0x00,
-            0x01,
-            0x24,
-            0x01,
-            0x00,
-    };
+uint32_t icc_append_apdu(uint8_t *buf, uint32_t buffer_length, uint32_t offset, uint8_t ins, uint8_t p1, uint8_t p2, uint8_t le) {
+    if (offset > buffer_length || buffer_length - offset < CCID_HEADER_SIZE + ISO7816_HEADER_SIZE) {
+        return 0;
+    }
+    uint8_t data_iso[ISO7816_HEADER_SIZE] = {};
+    const uint32_t iso_actual_length = iso7816_compose(data_iso, sizeof data_iso, ins, p1, p2, 0, le, NULL, 0);
+    return offset + icc_compose(buf + offset, buffer_length - offset, 0x6F, iso_actual_length, 0, 0, 0, data_iso);
+}
 
-    check_ret(
-            ccid_process_single(handle, buf, buf_size, cmd_select, sizeof cmd_select, iccResult),
-            RET_COMM_ERROR);
+static int send_select(struct Device *dev, enum SelectedApplication application, IccResult *iccResult) {
+    uint8_t cmd_select[SMALL_CCID_BUFFER_SIZE] = {};
+    const uint32_t length = icc_append_select(cmd_select, sizeof cmd_select, 0, application);
+    rassert(length > 0);
 
+    // selecting any application resets the verified PIN state on the device
+    session_end(dev);
+    return ccid_process_single(dev, cmd_select, length, iccResult);
+}
 
+int send_select_ccid(struct Device *dev, IccResult *iccResult) {
+    const int r = send_select(dev, Application_Secrets, iccResult);
+    if (r != 0) {
+        dev->secrets_app.known = false;
+        return r;
+    }
+    secrets_app_state_update(dev, iccResult);
     return RET_NO_ERROR;
 }
 
-int ccid_init(libusb_device_handle *handle) {
-
-    unsigned char cmd_select[] = {
-            0x6f,
-            0x0c,
-            0x00,
-            0x00,
-            0x00,
-            0x00,
-            0x00,
-            0x00,
-            0x00,
-            0x00,
-            0x00,
-            0xa4,
-            0x04,
-            0x00,
-            0x07,
-            0xa0,
-            0x00,
-            0x00,
-            0x05,
-            0x27,
-            0x21,
-            0x01,
-    };
+int send_select_nk3_admin_ccid(struct Device *dev, IccResult *iccResult) {
+    const int r = send_select(dev, Application_Admin, iccResult);
+    if (r != 0) {
+        return r;
+    }
+    return RET_NO_ERROR;
+}
 
+int send_select_nk3_pgp_ccid(struct Device *dev, IccResult *iccResult) {
+    const int r = send_select(dev, Application_Pgp, iccResult);
+    if (r != 0) {
+        return r;
+    }
+    return RET_NO_ERROR;
+}
 
-    const unsigned char *data_to_send[] = {
-            cmd_select,
-            cmd_select,
-    };
+// dwMaxCCIDMessageLength from the class descriptor of the CCID interface, or 0 if it is missing or not valid
+static uint32_t ccid_reader_max_message_length(libusb_device_handle *handle) {
+    struct libusb_config_descriptor *config = NULL;
+    if (libusb_get_active_config_descriptor(libusb_get_device(handle), &config) != 0) {
+        return 0;
+    }
+    uint32_t max_length = 0;
+    if (config->bNumInterfaces > 0 && config->interface[0].num_altsetting > 0) {
+        const struct libusb_interface_descriptor *setting = &config->interface[0].altsetting[0];
+        const uint8_t *extra = setting->extra;
+        for (int i = 0; i + 2 <= setting->extra_length && extra[i] >= 2; i += extra[i]) {
+            if (extra[i + 1] == CCID_DESCRIPTOR_TYPE && extra[i] >= CCID_DESCRIPTOR_LENGTH &&
+                i + CCID_DESCRIPTOR_LENGTH <= setting->extra_length) {
+                const uint8_t *field = extra + i + CCID_DESCRIPTOR_MAX_MESSAGE_OFFSET;
+                max_length = field[0] | (field[1] << 8) | (field[2] << 16) | ((uint32_t) field[3] << 24);
+                break;
+            }
+        }
+    }
+    libusb_free_config_descriptor(config);
+    return max_length >= CCID_MIN_MAX_MESSAGE_LENGTH ? max_length : 0;
+}
 
-    const unsigned int data_to_send_size[] = {
-            sizeof(cmd_select),
-            sizeof(cmd_select),
-    };
+int ccid_init(struct Device *dev) {
+    // a PC/SC transmission and a CTAPHID message carry a single exchange
+    dev->ccid_pipeline_depth = dev->ccid_backend_connected == CCID_BACKEND_LIBUSB ? CCID_PIPELINE_DEPTH : 1;
+    dev->ccid_max_message_length = dev->ccid_backend_connected == CCID_BACKEND_LIBUSB
+                                           ? ccid_reader_max_message_length(dev->mp_devhandle_ccid)
+                                           : 0;
 
-    unsigned char buf[MAX_CCID_BUFFER_SIZE] = {};
-    ccid_process(handle, buf, sizeof buf, data_to_send, LEN_ARR(data_to_send), data_to_send_size, true, NULL);
+    uint8_t cmd_select[SMALL_CCID_BUFFER_SIZE] = {};
+    const uint32_t length = icc_append_select(cmd_select, sizeof cmd_select, 0, Application_Secrets);
+    rassert(length > 0);
+
+    // a failed SELECT is sent again by the retry policy; the state stays unknown, if it fails still
+    IccResult iccResult = {};
+    if (ccid_process_single(dev, cmd_select, length, &iccResult) != 0) {
+        dev->secrets_app.known = false;
+        return 0;
+    }
+    secrets_app_state_update(dev, &iccResult);
     return 0;
 }
 
-uint32_t icc_pack_tlvs_for_sending(uint8_t *buf, size_t buflen, TLV *tlvs, int tlvs_count, int ins) {
-    uint8_t data_tlvs[MAX_CCID_BUFFER_SIZE] = {};
-    int tlvs_actual_length = process_all(data_tlvs, tlvs, tlvs_count);
+uint32_t icc_append_tlvs(struct Buffer *buf, uint32_t offset, TLV *tlvs, int tlvs_count, int ins) {
+    // TLVs are encoded directly at their final place in the frame. The APDU and CCID headers
+    // are composed in front of them, and the memmove calls in the compose functions become no-ops.
+    // Lc takes 3 bytes for the data over 255 bytes
+    const size_t tlvs_length = tlvs_encoded_length(tlvs, tlvs_count);
+    const size_t iso_offset = offset + CCID_HEADER_SIZE;
+    const size_t data_offset = iso_offset + 4 + iso7816_lc_size(tlvs_length, 0);
+    if (buffer_reserve(buf, data_offset + tlvs_length) != RET_NO_ERROR) {
+        return 0;
+    }
+    int tlvs_actual_length = process_all(buf->data + data_offset, tlvs, tlvs_count);
+    rassert(tlvs_actual_length >= 0 && (size_t) tlvs_actual_length == tlvs_length);
 
     // encode instruction
-    uint8_t data_iso[MAX_CCID_BUFFER_SIZE] = {};
     uint32_t iso_actual_length = iso7816_compose(
-            data_iso, sizeof data_iso,
-            ins, 0, 0, 0, 0, data_tlvs, tlvs_actual_length);
+            buf->data + iso_offset, buf->capacity - iso_offset,
+            ins, 0, 0, 0, 0, buf->data + data_offset, tlvs_actual_length);
+    if (iso_actual_length == 0) {
+        return 0;
+    }
 
     // encode ccid wrapper
-    uint32_t icc_actual_length = icc_compose(buf, buflen,
+    uint32_t icc_actual_length = icc_compose(buf->data + offset, buf->capacity - offset,
                                              0x6F, iso_actual_length,
-                                             0, 0, 0, data_iso);
+                                             0, 0, 0, buf->data + iso_offset);
+    buffer_mark(buf, offset + icc_actual_length);
 
+    return offset + icc_actual_length;
+}
 
+uint32_t icc_pack_tlvs_for_sending(struct Buffer *buf, TLV *tlvs, int tlvs_count, int ins) {
+    return icc_append_tlvs(buf, 0, tlvs, tlvs_count, ins);
+}
+
+uint32_t icc_pack_apdu_for_sending(struct Buffer *buf, uint8_t ins, uint8_t p1, uint8_t p2, uint8_t le) {
+    if (buffer_reserve(buf, CCID_HEADER_SIZE + ISO7816_HEADER_SIZE) != RET_NO_ERROR) {
+        return 0;
+    }
+    uint8_t data_iso[ISO7816_HEADER_SIZE] = {};
+    uint32_t iso_actual_length = iso7816_compose(
+            data_iso, sizeof data_iso,
+            ins, p1, p2, 0, le, NULL, 0);
+    uint32_t icc_actual_length = icc_compose(buf->data, buf->capacity,
+                                             0x6F, iso_actual_length,
+                                             0, 0, 0, data_iso);
+    buffer_mark(buf, icc_actual_length);
     return icc_actual_length;
 }
 
-int ccid_receive(libusb_device_handle *device, int *actual_length, unsigned char *returned_data, size_t buffer_length) {
-    rassert(device != NULL);
-    rassert(actual_length != NULL);
-    rassert(returned_data != NULL);
-    rassert(buffer_length > 0);
-    int32_t _buffer_length = MIN(buffer_length, INT32_MAX);
-    stopwatch_start();
-    int r = libusb_bulk_transfer(device, READ_ENDPOINT, returned_data, _buffer_length, actual_length, TIMEOUT);
-    LOG("*** Time for %s: %ld\n", __FUNCTION__, stopwatch_stop());
+// Timeout for a single transfer, cut to the time left for the operation. 0 means the deadline has passed,
+// and must not be given to libusb, where it disables the timeout.
+static unsigned int ccid_transfer_timeout(struct Device *dev) {
+    return (unsigned int) min(deadline_remaining_ms(dev->deadline), TIMEOUT);
+}
+
+static int ccid_bulk_read(struct Device *dev, uint8_t *data, int length, int *actual_length) {
+    const unsigned int timeout = ccid_transfer_timeout(dev);
+    if (timeout == 0) {
+        return RET_TIMEOUT;
+    }
+    if (dev->removed) {
+        return RET_CONNECTION_LOST;
+    }
+    if (dev->ccid_backend_connected == CCID_BACKEND_PCSC) {
+        return pcsc_receive(dev->pcsc, data, length, actual_length);
+    }
+    if (dev->ccid_backend_connected == CCID_BACKEND_CTAPHID) {
+        return ctaphid_receive(dev, data, length, actual_length, timeout);
+    }
+    const int64_t start = stopwatch_start();
+    int r = libusb_bulk_transfer(dev->mp_devhandle_ccid, READ_ENDPOINT, data, length, actual_length, timeout);
+    LOG("*** Time for %s: %ld\n", __FUNCTION__, stopwatch_stop(start));
+    unused(start);
+    if (r == LIBUSB_ERROR_TIMEOUT && deadline_expired(dev->deadline)) {
+        return RET_TIMEOUT;
+    }
+    if (r == LIBUSB_ERROR_NO_DEVICE) {
+        device_mark_removed(dev);
+        return RET_CONNECTION_LOST;
+    }
     if (r < 0) {
         LOG("Error reading data: %s\n", libusb_strerror(r));
         return RET_COMM_ERROR;
     }
-    print_buffer(returned_data, (*actual_length), "recv");
     return 0;
 }
 
-int ccid_send(libusb_device_handle *device, int *actual_length, const unsigned char *data, const size_t length) {
-    rassert(device != NULL);
+// Receive a single CCID message to the buffer, starting at the offset
+static int ccid_read_message(struct Device *dev, int *actual_length, struct Buffer *buffer, size_t offset) {
+    rassert(dev != NULL);
+    rassert(dev->mp_devhandle_ccid != NULL || dev->pcsc != NULL || dev->ctaphid != NULL);
     rassert(actual_length != NULL);
-    rassert(data != NULL);
-    rassert(length > 0);
+    rassert(buffer != NULL);
+
+    // Read the first packet, which holds the message header, and size the buffer from its dwLength.
+    // A zero-length packet might be left after the previous message of the packet size multiple - skip it.
+    if (buffer_reserve(buffer, offset + CCID_RECEIVE_CHUNK_SIZE) != RET_NO_ERROR) {
+        return RET_NO_MEMORY;
+    }
+    uint8_t *message = buffer->data + offset;
+    int received = 0;
+    for (int i = 0; i < 2 && received == 0; ++i) {
+        const int r = ccid_bulk_read(dev, message, CCID_RECEIVE_CHUNK_SIZE, &received);
+        if (r != 0) {
+            return r;
+        }
+    }
+    buffer_mark(buffer, offset + received);
+    if (received < CCID_HEADER_SIZE) {
+        LOG("Too short CCID message: %d\n", received);
+        return RET_COMM_ERROR;
+    }
+
+    // A reader sends at most the message length of its descriptor. The longer responses are split by the card,
+    // and joined from GET RESPONSE up to the longest extended-length response, see ccid_get_response().
+    const uint32_t max_message_length = dev->ccid_max_message_length != 0
+                                                ? (uint32_t) min(dev->ccid_max_message_length, MAX_CCID_BUFFER_SIZE)
+                                                : MAX_CCID_BUFFER_SIZE;
+    const uint32_t data_length = message[1] | (message[2] << 8) | (message[3] << 16) | ((uint32_t) message[4] << 24);
+    if (data_length > max_message_length - CCID_HEADER_SIZE) {
+        LOG("Too long CCID message: %u\n", data_length);
+        return RET_COMM_ERROR;
+    }
+    const int message_length = (int) (CCID_HEADER_SIZE + data_length);
+    if (received < message_length) {
+        // round up to the packet size, so the device is never sending more than requested
+        const int remaining = message_length - received;
+        const int to_read = (remaining + CCID_RECEIVE_CHUNK_SIZE - 1) / CCID_RECEIVE_CHUNK_SIZE * CCID_RECEIVE_CHUNK_SIZE;
+        if (buffer_reserve(buffer, offset + received + to_read) != RET_NO_ERROR) {
+            return RET_NO_MEMORY;
+        }
+        message = buffer->data + offset;
+        int received_rest = 0;
+        const int r = ccid_bulk_read(dev, message + received, to_read, &received_rest);
+        if (r != 0) {
+            return r;
+        }
+        received += received_rest;
+        buffer_mark(buffer, offset + received);
+        if (received < message_length) {
+            LOG("Incomplete CCID message: %d of %d\n", received, message_length);
+            return RET_COMM_ERROR;
+        }
+    }
+
+    *actual_length = received;
+    print_buffer(message, received, "recv");
+    return 0;
+}
+
+static int ccid_receive_at(struct Device *dev, int *actual_length, struct Buffer *buffer, size_t offset) {
+    const int r = ccid_read_message(dev, actual_length, buffer, offset);
+    const uint8_t *message = buffer->data + offset;
+    const int length = r == 0 ? *actual_length : 0;
+    TRACE_PROBE(ccid_receive, length > CCID_HEADER_SEQ_OFFSET ? message[CCID_HEADER_SEQ_OFFSET] : 0,
+                length > CCID_HEADER_STATUS_OFFSET ? message[CCID_HEADER_STATUS_OFFSET] : 0,
+                length >= CCID_HEADER_SIZE + 2 ? (message[length - 2] << 8) | message[length - 1] : 0,
+                length, r);
+    // the header and the status word, without the response data
+    uint8_t recorded[CCID_HEADER_SIZE + 2] = {};
+    const size_t header_length = min(length, CCID_HEADER_SIZE);
+    memcpy(recorded, message, header_length);
+    if (length >= CCID_HEADER_SIZE + 2) {
+        memcpy(recorded + CCID_HEADER_SIZE, message + length - 2, 2);
+    }
+    flight_record(dev->flight_id, "ccid_receive", NULL, r, recorded, length, length >= CCID_HEADER_SIZE + 2 ? sizeof recorded : header_length);
+    return r;
+}
+
+int ccid_receive(struct Device *dev, int *actual_length, struct Buffer *buffer) {
+    return ccid_receive_at(dev, actual_length, buffer, 0);
+}
+
+// The response is to a message sent before the awaited ones, e.g. left behind by an abandoned exchange
+static bool ccid_seq_is_stale(uint8_t oldest_awaited, uint8_t received) {
+    const uint8_t behind = (uint8_t) (oldest_awaited - received);
+    return behind > 0 && behind < 0x80;
+}
+
+/**
+ * Receive the response to one of the awaited messages, given by their bSeq from the oldest one.
+ * Stale responses are dropped, a response to a message never sent is a communication error.
+ * @param awaited_index set to the index of the answered message in awaited
+ */
+static int ccid_receive_matching(struct Device *dev, const uint8_t awaited[], int awaited_count, int *awaited_index,
+                                 int *actual_length, struct Buffer *buffer, size_t offset) {
+    rassert(awaited_count > 0);
+    for (int dropped = 0; dropped <= CCID_STALE_RESPONSES_LIMIT; ++dropped) {
+        const int r = ccid_receive_at(dev, actual_length, buffer, offset);
+        if (r != 0) {
+            return r;
+        }
+        const uint8_t seq = buffer->data[offset + CCID_HEADER_SEQ_OFFSET];
+        for (int i = 0; i < awaited_count; ++i) {
+            if (awaited[i] == seq) {
+                *awaited_index = i;
+                return 0;
+            }
+        }
+        if (!ccid_seq_is_stale(awaited[0], seq)) {
+            LOG("Unexpected CCID response sequence number: %d, awaiting %d\n", seq, awaited[0]);
+            return RET_COMM_ERROR;
+        }
+        LOG("Dropping stale CCID response with sequence number %d\n", seq);
+        TRACE_PROBE(retry, "ccid_receive", dropped + 1);
+        flight_record(dev->flight_id, "retry", "ccid_receive", dropped + 1, NULL, 0, 0);
+    }
+    LOG("Too many stale CCID responses\n");
+    return RET_COMM_ERROR;
+}
+
+// Receive the response to the single awaited message
+static int ccid_receive_response(struct Device *dev, uint8_t awaited_seq, int *actual_length, struct Buffer *buffer) {
+    int index = 0;
+    return ccid_receive_matching(dev, &awaited_seq, 1, &index, actual_length, buffer, 0);
+}
+
+static int ccid_write_message(struct Device *dev, int *actual_length, unsigned char *data, const size_t length) {
     print_buffer(data, length, "sending");
-    stopwatch_start();
-    int r = libusb_bulk_transfer(device, WRITE_ENDPOINT, (uint8_t *) data, (int) length, actual_length, TIMEOUT);
-    LOG("*** Time for %s: %ld\n", __FUNCTION__, stopwatch_stop());
+    const unsigned int timeout = ccid_transfer_timeout(dev);
+    if (timeout == 0) {
+        return RET_TIMEOUT;
+    }
+    if (dev->removed) {
+        return RET_CONNECTION_LOST;
+    }
+    if (dev->ccid_backend_connected == CCID_BACKEND_PCSC) {
+        // the whole message is taken, the transmission waits for the response
+        *actual_length = (int) length;
+        const int r = pcsc_send(dev->pcsc, data, length);
+        if (r == RET_CONNECTION_LOST) {
+            device_mark_removed(dev);
+        }
+        return r;
+    }
+    if (dev->ccid_backend_connected == CCID_BACKEND_CTAPHID) {
+        *actual_length = (int) length;
+        return ctaphid_send(dev, data, length);
+    }
+    const int64_t start = stopwatch_start();
+    int r = libusb_bulk_transfer(dev->mp_devhandle_ccid, WRITE_ENDPOINT, data, (int) length, actual_length, timeout);
+    LOG("*** Time for %s: %ld\n", __FUNCTION__, stopwatch_stop(start));
+    unused(start);
+    if (r == LIBUSB_ERROR_TIMEOUT && deadline_expired(dev->deadline)) {
+        return RET_TIMEOUT;
+    }
+    if (r == LIBUSB_ERROR_NO_DEVICE) {
+        device_mark_removed(dev);
+        return RET_CONNECTION_LOST;
+    }
     if (r < 0) {
         LOG("Error sending data: %s\n", libusb_strerror(r));
         return RET_COMM_ERROR;
@@ -471,6 +1034,58 @@ int ccid_send(libusb_device_handle *device, int *actual_length, const unsigned c
     return 0;
 }
 
+int ccid_send(struct Device *dev, int *actual_length, unsigned char *data, const size_t length) {
+    rassert(dev != NULL);
+    rassert(dev->mp_devhandle_ccid != NULL || dev->pcsc != NULL || dev->ctaphid != NULL);
+    rassert(actual_length != NULL);
+    rassert(data != NULL);
+    rassert(length > 0);
+    if (length >= CCID_HEADER_SIZE) {
+        // stamp the per-device sequence number into the bSeq field of the CCID header
+        data[CCID_HEADER_SEQ_OFFSET] = dev->ccid_seq++;
+    }
+    int r = ccid_write_message(dev, actual_length, data, length);
+    for (int attempt = 1; r == RET_COMM_ERROR && *actual_length == 0; ++attempt) {
+        // nothing of the message reached the device, so it is sent again whatever it does
+        if (!retry_next_attempt(dev, device_retry_policy(dev), "ccid_send", COMMAND_IDEMPOTENT, r, attempt)) {
+            break;
+        }
+        r = ccid_write_message(dev, actual_length, data, length);
+    }
+    TRACE_PROBE(ccid_send, length > CCID_HEADER_SEQ_OFFSET ? data[CCID_HEADER_SEQ_OFFSET] : 0,
+                data[0] == PC_TO_RDR_XFRBLOCK && length > CCID_HEADER_SIZE + 1 ? data[CCID_HEADER_SIZE + 1] : 0,
+                length, r);
+    // the header and CLA INS P1 P2 Lc, without the command data
+    flight_record(dev->flight_id, "ccid_send", NULL, r, data, length, CCID_HEADER_SIZE + 5);
+    return r;
+}
+
+int ccid_xfrblock_apdu(const uint8_t *message, size_t length, const uint8_t **apdu, uint32_t *apdu_length) {
+    if (length < CCID_HEADER_SIZE || message[0] != PC_TO_RDR_XFRBLOCK) {
+        LOG("Only the XfrBlock messages carry an APDU\n");
+        return RET_COMM_ERROR;
+    }
+    const uint32_t data_length = message[1] | (message[2] << 8) | (message[3] << 16) | ((uint32_t) message[4] << 24);
+    if (data_length > length - CCID_HEADER_SIZE) {
+        return RET_COMM_ERROR;
+    }
+    *apdu = message + CCID_HEADER_SIZE;
+    *apdu_length = data_length;
+    return 0;
+}
+
+void ccid_datablock_header(uint8_t header[CCID_HEADER_SIZE], const uint8_t *message, uint8_t status, uint32_t data_length) {
+    memset(header, 0, CCID_HEADER_SIZE);
+    header[0] = RDR_TO_PC_DATABLOCK;
+    header[1] = (uint8_t) data_length;
+    header[2] = (uint8_t) (data_length >> 8);
+    header[3] = (uint8_t) (data_length >> 16);
+    header[4] = (uint8_t) (data_length >> 24);
+    header[5] = message[5];
+    header[CCID_HEADER_SEQ_OFFSET] = message[CCID_HEADER_SEQ_OFFSET];
+    header[CCID_HEADER_STATUS_OFFSET] = status;
+}
+
 void print_buffer(const unsigned char *buffer, const uint32_t length, const char *message) {
 #ifdef NDEBUG
     unused(message);
@@ -22,19 +22,54 @@
 #ifndef NITROKEY_HOTP_VERIFICATION_CCID_H
 #define NITROKEY_HOTP_VERIFICATION_CCID_H
 
+#include "buffer.h"
 #include "device.h"
 #include "stdbool.h"
 #include "tlv.h"
 #include <libusb.h>
 #include <stdint.h>
 
+#define CCID_HEADER_SIZE (10)
+#define CCID_HEADER_SEQ_OFFSET (6)
+#define CCID_HEADER_STATUS_OFFSET (7)
+#define PC_TO_RDR_XFRBLOCK (0x6F)
+#define RDR_TO_PC_DATABLOCK (0x80)
+// CLA, INS, P1, P2 and the short Lc
+#define ISO7816_HEADER_SIZE (5)
+// Lengths of the data and of the expected response, over which the APDU takes the extended form
+#define ISO7816_SHORT_MAX_LC (255)
+#define ISO7816_SHORT_MAX_LE (256)
+#define ISO7816_EXTENDED_MAX_LC (65535)
+#define ISO7816_EXTENDED_MAX_LE (65536)
+// Offset of dwMaxCCIDMessageLength in the CCID class descriptor of the interface, and the length of the descriptor
+#define CCID_DESCRIPTOR_TYPE (0x21)
+#define CCID_DESCRIPTOR_MAX_MESSAGE_OFFSET (44)
+#define CCID_DESCRIPTOR_LENGTH (54)
+// Smallest dwMaxCCIDMessageLength allowed by the CCID specification, the short APDU response and the header
+#define CCID_MIN_MAX_MESSAGE_LENGTH (271)
+// Bulk endpoint packet size of the Nitrokey 3
+#define CCID_RECEIVE_CHUNK_SIZE (64)
+// Messages exchanged at once by ccid_process_batch()
+#define CCID_BATCH_MAX_MESSAGES (8)
+// Responses to abandoned messages dropped while waiting for the awaited one
+#define CCID_STALE_RESPONSES_LIMIT (8)
+
+// seq is written as given; ccid_send() overwrites it with the next sequence number of the device,
+// and the response is accepted only with the same bSeq
 uint32_t
 icc_compose(uint8_t *buf, uint32_t buffer_length, uint8_t msg_type, size_t data_len, uint8_t slot, uint8_t seq,
             uint16_t param, uint8_t *data);
 
+/**
+ * Compose the APDU with the data and the expected response length le, 0 for none.
+ * Lc and Le take the extended form, once the data is over 255 bytes or le over 256.
+ * @return the APDU length, or 0 if it does not fit in the buffer or its lengths in the extended form
+ */
 uint32_t
-iso7816_compose(uint8_t *buf, uint32_t buffer_length, uint8_t ins, uint8_t p1, uint8_t p2, uint8_t cls, uint8_t le,
-                uint8_t *data, uint8_t data_len);
+iso7816_compose(uint8_t *buf, uint32_t buffer_length, uint8_t ins, uint8_t p1, uint8_t p2, uint8_t cls, uint32_t le,
+                uint8_t *data, size_t data_len);
+// Size of the Lc field of the APDU composed by iso7816_compose()
+uint32_t iso7816_lc_size(size_t data_len, uint32_t le);
 
 typedef struct {
     uint8_t status;
@@ -52,26 +87,59 @@ int ccid_test();
 
 void print_buffer(const unsigned char *buffer, const uint32_t length, const char *message);
 
-int ccid_send(libusb_device_handle *device, int *actual_length, const unsigned char *data, const size_t length);
+int ccid_send(struct Device *dev, int *actual_length, unsigned char *data, const size_t length);
+
+// The APDU carried by the XfrBlock message, for the backends exchanging the APDUs only. Returns 0, or RET_COMM_ERROR.
+int ccid_xfrblock_apdu(const uint8_t *message, size_t length, const uint8_t **apdu, uint32_t *apdu_length);
+// Header of the DataBlock message answering the XfrBlock one, with its slot and bSeq
+void ccid_datablock_header(uint8_t header[CCID_HEADER_SIZE], const uint8_t *message, uint8_t status, uint32_t data_length);
 
-int ccid_receive(libusb_device_handle *device, int *actual_length, unsigned char *returned_data, size_t buffer_length);
+// Receive a single CCID message. The buffer is grown to the message length, given in its header.
+int ccid_receive(struct Device *dev, int *actual_length, struct Buffer *buffer);
 
 
-int ccid_process(libusb_device_handle *handle, uint8_t *buf, uint32_t buf_length, const uint8_t *data_to_send[],
-                 int data_to_send_count, const uint32_t data_to_send_sizes[], bool continue_on_errors,
-                 IccResult *result);
+/**
+ * Exchange independent messages, given one after another in messages, sending up to dev->ccid_pipeline_depth
+ * of them before reading the responses. Responses are matched to the messages by their bSeq.
+ * Chained responses are not supported. The data left by the status 61xx is fetched with GET RESPONSE
+ * like by ccid_process_single(), but only when no message was sent ahead. The result data points to dev->ccid_buffer_in.
+ * The batch is exchanged again after a transient error, if all its messages are safe to repeat, see retry_policy.h.
+ */
+int ccid_process_batch(struct Device *dev, uint8_t *messages, uint32_t messages_length, IccResult results[], int count);
 
-int ccid_process_single(libusb_device_handle *handle, uint8_t *receiving_buffer, uint32_t receiving_buffer_length, const uint8_t *sending_buffer,
-                        const uint32_t sending_buffer_length, IccResult *result);
+// Send the message and receive the response to dev->ccid_buffer_in, where the result data points to.
+// The data left by the status 61xx is fetched with GET RESPONSE, and joined to the result.
+// The message is sent again after a transient error, if it is safe to repeat, see retry_policy.h.
+int ccid_process_single(struct Device *dev, uint8_t *sending_buffer, const uint32_t sending_buffer_length, IccResult *result);
 
 char *ccid_error_message(uint16_t status_code);
 
-uint32_t icc_pack_tlvs_for_sending(uint8_t *buf, size_t buflen, TLV tlvs[], int tlvs_count, int ins);
-libusb_device_handle *get_device(libusb_context *ctx, const struct VidPid pPid[], int devices_count);
-int ccid_init(libusb_device_handle *handle);
-int send_select_ccid(libusb_device_handle *handle, uint8_t buf[], size_t buf_size, IccResult *iccResult);
-int send_select_nk3_admin_ccid(libusb_device_handle *handle, uint8_t buf[], size_t buf_size, IccResult *iccResult);
-int send_select_nk3_pgp_ccid(libusb_device_handle *handle, uint8_t buf[], size_t buf_size, IccResult *iccResult);
+// Compose the CCID message with the APDU in the buffer, growing it to the message size. Returns 0 on allocation failure.
+uint32_t icc_pack_tlvs_for_sending(struct Buffer *buf, TLV tlvs[], int tlvs_count, int ins);
+// Compose the message with the TLVs at offset in the buffer, after the messages of a batch.
+// Returns the offset after it, or 0 if it does not fit.
+uint32_t icc_append_tlvs(struct Buffer *buf, uint32_t offset, TLV tlvs[], int tlvs_count, int ins);
+uint32_t icc_pack_apdu_for_sending(struct Buffer *buf, uint8_t ins, uint8_t p1, uint8_t p2, uint8_t le);
+// Open and claim the first device, which lock could be taken. Sets busy, if only locked or claimed ones were found.
+libusb_device_handle *get_device(libusb_context *ctx, const struct VidPid pPid[], int devices_count,
+                                 struct DeviceLock *lock, bool *busy);
+// Open the device from the file descriptor of its USB device node, without enumerating the bus
+libusb_device_handle *get_device_from_fd(libusb_context *ctx, int fd, const struct VidPid pPid[], int devices_count,
+                                         struct DeviceLock *lock, bool *busy);
+int ccid_init(struct Device *dev);
+
+enum SelectedApplication {
+    Application_Secrets,
+    Application_Admin,
+    Application_Pgp,
+};
+
+// Append the CCID message to buf at the offset. Returns the new length, or 0 if it does not fit.
+uint32_t icc_append_select(uint8_t *buf, uint32_t buffer_length, uint32_t offset, enum SelectedApplication application);
+uint32_t icc_append_apdu(uint8_t *buf, uint32_t buffer_length, uint32_t offset, uint8_t ins, uint8_t p1, uint8_t p2, uint8_t le);
+int send_select_ccid(struct Device *dev, IccResult *iccResult);
+int send_select_nk3_admin_ccid(struct Device *dev, IccResult *iccResult);
+int send_select_nk3_pgp_ccid(struct Device *dev, IccResult *iccResult);
 
 
 enum {
@@ -0,0 +1,127 @@
+/*
+ * Copyright (c) 2023 Nitrokey GmbH
+ *
+ * This file is part of Nitrokey HOTP verification project.
+ *
+ * Nitrokey HOTP verification is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * Nitrokey HOTP verification is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Nitrokey HOTP verification. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0
+ */
+
+#include "connection_cache.h"
+#include "return_codes.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define CACHE_DIRECTORY "hotp-verification"
+#define CACHE_FILE "last-device"
+
+static const char *TRANSPORT_NAMES[CONNECTION_LENGTH] = {
+        [CONNECTION_UNKNOWN] = "auto",
+        [CONNECTION_HID] = "hid",
+        [CONNECTION_CCID] = "ccid",
+};
+
+// Directory holding the cache directory, created by the XDG-aware applications on demand
+static bool cache_base_directory(char *path, size_t size) {
+    const char *xdg_cache_home = getenv("XDG_CACHE_HOME");
+    int length;
+    // relative paths are to be ignored according to the XDG Base Directory specification
+    if (xdg_cache_home != NULL && xdg_cache_home[0] == '/') {
+        length = snprintf(path, size, "%s", xdg_cache_home);
+    } else {
+        const char *home = getenv("HOME");
+        if (home == NULL || home[0] == '\0') {
+            return false;
+        }
+        length = snprintf(path, size, "%s/.cache", home);
+    }
+    return length > 0 && (size_t) length < size;
+}
+
+bool connection_cache_path(char *path, size_t size) {
+    if (!cache_base_directory(path, size)) {
+        return false;
+    }
+    const size_t base_length = strlen(path);
+    const int length = snprintf(path + base_length, size - base_length, "/" CACHE_DIRECTORY "/" CACHE_FILE);
+    return length > 0 && (size_t) length < size - base_length;
+}
+
+int connection_cache_load(struct ConnectionCache *cache) {
+    rassert(cache != NULL);
+    char path[FILENAME_MAX];
+    if (!connection_cache_path(path, sizeof path)) {
+        return RET_NOT_FOUND;
+    }
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        return RET_NOT_FOUND;
+    }
+    char transport[8] = {};
+    unsigned int vid = 0, pid = 0;
+    const int fields = fscanf(file, "%7s %4x:%4x", transport, &vid, &pid);
+    fclose(file);
+    if (fields != 3) {
+        return RET_NOT_FOUND;
+    }
+    for (int i = CONNECTION_HID; i < CONNECTION_LENGTH; ++i) {
+        if (strcmp(transport, TRANSPORT_NAMES[i]) == 0) {
+            cache->transport = (ConnectionType) i;
+            cache->vid = (uint16_t) vid;
+            cache->pid = (uint16_t) pid;
+            return RET_NO_ERROR;
+        }
+    }
+    return RET_NOT_FOUND;
+}
+
+static bool make_directory(const char *path) {
+    return mkdir(path, 0700) == 0 || errno == EEXIST;
+}
+
+int connection_cache_store(const struct ConnectionCache *cache) {
+    rassert(cache != NULL);
+    rassert(cache->transport == CONNECTION_HID || cache->transport == CONNECTION_CCID);
+    char path[FILENAME_MAX];
+    if (!cache_base_directory(path, sizeof path) || !make_directory(path)) {
+        return RET_NOT_FOUND;
+    }
+    const size_t base_length = strlen(path);
+    const int length = snprintf(path + base_length, sizeof path - base_length, "/" CACHE_DIRECTORY);
+    if (length <= 0 || (size_t) length >= sizeof path - base_length || !make_directory(path)) {
+        return RET_NOT_FOUND;
+    }
+
+    // write a temporary file first, so a concurrent run never reads a partial cache
+    char temporary_path[FILENAME_MAX + 8];
+    if (!connection_cache_path(path, sizeof path)) {
+        return RET_NOT_FOUND;
+    }
+    snprintf(temporary_path, sizeof temporary_path, "%s.%d", path, (int) getpid());
+    FILE *file = fopen(temporary_path, "w");
+    if (file == NULL) {
+        return RET_NOT_FOUND;
+    }
+    const int written = fprintf(file, "%s %04x:%04x\n", TRANSPORT_NAMES[cache->transport], cache->vid, cache->pid);
+    if (fclose(file) != 0 || written <= 0 || rename(temporary_path, path) != 0) {
+        remove(temporary_path);
+        return RET_NOT_FOUND;
+    }
+    return RET_NO_ERROR;
+}
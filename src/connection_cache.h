@@ -0,0 +1,48 @@
+/*
+ * Copyright (c) 2023 Nitrokey GmbH
+ *
+ * This file is part of Nitrokey HOTP verification project.
+ *
+ * Nitrokey HOTP verification is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * Nitrokey HOTP verification is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Nitrokey HOTP verification. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0
+ */
+
+#ifndef NITROKEY_HOTP_VERIFICATION_CONNECTION_CACHE_H
+#define NITROKEY_HOTP_VERIFICATION_CONNECTION_CACHE_H
+
+#include "device.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Transport and USB identifiers of the last device connected in the auto mode, kept in
+ * $XDG_CACHE_HOME/hotp-verification/last-device (~/.cache when not set), so the next run can go
+ * straight to the right backend.
+ */
+struct ConnectionCache {
+    ConnectionType transport;
+    uint16_t vid;
+    uint16_t pid;
+};
+
+// Path of the cache file. Returns false, if neither XDG_CACHE_HOME nor HOME is set, or the path does not fit.
+bool connection_cache_path(char *path, size_t size);
+// RET_NO_ERROR, or RET_NOT_FOUND if the cache is missing or malformed
+int connection_cache_load(struct ConnectionCache *cache);
+// Replace the cache file atomically. RET_NO_ERROR, or RET_NOT_FOUND if it could not be written.
+int connection_cache_store(const struct ConnectionCache *cache);
+
+#endif//NITROKEY_HOTP_VERIFICATION_CONNECTION_CACHE_H
@@ -0,0 +1,127 @@
+/*
+ * Copyright (c) 2023 Nitrokey GmbH
+ *
+ * This file is part of Nitrokey HOTP verification project.
+ *
+ * Nitrokey HOTP verification is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * Nitrokey HOTP verification is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Nitrokey HOTP verification. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0
+ */
+
+#include "credentials.h"
+#include "ccid.h"
+#include "operations.h"
+#include "return_codes.h"
+#include "secret_file.h"
+#include "utils.h"
+#include <string.h>
+
+static const struct {
+    const char *name;
+    uint8_t value;
+} KIND_NAMES[] = {
+        {"hotp", Kind_Hotp},
+        {"totp", Kind_Totp},
+        {"hotp-reverse", Kind_HotpReverse},
+}, ALGORITHM_NAMES[] = {
+        {"sha1", Algo_Sha1},
+        {"sha256", Algo_Sha256},
+        {"sha512", Algo_Sha512},
+};
+
+static const char *parse_credential_line(char *line, struct Credential *credential) {
+    char *saveptr = NULL;
+    const char *fields[7] = {0};
+    const char *field = strtok_r(line, SECRET_FILE_SEPARATORS, &saveptr);
+    size_t count = 0;
+    for (; field != NULL && count < LEN_ARR(fields); ++count) {
+        fields[count] = field;
+        field = strtok_r(NULL, SECRET_FILE_SEPARATORS, &saveptr);
+    }
+    if (count < LEN_ARR(fields) - 1 || field != NULL) {
+        return "expected: <name> <base32 secret> <kind> <algorithm> <digits> <counter> [touch]";
+    }
+
+    if (strlen(fields[0]) > CREDENTIAL_NAME_MAX_LENGTH) {
+        return "too long name";
+    }
+    if (validate_base32_secret(fields[1]) != RET_NO_ERROR) {
+        return "invalid base32 secret";
+    }
+    size_t i;
+    for (i = 0; i < LEN_ARR(KIND_NAMES) && strcmp(fields[2], KIND_NAMES[i].name) != 0; ++i) {}
+    if (i == LEN_ARR(KIND_NAMES)) {
+        return "invalid kind, expected hotp, totp or hotp-reverse";
+    }
+    credential->kind = KIND_NAMES[i].value;
+    for (i = 0; i < LEN_ARR(ALGORITHM_NAMES) && strcmp(fields[3], ALGORITHM_NAMES[i].name) != 0; ++i) {}
+    if (i == LEN_ARR(ALGORITHM_NAMES)) {
+        return "invalid algorithm, expected sha1, sha256 or sha512";
+    }
+    credential->algorithm = ALGORITHM_NAMES[i].value;
+    if (strcmp(fields[4], "6") != 0 && strcmp(fields[4], "7") != 0 && strcmp(fields[4], "8") != 0) {
+        return "invalid digits, expected 6, 7 or 8";
+    }
+    credential->digits = (uint8_t) (fields[4][0] - '0');
+    uint64_t counter = 0;
+    if (validate_counter(fields[5], &counter) != RET_NO_ERROR) {
+        return "invalid counter";
+    }
+    if (credential->kind == Kind_Totp && counter != 0) {
+        return "TOTP takes no counter, expected 0";
+    }
+    credential->counter = (uint32_t) counter;
+    if (fields[6] != NULL && strcmp(fields[6], "touch") != 0) {
+        return "invalid flag, expected touch";
+    }
+    credential->touch = fields[6] != NULL;
+    strncpy(credential->name, fields[0], sizeof(credential->name) - 1);
+    strncpy(credential->secret, fields[1], sizeof(credential->secret) - 1);
+    return NULL;
+}
+
+// Parser of the credential lines for secret_file_load()
+static const char *parse_credential_entry(char *line, void *entry, const void *entries, size_t count) {
+    struct Credential *credential = entry;
+    const char *error = parse_credential_line(line, credential);
+    const struct Credential *listed = entries;
+    for (size_t i = 0; error == NULL && i < count; ++i) {
+        if (strcmp(listed[i].name, credential->name) == 0) {
+            error = "duplicate name";
+        }
+    }
+    return error;
+}
+
+static const struct SecretFileFormat CREDENTIALS_FORMAT = {
+        .name = "credentials",
+        .title = "Credentials",
+        .empty_message = "Credentials %s list none\n",
+        .entry_size = sizeof(struct Credential),
+        .parse = parse_credential_entry,
+};
+
+int credential_list_load(const char *path, struct CredentialList *list) {
+    memset(list, 0, sizeof(*list));
+    void *entries = NULL;
+    const int r = secret_file_load(path, &CREDENTIALS_FORMAT, &entries, &list->count);
+    list->entries = entries;
+    return r;
+}
+
+void credential_list_free(struct CredentialList *list) {
+    secret_entries_free(list->entries, list->count, sizeof(*list->entries));
+    list->entries = NULL;
+    list->count = 0;
+}
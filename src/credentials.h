@@ -0,0 +1,62 @@
+/*
+ * Copyright (c) 2023 Nitrokey GmbH
+ *
+ * This file is part of Nitrokey HOTP verification project.
+ *
+ * Nitrokey HOTP verification is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * Nitrokey HOTP verification is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Nitrokey HOTP verification. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0
+ */
+
+#ifndef NITROKEY_HOTP_VERIFICATION_CREDENTIALS_H
+#define NITROKEY_HOTP_VERIFICATION_CREDENTIALS_H
+
+#include "base32.h"
+#include "settings.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * List of the Secrets App credentials written to a Nitrokey 3 at once, from a file with one credential per line:
+ *
+ *     <name> <base32 secret> <hotp|totp|hotp-reverse> <sha1|sha256|sha512> <digits> <counter> [touch]
+ *
+ * hotp-reverse is the kind checked by the check command. The counter is the initial one of HOTP, and has to be 0
+ * for TOTP. touch requires the button press for each use of the credential. Empty lines and the ones starting
+ * with # are skipped.
+ */
+
+#define CREDENTIAL_NAME_MAX_LENGTH (64)
+
+struct Credential {
+    char name[CREDENTIAL_NAME_MAX_LENGTH + 1];
+    char secret[BASE32_LEN(HOTP_SECRET_SIZE_BYTES) + 1];
+    // Kind_* and Algo_* of ccid.h
+    uint8_t kind;
+    uint8_t algorithm;
+    uint8_t digits;
+    uint32_t counter;
+    bool touch;
+};
+
+struct CredentialList {
+    struct Credential *entries;
+    size_t count;
+};
+
+// Returns RET_INVALID_PARAMS and prints the line, if the file is malformed
+int credential_list_load(const char *path, struct CredentialList *list);
+void credential_list_free(struct CredentialList *list);
+
+#endif//NITROKEY_HOTP_VERIFICATION_CREDENTIALS_H
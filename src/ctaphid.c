@@ -0,0 +1,349 @@
+/*
+ * Copyright (c) 2023 Nitrokey GmbH
+ *
+ * This file is part of Nitrokey HOTP verification project.
+ *
+ * Nitrokey HOTP verification is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * Nitrokey HOTP verification is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Nitrokey HOTP verification. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0
+ */
+
+#include "ctaphid.h"
+#include "ccid.h"
+#include "hidraw.h"
+#include "min.h"
+#include "random_data.h"
+#include "return_codes.h"
+#include "settings.h"
+#include "utils.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define CTAPHID_BROADCAST_CID (0xFFFFFFFFu)
+#define CTAPHID_INIT_HEADER_SIZE (7)
+#define CTAPHID_CONT_HEADER_SIZE (5)
+#define CTAPHID_INIT_PAYLOAD_SIZE (CTAPHID_REPORT_SIZE - CTAPHID_INIT_HEADER_SIZE)
+#define CTAPHID_CONT_PAYLOAD_SIZE (CTAPHID_REPORT_SIZE - CTAPHID_CONT_HEADER_SIZE)
+// an initialization packet followed by the continuation packets with all sequence numbers
+#define CTAPHID_MAX_MESSAGE_SIZE (CTAPHID_INIT_PAYLOAD_SIZE + 128 * CTAPHID_CONT_PAYLOAD_SIZE)
+#define CTAPHID_NONCE_SIZE (8)
+// the command byte of an initialization packet has the highest bit set
+#define CTAPHID_INIT_PACKET (0x80)
+
+enum {
+    Ctaphid_Init = 0x06,
+    Ctaphid_Keepalive = 0x3B,
+    Ctaphid_Error = 0x3F,
+};
+
+enum {
+    Keepalive_Processing = 1,
+    Keepalive_UserPresenceNeeded = 2,
+};
+
+struct CtaphidChannel {
+    uint32_t cid;
+    // the XfrBlock message was sent, and its response not read yet
+    bool awaiting;
+    uint8_t message_header[CCID_HEADER_SIZE];
+    // CCID message of the last response or time extension, read by ctaphid_receive() from the offset
+    uint8_t response[CCID_HEADER_SIZE + MAX_CCID_BUFFER_SIZE];
+    size_t response_length;
+    size_t response_offset;
+};
+
+static void put_cid(uint8_t *report, uint32_t cid) {
+    report[0] = (uint8_t) (cid >> 24);
+    report[1] = (uint8_t) (cid >> 16);
+    report[2] = (uint8_t) (cid >> 8);
+    report[3] = (uint8_t) cid;
+}
+
+static uint32_t get_cid(const uint8_t *report) {
+    return ((uint32_t) report[0] << 24) | (report[1] << 16) | (report[2] << 8) | report[3];
+}
+
+static unsigned int call_timeout(struct Device *dev) {
+    return (unsigned int) min(deadline_remaining_ms(dev->deadline), CTAPHID_RESPONSE_TIMEOUT_MS);
+}
+
+static int write_report(struct Device *dev, const uint8_t *report) {
+    // the reports are not numbered, so the ID 0 goes first
+    uint8_t data[CTAPHID_REPORT_SIZE + 1] = {0};
+    memcpy(data + 1, report, CTAPHID_REPORT_SIZE);
+    const int r = dev->hid_backend_connected == HID_BACKEND_HIDRAW
+                          ? hidraw_write(dev->hidraw_fd, data, sizeof data)
+                          : hid_write(dev->mp_devhandle, data, sizeof data);
+    if (r < 0 && device_hid_removed(dev, errno)) {
+        return RET_CONNECTION_LOST;
+    }
+    if (r != (int) sizeof data) {
+        LOG("Error writing the CTAPHID report\n");
+        return RET_COMM_ERROR;
+    }
+    return 0;
+}
+
+static int read_report(struct Device *dev, uint8_t *report, unsigned int timeout_ms) {
+    const int r = dev->hid_backend_connected == HID_BACKEND_HIDRAW
+                          ? hidraw_read(dev->hidraw_fd, report, CTAPHID_REPORT_SIZE, (int) timeout_ms)
+                          : hid_read_timeout(dev->mp_devhandle, report, CTAPHID_REPORT_SIZE, (int) timeout_ms);
+    if (r == 0 && deadline_expired(dev->deadline)) {
+        return RET_TIMEOUT;
+    }
+    if (r < 0 && device_hid_removed(dev, errno)) {
+        return RET_CONNECTION_LOST;
+    }
+    if (r != CTAPHID_REPORT_SIZE) {
+        LOG("Error reading the CTAPHID report: %d\n", r);
+        return RET_COMM_ERROR;
+    }
+    return 0;
+}
+
+static int send_message(struct Device *dev, uint32_t cid, uint8_t command, const uint8_t *data, size_t length) {
+    if (length > CTAPHID_MAX_MESSAGE_SIZE) {
+        return RET_COMM_ERROR;
+    }
+    uint8_t report[CTAPHID_REPORT_SIZE] = {0};
+    put_cid(report, cid);
+    report[4] = CTAPHID_INIT_PACKET | command;
+    report[5] = (uint8_t) (length >> 8);
+    report[6] = (uint8_t) length;
+    size_t sent = min(length, CTAPHID_INIT_PAYLOAD_SIZE);
+    if (sent > 0) {
+        memcpy(report + CTAPHID_INIT_HEADER_SIZE, data, sent);
+    }
+    int r = write_report(dev, report);
+    for (uint8_t seq = 0; r == 0 && sent < length; ++seq) {
+        const size_t n = min(length - sent, CTAPHID_CONT_PAYLOAD_SIZE);
+        memset(report, 0, sizeof report);
+        put_cid(report, cid);
+        report[4] = seq;
+        memcpy(report + CTAPHID_CONT_HEADER_SIZE, data + sent, n);
+        sent += n;
+        r = write_report(dev, report);
+    }
+    return r;
+}
+
+// Read the next report of the channel, skipping the ones of the others, like of a browser
+static int read_channel_report(struct Device *dev, uint32_t cid, uint8_t *report, unsigned int timeout_ms) {
+    while (true) {
+        const int r = read_report(dev, report, timeout_ms);
+        if (r != 0 || get_cid(report) == cid) {
+            return r;
+        }
+    }
+}
+
+static int receive_message(struct Device *dev, uint32_t cid, uint8_t *command, uint8_t *data, size_t size,
+                           size_t *length, unsigned int timeout_ms) {
+    uint8_t report[CTAPHID_REPORT_SIZE];
+    do {
+        const int r = read_channel_report(dev, cid, report, timeout_ms);
+        if (r != 0) {
+            return r;
+        }
+        // a continuation packet of a message abandoned before
+    } while (!(report[4] & CTAPHID_INIT_PACKET));
+
+    *command = report[4] & ~CTAPHID_INIT_PACKET;
+    const size_t total = (report[5] << 8) | report[6];
+    if (total > size) {
+        LOG("Too long CTAPHID message: %zu\n", total);
+        return RET_COMM_ERROR;
+    }
+    size_t received = min(total, CTAPHID_INIT_PAYLOAD_SIZE);
+    memcpy(data, report + CTAPHID_INIT_HEADER_SIZE, received);
+    for (uint8_t seq = 0; received < total; ++seq) {
+        const int r = read_channel_report(dev, cid, report, timeout_ms);
+        if (r != 0) {
+            return r;
+        }
+        if (report[4] != seq) {
+            LOG("Unexpected CTAPHID sequence number: %d, awaiting %d\n", report[4], seq);
+            return RET_COMM_ERROR;
+        }
+        const size_t n = min(total - received, CTAPHID_CONT_PAYLOAD_SIZE);
+        memcpy(data + received, report + CTAPHID_CONT_HEADER_SIZE, n);
+        received += n;
+    }
+    *length = total;
+    return 0;
+}
+
+// Get a channel of its own with CTAPHID_INIT, which answer is recognized by the nonce
+static int allocate_channel(struct Device *dev, struct CtaphidChannel *c) {
+    const unsigned int timeout = call_timeout(dev);
+    if (timeout == 0) {
+        return RET_TIMEOUT;
+    }
+    uint8_t nonce[CTAPHID_NONCE_SIZE];
+    if (read_random_bytes_to_buf(nonce, sizeof nonce) != sizeof nonce) {
+        return RET_COMM_ERROR;
+    }
+    int r = send_message(dev, CTAPHID_BROADCAST_CID, Ctaphid_Init, nonce, sizeof nonce);
+    if (r != 0) {
+        return r;
+    }
+    uint8_t response[CTAPHID_INIT_PAYLOAD_SIZE];
+    while (true) {
+        uint8_t command = 0;
+        size_t length = 0;
+        r = receive_message(dev, CTAPHID_BROADCAST_CID, &command, response, sizeof response, &length, timeout);
+        if (r != 0) {
+            return r;
+        }
+        if (command == Ctaphid_Error) {
+            LOG("CTAPHID channel allocation failed: 0x%02x\n", length > 0 ? response[0] : 0);
+            return RET_COMM_ERROR;
+        }
+        if (command == Ctaphid_Init && length >= CTAPHID_NONCE_SIZE + 4 && memcmp(response, nonce, sizeof nonce) == 0) {
+            break;
+        }
+    }
+    c->cid = get_cid(response + CTAPHID_NONCE_SIZE);
+    c->awaiting = false;
+    c->response_length = 0;
+    c->response_offset = 0;
+    return 0;
+}
+
+int ctaphid_open(struct Device *dev) {
+    rassert(dev->ctaphid == NULL);
+    struct CtaphidChannel *c = calloc(1, sizeof(*c));
+    if (c == NULL) {
+        return RET_NO_MEMORY;
+    }
+    const int r = allocate_channel(dev, c);
+    if (r != 0) {
+        free(c);
+        return r;
+    }
+    dev->ctaphid = c;
+    return 0;
+}
+
+void ctaphid_close(struct Device *dev) {
+    free(dev->ctaphid);
+    dev->ctaphid = NULL;
+}
+
+int ctaphid_call(struct Device *dev, uint8_t command, const uint8_t *request, size_t request_length,
+                 uint8_t *response, size_t response_size, size_t *response_length) {
+    struct CtaphidChannel *c = dev->ctaphid;
+    rassert(c != NULL);
+    rassert(!c->awaiting);
+    const unsigned int timeout = call_timeout(dev);
+    if (timeout == 0) {
+        return RET_TIMEOUT;
+    }
+    int r = send_message(dev, c->cid, command, request, request_length);
+    uint8_t received_command = Ctaphid_Keepalive;
+    while (r == 0 && received_command == Ctaphid_Keepalive) {
+        r = receive_message(dev, c->cid, &received_command, response, response_size, response_length, timeout);
+    }
+    if (r == 0 && received_command != command) {
+        LOG("CTAPHID command 0x%02x failed: 0x%02x\n", command, *response_length > 0 ? response[0] : 0);
+        return RET_COMM_ERROR;
+    }
+    return r;
+}
+
+int ctaphid_send(struct Device *dev, const uint8_t *message, size_t length) {
+    struct CtaphidChannel *c = dev->ctaphid;
+    rassert(c != NULL);
+    const uint8_t *apdu;
+    uint32_t apdu_length;
+    if (ccid_xfrblock_apdu(message, length, &apdu, &apdu_length) != 0) {
+        return RET_COMM_ERROR;
+    }
+    if (c->awaiting) {
+        // the response to the abandoned message might still come, but not on a new channel
+        const int r = allocate_channel(dev, c);
+        if (r != 0) {
+            return r;
+        }
+    }
+    c->response_length = 0;
+    c->response_offset = 0;
+    const int r = send_message(dev, c->cid, CTAPHID_VENDOR_SECRETS, apdu, apdu_length);
+    if (r != 0) {
+        return r;
+    }
+    memcpy(c->message_header, message, CCID_HEADER_SIZE);
+    c->awaiting = true;
+    return 0;
+}
+
+// Receive the response to the message sent, or the time extension, while the device waits for touch
+static int receive_response(struct Device *dev, struct CtaphidChannel *c, unsigned int timeout_ms) {
+    uint8_t *data = c->response + CCID_HEADER_SIZE;
+    uint8_t command = Ctaphid_Keepalive;
+    size_t length = 0;
+    while (command == Ctaphid_Keepalive) {
+        const int r = receive_message(dev, c->cid, &command, data, MAX_CCID_BUFFER_SIZE, &length, timeout_ms);
+        if (r != 0) {
+            return r;
+        }
+        if (command == Ctaphid_Keepalive && length > 0 && data[0] == Keepalive_UserPresenceNeeded) {
+            ccid_datablock_header(c->response, c->message_header, AWAITING_FOR_TOUCH_STATUS_CODE, 0);
+            c->response_length = CCID_HEADER_SIZE;
+            c->response_offset = 0;
+            return 0;
+        }
+    }
+    c->awaiting = false;
+    if (command == Ctaphid_Error) {
+        LOG("CTAPHID error: 0x%02x\n", length > 0 ? data[0] : 0);
+        return RET_COMM_ERROR;
+    }
+    if (command != CTAPHID_VENDOR_SECRETS || length < 2) {
+        LOG("Unexpected CTAPHID response: 0x%02x\n", command);
+        return RET_COMM_ERROR;
+    }
+    // the status word comes first, move it to the end like in the APDU responses
+    const uint8_t sw1 = data[0], sw2 = data[1];
+    memmove(data, data + 2, length - 2);
+    data[length - 2] = sw1;
+    data[length - 1] = sw2;
+    ccid_datablock_header(c->response, c->message_header, 0, (uint32_t) length);
+    c->response_length = CCID_HEADER_SIZE + length;
+    c->response_offset = 0;
+    return 0;
+}
+
+int ctaphid_receive(struct Device *dev, uint8_t *data, int length, int *actual_length, unsigned int timeout_ms) {
+    struct CtaphidChannel *c = dev->ctaphid;
+    rassert(c != NULL);
+    rassert(length >= 0);
+    *actual_length = 0;
+    if (c->response_offset == c->response_length) {
+        if (!c->awaiting) {
+            LOG("No response waiting to be read\n");
+            return RET_COMM_ERROR;
+        }
+        const int r = receive_response(dev, c, timeout_ms);
+        if (r != 0) {
+            return r;
+        }
+    }
+    const size_t n = min((size_t) length, c->response_length - c->response_offset);
+    memcpy(data, c->response + c->response_offset, n);
+    c->response_offset += n;
+    *actual_length = (int) n;
+    return 0;
+}
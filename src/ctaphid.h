@@ -0,0 +1,58 @@
+/*
+ * Copyright (c) 2023 Nitrokey GmbH
+ *
+ * This file is part of Nitrokey HOTP verification project.
+ *
+ * Nitrokey HOTP verification is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * Nitrokey HOTP verification is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Nitrokey HOTP verification. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0
+ */
+
+#ifndef NITROKEY_HOTP_VERIFICATION_CTAPHID_H
+#define NITROKEY_HOTP_VERIFICATION_CTAPHID_H
+
+#include "device.h"
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Secrets App commands of the Nitrokey 3 tunneled over its CTAPHID (FIDO HID) interface, with the vendor command
+ * CTAPHID_VENDOR_SECRETS. The interface is shared with the browsers, and over hidraw nothing is claimed, so it stays
+ * reachable while pcscd or another process holds the CCID interface.
+ * Like with PC/SC, the CCID messages composed by the core are unwrapped, and the responses wrapped back into the
+ * CCID messages ccid_receive() expects. The keepalive messages sent while the device waits for touch become
+ * CCID time extension messages, so the touch is handled the same way as over CCID.
+ * Only the Secrets App is reachable: the other applications can not be selected.
+ */
+
+#define CTAPHID_REPORT_SIZE (64)
+// Vendor commands of the Nitrokey 3 firmware
+#define CTAPHID_VENDOR_VERSION (0x61)
+#define CTAPHID_VENDOR_SECRETS (0x70)
+
+struct CtaphidChannel;
+
+// Allocate a channel on the HID interface already opened for dev, with CTAPHID_INIT
+int ctaphid_open(struct Device *dev);
+void ctaphid_close(struct Device *dev);
+// Exchange a whole message of the command. Returns 0 on success.
+int ctaphid_call(struct Device *dev, uint8_t command, const uint8_t *request, size_t request_length,
+                 uint8_t *response, size_t response_size, size_t *response_length);
+// Send the APDU of the CCID XfrBlock message to the Secrets App, for ctaphid_receive() to read its response.
+// Both return 0 on success, like the transfers of ccid.c.
+int ctaphid_send(struct Device *dev, const uint8_t *message, size_t length);
+// Read the response as a CCID DataBlock message, waiting up to timeout_ms for each report
+int ctaphid_receive(struct Device *dev, uint8_t *data, int length, int *actual_length, unsigned int timeout_ms);
+
+#endif//NITROKEY_HOTP_VERIFICATION_CTAPHID_H
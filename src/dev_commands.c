@@ -37,10 +37,10 @@ int authenticate_admin(struct Device *dev, const char *admin_PIN, uint8_t *admin
     }
 
     int res;
-    read_random_bytes_to_buf(dev->admin_temporary_password, sizeof(dev->admin_temporary_password));
+    read_random_bytes_to_buf(admin_temporary_password, TEMPORARY_PASSWORD_LENGTH);
 
     memcpy(auth_st.card_password, admin_PIN, min(strnlen(admin_PIN, MAX_STRING_LENGTH), sizeof(auth_st.card_password)));
-    memcpy(admin_temporary_password, auth_st.temporary_password,
+    memcpy(auth_st.temporary_password, admin_temporary_password,
            min(TEMPORARY_PASSWORD_LENGTH, sizeof(auth_st.temporary_password)));
     res = device_send(dev, (uint8_t *) &auth_st, sizeof(auth_st), FIRST_AUTHENTICATE);
     if (res != RET_NO_ERROR) return res;
@@ -57,10 +57,10 @@ int authenticate_user(struct Device *dev, const char *user_PIN, uint8_t *user_te
     }
 
     int res;
-    read_random_bytes_to_buf(dev->user_temporary_password, sizeof(dev->user_temporary_password));
+    read_random_bytes_to_buf(user_temporary_password, TEMPORARY_PASSWORD_LENGTH);
 
     memcpy(auth_st.card_password, user_PIN, min(strnlen(user_PIN, MAX_STRING_LENGTH), sizeof(auth_st.card_password)));
-    memcpy(user_temporary_password, auth_st.temporary_password,
+    memcpy(auth_st.temporary_password, user_temporary_password,
            min(TEMPORARY_PASSWORD_LENGTH, sizeof(auth_st.temporary_password)));
     res = device_send(dev, (uint8_t *) &auth_st, sizeof(auth_st), USER_AUTHENTICATE);
     if (res != RET_NO_ERROR) return res;
@@ -23,13 +23,23 @@
 #include "ccid.h"
 #include "command_id.h"
 #include "crc32.h"
+#include "ctaphid.h"
+#include "flight_recorder.h"
+#include "hidraw.h"
 #include "min.h"
+#include "pcsc.h"
 #include "return_codes.h"
 #include "settings.h"
 #include "structs.h"
+#include "trace.h"
 #include "utils.h"
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <hidapi/hidapi.h>
+#include <limits.h>
+#include <sched.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <string.h>
@@ -43,6 +53,7 @@
 #define LIBREM_KEY_USB_PID 0x4c4b
 
 static void device_clear_buffers(struct Device *dev);
+static void device_clear_packets(struct Device *dev);
 
 void _dump(uint8_t *data, size_t datalen) {
     if (datalen == 0) {
@@ -83,19 +94,197 @@ static const int CONNECTION_ATTEMPTS_COUNT = 2;
 
 static const int CONNECTION_ATTEMPT_DELAY_MICRO_SECONDS = 1000 * 1000 / 2;
 
-int device_receive(struct Device *dev, uint8_t *out_data, size_t out_buffer_size) {
+// HIDAPI keeps a single library context for the whole process. Initialize it with the first HID
+// Device and release it with the last one, so disconnecting one Device does not break the others.
+// A spinlock keeps the core free of a pthread dependency.
+static atomic_flag hidapi_lock = ATOMIC_FLAG_INIT;
+static int hidapi_users = 0;
+
+static void hidapi_lock_acquire(void) {
+    while (atomic_flag_test_and_set_explicit(&hidapi_lock, memory_order_acquire)) {
+        sched_yield();
+    }
+}
+
+static void hidapi_lock_release(void) {
+    atomic_flag_clear_explicit(&hidapi_lock, memory_order_release);
+}
+
+/**
+ * Lock key of the HID device by its hidraw node or HIDAPI path. The USB bus and address in the path of the HIDAPI
+ * libusb backend, or behind the hidraw node, give the same key as the CCID interface of the device has.
+ */
+static void hid_path_key(char key[DEVICE_LOCK_KEY_SIZE], const char *path) {
+    unsigned bus = 0, address = 0, interface = 0;
+    int end = 0;
+    if ((sscanf(path, "%4x:%4x:%2x%n", &bus, &address, &interface, &end) == 3 && path[end] == '\0') ||
+        hidraw_usb_address(path, &bus, &address)) {
+        device_lock_usb_key(key, bus, address);
+    } else {
+        device_lock_path_key(key, path);
+    }
+}
+
+static int lock_hid_path(struct DeviceLock *lock, const char *path) {
+    char key[DEVICE_LOCK_KEY_SIZE];
+    hid_path_key(key, path);
+    return device_lock_try(lock, key);
+}
+
+// Open the first free device with the given USB identifiers, and take its lock. With the path prefix, only the one
+// with the matching HIDAPI path is opened, which starts with "bus:address:" for the libusb backend.
+static hid_device *hidapi_open(struct DeviceLock *lock, uint16_t vid, uint16_t pid, const char *path_prefix, bool *busy) {
+    hidapi_lock_acquire();
+    if (hidapi_users == 0 && hid_init() != 0) {
+        hidapi_lock_release();
+        return nullptr;
+    }
+    hid_device *handle = nullptr;
+    struct hid_device_info *list = hid_enumerate(vid, pid);
+    for (struct hid_device_info *info = list; info != nullptr && handle == nullptr; info = info->next) {
+        if (path_prefix != nullptr && strncmp(info->path, path_prefix, strlen(path_prefix)) != 0) {
+            continue;
+        }
+        // another Device instance or process might be using this key already - try the next one
+        if (lock_hid_path(lock, info->path) == RET_DEVICE_BUSY) {
+            *busy = true;
+            continue;
+        }
+        handle = hid_open_path(info->path);
+        if (handle == nullptr) {
+            device_lock_release(lock);
+        }
+    }
+    hid_free_enumeration(list);
+    if (handle != nullptr) {
+        hidapi_users++;
+    } else if (hidapi_users == 0) {
+        hid_exit();
+    }
+    hidapi_lock_release();
+    return handle;
+}
+
+// Count of the attached devices, without opening them. With the key, only the device of that lock key is counted.
+static size_t hidapi_count(uint16_t vid, uint16_t pid, const char *key) {
+    hidapi_lock_acquire();
+    if (hidapi_users == 0 && hid_init() != 0) {
+        hidapi_lock_release();
+        return 0;
+    }
+    struct hid_device_info *list = hid_enumerate(vid, pid);
+    size_t count = 0;
+    for (struct hid_device_info *info = list; info != nullptr; info = info->next) {
+        char info_key[DEVICE_LOCK_KEY_SIZE];
+        if (key != nullptr) {
+            hid_path_key(info_key, info->path);
+        }
+        count += key == nullptr || strcmp(info_key, key) == 0;
+    }
+    hid_free_enumeration(list);
+    if (hidapi_users == 0) {
+        hid_exit();
+    }
+    hidapi_lock_release();
+    return count;
+}
+
+static void hidapi_close(hid_device *handle) {
+    hidapi_lock_acquire();
+    hid_close(handle);
+    if (--hidapi_users == 0) {
+        hid_exit();
+    }
+    hidapi_lock_release();
+}
+
+void device_mark_removed(struct Device *dev) {
+    if (!dev->removed) {
+        LOG("The device was unplugged\n");
+        flight_record(dev->flight_id, "removed", NULL, RET_CONNECTION_LOST, NULL, 0, 0);
+    }
+    dev->removed = true;
+}
+
+bool device_hid_removed(struct Device *dev, int error) {
+    if (dev->removed) {
+        return true;
+    }
+    // over HIDAPI, the opened device is looked up by its lock key, as another one of the model might be left
+    const bool removed = dev->hid_backend_connected == HID_BACKEND_HIDRAW
+                                 ? error == ENODEV
+                                 : hidapi_count(dev->dev_info.vid, dev->dev_info.pid, dev->lock.key) == 0;
+    if (removed) {
+        device_mark_removed(dev);
+    }
+    return removed;
+}
+
+static void hid_stats_add(struct Device *dev, int64_t start_us) {
+    dev->hid_stats.transfers++;
+    dev->hid_stats.transfer_us += monotonic_us() - start_us;
+}
+
+static int hid_send_report(struct Device *dev) {
+    const int64_t start = monotonic_us();
+    int r;
+    if (dev->hid_backend_connected == HID_BACKEND_HIDRAW) {
+        r = hidraw_send_feature_report(dev->hidraw_fd, dev->packet_query.as_data, HID_REPORT_SIZE_CONST);
+    } else {
+        r = hid_send_feature_report(dev->mp_devhandle, dev->packet_query.as_data, HID_REPORT_SIZE_CONST);
+    }
+    hid_stats_add(dev, start);
+    return r;
+}
+
+static int hid_get_report(struct Device *dev) {
+    const int64_t start = monotonic_us();
+    int r;
+    if (dev->hid_backend_connected == HID_BACKEND_HIDRAW) {
+        r = hidraw_get_feature_report(dev->hidraw_fd, dev->packet_response.as_data, HID_REPORT_SIZE_CONST);
+    } else {
+        r = hid_get_feature_report(dev->mp_devhandle, dev->packet_response.as_data, HID_REPORT_SIZE_CONST);
+    }
+    hid_stats_add(dev, start);
+    return r;
+}
+
+static int device_receive_report(struct Device *dev, uint8_t *out_data, size_t out_buffer_size) {
     const int receive_attempts = 40;
     int i;
     int receive_status = 0;
+    int read_errors = 0;
     for (i = 0; i < receive_attempts; ++i) {
+        if (dev->removed) {
+            return RET_CONNECTION_LOST;
+        }
+        if (i > 0) {
+            TRACE_PROBE(retry, "hid_receive", i);
+            flight_record(dev->flight_id, "retry", "hid_receive", i, NULL, 0, 0);
+        }
 #ifdef _DEBUG
         fprintf(stderr, ".");
         fflush(stderr);
 #endif
         // keep this 200ms for Nitrokey Storage, to stabilize its responses (otherwise it sometimes returns with no data)
-        usleep(200 * 1000);
+        if (!deadline_sleep(dev->deadline, 200 * 1000)) {
+            message_print(MESSAGE_INFO, "WARN %s:%d: deadline passed while waiting for the device response.\n", "device.c", __LINE__);
+            return RET_TIMEOUT;
+        }
 
-        receive_status = (hid_get_feature_report(dev->mp_devhandle, dev->packet_response.as_data, HID_REPORT_SIZE_CONST));
+        receive_status = hid_get_report(dev);
+        if (receive_status < 0 && device_hid_removed(dev, errno)) {
+            message_print(MESSAGE_INFO, "WARN %s:%d: the device was unplugged.\n", "device.c", __LINE__);
+            return RET_CONNECTION_LOST;
+        }
+        if (receive_status < 0) {
+            // reading the report again is safe, whatever the command was
+            if (!retry_next_attempt(dev, device_retry_policy(dev), "hid_get_report", COMMAND_IDEMPOTENT, RET_COMM_ERROR, ++read_errors)) {
+                message_print(MESSAGE_INFO, "WARN %s:%d: could not read the report from the device.\n", "device.c", __LINE__);
+                return RET_COMM_ERROR;
+            }
+            continue;
+        }
         if (receive_status != (int) HID_REPORT_SIZE_CONST) continue;
         dump((dev->packet_response.as_data + 1), receive_status - 1);
         const bool valid_response_crc = stm_crc32(dev->packet_response.as_data + 1, HID_REPORT_SIZE_CONST - 5) == dev->packet_response.response_st.crc;
@@ -105,7 +294,7 @@ int device_receive(struct Device *dev, uint8_t *out_data, size_t out_buffer_size
         }
     }
     if (i >= receive_attempts - 1) {
-        printf("WARN %s:%d: could not receive the data from the device.\n", "device.c", __LINE__);
+        message_print(MESSAGE_INFO, "WARN %s:%d: could not receive the data from the device.\n", "device.c", __LINE__);
         return RET_CONNECTION_LOST;
     }
 
@@ -113,7 +302,7 @@ int device_receive(struct Device *dev, uint8_t *out_data, size_t out_buffer_size
         rassert(out_buffer_size != 0);
         memcpy(out_data, dev->packet_response.as_data + 1, min(out_buffer_size, HID_REPORT_SIZE_CONST - 1));
         if (out_buffer_size > HID_REPORT_SIZE_CONST - 1) {
-            printf("WARN %s:%d: incoming data bigger than provided output buffer.\n", "device.c", __LINE__);
+            message_print(MESSAGE_INFO, "WARN %s:%d: incoming data bigger than provided output buffer.\n", "device.c", __LINE__);
         }
     } else {
         //exit on wrong function parameters
@@ -123,8 +312,55 @@ int device_receive(struct Device *dev, uint8_t *out_data, size_t out_buffer_size
     return RET_NO_ERROR;
 }
 
+// Send the query kept in the packet, again after a failure if the command is safe to repeat
+static int device_send_query(struct Device *dev) {
+    const CommandKind kind = retry_classify_hid_command(dev->packet_query.command_id);
+    int r = RET_NO_ERROR;
+    for (int attempt = 1; !dev->removed; ++attempt) {
+        const int sent = hid_send_report(dev);
+        if (sent == (int) HID_REPORT_SIZE_CONST) {
+            break;
+        }
+        if (sent < 0 && device_hid_removed(dev, errno)) {
+            break;
+        }
+        // a failed control transfer could have reached the device still
+        if (!retry_next_attempt(dev, device_retry_policy(dev), "hid_send", kind, RET_COMM_ERROR, attempt)) {
+            r = RET_CONNECTION_LOST;
+            break;
+        }
+    }
+    if (dev->removed) {
+        r = RET_CONNECTION_LOST;
+    }
+    TRACE_PROBE(hid_send, dev->packet_query.command_id, r);
+    // the report ID and the command, the payload might hold the passwords
+    flight_record(dev->flight_id, "hid_send", NULL, r, dev->packet_query.as_data, HID_REPORT_SIZE_CONST, 2);
+    return r;
+}
+
+int device_receive(struct Device *dev, uint8_t *out_data, size_t out_buffer_size) {
+    const CommandKind kind = retry_classify_hid_command(dev->packet_query.command_id);
+    int r = device_receive_report(dev, out_data, out_buffer_size);
+    for (int attempt = 1; r == RET_COMM_ERROR; ++attempt) {
+        // the response was lost, ask for a fresh one if the command can be executed again
+        if (!retry_next_attempt(dev, device_retry_policy(dev), "hid_exchange", kind, r, attempt)) {
+            break;
+        }
+        r = device_send_query(dev);
+        if (r == RET_NO_ERROR) {
+            r = device_receive_report(dev, out_data, out_buffer_size);
+        }
+    }
+    TRACE_PROBE(hid_receive, dev->packet_query.command_id, dev->packet_response.response_st.last_command_status, r);
+    // the device and command status, without the payload
+    flight_record(dev->flight_id, "hid_receive", NULL, r, dev->packet_response.as_data, HID_REPORT_SIZE_CONST, 8);
+    return r;
+}
+
 int device_send(struct Device *dev, uint8_t *in_data, size_t data_size, uint8_t command_ID) {
-    device_clear_buffers(dev);
+    // the temporary passwords are kept, since they are reused by the following commands
+    device_clear_packets(dev);
 
     dev->packet_query.command_id = command_ID;
 
@@ -132,7 +368,7 @@ int device_send(struct Device *dev, uint8_t *in_data, size_t data_size, uint8_t
         rassert(data_size != 0);
         memcpy(dev->packet_query.payload, in_data, min(data_size, sizeof(dev->packet_query.payload)));
         if (data_size > HID_REPORT_SIZE_CONST - 1) {
-            printf("WARN %s:%d: input data bigger than buffer.\n", "device.c", __LINE__);
+            message_print(MESSAGE_INFO, "WARN %s:%d: input data bigger than buffer.\n", "device.c", __LINE__);
         }
     } else {
         //exit on wrong function parameters
@@ -141,99 +377,557 @@ int device_send(struct Device *dev, uint8_t *in_data, size_t data_size, uint8_t
 
     dev->packet_query.crc = stm_crc32(dev->packet_query.as_data + 1, HID_REPORT_SIZE_CONST - 5);
     dump((dev->packet_query.as_data + 1), HID_REPORT_SIZE_CONST - 1);
-    int send_status = hid_send_feature_report(dev->mp_devhandle, dev->packet_query.as_data, HID_REPORT_SIZE_CONST);
+    const int r = device_send_query(dev);
+    if (r != RET_NO_ERROR) {
+        message_print(MESSAGE_INFO, "WARN %s:%d: could not send the data to the device.\n", "device.c", __LINE__);
+    }
+    return r;
+}
 
-    if (send_status != (int) HID_REPORT_SIZE_CONST) {
-        printf("WARN %s:%d: could not send the data to the device.\n", "device.c", __LINE__);
-        return RET_CONNECTION_LOST;
+int device_connect_hid(struct Device *dev, const VidPid **busy_model);
+
+static bool model_matches(const struct Device *dev, const VidPid *vidPid) {
+    return dev->model_hint == 0 || dev->model_hint == vidPid->name_short;
+}
+
+static bool any_model_matches(const struct Device *dev, const VidPid list[], size_t count) {
+    for (size_t i = 0; i < count; ++i) {
+        if (model_matches(dev, &list[i])) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void device_set_connection_hints(struct Device *dev, ConnectionType transport, char model) {
+    rassert(transport < CONNECTION_LENGTH);
+    dev->transport_hint = transport;
+    dev->model_hint = model;
+}
+
+const VidPid *device_find_model(uint16_t vid, uint16_t pid) {
+    for (size_t i = 0; i < devices_size; ++i) {
+        if (devices[i].vid == vid && devices[i].pid == pid) {
+            return &devices[i];
+        }
+    }
+    for (size_t i = 0; i < LEN_ARR(devices_ccid); ++i) {
+        if (devices_ccid[i].vid == vid && devices_ccid[i].pid == pid) {
+            return &devices_ccid[i];
+        }
+    }
+    return NULL;
+}
+
+void device_set_hid_backend(struct Device *dev, HidBackend backend) {
+    rassert(backend < HID_BACKEND_LENGTH);
+    dev->hid_backend = backend;
+}
+
+void device_set_retry_policy(struct Device *dev, const struct RetryPolicy *policy) {
+    rassert(policy == NULL || policy->max_attempts > 0);
+    dev->retry_policy = policy != NULL ? *policy : retry_policy_default;
+}
+
+void device_set_ccid_backend(struct Device *dev, CcidBackend backend, const char *reader) {
+    rassert(backend < CCID_BACKEND_LENGTH);
+    dev->ccid_backend = backend;
+    dev->pcsc_reader = reader;
+}
+
+struct HidrawClaim {
+    struct DeviceLock *lock;
+    int fd;
+    bool busy;
+};
+
+// Keep the first node, which device is not used by another caller
+static bool claim_hidraw_node(int fd, const char *path, void *user_data) {
+    struct HidrawClaim *claim = user_data;
+    if (lock_hid_path(claim->lock, path) == RET_DEVICE_BUSY) {
+        claim->busy = true;
+        return false;
+    }
+    claim->fd = fd;
+    return true;
+}
+
+// Open the first free HID device of the model with the backend allowed by the settings, trying hidraw first.
+// Each device is locked on its own, so the keys of the same model are used by the callers in parallel.
+static int device_open_hid(struct Device *dev, const VidPid *model) {
+    bool busy = false;
+    if (dev->hid_backend != HID_BACKEND_HIDAPI) {
+        struct HidrawClaim claim = {.lock = &dev->lock, .fd = -1};
+        hidraw_find(model->vid, model->pid, claim_hidraw_node, &claim);
+        busy = claim.busy;
+        if (claim.fd >= 0) {
+            dev->hidraw_fd = claim.fd;
+            dev->hidraw_fd_owned = true;
+            dev->hid_backend_connected = HID_BACKEND_HIDRAW;
+            return RET_NO_ERROR;
+        }
+    }
+    if (dev->hid_backend != HID_BACKEND_HIDRAW) {
+        dev->mp_devhandle = hidapi_open(&dev->lock, model->vid, model->pid, nullptr, &busy);
+        if (dev->mp_devhandle != nullptr) {
+            dev->hid_backend_connected = HID_BACKEND_HIDAPI;
+            return RET_NO_ERROR;
+        }
     }
+    return busy ? RET_DEVICE_BUSY : RET_COMM_ERROR;
+}
 
+static void device_close_hid(struct Device *dev) {
+    if (dev->hid_backend_connected == HID_BACKEND_HIDRAW) {
+        if (dev->hidraw_fd_owned) {
+            hidraw_close(dev->hidraw_fd);
+        }
+        dev->hidraw_fd = -1;
+        dev->hidraw_fd_owned = false;
+    } else if (dev->mp_devhandle != nullptr) {
+        hidapi_close(dev->mp_devhandle);
+        dev->mp_devhandle = nullptr;
+    }
+    dev->hid_backend_connected = HID_BACKEND_AUTO;
+}
+
+void device_set_location(struct Device *dev, const char *path, int fd) {
+    dev->location.path = path;
+    dev->location.fd = fd;
+    dev->location.has_fd = fd >= 0;
+}
+
+// Read the USB identifiers from the device descriptor, which a usbfs node returns first
+static int read_usb_node_ids(int fd, uint16_t *vid, uint16_t *pid) {
+    uint8_t descriptor[18] = {};
+    if (pread(fd, descriptor, sizeof descriptor, 0) != (ssize_t) sizeof descriptor ||
+        descriptor[0] != sizeof descriptor || descriptor[1] != 0x01) {
+        return RET_UNKNOWN_DEVICE;
+    }
+    *vid = descriptor[8] | (descriptor[9] << 8);
+    *pid = descriptor[10] | (descriptor[11] << 8);
     return RET_NO_ERROR;
 }
 
-int device_connect_hid(struct Device *dev);
+static int device_connect_hid_node(struct Device *dev, const char *path, const VidPid *model) {
+    unsigned int bus = 0, address = 0;
+    int end = 0;
+    if (sscanf(path, "/dev/bus/usb/%u/%u%n", &bus, &address, &end) != 2 || path[end] != '\0') {
+        message_print(MESSAGE_INFO, "HID device path is expected as /dev/bus/usb/BBB/DDD: %s\n", path);
+        return RET_INVALID_PARAMS;
+    }
+    char path_prefix[16] = {};
+    snprintf(path_prefix, sizeof path_prefix, "%04x:%04x:", bus, address);
+    if (dev->hid_backend == HID_BACKEND_HIDRAW) {
+        message_print(MESSAGE_INFO, "The USB device node can not be used with hidraw, give the /dev/hidrawN node instead\n");
+        return RET_INVALID_PARAMS;
+    }
+    bool busy = false;
+    dev->mp_devhandle = hidapi_open(&dev->lock, model->vid, model->pid, path_prefix, &busy);
+    if (dev->mp_devhandle == nullptr) {
+        return busy ? RET_DEVICE_BUSY : RET_COMM_ERROR;
+    }
+    dev->hid_backend_connected = HID_BACKEND_HIDAPI;
+    dev->dev_info = *model;
+    return RET_NO_ERROR;
+}
 
-int device_connect_ccid(struct Device *dev) {
+// libusb context for the device given by its node, which does not need to scan the bus where supported
+static int ccid_context_init(libusb_context **ctx, bool discovery) {
+#if defined(LIBUSB_API_VERSION) && LIBUSB_API_VERSION >= 0x0100010A
+    if (!discovery) {
+        const struct libusb_init_option options[] = {{.option = LIBUSB_OPTION_NO_DEVICE_DISCOVERY}};
+        return libusb_init_context(ctx, options, LEN_ARR(options));
+    }
+#else
+    unused(discovery);
+#endif
+    return libusb_init(ctx);
+}
+
+static int device_connect_ccid_fd(struct Device *dev, int fd) {
+    dev->ctx_ccid = NULL;
+    int r = ccid_context_init(&dev->ctx_ccid, false);
+    if (r < 0) {
+        message_print(MESSAGE_INFO, "Error initializing libusb: %s\n", libusb_strerror(r));
+        return RET_COMM_ERROR;
+    }
+    bool busy = false;
+    dev->mp_devhandle_ccid = get_device_from_fd(dev->ctx_ccid, fd, devices_ccid, LEN_ARR(devices_ccid), &dev->lock, &busy);
+    if (dev->mp_devhandle_ccid == NULL) {
+        device_lock_release(&dev->lock);
+        libusb_exit(dev->ctx_ccid);
+        dev->ctx_ccid = NULL;
+        return busy ? RET_DEVICE_BUSY : RET_COMM_ERROR;
+    }
+    dev->ccid_backend_connected = CCID_BACKEND_LIBUSB;
+    dev->dev_info = devices_ccid[0];
+    ccid_init(dev);
+    return RET_NO_ERROR;
+}
+
+static bool is_hid_model(const VidPid *model) {
+    return model >= devices && model < devices + devices_size;
+}
+
+// Lock of the given hidraw node, which path is resolved from the descriptor, when it was passed alone
+static int lock_hidraw_node(struct Device *dev, int fd) {
+    if (dev->location.path != NULL) {
+        return lock_hid_path(&dev->lock, dev->location.path);
+    }
+    char link[32], path[PATH_MAX];
+    snprintf(link, sizeof link, "/proc/self/fd/%d", fd);
+    const ssize_t length = readlink(link, path, sizeof path - 1);
+    path[length > 0 ? length : 0] = '\0';
+    return lock_hid_path(&dev->lock, length > 0 ? path : link);
+}
+
+static int device_connect_location(struct Device *dev) {
+    struct DeviceLocation *location = &dev->location;
+    int fd = location->fd;
+    if (location->path != NULL) {
+        fd = open(location->path, O_RDWR | O_CLOEXEC);
+        if (fd < 0) {
+            message_print(MESSAGE_INFO, "Could not open %s: %s\n", location->path, strerror(errno));
+            return RET_COMM_ERROR;
+        }
+    }
+
+    uint16_t vid = 0, pid = 0;
+    const bool hidraw_node = hidraw_read_ids(fd, &vid, &pid);
+    const bool usb_node = !hidraw_node && read_usb_node_ids(fd, &vid, &pid) == RET_NO_ERROR;
+    const VidPid *model = hidraw_node || usb_node ? device_find_model(vid, pid) : NULL;
+    int r = RET_UNKNOWN_DEVICE;
+    if (model == NULL || !model_matches(dev, model)) {
+        message_print(MESSAGE_INFO, "Not a supported device: %04x:%04x\n", vid, pid);
+    } else if (is_hid_model(model)) {
+        if (dev->transport_hint == CONNECTION_CCID) {
+            message_print(MESSAGE_INFO, "%s is not available over CCID\n", model->name);
+        } else if (hidraw_node) {
+            if (dev->hid_backend == HID_BACKEND_HIDAPI) {
+                message_print(MESSAGE_INFO, "The hidraw node can not be used with HIDAPI, give the USB device node instead\n");
+                r = RET_INVALID_PARAMS;
+            } else if (lock_hidraw_node(dev, fd) == RET_DEVICE_BUSY) {
+                r = RET_DEVICE_BUSY;
+            } else {
+                dev->hidraw_fd = fd;
+                dev->hidraw_fd_owned = location->path != NULL;
+                dev->hid_backend_connected = HID_BACKEND_HIDRAW;
+                dev->dev_info = *model;
+                dev->connection_type = CONNECTION_HID;
+                return RET_NO_ERROR;
+            }
+        } else if (location->path == NULL) {
+            message_print(MESSAGE_INFO, "%s can be opened from a file descriptor of its hidraw node only, give its path instead\n", model->name);
+        } else {
+            r = device_connect_hid_node(dev, location->path, model);
+            if (r == RET_NO_ERROR) {
+                dev->connection_type = CONNECTION_HID;
+            }
+        }
+    } else if (hidraw_node) {
+        message_print(MESSAGE_INFO, "%s is connected over CCID, give its USB device node instead of the hidraw one\n", model->name);
+    } else if (dev->transport_hint == CONNECTION_HID) {
+        message_print(MESSAGE_INFO, "%s is not available over HID\n", model->name);
+    } else {
+        r = device_connect_ccid_fd(dev, fd);
+        if (r == RET_NO_ERROR) {
+            dev->connection_type = CONNECTION_CCID;
+            // libusb does not close the wrapped descriptor
+            location->opened_fd = fd;
+            location->owns_opened_fd = location->path != NULL;
+            return r;
+        }
+    }
+
+    if (location->path != NULL) {
+        close(fd);
+    }
+    return r;
+}
+
+static int device_connect_ccid_libusb(struct Device *dev) {
     dev->ctx_ccid = NULL;
     int r = libusb_init(&dev->ctx_ccid);
     if (r < 0) {
-        printf("Error initializing libusb: %s\n", libusb_strerror(r));
+        message_print(MESSAGE_INFO, "Error initializing libusb: %s\n", libusb_strerror(r));
         return RET_COMM_ERROR;
     }
-    dev->mp_devhandle_ccid = get_device(dev->ctx_ccid, devices_ccid, 1);
+    bool busy = false;
+    dev->mp_devhandle_ccid = get_device(dev->ctx_ccid, devices_ccid, 1, &dev->lock, &busy);
     if (dev->mp_devhandle_ccid == NULL) {
+        device_lock_release(&dev->lock);
+        libusb_exit(dev->ctx_ccid);
+        dev->ctx_ccid = NULL;
+        return busy ? RET_DEVICE_BUSY : RET_COMM_ERROR;
+    }
+    dev->ccid_backend_connected = CCID_BACKEND_LIBUSB;
+    return RET_NO_ERROR;
+}
+
+static int device_connect_ccid_pcsc(struct Device *dev) {
+    const char *reader = dev->pcsc_reader != NULL ? dev->pcsc_reader : PCSC_READER_FILTER;
+    const int r = pcsc_connect(&dev->pcsc, reader, &dev->lock);
+    if (r != RET_NO_ERROR) {
+        device_lock_release(&dev->lock);
+        return r;
+    }
+    dev->ccid_backend_connected = CCID_BACKEND_PCSC;
+    return RET_NO_ERROR;
+}
+
+static int device_connect_ccid_ctaphid(struct Device *dev) {
+    int r = device_open_hid(dev, &devices_ccid[0]);
+    if (r != RET_NO_ERROR) {
+        return r;
+    }
+    r = ctaphid_open(dev);
+    if (r != 0) {
+        device_close_hid(dev);
+        device_lock_release(&dev->lock);
+        return r;
+    }
+    dev->ccid_backend_connected = CCID_BACKEND_CTAPHID;
+    return RET_NO_ERROR;
+}
+
+int device_connect_ccid(struct Device *dev) {
+    if (!any_model_matches(dev, devices_ccid, LEN_ARR(devices_ccid))) {
         return RET_COMM_ERROR;
     }
-    ccid_init(dev->mp_devhandle_ccid);
+    if (dev->ccid_backend == CCID_BACKEND_CTAPHID) {
+        const int r = device_connect_ccid_ctaphid(dev);
+        if (r == RET_NO_ERROR) {
+            dev->dev_info = devices_ccid[0];
+            ccid_init(dev);
+        }
+        return r;
+    }
+    int r = RET_COMM_ERROR;
+    if (dev->ccid_backend != CCID_BACKEND_PCSC) {
+        r = device_connect_ccid_libusb(dev);
+    }
+    // pcscd claims the interface of the keys it serves
+    if (r != RET_NO_ERROR && dev->ccid_backend != CCID_BACKEND_LIBUSB && pcsc_supported()) {
+        const int r_pcsc = device_connect_ccid_pcsc(dev);
+        if (r_pcsc == RET_NO_ERROR || r != RET_DEVICE_BUSY) {
+            r = r_pcsc;
+        }
+    }
+    if (r != RET_NO_ERROR) {
+        return r;
+    }
+    dev->dev_info = devices_ccid[0];
+    ccid_init(dev);
 
     return RET_NO_ERROR;
 }
-int device_connect(struct Device *dev) {
-    int r = device_connect_hid(dev);
+// Count of the devices of the model, which HID interface can be opened with the backend allowed by the settings.
+// A device might be reachable over only one of the backends, and is counted once.
+static size_t hid_model_count(const struct Device *dev, const VidPid *model) {
+    const size_t hidraw = dev->hid_backend != HID_BACKEND_HIDAPI ? hidraw_find(model->vid, model->pid, NULL, NULL) : 0;
+    const size_t hidapi = dev->hid_backend != HID_BACKEND_HIDRAW ? hidapi_count(model->vid, model->pid, NULL) : 0;
+    return hidraw > hidapi ? hidraw : hidapi;
+}
+
+size_t device_count_available(struct Device *dev) {
+    if (dev->location.path != NULL || dev->location.has_fd) {
+        return 1;
+    }
+    size_t count = 0;
+    for (size_t i = 0; dev->transport_hint != CONNECTION_CCID && i < devices_size; ++i) {
+        if (model_matches(dev, &devices[i])) {
+            count += hid_model_count(dev, &devices[i]);
+        }
+    }
+#ifdef FEATURE_USE_CCID
+    if (dev->ccid_backend == CCID_BACKEND_CTAPHID) {
+        const bool counted = dev->transport_hint != CONNECTION_HID && any_model_matches(dev, devices_ccid, LEN_ARR(devices_ccid));
+        return count + (counted ? hid_model_count(dev, &devices_ccid[0]) : 0);
+    }
+    libusb_context *ctx = NULL;
+    if (dev->transport_hint == CONNECTION_HID || !any_model_matches(dev, devices_ccid, LEN_ARR(devices_ccid)) ||
+        libusb_init(&ctx) < 0) {
+        return count;
+    }
+    libusb_device **list = NULL;
+    const ssize_t listed = libusb_get_device_list(ctx, &list);
+    for (ssize_t i = 0; i < listed; ++i) {
+        struct libusb_device_descriptor desc;
+        if (libusb_get_device_descriptor(list[i], &desc) >= 0 && device_find_model(desc.idVendor, desc.idProduct) == &devices_ccid[0]) {
+            count++;
+        }
+    }
+    if (listed >= 0) {
+        libusb_free_device_list(list, 1);
+    }
+    libusb_exit(ctx);
+#endif
+    return count;
+}
+
+// Connect to the first free device. Returns RET_DEVICE_BUSY with the model, if a matching device is held by another caller.
+static int device_connect_any(struct Device *dev, const VidPid **busy_model) {
+    *busy_model = NULL;
+    if (dev->location.path != NULL || dev->location.has_fd) {
+        return device_connect_location(dev);
+    }
+    int r = RET_COMM_ERROR;
+    if (dev->transport_hint != CONNECTION_CCID && any_model_matches(dev, devices, devices_size)) {
+        r = device_connect_hid(dev, busy_model);
+    }
     if (r == RET_NO_ERROR) {
         dev->connection_type = CONNECTION_HID;
-        fprintf(stderr, "\n");
-        fflush(stderr);
+        message_print(MESSAGE_PROGRESS, "\n");
         return r;
     }
+    if (r == RET_TIMEOUT || deadline_expired(dev->deadline)) {
+        message_print(MESSAGE_PROGRESS, "\n");
+        return RET_TIMEOUT;
+    }
 
 #ifdef FEATURE_USE_CCID
-    fflush(stderr);
-    fprintf(stderr, ".");
+    if (dev->transport_hint == CONNECTION_HID) {
+        message_print(MESSAGE_PROGRESS, "\n");
+        return *busy_model != NULL ? RET_DEVICE_BUSY : RET_COMM_ERROR;
+    }
+    message_print(MESSAGE_PROGRESS, ".");
     r = device_connect_ccid(dev);
     if (r == RET_NO_ERROR) {
         dev->connection_type = CONNECTION_CCID;
-        fprintf(stderr, "\n");
-        fflush(stderr);
+        message_print(MESSAGE_PROGRESS, "\n");
         return r;
     }
+    if (r == RET_DEVICE_BUSY) {
+        *busy_model = &devices_ccid[0];
+    }
 #endif
 
-    fprintf(stderr, "\n");
-    return RET_COMM_ERROR;
+    message_print(MESSAGE_PROGRESS, "\n");
+    return *busy_model != NULL ? RET_DEVICE_BUSY : RET_COMM_ERROR;
+}
+
+int device_connect(struct Device *dev) {
+    if (dev->flight_id == 0) {
+        dev->flight_id = flight_recorder_new_device();
+    }
+    dev->retry_stats = (struct RetryStats){0};
+    dev->removed = false;
+    dev->card_serial = 0;
+    const struct Deadline wait = deadline_earlier(dev->deadline, deadline_in(DEVICE_ARBITRATION_TIMEOUT_MS));
+    const VidPid *busy_model = NULL;
+    int r = device_connect_any(dev, &busy_model);
+
+    const ConnectionType transport_hint = dev->transport_hint;
+    const char model_hint = dev->model_hint;
+    for (int attempt = 1; r == RET_DEVICE_BUSY; ++attempt) {
+        if (!dev->lock.queue.queued) {
+            // the callers, which came earlier for the busy device, are served first
+            device_queue_enter(&dev->lock.queue, dev->lock.key);
+        }
+        // wait for the release and the turn, without probing the bus meanwhile
+        while (device_lock_busy(dev->lock.key) || device_queue_ahead(&dev->lock.queue)) {
+            if (!deadline_sleep(wait, DEVICE_ARBITRATION_POLL_US)) {
+                break;
+            }
+        }
+        if (deadline_expired(wait)) {
+            break;
+        }
+        // only the model found busy is tried again
+        if (busy_model != NULL) {
+            device_set_connection_hints(dev, is_hid_model(busy_model) ? CONNECTION_HID : CONNECTION_CCID, busy_model->name_short);
+        }
+        TRACE_PROBE(retry, "connect", attempt);
+        flight_record(dev->flight_id, "retry", "connect", attempt, NULL, 0, 0);
+        r = device_connect_any(dev, &busy_model);
+        device_set_connection_hints(dev, transport_hint, model_hint);
+    }
+    device_queue_leave(&dev->lock.queue);
+
+    if (r == RET_TIMEOUT || r == RET_DEVICE_BUSY) {
+        r = deadline_expired(dev->deadline) ? RET_TIMEOUT : RET_DEVICE_BUSY;
+    }
+    TRACE_PROBE(connect, dev->connection_type, dev->dev_info.vid, dev->dev_info.pid, r);
+    flight_record(dev->flight_id, "connect", r == RET_NO_ERROR ? dev->dev_info.name : NULL, r, NULL, 0, 0);
+    return r;
 }
 
-int device_connect_hid(struct Device *dev) {
+int device_connect_hid(struct Device *dev, const VidPid **busy_model) {
     int count = CONNECTION_ATTEMPTS_COUNT;
 
     // Abort if device seem to be initialized
     rassert(dev->mp_devhandle == nullptr);
 
     while (count-- > 0) {
+        if (count < CONNECTION_ATTEMPTS_COUNT - 1) {
+            TRACE_PROBE(retry, "connect_hid", CONNECTION_ATTEMPTS_COUNT - 1 - count);
+            flight_record(dev->flight_id, "retry", "connect_hid", CONNECTION_ATTEMPTS_COUNT - 1 - count, NULL, 0, 0);
+        }
         for (size_t dev_id = 0; dev_id < devices_size; ++dev_id) {
             const VidPid vidPid = devices[dev_id];
-            dev->mp_devhandle = hid_open(vidPid.vid, vidPid.pid, nullptr);
-            if (dev->mp_devhandle != nullptr) {
+            if (!model_matches(dev, &vidPid)) {
+                continue;
+            }
+            const int r = device_open_hid(dev, &vidPid);
+            if (r == RET_NO_ERROR) {
                 dev->dev_info = vidPid;
                 return RET_NO_ERROR;
             }
-            usleep(CONNECTION_ATTEMPT_DELAY_MICRO_SECONDS);
+            if (r == RET_DEVICE_BUSY) {
+                *busy_model = &devices[dev_id];
+                continue;
+            }
+            if (!deadline_sleep(dev->deadline, CONNECTION_ATTEMPT_DELAY_MICRO_SECONDS)) {
+                return RET_TIMEOUT;
+            }
+        }
+        if (*busy_model != NULL) {
+            return RET_DEVICE_BUSY;
         }
         if (count == CONNECTION_ATTEMPTS_COUNT)
-            fprintf(stderr, "Trying to connect to device: ");
+            message_print(MESSAGE_PROGRESS, "Trying to connect to device: ");
         else
-            fprintf(stderr, ".");
-        fflush(stderr);
+            message_print(MESSAGE_PROGRESS, ".");
     }
 
     return RET_COMM_ERROR;
 }
 
 int device_disconnect(struct Device *dev) {
+    TRACE_PROBE(disconnect, dev->connection_type);
+    flight_record(dev->flight_id, "disconnect", NULL, dev->connection_type, NULL, 0, 0);
     if (dev->connection_type == CONNECTION_CCID) {
-        if (dev->mp_devhandle_ccid == nullptr) return 1;//TODO name error value
-        libusb_release_interface(dev->mp_devhandle_ccid, 0);
-        libusb_close(dev->mp_devhandle_ccid);
-        libusb_exit(dev->ctx_ccid);
-        dev->mp_devhandle_ccid = nullptr;
+        if (dev->ccid_backend_connected == CCID_BACKEND_PCSC) {
+            pcsc_disconnect(dev->pcsc);
+            dev->pcsc = nullptr;
+        } else if (dev->ccid_backend_connected == CCID_BACKEND_CTAPHID) {
+            ctaphid_close(dev);
+            device_close_hid(dev);
+        } else {
+            if (dev->mp_devhandle_ccid == nullptr) return 1;//TODO name error value
+            libusb_release_interface(dev->mp_devhandle_ccid, 0);
+            libusb_close(dev->mp_devhandle_ccid);
+            libusb_exit(dev->ctx_ccid);
+            dev->mp_devhandle_ccid = nullptr;
+        }
+        dev->ccid_backend_connected = CCID_BACKEND_AUTO;
+        if (dev->location.owns_opened_fd) {
+            close(dev->location.opened_fd);
+            dev->location.owns_opened_fd = false;
+        }
+        device_lock_release(&dev->lock);
         device_clear_buffers(dev);
+        buffer_free(&dev->ccid_buffer_in);
+        buffer_free(&dev->ccid_buffer_out);
+        buffer_free(&dev->touch_pending_message);
+        dev->touch_pending = false;
         dev->connection_type = CONNECTION_UNKNOWN;
         return RET_NO_ERROR;
     } else if (dev->connection_type == CONNECTION_HID) {
-        if (dev->mp_devhandle == nullptr) return 1;//TODO name error value
-        hid_close(dev->mp_devhandle);
-        hid_exit();
-        dev->mp_devhandle = nullptr;
+        if (dev->hid_backend_connected != HID_BACKEND_HIDRAW && dev->mp_devhandle == nullptr) return 1;//TODO name error value
+        device_close_hid(dev);
+        device_lock_release(&dev->lock);
         device_clear_buffers(dev);
         dev->connection_type = CONNECTION_UNKNOWN;
         return RET_NO_ERROR;
@@ -241,12 +935,15 @@ int device_disconnect(struct Device *dev) {
     return RET_UNKNOWN_DEVICE;
 }
 
-static void device_clear_buffers(struct Device *dev) {
+static void device_clear_packets(struct Device *dev) {
     static_assert(sizeof(dev->packet_query.as_data) == HID_REPORT_SIZE, "Data size is not equal HID report size!");
     memset(dev->packet_query.as_data, 0, sizeof(dev->packet_query.as_data));
     memset(dev->packet_response.as_data, 0, sizeof(dev->packet_response.as_data));
-    memset(dev->user_temporary_password, 0, sizeof(dev->user_temporary_password));
-    memset(dev->admin_temporary_password, 0, sizeof(dev->admin_temporary_password));
+}
+
+static void device_clear_buffers(struct Device *dev) {
+    device_clear_packets(dev);
+    session_end(dev);
     clean_buffers(dev);
 }
 
@@ -258,6 +955,15 @@ int device_receive_buf(struct Device *dev) {
     return device_receive(dev, nullptr, 0);
 }
 
+// Send the command without data, and take its response
+static int device_query(struct Device *dev, uint8_t command_ID) {
+    const int res = device_send_buf(dev, command_ID);
+    if (res != RET_NO_ERROR) {
+        return res;
+    }
+    return device_receive_buf(dev);
+}
+
 #include "operations_ccid.h"
 
 int device_get_status(struct Device *dev, struct FullResponseStatus *out_response) {
@@ -268,7 +974,7 @@ int device_get_status(struct Device *dev, struct FullResponseStatus *out_respons
     struct ResponseStatus *out_status = &out_response->response_status;
 
     if (dev->connection_type == CONNECTION_CCID) {
-        int res = status_ccid(dev->mp_devhandle_ccid, out_response);
+        int res = status_ccid(dev, out_response);
         // out_status->retry_admin = counter;
         // out_status->retry_user = counter;
         // out_status->card_serial_u32 = serial;
@@ -278,21 +984,32 @@ int device_get_status(struct Device *dev, struct FullResponseStatus *out_respons
 
     //getting smartcards counters takes additional 100ms
     //could be skipped initially and shown only on failed attempt to make that faster
-    device_send_buf(dev, GET_PASSWORD_RETRY_COUNT);
-    device_receive_buf(dev);
+    int res = device_query(dev, GET_PASSWORD_RETRY_COUNT);
+    if (res != RET_NO_ERROR) {
+        return res;
+    }
     const uint8_t retry_admin = dev->packet_response.response_st.payload[0];
-    device_send_buf(dev, GET_USER_PASSWORD_RETRY_COUNT);
-    device_receive_buf(dev);
+    res = device_query(dev, GET_USER_PASSWORD_RETRY_COUNT);
+    if (res != RET_NO_ERROR) {
+        return res;
+    }
     const uint8_t retry_user = dev->packet_response.response_st.payload[0];
 
-    device_send_buf(dev, GET_STATUS);
-    device_receive_buf(dev);
+    res = device_query(dev, GET_STATUS);
+    if (res != RET_NO_ERROR) {
+        return res;
+    }
     out_response->response_status = *(struct ResponseStatus *) dev->packet_response.response_st.payload;
 
     if (out_status->firmware_version_st.minor == 1) {
         for (int i = 0; i < 100; ++i) {
-            device_send_buf(dev, GET_DEVICE_STATUS);
-            device_receive_buf(dev);
+            if (deadline_expired(dev->deadline)) {
+                return RET_TIMEOUT;
+            }
+            res = device_query(dev, GET_DEVICE_STATUS);
+            if (res != RET_NO_ERROR) {
+                return res;
+            }
 
             struct StatusResponsePayloadStorage *status = (struct StatusResponsePayloadStorage *) (dev->packet_response.response_st.payload + 22);
             out_status->card_serial_u32 = status->ActiveSmartCardID_u32;
@@ -306,6 +1023,7 @@ int device_get_status(struct Device *dev, struct FullResponseStatus *out_respons
 
     out_status->retry_admin = retry_admin;
     out_status->retry_user = retry_user;
+    dev->card_serial = out_status->card_serial_u32;
     return RET_NO_ERROR;
 }
 
@@ -337,7 +1055,13 @@ const char *command_status_to_string(uint8_t status_code) {
 }
 #undef STR
 
+void device_set_touch_handler(struct Device *dev, TouchCallback callback, void *user_data, bool non_blocking) {
+    dev->touch_callback = callback;
+    dev->touch_callback_data = user_data;
+    dev->touch_non_blocking = non_blocking;
+}
+
 void clean_buffers(struct Device *dev) {
-    memset(dev->ccid_buffer_in, 0, sizeof dev->ccid_buffer_in);
-    memset(dev->ccid_buffer_out, 0, sizeof dev->ccid_buffer_out);
+    buffer_clean(&dev->ccid_buffer_in);
+    buffer_clean(&dev->ccid_buffer_out);
 }
@@ -22,8 +22,13 @@
 #ifndef NITROKEY_HOTP_VERIFICATION_DEVICE_H
 #define NITROKEY_HOTP_VERIFICATION_DEVICE_H
 
+#include "buffer.h"
+#include "device_lock.h"
+#include "retry_policy.h"
+#include "session.h"
 #include "settings.h"
 #include "structs.h"
+#include "utils.h"
 #include <hidapi/hidapi.h>
 #include <libusb.h>
 #include <stddef.h>
@@ -45,6 +50,51 @@ typedef enum {
     CONNECTION_LENGTH
 } ConnectionType;
 
+// Access to the HID feature reports
+typedef enum {
+    // hidraw where available, HIDAPI otherwise
+    HID_BACKEND_AUTO,
+    // Linux hidraw ioctls, with the kernel driver left attached
+    HID_BACKEND_HIDRAW,
+    // HIDAPI with its libusb backend
+    HID_BACKEND_HIDAPI,
+    HID_BACKEND_LENGTH
+} HidBackend;
+
+// Access to the CCID interface of the Nitrokey 3
+typedef enum {
+    // libusb, and PC/SC when the interface is claimed already, like by pcscd
+    CCID_BACKEND_AUTO,
+    // the interface claimed with libusb
+    CCID_BACKEND_LIBUSB,
+    // the reader of pcscd, see pcsc.h
+    CCID_BACKEND_PCSC,
+    // the Secrets App commands tunneled over the CTAPHID interface, see ctaphid.h
+    CCID_BACKEND_CTAPHID,
+    CCID_BACKEND_LENGTH
+} CcidBackend;
+
+struct PcscConnection;
+struct CtaphidChannel;
+
+// Feature report transfers of the HID connection, for comparing the backends
+struct HidTransferStats {
+    uint32_t transfers;
+    // time spent in the backend calls only, without the waits between the retries
+    int64_t transfer_us;
+};
+
+typedef enum {
+    // the device started waiting for the touch confirmation
+    TOUCH_REQUIRED,
+    // the device reported it is still waiting
+    TOUCH_WAITING,
+    // the touch was confirmed, the operation continues
+    TOUCH_RECEIVED,
+} TouchEvent;
+
+typedef void (*TouchCallback)(TouchEvent event, void *user_data);
+
 typedef struct VidPid {
     uint16_t vid;
     uint16_t pid;
@@ -52,22 +102,87 @@ typedef struct VidPid {
     char name_short;
 } VidPid;
 
+// Device given explicitly, instead of being looked for on the bus
+struct DeviceLocation {
+    // USB device node, like /dev/bus/usb/001/005, or NULL
+    const char *path;
+    // already opened USB device node, e.g. inherited from a privileged launcher, used if has_fd
+    int fd;
+    bool has_fd;
+    // node opened from the path for the CCID connection, closed on disconnect
+    int opened_fd;
+    bool owns_opened_fd;
+};
+
+// Secrets App state, as announced in its SELECT response
+struct SecretsAppState {
+    // false until the Secrets App was selected, or when its state could not be followed
+    bool known;
+    bool pin_set;
+};
+
 struct Device {
     hid_device *mp_devhandle;
+    // hidraw node, used instead of mp_devhandle when hid_backend_connected is HID_BACKEND_HIDRAW
+    int hidraw_fd;
+    bool hidraw_fd_owned;
+    // requested by device_set_hid_backend(), and the one the connection uses
+    HidBackend hid_backend;
+    HidBackend hid_backend_connected;
+    struct HidTransferStats hid_stats;
     libusb_device_handle *mp_devhandle_ccid;
     libusb_context *ctx_ccid;
+    // requested by device_set_ccid_backend(), and the one the connection uses
+    CcidBackend ccid_backend;
+    CcidBackend ccid_backend_connected;
+    // used instead of mp_devhandle_ccid when ccid_backend_connected is CCID_BACKEND_PCSC
+    struct PcscConnection *pcsc;
+    // part of the PC/SC reader names to connect to, PCSC_READER_FILTER when NULL
+    const char *pcsc_reader;
+    // used with the HID handle above, when ccid_backend_connected is CCID_BACKEND_CTAPHID
+    struct CtaphidChannel *ctaphid;
     ConnectionType connection_type;
     VidPid dev_info;
-    union {
-        struct DeviceQuery packet_query;
-        uint8_t ccid_buffer_out[MAX_CCID_BUFFER_SIZE];
-    } __packed;
-    union {
-        struct DeviceResponse packet_response;
-        uint8_t ccid_buffer_in[MAX_CCID_BUFFER_SIZE];
-    } __packed;
+    // Limits for device_connect(), see device_set_connection_hints()
+    ConnectionType transport_hint;
+    char model_hint;
+    struct DeviceLocation location;
+    // held while connected, keeps the other callers away from the device
+    struct DeviceLock lock;
+    struct DeviceQuery packet_query;
+    struct DeviceResponse packet_response;
+    // CCID frames, allocated on the first use and sized to the largest frame exchanged
+    struct Buffer ccid_buffer_out;
+    struct Buffer ccid_buffer_in;
     uint8_t user_temporary_password[TEMPORARY_PASSWORD_LENGTH];
     uint8_t admin_temporary_password[TEMPORARY_PASSWORD_LENGTH];
+    // bSeq of the next CCID message sent to this device
+    uint8_t ccid_seq;
+    // CCID messages sent ahead by ccid_process_batch(), before reading their responses
+    uint8_t ccid_pipeline_depth;
+    // longest CCID message of the reader, from its class descriptor; 0 when it is not known, as over PC/SC
+    uint32_t ccid_max_message_length;
+    struct Session session;
+    // kept up to date by the SELECT and PIN commands
+    struct SecretsAppState secrets_app;
+    // serial number of the card, as reported by the status or by the SELECT of the Secrets App; 0 until then
+    uint32_t card_serial;
+    // Limit for all exchanges of the current operation, set by its caller
+    struct Deadline deadline;
+    // the default policy when not set, see device_set_retry_policy()
+    struct RetryPolicy retry_policy;
+    struct RetryStats retry_stats;
+    // identifies the events of this device in the flight recorder, taken on the first connect
+    uint32_t flight_id;
+    // set once a transfer found the device unplugged, the exchanges fail right away until connected again
+    bool removed;
+    // Touch handling, see device_set_touch_handler()
+    TouchCallback touch_callback;
+    void *touch_callback_data;
+    bool touch_non_blocking;
+    // CCID message, which response is waiting for touch. Sending it again resumes the exchange.
+    bool touch_pending;
+    struct Buffer touch_pending_message;
 };
 
 int device_connect(struct Device *dev);
@@ -82,4 +197,68 @@ const char *command_status_to_string(uint8_t status_code);
 
 void clean_buffers(struct Device *dev);
 
+/**
+ * The device was unplugged. The following exchanges return RET_CONNECTION_LOST without touching the bus or waiting,
+ * instead of going through their polls and retries, until the device is connected again.
+ */
+void device_mark_removed(struct Device *dev);
+/**
+ * Tell, after a failed transfer on the HID interface, whether the device was unplugged, and mark it removed then.
+ * error is the errno of the failed call: hidraw reports ENODEV. HIDAPI reports no causes, so the device is looked
+ * for on the bus instead.
+ */
+bool device_hid_removed(struct Device *dev, int error);
+
+/**
+ * Limit device_connect() to the transport and the device model, skipping the probing of the others.
+ * CONNECTION_UNKNOWN tries HID first, then CCID. The model is the name_short of its VidPid
+ * ('P', 'L', 'S' or '3'), or 0 for any.
+ */
+void device_set_connection_hints(struct Device *dev, ConnectionType transport, char model);
+
+/**
+ * Connect to the device on the given USB device node path, or on the already opened node fd (-1 for none),
+ * skipping the enumeration. HID devices can be given only with the path. The connection hints still apply.
+ * The path is not copied, and must stay valid until connected.
+ */
+void device_set_location(struct Device *dev, const char *path, int fd);
+
+/**
+ * Use the given backend for the HID devices. HID_BACKEND_AUTO tries hidraw first, then HIDAPI.
+ * A hidraw node, like /dev/hidraw0, can be given with device_set_location() as well.
+ */
+void device_set_hid_backend(struct Device *dev, HidBackend backend);
+
+/**
+ * Use the given backend for the Nitrokey 3. CCID_BACKEND_AUTO claims the interface with libusb, and goes over
+ * PC/SC when it is claimed already. The PC/SC readers are taken by their names containing the reader,
+ * or PCSC_READER_FILTER when NULL. The reader is not copied, and must stay valid until connected.
+ * CCID_BACKEND_CTAPHID opens the HID interface with the HID backend, and like for the HID devices,
+ * reaches the first Nitrokey 3 only.
+ */
+void device_set_ccid_backend(struct Device *dev, CcidBackend backend, const char *reader);
+
+/**
+ * Retry the exchanges failing with a transient USB error by the policy, or by retry_policy_default when NULL.
+ * The policy is copied. The retries since connecting are counted in dev->retry_stats.
+ */
+void device_set_retry_policy(struct Device *dev, const struct RetryPolicy *policy);
+
+/**
+ * Count of the devices device_connect() can reach with the current hints, including the ones used by other
+ * processes. HIDAPI opens only the first device of a HID model, so each HID model is counted once,
+ * and so is the Nitrokey 3 over CTAPHID.
+ */
+size_t device_count_available(struct Device *dev);
+
+// The known device with the given USB identifiers, or NULL
+const VidPid *device_find_model(uint16_t vid, uint16_t pid);
+
+/**
+ * Report the touch confirmation progress to the callback, instead of staying silent.
+ * In the non-blocking mode an operation waiting for touch returns RET_TOUCH_REQUIRED right away.
+ * Calling the same operation again resumes the waiting exchange, and returns its result once touched.
+ */
+void device_set_touch_handler(struct Device *dev, TouchCallback callback, void *user_data, bool non_blocking);
+
 #endif//NITROKEY_HOTP_VERIFICATION_DEVICE_H
@@ -0,0 +1,264 @@
+/*
+ * Copyright (c) 2023 Nitrokey GmbH
+ *
+ * This file is part of Nitrokey HOTP verification project.
+ *
+ * Nitrokey HOTP verification is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * Nitrokey HOTP verification is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Nitrokey HOTP verification. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0
+ */
+
+#include "device_lock.h"
+#include "return_codes.h"
+#include "settings.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define LOCK_DIRECTORY "hotp-verification"
+#define QUEUE_DIRECTORY "queue"
+#define TICKET_FILE "ticket"
+#define LOCK_PATH_SIZE 256
+
+// Directory of the lock files, created on demand. Returns false, if it is not usable.
+static bool lock_directory(char *path, size_t size) {
+    const char *runtime_dir = getenv("XDG_RUNTIME_DIR");
+    int length;
+    if (runtime_dir != NULL && runtime_dir[0] == '/') {
+        length = snprintf(path, size, "%s/" LOCK_DIRECTORY, runtime_dir);
+    } else {
+        length = snprintf(path, size, "/tmp/" LOCK_DIRECTORY "-%u", (unsigned) getuid());
+    }
+    if (length < 0 || (size_t) length >= size) {
+        return false;
+    }
+    if (mkdir(path, 0700) != 0 && errno != EEXIST) {
+        return false;
+    }
+    // in the shared /tmp the directory might have been placed by another user
+    struct stat st;
+    return lstat(path, &st) == 0 && S_ISDIR(st.st_mode) && st.st_uid == getuid();
+}
+
+static bool lock_path(char *path, size_t size, const char *format, const char *name) {
+    if (!lock_directory(path, size)) {
+        return false;
+    }
+    const size_t used = strlen(path);
+    const int length = snprintf(path + used, size - used, format, name);
+    return length >= 0 && (size_t) length < size - used;
+}
+
+// Whether an earlier waiter is still in the queue. The ones, which ended without leaving it, are removed.
+static bool earlier_waiter_present(const char *directory, uint64_t ticket) {
+    DIR *queue = opendir(directory);
+    if (queue == NULL) {
+        return false;
+    }
+    bool present = false;
+    struct dirent *entry;
+    while ((entry = readdir(queue)) != NULL) {
+        if (entry->d_name[0] == '.') {
+            continue;
+        }
+        char *end = NULL;
+        const uint64_t other = strtoull(entry->d_name, &end, 10);
+        if (*end != '\0' || other >= ticket) {
+            continue;
+        }
+        const int fd = openat(dirfd(queue), entry->d_name, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            continue;
+        }
+        // a waiter keeps its file locked for as long as it is in the queue
+        if (flock(fd, LOCK_EX | LOCK_NB) == 0) {
+            unlinkat(dirfd(queue), entry->d_name, 0);
+        } else {
+            present = true;
+        }
+        close(fd);
+    }
+    closedir(queue);
+    return present;
+}
+
+// Directory of the queue of the device, created on demand. Returns false, if it is not usable.
+static bool queue_directory(char *path, size_t size, const char *key, bool create) {
+    if (!lock_path(path, size, "/%s", QUEUE_DIRECTORY)) {
+        return false;
+    }
+    if (create && mkdir(path, 0700) != 0 && errno != EEXIST) {
+        return false;
+    }
+    const size_t used = strlen(path);
+    const int length = snprintf(path + used, size - used, "/%s", key);
+    if (length < 0 || (size_t) length >= size - used) {
+        return false;
+    }
+    return !create || mkdir(path, 0700) == 0 || errno == EEXIST;
+}
+
+// Take the lock file of the device, regardless of its queue
+static int lock_file_try(struct DeviceLock *lock, const char *key) {
+    rassert(!lock->held);
+    snprintf(lock->key, sizeof lock->key, "%s", key);
+    char path[LOCK_PATH_SIZE];
+    if (!lock_path(path, sizeof path, "/%s.lock", key)) {
+        return RET_NO_ERROR;
+    }
+    const int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        return RET_NO_ERROR;
+    }
+    if (flock(fd, LOCK_EX | LOCK_NB) != 0) {
+        const bool busy = errno == EWOULDBLOCK;
+        close(fd);
+        return busy ? RET_DEVICE_BUSY : RET_NO_ERROR;
+    }
+    lock->fd = fd;
+    lock->held = true;
+    return RET_NO_ERROR;
+}
+
+int device_lock_try(struct DeviceLock *lock, const char *key) {
+    const int r = lock_file_try(lock, key);
+    if (r != RET_NO_ERROR || !lock->held) {
+        return r;
+    }
+    // the callers waiting in the queue of the device came earlier, unless the caller waits there before them
+    const bool own_queue = lock->queue.queued && strcmp(lock->queue.key, key) == 0;
+    char directory[LOCK_PATH_SIZE];
+    if (queue_directory(directory, sizeof directory, key, false) &&
+        earlier_waiter_present(directory, own_queue ? lock->queue.ticket : UINT64_MAX)) {
+        device_lock_release(lock);
+        return RET_DEVICE_BUSY;
+    }
+    return RET_NO_ERROR;
+}
+
+void device_lock_usb_key(char key[DEVICE_LOCK_KEY_SIZE], unsigned bus, unsigned address) {
+    snprintf(key, DEVICE_LOCK_KEY_SIZE, "usb-%03u-%03u", bus % 1000, address % 1000);
+}
+
+void device_lock_name_key(char key[DEVICE_LOCK_KEY_SIZE], const char *prefix, const char *name) {
+    // FNV-1a, the name itself might not fit, or contain characters not allowed in the file names
+    uint32_t hash = 2166136261u;
+    for (const char *c = name; *c != '\0'; ++c) {
+        hash = (hash ^ (uint8_t) *c) * 16777619u;
+    }
+    snprintf(key, DEVICE_LOCK_KEY_SIZE, "%s-%08" PRIx32, prefix, hash);
+}
+
+void device_lock_path_key(char key[DEVICE_LOCK_KEY_SIZE], const char *path) {
+    device_lock_name_key(key, "path", path);
+}
+
+void device_lock_release(struct DeviceLock *lock) {
+    if (!lock->held) {
+        return;
+    }
+    // the lock file stays, removing it would race with the callers opening it
+    close(lock->fd);
+    lock->held = false;
+}
+
+bool device_lock_busy(const char *key) {
+    struct DeviceLock probe = {0};
+    const bool busy = lock_file_try(&probe, key) == RET_DEVICE_BUSY;
+    device_lock_release(&probe);
+    return busy;
+}
+
+// Next number from the ticket file, or 0 if it could not be read or written
+static uint64_t take_ticket(const char *directory) {
+    char path[LOCK_PATH_SIZE + sizeof("/" TICKET_FILE)];
+    const int path_length = snprintf(path, sizeof path, "%s/" TICKET_FILE, directory);
+    if (path_length < 0 || (size_t) path_length >= sizeof path) {
+        return 0;
+    }
+    const int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        return 0;
+    }
+    uint64_t ticket = 0;
+    if (flock(fd, LOCK_EX) == 0) {
+        char text[24] = {0};
+        const ssize_t length = pread(fd, text, sizeof text - 1, 0);
+        const uint64_t last = length > 0 ? strtoull(text, NULL, 10) : 0;
+        const int written = snprintf(text, sizeof text, "%" PRIu64 "\n", last + 1);
+        if (ftruncate(fd, 0) == 0 && pwrite(fd, text, written, 0) == written) {
+            ticket = last + 1;
+        }
+    }
+    // closing releases the lock
+    close(fd);
+    return ticket;
+}
+
+void device_queue_enter(struct DeviceQueue *queue, const char *key) {
+    queue->queued = false;
+    snprintf(queue->key, sizeof queue->key, "%s", key);
+    char directory[LOCK_PATH_SIZE];
+    if (!queue_directory(directory, sizeof directory, key, true)) {
+        return;
+    }
+    const uint64_t ticket = take_ticket(directory);
+    if (ticket == 0) {
+        return;
+    }
+
+    // the file is locked before it is given its name, so the others never see it unlocked
+    char temporary[LOCK_PATH_SIZE + 32], path[LOCK_PATH_SIZE + 32];
+    snprintf(temporary, sizeof temporary, "%s/.waiting-XXXXXX", directory);
+    snprintf(path, sizeof path, "%s/%020" PRIu64, directory, ticket);
+    const int fd = mkstemp(temporary);
+    if (fd < 0) {
+        return;
+    }
+    if (flock(fd, LOCK_EX) != 0 || rename(temporary, path) != 0) {
+        unlink(temporary);
+        close(fd);
+        return;
+    }
+    queue->fd = fd;
+    queue->ticket = ticket;
+    queue->queued = true;
+}
+
+bool device_queue_ahead(const struct DeviceQueue *queue) {
+    char directory[LOCK_PATH_SIZE];
+    return queue->queued && queue_directory(directory, sizeof directory, queue->key, false) &&
+           earlier_waiter_present(directory, queue->ticket);
+}
+
+void device_queue_leave(struct DeviceQueue *queue) {
+    if (!queue->queued) {
+        return;
+    }
+    char path[LOCK_PATH_SIZE + 32];
+    if (queue_directory(path, LOCK_PATH_SIZE, queue->key, false)) {
+        const size_t used = strlen(path);
+        snprintf(path + used, sizeof path - used, "/%020" PRIu64, queue->ticket);
+        unlink(path);
+    }
+    close(queue->fd);
+    queue->queued = false;
+}
@@ -0,0 +1,81 @@
+/*
+ * Copyright (c) 2023 Nitrokey GmbH
+ *
+ * This file is part of Nitrokey HOTP verification project.
+ *
+ * Nitrokey HOTP verification is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * Nitrokey HOTP verification is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Nitrokey HOTP verification. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0
+ */
+
+#ifndef NITROKEY_HOTP_VERIFICATION_DEVICE_LOCK_H
+#define NITROKEY_HOTP_VERIFICATION_DEVICE_LOCK_H
+
+#include "utils.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * Arbitration of the devices between the processes, and the Device instances, of a host.
+ *
+ * Each device has a lock file, taken before its interface is claimed and held until the disconnection.
+ * The callers finding a device busy wait for their turn in the queue of that device, so they are served
+ * in the order of arrival, instead of failing to claim it and retrying blindly, while the callers
+ * of the other devices are not held up. The files are kept in
+ * $XDG_RUNTIME_DIR/hotp-verification, or /tmp/hotp-verification-<uid> when it is not set.
+ * When they can not be created, the devices are used without the arbitration, like before.
+ */
+
+#define DEVICE_LOCK_KEY_SIZE 24
+
+// Place in the queue of a device, held while the caller waits for it
+struct DeviceQueue {
+    int fd;
+    bool queued;
+    uint64_t ticket;
+    char key[DEVICE_LOCK_KEY_SIZE];
+};
+
+struct DeviceLock {
+    int fd;
+    bool held;
+    // device of the held lock, or of the one found busy
+    char key[DEVICE_LOCK_KEY_SIZE];
+    // place of the caller in the queue of a busy device, which lets it take the lock once its turn comes
+    struct DeviceQueue queue;
+};
+
+/**
+ * Take the lock of the device with the given key without waiting, like "usb-001-005".
+ * The device is busy as well while others wait for it in its queue ahead of lock->queue.
+ * Returns RET_NO_ERROR, also when the arbitration is not available, or RET_DEVICE_BUSY.
+ */
+int device_lock_try(struct DeviceLock *lock, const char *key);
+// Key of the device at the USB bus and address, which stay the same until it is unplugged, for all its interfaces
+void device_lock_usb_key(char key[DEVICE_LOCK_KEY_SIZE], unsigned bus, unsigned address);
+// Key of the device known only by its path, like a HIDAPI path on the systems without the USB address in it
+void device_lock_path_key(char key[DEVICE_LOCK_KEY_SIZE], const char *path);
+// Key of the device known by a name of any length, hashed behind the short prefix telling the kind of the name
+void device_lock_name_key(char key[DEVICE_LOCK_KEY_SIZE], const char *prefix, const char *name);
+void device_lock_release(struct DeviceLock *lock);
+// Another caller holds the lock of the device
+bool device_lock_busy(const char *key);
+
+// Join the queue of the device with the given key, without waiting. Not queued, if the arbitration is not available.
+void device_queue_enter(struct DeviceQueue *queue, const char *key);
+// The callers, which joined the queue earlier, are still waiting in it
+bool device_queue_ahead(const struct DeviceQueue *queue);
+void device_queue_leave(struct DeviceQueue *queue);
+
+#endif//NITROKEY_HOTP_VERIFICATION_DEVICE_LOCK_H
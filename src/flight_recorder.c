@@ -0,0 +1,257 @@
+/*
+ * Copyright (c) 2023 Nitrokey GmbH
+ *
+ * This file is part of Nitrokey HOTP verification project.
+ *
+ * Nitrokey HOTP verification is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * Nitrokey HOTP verification is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Nitrokey HOTP verification. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0
+ */
+
+#include "flight_recorder.h"
+#include "min.h"
+#include "settings.h"
+#include "utils.h"
+#include <sched.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+
+struct Slot {
+    // taken by the one writer or reader of the record
+    atomic_bool busy;
+    // number of the event held plus one, 0 while empty
+    uint_fast64_t number;
+    struct FlightRecord record;
+};
+
+static struct Slot slots[FLIGHT_RECORDER_SIZE];
+// events recorded since the start, the next one goes to slots[recorded % FLIGHT_RECORDER_SIZE]
+static atomic_uint_fast64_t recorded = 0;
+static atomic_uint_fast32_t devices = 0;
+
+static bool slot_take(struct Slot *slot) {
+    return !atomic_exchange_explicit(&slot->busy, true, memory_order_acquire);
+}
+
+static void slot_release(struct Slot *slot) {
+    atomic_store_explicit(&slot->busy, false, memory_order_release);
+}
+
+void flight_record(uint32_t device, const char *event, const char *detail, int32_t code, const uint8_t *frame,
+                   size_t length, size_t captured) {
+    const uint_fast64_t number = atomic_fetch_add_explicit(&recorded, 1, memory_order_relaxed);
+    struct Slot *slot = &slots[number % FLIGHT_RECORDER_SIZE];
+    // held for a few stores only, by a writer of the same slot a whole ring earlier or by a reader
+    while (!slot_take(slot)) {
+        sched_yield();
+    }
+    struct FlightRecord *record = &slot->record;
+    slot->number = number + 1;
+    record->time_us = clock_now_us();
+    record->device = device;
+    record->event = event;
+    record->detail = detail;
+    record->code = code;
+    record->length = (uint16_t) min(length, UINT16_MAX);
+    record->captured = 0;
+    if (frame != NULL) {
+        record->captured = (uint8_t) min(min(captured, length), FLIGHT_RECORD_DATA_SIZE);
+        memcpy(record->data, frame, record->captured);
+    }
+    slot_release(slot);
+}
+
+uint32_t flight_recorder_new_device(void) {
+    return (uint32_t) atomic_fetch_add(&devices, 1) + 1;
+}
+
+/**
+ * Copy the record of the event, if its slot still holds it. Without waiting, a slot taken by another thread
+ * is skipped, as the signal handlers do not wait for the thread they interrupted.
+ */
+static bool slot_read(uint_fast64_t number, struct FlightRecord *out, bool wait) {
+    struct Slot *slot = &slots[number % FLIGHT_RECORDER_SIZE];
+    while (!slot_take(slot)) {
+        if (!wait) {
+            return false;
+        }
+        sched_yield();
+    }
+    const bool held = slot->number == number + 1;
+    if (held) {
+        *out = slot->record;
+    }
+    slot_release(slot);
+    return held;
+}
+
+void flight_recorder_clear(void) {
+    for (size_t i = 0; i < FLIGHT_RECORDER_SIZE; ++i) {
+        while (!slot_take(&slots[i])) {
+            sched_yield();
+        }
+        slots[i].number = 0;
+        slot_release(&slots[i]);
+    }
+    atomic_store(&recorded, 0);
+}
+
+// Count of the events still in the ring, out of the recorded ones
+static size_t kept_count(uint_fast64_t end) {
+    return end < FLIGHT_RECORDER_SIZE ? (size_t) end : FLIGHT_RECORDER_SIZE;
+}
+
+size_t flight_recorder_count(void) {
+    return kept_count(atomic_load(&recorded));
+}
+
+size_t flight_recorder_snapshot(struct FlightRecord *out, size_t size) {
+    const uint_fast64_t end = atomic_load(&recorded);
+    const size_t count = min(kept_count(end), size);
+    // the newest ones, if not all fit. They are read the newest first, as the writers overwrite the oldest ones,
+    // and the events overwritten meanwhile are left out.
+    size_t copied = 0;
+    for (size_t i = 0; i < count; ++i) {
+        copied += slot_read(end - 1 - i, &out[count - 1 - copied], true);
+    }
+    memmove(out, out + count - copied, copied * sizeof(*out));
+    return copied;
+}
+
+// Line formatted without the stdio, which is not safe in the signal handlers
+struct DumpLine {
+    char text[160];
+    size_t length;
+};
+
+static void line_append(struct DumpLine *line, const char *text) {
+    while (*text != '\0' && line->length < sizeof(line->text)) {
+        line->text[line->length++] = *text++;
+    }
+}
+
+static void line_append_int(struct DumpLine *line, int64_t value) {
+    char digits[24];
+    size_t n = 0;
+    const bool negative = value < 0;
+    // the magnitude is taken digit by digit, so INT64_MIN does not overflow
+    do {
+        const int digit = (int) (value % 10);
+        digits[n++] = (char) ('0' + (digit < 0 ? -digit : digit));
+        value /= 10;
+    } while (value != 0);
+    if (negative) {
+        digits[n++] = '-';
+    }
+    while (n > 0 && line->length < sizeof(line->text)) {
+        line->text[line->length++] = digits[--n];
+    }
+}
+
+static void line_append_hex(struct DumpLine *line, uint8_t byte) {
+    static const char hex[] = "0123456789abcdef";
+    const char text[] = {' ', hex[byte >> 4], hex[byte & 0x0F], '\0'};
+    line_append(line, text);
+}
+
+static void line_write(int fd, struct DumpLine *line) {
+    line_append(line, "\n");
+    if (line->length == sizeof(line->text)) {
+        line->text[line->length - 1] = '\n';
+    }
+    size_t written = 0;
+    while (written < line->length) {
+        const ssize_t r = write(fd, line->text + written, line->length - written);
+        if (r <= 0) {
+            return;
+        }
+        written += (size_t) r;
+    }
+}
+
+void flight_recorder_dump(int fd) {
+    const uint_fast64_t end = atomic_load(&recorded);
+    const size_t count = kept_count(end);
+    if (count == 0) {
+        return;
+    }
+    struct DumpLine line = {};
+    line_append(&line, "Recent device events (");
+    line_append_int(&line, (int64_t) count);
+    line_append(&line, "):");
+    line_write(fd, &line);
+
+    bool started = false;
+    int64_t start_us = 0;
+    for (uint_fast64_t i = end - count; i < end; ++i) {
+        struct FlightRecord copy;
+        if (!slot_read(i, &copy, false)) {
+            continue;
+        }
+        const struct FlightRecord *record = &copy;
+        if (!started) {
+            start_us = record->time_us;
+            started = true;
+        }
+        line.length = 0;
+        line_append(&line, "  +");
+        line_append_int(&line, record->time_us - start_us);
+        line_append(&line, " us ");
+        if (record->device != 0) {
+            line_append(&line, "device ");
+            line_append_int(&line, record->device);
+            line_append(&line, " ");
+        }
+        line_append(&line, record->event != NULL ? record->event : "?");
+        if (record->detail != NULL) {
+            line_append(&line, " ");
+            line_append(&line, record->detail);
+        }
+        line_append(&line, ", code ");
+        line_append_int(&line, record->code);
+        if (record->length > 0) {
+            line_append(&line, ", ");
+            line_append_int(&line, record->length);
+            line_append(&line, " bytes");
+        }
+        if (record->captured > 0) {
+            line_append(&line, ":");
+            for (uint8_t b = 0; b < record->captured && b < FLIGHT_RECORD_DATA_SIZE; ++b) {
+                line_append_hex(&line, record->data[b]);
+            }
+        }
+        line_write(fd, &line);
+    }
+}
+
+static const int DUMPED_SIGNALS[] = {SIGABRT, SIGBUS, SIGFPE, SIGILL, SIGSEGV, SIGHUP, SIGINT, SIGTERM};
+
+static void dump_on_signal(int signal_number) {
+    flight_recorder_dump(STDERR_FILENO);
+    // the handler was reset to the default one, which ends the process now
+    raise(signal_number);
+}
+
+void flight_recorder_install_signal_handlers(void) {
+    struct sigaction action = {};
+    action.sa_handler = dump_on_signal;
+    action.sa_flags = SA_RESETHAND | SA_NODEFER;
+    sigemptyset(&action.sa_mask);
+    for (size_t i = 0; i < LEN_ARR(DUMPED_SIGNALS); ++i) {
+        sigaction(DUMPED_SIGNALS[i], &action, NULL);
+    }
+}
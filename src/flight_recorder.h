@@ -0,0 +1,84 @@
+/*
+ * Copyright (c) 2023 Nitrokey GmbH
+ *
+ * This file is part of Nitrokey HOTP verification project.
+ *
+ * Nitrokey HOTP verification is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * Nitrokey HOTP verification is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Nitrokey HOTP verification. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0
+ */
+
+#ifndef NITROKEY_HOTP_VERIFICATION_FLIGHT_RECORDER_H
+#define NITROKEY_HOTP_VERIFICATION_FLIGHT_RECORDER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Always-on history of the recent device exchanges, kept in a fixed ring of binary records.
+ * Recording copies a few header bytes with a timestamp, and formats nothing; the history is written in a readable
+ * form only when a command fails, or the process is killed by a signal.
+ *
+ * Only the headers of the frames are kept: the HID report header, the CCID message header and the APDU header
+ * with the status word. The payloads carry the PINs and secrets, and are left out.
+ */
+
+#define FLIGHT_RECORD_DATA_SIZE 16
+
+struct FlightRecord {
+    int64_t time_us;
+    // the Device the event belongs to, see flight_recorder_new_device(), 0 for none
+    uint32_t device;
+    // static string naming the event, and an optional static detail, like the model or the retried step
+    const char *event;
+    const char *detail;
+    // result code or attempt number
+    int32_t code;
+    // length of the whole frame, of which the first captured bytes are kept
+    uint16_t length;
+    uint8_t captured;
+    uint8_t data[FLIGHT_RECORD_DATA_SIZE];
+};
+
+/**
+ * Record the event. Safe to call from several threads: each slot of the ring is taken by one writer or reader
+ * at a time, and holds the number of its event, so a slot overwritten after the ring wrapped around is skipped
+ * by the readers instead of coming out mixed.
+ * @param device identifier of the Device, 0 for none
+ * @param frame bytes to capture, NULL for none
+ * @param length length of the whole frame, captured is cut to it and to FLIGHT_RECORD_DATA_SIZE
+ */
+void flight_record(uint32_t device, const char *event, const char *detail, int32_t code, const uint8_t *frame,
+                   size_t length, size_t captured);
+// New identifier for the events of a Device, unique within the process
+uint32_t flight_recorder_new_device(void);
+// Forget the recorded events
+void flight_recorder_clear(void);
+// Count of the events kept, at most FLIGHT_RECORDER_SIZE
+size_t flight_recorder_count(void);
+// Copy the kept events to records, the oldest first. Returns their count.
+size_t flight_recorder_snapshot(struct FlightRecord *records, size_t size);
+/**
+ * Write the kept events to the file descriptor, one per line, with the time relative to the oldest one.
+ * Uses write() only, so it is safe to call from a signal handler, and skips the records being written.
+ * Nothing is written, if no event was recorded.
+ */
+void flight_recorder_dump(int fd);
+/**
+ * Dump the events to stderr when the process receives a fatal or termination signal, before it is handled
+ * as by default. For applications, the library does not touch the signal handlers on its own.
+ */
+void flight_recorder_install_signal_handlers(void);
+
+#endif//NITROKEY_HOTP_VERIFICATION_FLIGHT_RECORDER_H
@@ -0,0 +1,211 @@
+/*
+ * Copyright (c) 2023 Nitrokey GmbH
+ *
+ * This file is part of Nitrokey HOTP verification project.
+ *
+ * Nitrokey HOTP verification is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * Nitrokey HOTP verification is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Nitrokey HOTP verification. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0
+ */
+
+#include "hidraw.h"
+#include "utils.h"
+#include <errno.h>
+
+#ifdef __linux__
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/hidraw.h>
+#include <linux/input.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+bool hidraw_supported(void) {
+    return true;
+}
+
+bool hidraw_read_ids(int fd, uint16_t *vid, uint16_t *pid) {
+    struct hidraw_devinfo info = {0};
+    if (ioctl(fd, HIDIOCGRAWINFO, &info) < 0 || info.bustype != BUS_USB) {
+        return false;
+    }
+    *vid = (uint16_t) info.vendor;
+    *pid = (uint16_t) info.product;
+    return true;
+}
+
+size_t hidraw_find(uint16_t vid, uint16_t pid, HidrawVisitor visit, void *user_data) {
+    DIR *directory = opendir(HIDRAW_DEVICE_DIRECTORY);
+    if (directory == NULL) {
+        return 0;
+    }
+    size_t visited = 0;
+    bool kept = false;
+    const size_t prefix_length = strlen(HIDRAW_DEVICE_PREFIX);
+    struct dirent *entry;
+    while (!kept && (entry = readdir(directory)) != NULL) {
+        if (strncmp(entry->d_name, HIDRAW_DEVICE_PREFIX, prefix_length) != 0) {
+            continue;
+        }
+        char path[sizeof HIDRAW_DEVICE_DIRECTORY + sizeof entry->d_name];
+        snprintf(path, sizeof path, HIDRAW_DEVICE_DIRECTORY "/%s", entry->d_name);
+        // nodes without the access rights are skipped, the device might be reachable over HIDAPI still
+        const int fd = open(path, O_RDWR | O_CLOEXEC);
+        if (fd < 0) {
+            continue;
+        }
+        uint16_t node_vid = 0, node_pid = 0;
+        if (hidraw_read_ids(fd, &node_vid, &node_pid) && node_vid == vid && node_pid == pid) {
+            visited++;
+            kept = visit != NULL && visit(fd, path, user_data);
+        }
+        if (!kept) {
+            close(fd);
+        }
+    }
+    closedir(directory);
+    return visited;
+}
+
+static bool read_sysfs_number(const char *directory, const char *name, unsigned *value) {
+    char path[PATH_MAX];
+    const int length = snprintf(path, sizeof path, "%s/%s", directory, name);
+    if (length < 0 || (size_t) length >= sizeof path) {
+        return false;
+    }
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        return false;
+    }
+    const bool read = fscanf(f, "%u", value) == 1;
+    fclose(f);
+    return read;
+}
+
+bool hidraw_usb_address(const char *path, unsigned *bus, unsigned *address) {
+    const char *slash = strrchr(path, '/');
+    const char *name = slash != NULL ? slash + 1 : path;
+    char link[PATH_MAX], device[PATH_MAX];
+    const int length = snprintf(link, sizeof link, HIDRAW_SYSFS_DIRECTORY "/%s/device", name);
+    if (length < 0 || (size_t) length >= sizeof link || realpath(link, device) == NULL) {
+        return false;
+    }
+    // the HID device is a child of the USB interface, which is a child of the USB device
+    for (int level = 0; level < 2; ++level) {
+        char *parent = strrchr(device, '/');
+        if (parent == NULL || parent == device) {
+            return false;
+        }
+        *parent = '\0';
+    }
+    return read_sysfs_number(device, "busnum", bus) && read_sysfs_number(device, "devnum", address);
+}
+
+int hidraw_send_feature_report(int fd, const uint8_t *data, size_t length) {
+    return ioctl(fd, HIDIOCSFEATURE(length), (void *) data);
+}
+
+int hidraw_get_feature_report(int fd, uint8_t *data, size_t length) {
+    return ioctl(fd, HIDIOCGFEATURE(length), data);
+}
+
+int hidraw_write(int fd, const uint8_t *data, size_t length) {
+    return (int) write(fd, data, length);
+}
+
+int hidraw_read(int fd, uint8_t *data, size_t length, int timeout_ms) {
+    struct pollfd readable = {.fd = fd, .events = POLLIN};
+    const int r = poll(&readable, 1, timeout_ms);
+    if (r <= 0) {
+        return r;
+    }
+    return (int) read(fd, data, length);
+}
+
+void hidraw_close(int fd) {
+    close(fd);
+}
+
+#else
+
+bool hidraw_supported(void) {
+    return false;
+}
+
+bool hidraw_read_ids(int fd, uint16_t *vid, uint16_t *pid) {
+    unused(fd);
+    unused(vid);
+    unused(pid);
+    return false;
+}
+
+size_t hidraw_find(uint16_t vid, uint16_t pid, HidrawVisitor visit, void *user_data) {
+    unused(vid);
+    unused(pid);
+    unused(visit);
+    unused(user_data);
+    return 0;
+}
+
+bool hidraw_usb_address(const char *path, unsigned *bus, unsigned *address) {
+    unused(path);
+    unused(bus);
+    unused(address);
+    return false;
+}
+
+int hidraw_send_feature_report(int fd, const uint8_t *data, size_t length) {
+    unused(fd);
+    unused(data);
+    unused(length);
+    errno = ENOSYS;
+    return -1;
+}
+
+int hidraw_get_feature_report(int fd, uint8_t *data, size_t length) {
+    unused(fd);
+    unused(data);
+    unused(length);
+    errno = ENOSYS;
+    return -1;
+}
+
+int hidraw_write(int fd, const uint8_t *data, size_t length) {
+    unused(fd);
+    unused(data);
+    unused(length);
+    errno = ENOSYS;
+    return -1;
+}
+
+int hidraw_read(int fd, uint8_t *data, size_t length, int timeout_ms) {
+    unused(fd);
+    unused(data);
+    unused(length);
+    unused(timeout_ms);
+    errno = ENOSYS;
+    return -1;
+}
+
+void hidraw_close(int fd) {
+    unused(fd);
+}
+
+#endif
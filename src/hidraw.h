@@ -0,0 +1,62 @@
+/*
+ * Copyright (c) 2023 Nitrokey GmbH
+ *
+ * This file is part of Nitrokey HOTP verification project.
+ *
+ * Nitrokey HOTP verification is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * Nitrokey HOTP verification is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Nitrokey HOTP verification. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0
+ */
+
+#ifndef NITROKEY_HOTP_VERIFICATION_HIDRAW_H
+#define NITROKEY_HOTP_VERIFICATION_HIDRAW_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Feature reports over the Linux hidraw nodes, with the HIDIOCSFEATURE and HIDIOCGFEATURE ioctls.
+ * Unlike the HIDAPI libusb backend, the kernel driver stays attached and no interface is claimed.
+ * On other systems the functions fail, and hidraw_supported() returns false.
+ */
+
+#define HIDRAW_DEVICE_DIRECTORY "/dev"
+#define HIDRAW_DEVICE_PREFIX "hidraw"
+
+#define HIDRAW_SYSFS_DIRECTORY "/sys/class/hidraw"
+
+// Called with each opened node, returns true to keep it open and stop the search
+typedef bool (*HidrawVisitor)(int fd, const char *path, void *user_data);
+
+bool hidraw_supported(void);
+/**
+ * Pass the hidraw nodes of the devices with the given USB identifiers to the visitor, until it keeps one.
+ * The nodes not kept are closed, and with a NULL visitor all of them. Returns the count of the nodes visited.
+ */
+size_t hidraw_find(uint16_t vid, uint16_t pid, HidrawVisitor visit, void *user_data);
+// USB bus and address of the device behind the node, from sysfs. Returns false, if they are not known.
+bool hidraw_usb_address(const char *path, unsigned *bus, unsigned *address);
+// USB identifiers of the device behind the opened node. Returns false, if it is not a hidraw node of a USB device.
+bool hidraw_read_ids(int fd, uint16_t *vid, uint16_t *pid);
+// Both take the report with its ID in the first byte, like HIDAPI. Return the bytes transferred, or -1.
+int hidraw_send_feature_report(int fd, const uint8_t *data, size_t length);
+int hidraw_get_feature_report(int fd, uint8_t *data, size_t length);
+// Output report, with its ID in the first byte. Returns the bytes written, or -1.
+int hidraw_write(int fd, const uint8_t *data, size_t length);
+// Wait up to timeout_ms for an input report. Returns its length, 0 on timeout, or -1.
+int hidraw_read(int fd, uint8_t *data, size_t length, int timeout_ms);
+void hidraw_close(int fd);
+
+#endif//NITROKEY_HOTP_VERIFICATION_HIDRAW_H
@@ -0,0 +1,172 @@
+/*
+ * Copyright (c) 2023 Nitrokey GmbH
+ *
+ * This file is part of Nitrokey HOTP verification project.
+ *
+ * Nitrokey HOTP verification is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * Nitrokey HOTP verification is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Nitrokey HOTP verification. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0
+ */
+
+#include "hotp.h"
+#include <string.h>
+
+#define SHA1_BLOCK_SIZE 64
+
+struct Sha1 {
+    uint32_t h[5];
+    uint8_t block[SHA1_BLOCK_SIZE];
+    size_t block_used;
+    uint64_t length;
+};
+
+static uint32_t rol(uint32_t x, int n) {
+    return (x << n) | (x >> (32 - n));
+}
+
+static void sha1_init(struct Sha1 *s) {
+    static const uint32_t initial[5] = {0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0};
+    memcpy(s->h, initial, sizeof initial);
+    s->block_used = 0;
+    s->length = 0;
+}
+
+static void sha1_block(struct Sha1 *s, const uint8_t *p) {
+    uint32_t w[80];
+    for (int i = 0; i < 16; i++) {
+        w[i] = ((uint32_t) p[4 * i] << 24) | ((uint32_t) p[4 * i + 1] << 16) | ((uint32_t) p[4 * i + 2] << 8) | p[4 * i + 3];
+    }
+    for (int i = 16; i < 80; i++) {
+        w[i] = rol(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+    }
+    uint32_t a = s->h[0], b = s->h[1], c = s->h[2], d = s->h[3], e = s->h[4];
+    for (int i = 0; i < 80; i++) {
+        uint32_t f, k;
+        if (i < 20) {
+            f = (b & c) | (~b & d);
+            k = 0x5A827999;
+        } else if (i < 40) {
+            f = b ^ c ^ d;
+            k = 0x6ED9EBA1;
+        } else if (i < 60) {
+            f = (b & c) | (b & d) | (c & d);
+            k = 0x8F1BBCDC;
+        } else {
+            f = b ^ c ^ d;
+            k = 0xCA62C1D6;
+        }
+        const uint32_t t = rol(a, 5) + f + e + k + w[i];
+        e = d;
+        d = c;
+        c = rol(b, 30);
+        b = a;
+        a = t;
+    }
+    s->h[0] += a;
+    s->h[1] += b;
+    s->h[2] += c;
+    s->h[3] += d;
+    s->h[4] += e;
+}
+
+static void sha1_update(struct Sha1 *s, const uint8_t *data, size_t length) {
+    s->length += length;
+    while (length > 0) {
+        size_t n = SHA1_BLOCK_SIZE - s->block_used;
+        if (n > length) {
+            n = length;
+        }
+        memcpy(s->block + s->block_used, data, n);
+        s->block_used += n;
+        data += n;
+        length -= n;
+        if (s->block_used == SHA1_BLOCK_SIZE) {
+            sha1_block(s, s->block);
+            s->block_used = 0;
+        }
+    }
+}
+
+static void sha1_final(struct Sha1 *s, uint8_t digest[SHA1_DIGEST_SIZE]) {
+    const uint64_t bits = s->length * 8;
+    const uint8_t pad = 0x80, zero = 0;
+    sha1_update(s, &pad, 1);
+    while (s->block_used != SHA1_BLOCK_SIZE - 8) {
+        sha1_update(s, &zero, 1);
+    }
+    uint8_t length_be[8];
+    for (int i = 0; i < 8; i++) {
+        length_be[i] = (uint8_t) (bits >> (56 - 8 * i));
+    }
+    sha1_update(s, length_be, sizeof length_be);
+    for (int i = 0; i < 5; i++) {
+        for (int j = 0; j < 4; j++) {
+            digest[4 * i + j] = (uint8_t) (s->h[i] >> (24 - 8 * j));
+        }
+    }
+}
+
+void sha1(const uint8_t *data, size_t length, uint8_t digest[SHA1_DIGEST_SIZE]) {
+    struct Sha1 s;
+    sha1_init(&s);
+    sha1_update(&s, data, length);
+    sha1_final(&s, digest);
+}
+
+void hmac_sha1(const uint8_t *key, size_t key_length, const uint8_t *data, size_t length, uint8_t digest[SHA1_DIGEST_SIZE]) {
+    uint8_t key_block[SHA1_BLOCK_SIZE] = {0};
+    if (key_length > SHA1_BLOCK_SIZE) {
+        sha1(key, key_length, key_block);
+    } else {
+        memcpy(key_block, key, key_length);
+    }
+    uint8_t pad[SHA1_BLOCK_SIZE];
+    uint8_t inner[SHA1_DIGEST_SIZE];
+    struct Sha1 s;
+
+    for (int i = 0; i < SHA1_BLOCK_SIZE; i++) {
+        pad[i] = key_block[i] ^ 0x36;
+    }
+    sha1_init(&s);
+    sha1_update(&s, pad, sizeof pad);
+    sha1_update(&s, data, length);
+    sha1_final(&s, inner);
+
+    for (int i = 0; i < SHA1_BLOCK_SIZE; i++) {
+        pad[i] = key_block[i] ^ 0x5c;
+    }
+    sha1_init(&s);
+    sha1_update(&s, pad, sizeof pad);
+    sha1_update(&s, inner, sizeof inner);
+    sha1_final(&s, digest);
+}
+
+uint32_t hotp_calculate(const uint8_t *key, size_t key_length, uint64_t counter, unsigned digits) {
+    uint8_t message[8];
+    for (int i = 0; i < 8; i++) {
+        message[i] = (uint8_t) (counter >> (56 - 8 * i));
+    }
+    uint8_t digest[SHA1_DIGEST_SIZE];
+    hmac_sha1(key, key_length, message, sizeof message, digest);
+
+    // dynamic truncation, RFC 4226 section 5.3
+    const int offset = digest[SHA1_DIGEST_SIZE - 1] & 0x0F;
+    const uint32_t binary = ((uint32_t) (digest[offset] & 0x7F) << 24) | ((uint32_t) digest[offset + 1] << 16) |
+                            ((uint32_t) digest[offset + 2] << 8) | digest[offset + 3];
+    uint32_t modulo = 1;
+    for (unsigned i = 0; i < digits; i++) {
+        modulo *= 10;
+    }
+    return binary % modulo;
+}
@@ -0,0 +1,39 @@
+/*
+ * Copyright (c) 2023 Nitrokey GmbH
+ *
+ * This file is part of Nitrokey HOTP verification project.
+ *
+ * Nitrokey HOTP verification is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * Nitrokey HOTP verification is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Nitrokey HOTP verification. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0
+ */
+
+#ifndef NITROKEY_HOTP_VERIFICATION_HOTP_H
+#define NITROKEY_HOTP_VERIFICATION_HOTP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Host side RFC 4226 HOTP calculation, for checking the devices against the codes they should produce.
+ */
+
+#define SHA1_DIGEST_SIZE 20
+
+void sha1(const uint8_t *data, size_t length, uint8_t digest[SHA1_DIGEST_SIZE]);
+void hmac_sha1(const uint8_t *key, size_t key_length, const uint8_t *data, size_t length, uint8_t digest[SHA1_DIGEST_SIZE]);
+// HOTP value of the counter, truncated to the given count of digits
+uint32_t hotp_calculate(const uint8_t *key, size_t key_length, uint64_t counter, unsigned digits);
+
+#endif//NITROKEY_HOTP_VERIFICATION_HOTP_H
@@ -0,0 +1,353 @@
+/*
+ * Copyright (c) 2023 Nitrokey GmbH
+ *
+ * This file is part of Nitrokey HOTP verification project.
+ *
+ * Nitrokey HOTP verification is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * Nitrokey HOTP verification is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Nitrokey HOTP verification. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0
+ */
+
+#include "hotpverify.h"
+#include "base32.h"
+#include "device.h"
+#include "flight_recorder.h"
+#include "operations.h"
+#include "operations_ccid.h"
+#include "return_codes.h"
+#include "session.h"
+#include "settings.h"
+#include "utils.h"
+#include "version.h"
+#include <stdlib.h>
+#include <string.h>
+
+struct hotpverify_context {
+    struct Device dev;
+    bool connected;
+    uint32_t timeout_ms;
+    hotpverify_touch_callback touch_callback;
+    void *touch_user_data;
+    bool touch_non_blocking;
+    hotpverify_message_callback message_callback;
+    void *message_user_data;
+};
+
+static int to_public_result(int res) {
+    switch (res) {
+        case dev_ok:
+        case RET_NO_ERROR:
+            return HOTPVERIFY_OK;
+        case RET_VALIDATION_PASSED:
+            return HOTPVERIFY_CODE_VALID;
+        case RET_VALIDATION_FAILED:
+            return HOTPVERIFY_CODE_INVALID;
+        case RET_INVALID_PARAMS:
+            return HOTPVERIFY_ERR_INVALID_PARAMS;
+        case RET_BADLY_FORMATTED_BASE32_STRING:
+        case RET_BADLY_FORMATTED_HOTP_CODE:
+        case RET_TOO_LONG_PIN:
+            return HOTPVERIFY_ERR_BAD_FORMAT;
+        case RET_CONNECTION_LOST:
+            return HOTPVERIFY_ERR_CONNECTION_LOST;
+        case RET_COMM_ERROR:
+            return HOTPVERIFY_ERR_CONNECTION;
+        case dev_wrong_password:
+        case not_authorized:
+            return HOTPVERIFY_ERR_WRONG_PIN;
+        case dev_slot_not_programmed:
+        case RET_SLOT_NOT_CONFIGURED:
+            return HOTPVERIFY_ERR_SLOT_NOT_CONFIGURED;
+        case dev_unknown_command:
+        case not_supported:
+        case RET_UNKNOWN_DEVICE:
+            return HOTPVERIFY_ERR_UNSUPPORTED;
+        case RET_SECURITY_STATUS_NOT_SATISFIED:
+            return HOTPVERIFY_ERR_SECURITY_STATUS;
+        case RET_NO_MEMORY:
+            return HOTPVERIFY_ERR_NO_MEMORY;
+        case RET_TIMEOUT:
+            return HOTPVERIFY_ERR_TIMEOUT;
+        case RET_TOUCH_REQUIRED:
+            return HOTPVERIFY_TOUCH_REQUIRED;
+        case RET_SESSION_EXPIRED:
+            return HOTPVERIFY_ERR_SESSION_EXPIRED;
+        default:
+            return HOTPVERIFY_ERR_DEVICE;
+    }
+}
+
+static enum hotpverify_model model_of(const struct Device *dev) {
+    if (dev->connection_type == CONNECTION_CCID) {
+        return HOTPVERIFY_MODEL_NITROKEY_3;
+    }
+    switch (dev->dev_info.name_short) {
+        case 'P':
+            return HOTPVERIFY_MODEL_NITROKEY_PRO;
+        case 'S':
+            return HOTPVERIFY_MODEL_NITROKEY_STORAGE;
+        case 'L':
+            return HOTPVERIFY_MODEL_LIBREM_KEY;
+        default:
+            return HOTPVERIFY_MODEL_UNKNOWN;
+    }
+}
+
+static void forward_touch_event(TouchEvent event, void *user_data) {
+    hotpverify_context *ctx = user_data;
+    if (ctx->touch_callback == NULL) return;
+    switch (event) {
+        case TOUCH_REQUIRED:
+            ctx->touch_callback(HOTPVERIFY_TOUCH_EVENT_REQUIRED, ctx->touch_user_data);
+            break;
+        case TOUCH_WAITING:
+            ctx->touch_callback(HOTPVERIFY_TOUCH_EVENT_WAITING, ctx->touch_user_data);
+            break;
+        case TOUCH_RECEIVED:
+            ctx->touch_callback(HOTPVERIFY_TOUCH_EVENT_RECEIVED, ctx->touch_user_data);
+            break;
+    }
+}
+
+static void forward_message(MessageKind kind, const char *text, void *user_data) {
+    hotpverify_context *ctx = user_data;
+    if (ctx->message_callback == NULL) return;
+    ctx->message_callback(kind == MESSAGE_PROGRESS ? HOTPVERIFY_MESSAGE_PROGRESS : HOTPVERIFY_MESSAGE_INFO, text,
+                          ctx->message_user_data);
+}
+
+// Each API call gets its own budget, and the messages of the core go to the callback of its context
+static void start_operation(hotpverify_context *ctx) {
+    ctx->dev.deadline = deadline_in(ctx->timeout_ms);
+    device_set_touch_handler(&ctx->dev, forward_touch_event, ctx, ctx->touch_non_blocking);
+    messages_set_handler(forward_message, ctx);
+}
+
+// The PINs are limited by the longest one of the supported devices. NULL is checked by the calls not allowing it.
+static bool valid_pin(const char *pin) {
+    return pin == NULL || validate_pin(pin) == RET_NO_ERROR;
+}
+
+hotpverify_context *hotpverify_new(void) {
+    return calloc(1, sizeof(hotpverify_context));
+}
+
+void hotpverify_free(hotpverify_context *ctx) {
+    if (ctx == NULL) return;
+    hotpverify_disconnect(ctx);
+    // the messages of the thread are not forwarded to the freed context anymore
+    messages_set_handler(NULL, NULL);
+    secure_zero(ctx, sizeof(*ctx));
+    free(ctx);
+}
+
+int hotpverify_connect(hotpverify_context *ctx) {
+    if (ctx == NULL) return HOTPVERIFY_ERR_INVALID_PARAMS;
+    if (ctx->connected) return HOTPVERIFY_OK;
+
+    memset(&ctx->dev, 0, sizeof(ctx->dev));
+    start_operation(ctx);
+    const int res = device_connect(&ctx->dev);
+    if (res != RET_NO_ERROR) {
+        return res == RET_TIMEOUT ? HOTPVERIFY_ERR_TIMEOUT : HOTPVERIFY_ERR_CONNECTION;
+    }
+    ctx->connected = true;
+    return HOTPVERIFY_OK;
+}
+
+int hotpverify_disconnect(hotpverify_context *ctx) {
+    if (ctx == NULL) return HOTPVERIFY_ERR_INVALID_PARAMS;
+    if (!ctx->connected) return HOTPVERIFY_OK;
+
+    ctx->connected = false;
+    messages_set_handler(forward_message, ctx);
+    return to_public_result(device_disconnect(&ctx->dev));
+}
+
+bool hotpverify_is_connected(const hotpverify_context *ctx) {
+    return ctx != NULL && ctx->connected;
+}
+
+int hotpverify_set_timeout(hotpverify_context *ctx, uint32_t timeout_ms) {
+    if (ctx == NULL) return HOTPVERIFY_ERR_INVALID_PARAMS;
+    ctx->timeout_ms = timeout_ms;
+    return HOTPVERIFY_OK;
+}
+
+int hotpverify_set_touch_handler(hotpverify_context *ctx, hotpverify_touch_callback callback,
+                                 void *user_data, bool non_blocking) {
+    if (ctx == NULL) return HOTPVERIFY_ERR_INVALID_PARAMS;
+    ctx->touch_callback = callback;
+    ctx->touch_user_data = user_data;
+    ctx->touch_non_blocking = non_blocking;
+    return HOTPVERIFY_OK;
+}
+
+int hotpverify_set_message_handler(hotpverify_context *ctx, hotpverify_message_callback callback, void *user_data) {
+    if (ctx == NULL) return HOTPVERIFY_ERR_INVALID_PARAMS;
+    ctx->message_callback = callback;
+    ctx->message_user_data = user_data;
+    return HOTPVERIFY_OK;
+}
+
+int hotpverify_get_status(hotpverify_context *ctx, struct hotpverify_status *out_status) {
+    if (ctx == NULL || out_status == NULL) return HOTPVERIFY_ERR_INVALID_PARAMS;
+    if (!ctx->connected) return HOTPVERIFY_ERR_NOT_CONNECTED;
+
+    struct FullResponseStatus status;
+    memset(out_status, 0, sizeof(*out_status));
+    start_operation(ctx);
+    const int res = device_get_status(&ctx->dev, &status);
+    if (res != RET_NO_ERROR && res != RET_NO_PIN_ATTEMPTS) {
+        return to_public_result(res);
+    }
+
+    out_status->model = model_of(&ctx->dev);
+    out_status->serial = status.response_status.card_serial_u32;
+    out_status->firmware_major = status.response_status.firmware_version_st.major;
+    out_status->firmware_minor = status.response_status.firmware_version_st.minor;
+    out_status->pin_counters_valid = res != RET_NO_PIN_ATTEMPTS;
+    out_status->admin_pin_retries = status.response_status.retry_admin;
+    out_status->user_pin_retries = status.response_status.retry_user;
+    if (out_status->model == HOTPVERIFY_MODEL_NITROKEY_3) {
+        const uint32_t fw = status.nk3_extra_info.firmware_version;
+        out_status->nk3.firmware_major = (fw >> 22) & 0b1111111111;
+        out_status->nk3.firmware_minor = (fw >> 6) & 0xFFFF;
+        out_status->nk3.firmware_patch = fw & 0b111111;
+        out_status->nk3.pgp_admin_pin_retries = status.nk3_extra_info.pgp_admin_pin_retries;
+        out_status->nk3.pgp_user_pin_retries = status.nk3_extra_info.pgp_user_pin_retries;
+    }
+    return HOTPVERIFY_OK;
+}
+
+int hotpverify_check_code(hotpverify_context *ctx, const char *hotp_code) {
+    if (ctx == NULL || hotp_code == NULL) return HOTPVERIFY_ERR_INVALID_PARAMS;
+    if (!ctx->connected) return HOTPVERIFY_ERR_NOT_CONNECTED;
+    start_operation(ctx);
+    return to_public_result(check_code_on_device(&ctx->dev, hotp_code));
+}
+
+int hotpverify_check_code_detailed(hotpverify_context *ctx, const char *hotp_code,
+                                   struct hotpverify_check_details *out_details) {
+    if (ctx == NULL || hotp_code == NULL || out_details == NULL) return HOTPVERIFY_ERR_INVALID_PARAMS;
+    if (!ctx->connected) return HOTPVERIFY_ERR_NOT_CONNECTED;
+    start_operation(ctx);
+    struct VerifyDetails details;
+    const int res = check_code_on_device_detailed(&ctx->dev, hotp_code, &details);
+    out_details->drift = details.drift;
+    out_details->latency_us = details.latency_us;
+    return to_public_result(res);
+}
+
+int hotpverify_set_secret(hotpverify_context *ctx, const char *base32_secret, const char *admin_pin, uint64_t counter) {
+    if (ctx == NULL || base32_secret == NULL) return HOTPVERIFY_ERR_INVALID_PARAMS;
+    // the write path takes the lengths for granted, as the command line tool checks them on parsing.
+    // A secret of the right length, but not in base32, is refused by the write path as badly formatted.
+    const size_t secret_length_limit = BASE32_LEN(HOTP_SECRET_SIZE_BYTES);
+    if (strnlen(base32_secret, secret_length_limit + 1) > secret_length_limit || !valid_pin(admin_pin) ||
+        counter >= UINT32_MAX) {
+        return HOTPVERIFY_ERR_INVALID_PARAMS;
+    }
+    if (!ctx->connected) return HOTPVERIFY_ERR_NOT_CONNECTED;
+    start_operation(ctx);
+    return to_public_result(set_secret_on_device(&ctx->dev, base32_secret, admin_pin, counter));
+}
+
+int hotpverify_session_begin(hotpverify_context *ctx, const char *admin_pin, uint32_t ttl_ms) {
+    if (ctx == NULL || admin_pin == NULL || !valid_pin(admin_pin)) return HOTPVERIFY_ERR_INVALID_PARAMS;
+    if (!ctx->connected) return HOTPVERIFY_ERR_NOT_CONNECTED;
+    start_operation(ctx);
+    return to_public_result(session_begin(&ctx->dev, admin_pin, ttl_ms));
+}
+
+int hotpverify_session_end(hotpverify_context *ctx) {
+    if (ctx == NULL) return HOTPVERIFY_ERR_INVALID_PARAMS;
+    session_end(&ctx->dev);
+    return HOTPVERIFY_OK;
+}
+
+int hotpverify_regenerate_aes_key(hotpverify_context *ctx, const char *admin_pin) {
+    if (ctx == NULL || admin_pin == NULL || !valid_pin(admin_pin)) return HOTPVERIFY_ERR_INVALID_PARAMS;
+    if (!ctx->connected) return HOTPVERIFY_ERR_NOT_CONNECTED;
+    if (ctx->dev.connection_type != CONNECTION_HID) return HOTPVERIFY_ERR_UNSUPPORTED;
+    start_operation(ctx);
+    return to_public_result(regenerate_AES_key(&ctx->dev, admin_pin));
+}
+
+int hotpverify_nk3_reset(hotpverify_context *ctx, const char *new_pin) {
+    if (ctx == NULL || !valid_pin(new_pin)) return HOTPVERIFY_ERR_INVALID_PARAMS;
+    if (!ctx->connected) return HOTPVERIFY_ERR_NOT_CONNECTED;
+    if (ctx->dev.connection_type != CONNECTION_CCID) return HOTPVERIFY_ERR_UNSUPPORTED;
+    start_operation(ctx);
+    return to_public_result(nk3_reset(&ctx->dev, new_pin));
+}
+
+int hotpverify_nk3_change_pin(hotpverify_context *ctx, const char *old_pin, const char *new_pin) {
+    if (ctx == NULL || old_pin == NULL || new_pin == NULL || !valid_pin(old_pin) || !valid_pin(new_pin)) {
+        return HOTPVERIFY_ERR_INVALID_PARAMS;
+    }
+    if (!ctx->connected) return HOTPVERIFY_ERR_NOT_CONNECTED;
+    if (ctx->dev.connection_type != CONNECTION_CCID) return HOTPVERIFY_ERR_UNSUPPORTED;
+    start_operation(ctx);
+    return to_public_result(nk3_change_pin(&ctx->dev, old_pin, new_pin));
+}
+
+const char *hotpverify_strerror(int result) {
+    switch (result) {
+        case HOTPVERIFY_OK:
+            return "Operation success";
+        case HOTPVERIFY_CODE_VALID:
+            return "HOTP code is correct";
+        case HOTPVERIFY_CODE_INVALID:
+            return "HOTP code is incorrect";
+        case HOTPVERIFY_TOUCH_REQUIRED:
+            return "Device is waiting for the touch confirmation";
+        case HOTPVERIFY_ERR_INVALID_PARAMS:
+            return "Invalid parameters";
+        case HOTPVERIFY_ERR_BAD_FORMAT:
+            return "Badly formatted HOTP code, base32 secret or PIN";
+        case HOTPVERIFY_ERR_NOT_CONNECTED:
+            return "Not connected to the device";
+        case HOTPVERIFY_ERR_CONNECTION:
+            return "Connection error occurred";
+        case HOTPVERIFY_ERR_CONNECTION_LOST:
+            return "Connection to the device was lost during the process";
+        case HOTPVERIFY_ERR_WRONG_PIN:
+            return "Wrong PIN";
+        case HOTPVERIFY_ERR_SLOT_NOT_CONFIGURED:
+            return "HOTP slot is not configured";
+        case HOTPVERIFY_ERR_UNSUPPORTED:
+            return "Operation is not supported by the connected device";
+        case HOTPVERIFY_ERR_SECURITY_STATUS:
+            return "Touch was not recognized, or there was other problem with the authentication";
+        case HOTPVERIFY_ERR_NO_MEMORY:
+            return "Out of memory";
+        case HOTPVERIFY_ERR_DEVICE:
+            return "Device reported an error";
+        case HOTPVERIFY_ERR_TIMEOUT:
+            return "Operation did not finish within the set timeout";
+        case HOTPVERIFY_ERR_SESSION_EXPIRED:
+            return "Authenticated session is not open or has expired";
+        default:
+            return "Unknown error";
+    }
+}
+
+const char *hotpverify_version(void) {
+    return VERSION;
+}
+
+void hotpverify_dump_history(int fd) {
+    flight_recorder_dump(fd);
+}
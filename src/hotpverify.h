@@ -0,0 +1,215 @@
+/*
+ * Copyright (c) 2023 Nitrokey GmbH
+ *
+ * This file is part of Nitrokey HOTP verification project.
+ *
+ * Nitrokey HOTP verification is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * Nitrokey HOTP verification is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Nitrokey HOTP verification. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0
+ */
+
+#ifndef NITROKEY_HOTP_VERIFICATION_HOTPVERIFY_H
+#define NITROKEY_HOTP_VERIFICATION_HOTPVERIFY_H
+
+/**
+ * Public C interface of libhotpverify.
+ *
+ * All state of a connection is kept in an opaque context, so a single process can keep the device
+ * open across calls instead of running the command line tool for each action. Functions do not print
+ * anything - results are returned through the return value and output structures, and the diagnostic
+ * messages go to the handler set with hotpverify_set_message_handler().
+ *
+ * Numeric values of the enumerations below are part of the stable interface and will not change.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#if defined(__GNUC__)
+#define HOTPVERIFY_EXPORT __attribute__((visibility("default")))
+#else
+#define HOTPVERIFY_EXPORT
+#endif
+
+#define HOTPVERIFY_API_VERSION 2
+
+typedef struct hotpverify_context hotpverify_context;
+
+enum hotpverify_touch_event {
+    HOTPVERIFY_TOUCH_EVENT_REQUIRED = 0,
+    HOTPVERIFY_TOUCH_EVENT_WAITING = 1,
+    HOTPVERIFY_TOUCH_EVENT_RECEIVED = 2,
+};
+
+typedef void (*hotpverify_touch_callback)(enum hotpverify_touch_event event, void *user_data);
+
+enum hotpverify_message_kind {
+    // warnings and hints, like the failed transfers, one line each
+    HOTPVERIFY_MESSAGE_INFO = 0,
+    // progress of the waits for the device, like the dots printed by the command line tool
+    HOTPVERIFY_MESSAGE_PROGRESS = 1,
+};
+
+typedef void (*hotpverify_message_callback)(enum hotpverify_message_kind kind, const char *text, void *user_data);
+
+enum hotpverify_result {
+    HOTPVERIFY_OK = 0,
+    HOTPVERIFY_CODE_VALID = 1,
+    HOTPVERIFY_CODE_INVALID = 2,
+    // non-blocking touch mode only: the device waits for touch, call the same function again to continue
+    HOTPVERIFY_TOUCH_REQUIRED = 3,
+
+    HOTPVERIFY_ERR_INVALID_PARAMS = -1,
+    HOTPVERIFY_ERR_BAD_FORMAT = -2,
+    HOTPVERIFY_ERR_NOT_CONNECTED = -3,
+    HOTPVERIFY_ERR_CONNECTION = -4,
+    HOTPVERIFY_ERR_CONNECTION_LOST = -5,
+    HOTPVERIFY_ERR_WRONG_PIN = -6,
+    HOTPVERIFY_ERR_SLOT_NOT_CONFIGURED = -7,
+    HOTPVERIFY_ERR_UNSUPPORTED = -8,
+    HOTPVERIFY_ERR_SECURITY_STATUS = -9,
+    HOTPVERIFY_ERR_NO_MEMORY = -10,
+    HOTPVERIFY_ERR_DEVICE = -11,
+    HOTPVERIFY_ERR_TIMEOUT = -12,
+    HOTPVERIFY_ERR_SESSION_EXPIRED = -13,
+};
+
+enum hotpverify_model {
+    HOTPVERIFY_MODEL_UNKNOWN = 0,
+    HOTPVERIFY_MODEL_NITROKEY_PRO = 1,
+    HOTPVERIFY_MODEL_NITROKEY_STORAGE = 2,
+    HOTPVERIFY_MODEL_LIBREM_KEY = 3,
+    HOTPVERIFY_MODEL_NITROKEY_3 = 4,
+};
+
+struct hotpverify_status {
+    enum hotpverify_model model;
+    // 0 if the serial is not available
+    uint32_t serial;
+    // Firmware version; on Nitrokey 3 this is the version of the Secrets App
+    uint8_t firmware_major;
+    uint8_t firmware_minor;
+    // false, if the PIN is not set yet and the counters below are not valid
+    bool pin_counters_valid;
+    uint8_t admin_pin_retries;
+    uint8_t user_pin_retries;
+    // Only valid for HOTPVERIFY_MODEL_NITROKEY_3
+    struct {
+        uint16_t firmware_major;
+        uint16_t firmware_minor;
+        uint16_t firmware_patch;
+        uint8_t pgp_admin_pin_retries;
+        uint8_t pgp_user_pin_retries;
+    } nk3;
+};
+
+// drift of the checks, where the device does not tell it
+#define HOTPVERIFY_DRIFT_UNKNOWN (-1)
+
+struct hotpverify_check_details {
+    // Count of the counter values the device skipped to find the matching code, 0 when it was the expected one.
+    // HOTPVERIFY_DRIFT_UNKNOWN for the failed checks, and on the Nitrokey 3, which does not report it.
+    int32_t drift;
+    // time spent on the exchange with the device, in microseconds
+    int64_t latency_us;
+};
+
+/**
+ * Allocate a new, disconnected context. Returns NULL when out of memory.
+ */
+HOTPVERIFY_EXPORT hotpverify_context *hotpverify_new(void);
+/**
+ * Disconnect, if needed, and release the context. Accepts NULL.
+ */
+HOTPVERIFY_EXPORT void hotpverify_free(hotpverify_context *ctx);
+
+/**
+ * Connect to the first supported device. Calling it on a connected context is a no-op.
+ */
+HOTPVERIFY_EXPORT int hotpverify_connect(hotpverify_context *ctx);
+HOTPVERIFY_EXPORT int hotpverify_disconnect(hotpverify_context *ctx);
+HOTPVERIFY_EXPORT bool hotpverify_is_connected(const hotpverify_context *ctx);
+/**
+ * Limit each following call, including the connection and the wait for touch, to timeout_ms milliseconds
+ * end-to-end. A call running out of time returns HOTPVERIFY_ERR_TIMEOUT. 0, the default, disables the limit.
+ */
+HOTPVERIFY_EXPORT int hotpverify_set_timeout(hotpverify_context *ctx, uint32_t timeout_ms);
+/**
+ * Nitrokey 3 asks for touch before using a credential protected this way. The callback, if not NULL, is called
+ * when the device starts waiting for touch, on each further status report while waiting, and when touched.
+ * The library prints nothing itself.
+ * With non_blocking set, a call waiting for touch returns HOTPVERIFY_TOUCH_REQUIRED instead of polling.
+ * Calling the same function with the same arguments again resumes the exchange, and returns its result once touched.
+ */
+HOTPVERIFY_EXPORT int hotpverify_set_touch_handler(hotpverify_context *ctx, hotpverify_touch_callback callback,
+                                                   void *user_data, bool non_blocking);
+/**
+ * The messages, which the command line tool prints, are passed to the callback on the thread making the call.
+ * They are dropped, while the callback is NULL, the default.
+ */
+HOTPVERIFY_EXPORT int hotpverify_set_message_handler(hotpverify_context *ctx, hotpverify_message_callback callback,
+                                                     void *user_data);
+
+HOTPVERIFY_EXPORT int hotpverify_get_status(hotpverify_context *ctx, struct hotpverify_status *out_status);
+/**
+ * Verify the HOTP code on the device.
+ * @return HOTPVERIFY_CODE_VALID or HOTPVERIFY_CODE_INVALID on successful communication, error code otherwise
+ */
+HOTPVERIFY_EXPORT int hotpverify_check_code(hotpverify_context *ctx, const char *hotp_code);
+/**
+ * hotpverify_check_code(), which fills out_details as well. Available since API version 2.
+ */
+HOTPVERIFY_EXPORT int hotpverify_check_code_detailed(hotpverify_context *ctx, const char *hotp_code,
+                                                     struct hotpverify_check_details *out_details);
+/**
+ * admin_pin can be NULL to use the session opened with hotpverify_session_begin(), which saves the authentication
+ * round trip. HOTPVERIFY_ERR_SESSION_EXPIRED is returned then, if the session is not open anymore.
+ * HOTPVERIFY_ERR_INVALID_PARAMS is returned for a secret of over 64 characters, a counter of 2^32-1 or more,
+ * and for a PIN of over 128 characters, as in all calls taking a PIN.
+ */
+HOTPVERIFY_EXPORT int hotpverify_set_secret(hotpverify_context *ctx, const char *base32_secret, const char *admin_pin, uint64_t counter);
+/**
+ * Authenticate once for the following admin operations on this connection. The session ends after ttl_ms
+ * milliseconds (0 for no limit), on disconnection, on hotpverify_get_status(), which selects other applications
+ * on Nitrokey 3, after a wrong PIN or authorization error, and on reset, PIN change or AES key regeneration.
+ */
+HOTPVERIFY_EXPORT int hotpverify_session_begin(hotpverify_context *ctx, const char *admin_pin, uint32_t ttl_ms);
+HOTPVERIFY_EXPORT int hotpverify_session_end(hotpverify_context *ctx);
+/**
+ * Regenerate the AES key after the OpenPGP factory reset. Nitrokey Pro, Nitrokey Storage and Librem Key only.
+ */
+HOTPVERIFY_EXPORT int hotpverify_regenerate_aes_key(hotpverify_context *ctx, const char *admin_pin);
+/**
+ * Nitrokey 3 only. new_pin can be NULL, in which case no PIN is set after the reset.
+ */
+HOTPVERIFY_EXPORT int hotpverify_nk3_reset(hotpverify_context *ctx, const char *new_pin);
+HOTPVERIFY_EXPORT int hotpverify_nk3_change_pin(hotpverify_context *ctx, const char *old_pin, const char *new_pin);
+
+HOTPVERIFY_EXPORT const char *hotpverify_strerror(int result);
+HOTPVERIFY_EXPORT const char *hotpverify_version(void);
+/**
+ * Write the recent device exchanges of the process, as kept by the always-on flight recorder, to the file descriptor.
+ * Only the frame headers are kept, no PINs or secrets. Safe to call from a signal handler.
+ */
+HOTPVERIFY_EXPORT void hotpverify_dump_history(int fd);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif//NITROKEY_HOTP_VERIFICATION_HOTPVERIFY_H
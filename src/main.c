@@ -19,18 +19,101 @@
  * SPDX-License-Identifier: GPL-3.0
  */
 
+#include "base32.h"
 #include "ccid.h"
+#include "connection_cache.h"
+#include "credentials.h"
+#include "flight_recorder.h"
+#include "hidraw.h"
+#include "metrics.h"
 #include "operations.h"
 #include "operations_ccid.h"
+#include "pcsc.h"
+#include "provision.h"
 #include "return_codes.h"
 #include "utils.h"
 #include "version.h"
+#include <errno.h>
+#include <limits.h>
 #include <stdio.h>
 #include <string.h>
+#include <unistd.h>
 
 static struct Device dev = {};
+// Budget for the whole run, including the connection. 0 means no limit.
+static int64_t timeout_ms = 0;
+static bool wait_for_touch = true;
+static bool touch_prompt_shown = false;
+// Connection hints, CONNECTION_UNKNOWN uses the transport remembered from the last run
+static ConnectionType transport = CONNECTION_UNKNOWN;
+static char model = 0;
+// Device given explicitly with --device or --fd, skipping the discovery
+static const char *device_path = NULL;
+static int device_fd = -1;
+static HidBackend hid_backend = HID_BACKEND_AUTO;
+static CcidBackend ccid_backend = CCID_BACKEND_AUTO;
+static const char *pcsc_reader = NULL;
+// File the verification telemetry is appended to, or NULL
+static const char *metrics_path = NULL;
 
-int parse_cmd_and_run(int argc, char *const *argv);
+static const struct {
+    const char *name;
+    char model;
+} MODEL_NAMES[] = {
+        {"pro", 'P'},
+        {"storage", 'S'},
+        {"librem", 'L'},
+        {"nk3", '3'},
+};
+
+static const char *HID_BACKEND_NAMES[HID_BACKEND_LENGTH] = {
+        [HID_BACKEND_AUTO] = "auto",
+        [HID_BACKEND_HIDRAW] = "hidraw",
+        [HID_BACKEND_HIDAPI] = "hidapi",
+};
+
+static const char *CCID_BACKEND_NAMES[CCID_BACKEND_LENGTH] = {
+        [CCID_BACKEND_AUTO] = "auto",
+        [CCID_BACKEND_LIBUSB] = "libusb",
+        [CCID_BACKEND_PCSC] = "pcsc",
+        [CCID_BACKEND_CTAPHID] = "ctaphid",
+};
+
+#define LATENCY_DEFAULT_ROUNDS 10
+#define LATENCY_MAX_ROUNDS 1000
+
+enum CommandType {
+    COMMAND_HELP,
+    COMMAND_VERSION,
+    COMMAND_ID,
+    COMMAND_INFO,
+    COMMAND_CHECK,
+    COMMAND_CHANGE_PIN,
+    COMMAND_SET,
+    COMMAND_SET_MANY,
+    COMMAND_RESET,
+    COMMAND_REGENERATE,
+    COMMAND_HID_LATENCY,
+    COMMAND_NK3_LATENCY,
+    COMMAND_PROVISION,
+};
+
+// Command with its validated arguments
+struct Command {
+    enum CommandType type;
+    const char *code;
+    const char *secret;
+    const char *pin;
+    const char *new_pin;
+    uint64_t counter;
+    unsigned rounds;
+    const char *manifest;
+    const char *log;
+    struct CredentialList credentials;
+};
+
+static int parse_cmd(int argc, char *const *argv, struct Command *cmd);
+static int run_cmd(const struct Command *cmd);
 
 void print_help(char *app_name) {
     printf("Available commands: \n"
@@ -40,33 +123,259 @@ void print_help(char *app_name) {
            "\t%s check <HOTP CODE>\n"
            "\t%s regenerate <ADMIN PIN>\n"
            "\t%s set <BASE32 HOTP SECRET> <ADMIN PIN> [COUNTER]\n"
+           "\t%s set-many <CREDENTIALS FILE> <ADMIN PIN>  write the listed credentials to the Nitrokey 3 at once\n"
            "\t%s nk3-change-pin <old-pin> <new-pin>\n"
            "\t%s reset [ADMIN PIN]\n"
            "\t%s regenerate\n"
-           "\t%s set <BASE32 HOTP SECRET> <ADMIN PIN> [COUNTER]\n",
-           app_name, app_name, app_name, app_name, app_name, app_name, app_name, app_name, app_name, app_name);
+           "\t%s set <BASE32 HOTP SECRET> <ADMIN PIN> [COUNTER]\n"
+           "\t%s hid-latency [ROUNDS]  compare the status query latency of the HID backends\n"
+           "\t%s nk3-latency [ROUNDS]  compare the Secrets App latency of the Nitrokey 3 backends\n"
+           "\t%s provision <MANIFEST> [LOG]  provision all attached keys listed in the manifest, in parallel\n"
+           "Options, given before the command:\n"
+           "\t--timeout=<ms>  fail, if the command does not finish within the given time\n"
+           "\t--no-touch-wait  do not wait for the touch confirmation, exit with a distinct code instead\n"
+           "\t--transport=<hid|ccid|auto>  connect over the given transport only\n"
+           "\t--model=<pro|storage|librem|nk3>  connect to the given device model only\n"
+           "\t--device=<path>  connect to the device on the USB device node, like /dev/bus/usb/001/005\n"
+           "\t--fd=<number>  connect to the device on the already opened USB device node\n"
+           "\t--hid-backend=<auto|hidraw|hidapi>  access the HID devices over Linux hidraw or HIDAPI\n"
+           "\t--ccid-backend=<auto|libusb|pcsc|ctaphid>  access the Nitrokey 3 with libusb, over PC/SC or its FIDO interface\n"
+           "\t--reader=<name>  use the PC/SC reader, which name contains the given text\n"
+           "\t--metrics=<path>  append the result, counter drift and latency of the check to the file\n",
+           app_name, app_name, app_name, app_name, app_name, app_name, app_name, app_name, app_name, app_name, app_name,
+           app_name, app_name, app_name);
 }
 
+static void print_touch_prompt(TouchEvent event, void *user_data) {
+    unused(user_data);
+    switch (event) {
+        case TOUCH_REQUIRED:
+            printf("Please touch the USB security key if it blinks ");
+            touch_prompt_shown = true;
+            break;
+        case TOUCH_WAITING:
+            printf(".");
+            break;
+        case TOUCH_RECEIVED:
+            printf("\n");
+            touch_prompt_shown = false;
+            break;
+    }
+    fflush(stdout);
+}
+
+// Consume the options placed before the command, keeping the application name in argv[0]
+static int parse_global_options(int *argc, char ***argv) {
+    while (*argc > 1 && strncmp((*argv)[1], "--", 2) == 0) {
+        const char *option = (*argv)[1];
+        if (strncmp(option, "--timeout=", 10) == 0) {
+            char *end = NULL;
+            const long long value = strtoll(option + 10, &end, 10);
+            if (end == option + 10 || *end != '\0' || value < 0) {
+                return RET_INVALID_PARAMS;
+            }
+            timeout_ms = value;
+        } else if (strcmp(option, "--no-touch-wait") == 0) {
+            wait_for_touch = false;
+        } else if (strncmp(option, "--transport=", 12) == 0) {
+            const char *value = option + 12;
+            if (strcmp(value, "hid") == 0) {
+                transport = CONNECTION_HID;
+            } else if (strcmp(value, "ccid") == 0) {
+                transport = CONNECTION_CCID;
+            } else if (strcmp(value, "auto") == 0) {
+                transport = CONNECTION_UNKNOWN;
+            } else {
+                return RET_INVALID_PARAMS;
+            }
+        } else if (strncmp(option, "--device=", 9) == 0) {
+            device_path = option + 9;
+            if (device_path[0] == '\0') {
+                return RET_INVALID_PARAMS;
+            }
+        } else if (strncmp(option, "--fd=", 5) == 0) {
+            char *end = NULL;
+            const long value = strtol(option + 5, &end, 10);
+            if (end == option + 5 || *end != '\0' || value < 0 || value > INT_MAX) {
+                return RET_INVALID_PARAMS;
+            }
+            device_fd = (int) value;
+        } else if (strncmp(option, "--hid-backend=", 14) == 0) {
+            hid_backend = HID_BACKEND_LENGTH;
+            for (int i = 0; i < HID_BACKEND_LENGTH; ++i) {
+                if (strcmp(option + 14, HID_BACKEND_NAMES[i]) == 0) {
+                    hid_backend = (HidBackend) i;
+                }
+            }
+            if (hid_backend == HID_BACKEND_LENGTH) {
+                return RET_INVALID_PARAMS;
+            }
+        } else if (strncmp(option, "--ccid-backend=", 15) == 0) {
+            ccid_backend = CCID_BACKEND_LENGTH;
+            for (int i = 0; i < CCID_BACKEND_LENGTH; ++i) {
+                if (strcmp(option + 15, CCID_BACKEND_NAMES[i]) == 0) {
+                    ccid_backend = (CcidBackend) i;
+                }
+            }
+            if (ccid_backend == CCID_BACKEND_LENGTH) {
+                return RET_INVALID_PARAMS;
+            }
+        } else if (strncmp(option, "--reader=", 9) == 0) {
+            pcsc_reader = option + 9;
+            if (pcsc_reader[0] == '\0') {
+                return RET_INVALID_PARAMS;
+            }
+        } else if (strncmp(option, "--metrics=", 10) == 0) {
+            metrics_path = option + 10;
+            if (metrics_path[0] == '\0') {
+                return RET_INVALID_PARAMS;
+            }
+        } else if (strncmp(option, "--model=", 8) == 0) {
+            model = 0;
+            for (size_t i = 0; i < LEN_ARR(MODEL_NAMES); ++i) {
+                if (strcmp(option + 8, MODEL_NAMES[i].name) == 0) {
+                    model = MODEL_NAMES[i].model;
+                }
+            }
+            if (model == 0) {
+                return RET_INVALID_PARAMS;
+            }
+        } else {
+            return RET_INVALID_PARAMS;
+        }
+        (*argv)[1] = (*argv)[0];
+        (*argv)++;
+        (*argc)--;
+    }
+    if (device_path != NULL && device_fd >= 0) {
+        return RET_INVALID_PARAMS;
+    }
+    if (hid_backend == HID_BACKEND_HIDRAW && !hidraw_supported()) {
+        printf("hidraw is available on Linux only\n");
+        return RET_INVALID_PARAMS;
+    }
+    if ((ccid_backend == CCID_BACKEND_PCSC || pcsc_reader != NULL) && !pcsc_supported()) {
+        printf("PC/SC support is not built in\n");
+        return RET_INVALID_PARAMS;
+    }
+    if (ccid_backend == CCID_BACKEND_PCSC && (device_path != NULL || device_fd >= 0)) {
+        printf("The PC/SC readers are selected with --reader\n");
+        return RET_INVALID_PARAMS;
+    }
+    if (ccid_backend == CCID_BACKEND_CTAPHID && (device_path != NULL || device_fd >= 0)) {
+        printf("The Nitrokey 3 is reached over CTAPHID without a device node\n");
+        return RET_INVALID_PARAMS;
+    }
+    return RET_NO_ERROR;
+}
+
+// Connect with the given hints. In the auto mode try the transport and device, which worked last time, first.
+static int connect_device(void) {
+    device_set_hid_backend(&dev, hid_backend);
+    device_set_ccid_backend(&dev, ccid_backend, pcsc_reader);
+    if (device_path != NULL || device_fd >= 0) {
+        device_set_location(&dev, device_path, device_fd);
+        device_set_connection_hints(&dev, transport, model);
+        return device_connect(&dev);
+    }
+
+    struct ConnectionCache cached = {};
+    const bool have_cache = transport == CONNECTION_UNKNOWN && connection_cache_load(&cached) == RET_NO_ERROR;
+    if (have_cache) {
+        const VidPid *cached_model = device_find_model(cached.vid, cached.pid);
+        if (cached_model != NULL && (model == 0 || model == cached_model->name_short)) {
+            device_set_connection_hints(&dev, cached.transport, cached_model->name_short);
+            const int res = device_connect(&dev);
+            if (res == RET_NO_ERROR || res == RET_TIMEOUT) {
+                return res;
+            }
+        }
+    }
+
+    device_set_connection_hints(&dev, transport, model);
+    const int res = device_connect(&dev);
+    if (res == RET_NO_ERROR && transport == CONNECTION_UNKNOWN) {
+        const struct ConnectionCache current = {dev.connection_type, dev.dev_info.vid, dev.dev_info.pid};
+        const bool changed = !have_cache || current.transport != cached.transport ||
+                             current.vid != cached.vid || current.pid != cached.pid;
+        if (changed) {
+            // best effort - the cache only saves time on the next run
+            connection_cache_store(&current);
+        }
+    }
+    return res;
+}
+
+// Show the recent device exchanges after a failure, following the messages printed so far
+static void dump_history(void) {
+    fflush(stdout);
+    flight_recorder_dump(STDERR_FILENO);
+}
 
 int main(int argc, char *argv[]) {
     printf("HOTP code verification application, version %s\n", VERSION);
+    flight_recorder_install_signal_handlers();
 
     int res;
 
-    if (argc != 1 && argv[1][0] != 'v') {
-        res = device_connect(&dev);
+    res = parse_global_options(&argc, &argv);
+    if (res != RET_NO_ERROR) {
+        print_help(argv[0]);
+        return EXIT_INVALID_PARAMS;
+    }
+
+    // all arguments are checked before the device is looked for, which might take seconds
+    struct Command cmd = {};
+    res = parse_cmd(argc, argv, &cmd);
+    if (res != RET_NO_ERROR) {
+        if (res == RET_INVALID_PARAMS) {
+            print_help(argv[0]);
+        }
+        printf("Error occurred, status code %d: %s\n", res, res_to_error_string(res));
+        return res_to_exit_code(res);
+    }
+    if (cmd.type == COMMAND_HELP) {
+        print_help(argv[0]);
+        return EXIT_NO_ERROR;
+    }
+
+    dev.deadline = deadline_in(timeout_ms);
+    device_set_touch_handler(&dev, print_touch_prompt, NULL, !wait_for_touch);
+
+    // the latency comparison connects over each backend on its own, and the provisioning to each device
+    if (cmd.type != COMMAND_VERSION && cmd.type != COMMAND_HID_LATENCY && cmd.type != COMMAND_NK3_LATENCY &&
+        cmd.type != COMMAND_PROVISION) {
+        res = connect_device();
         if (res != RET_NO_ERROR) {
-            printf("Could not connect to the device\n");
-            return EXIT_CONNECTION_ERROR;
+            if (res == RET_TIMEOUT) {
+                printf("Could not connect to the device within %lld ms\n", (long long) timeout_ms);
+            } else if (res == RET_DEVICE_BUSY) {
+                printf("The device is used by another process, and was not released within %d s\n",
+                       DEVICE_ARBITRATION_TIMEOUT_MS / 1000);
+            } else {
+                printf("Could not connect to the device\n");
+            }
+            dump_history();
+            return res == RET_TIMEOUT ? EXIT_TIMEOUT : EXIT_CONNECTION_ERROR;
         }
     }
 
-    res = parse_cmd_and_run(argc, argv);
+    res = run_cmd(&cmd);
+    credential_list_free(&cmd.credentials);
+    if (touch_prompt_shown) {
+        // the touch was not confirmed, finish the prompt line before the result
+        printf("\n");
+    }
     if (res != dev_ok && res != RET_NO_ERROR && res != RET_VALIDATION_PASSED && res != RET_VALIDATION_FAILED) {
         printf("Error occurred, status code %d: %s\n", res, res_to_error_string(res));
+        dump_history();
     } else {
         printf("%s\n", res_to_error_string(res));
     }
+    if (dev.retry_stats.retries > 0) {
+        fflush(stdout);
+        fprintf(stderr, "%u USB transfers were retried after transient errors\n", dev.retry_stats.retries);
+    }
 
 #ifdef _DEBUG
     if (res < dev_command_status_range && res != dev_ok) {
@@ -88,99 +397,373 @@ void print_card_serial(struct ResponseStatus *status) {
     }
 }
 
-int parse_cmd_and_run(int argc, char *const *argv) {
+// Optional count of the rounds of the latency comparisons
+static int parse_rounds(int argc, char *const *argv, struct Command *cmd) {
+    cmd->rounds = LATENCY_DEFAULT_ROUNDS;
+    if (argc == 3) {
+        char *end = NULL;
+        const unsigned long rounds = strtoul(argv[2], &end, 10);
+        if (end == argv[2] || *end != '\0' || rounds == 0 || rounds > LATENCY_MAX_ROUNDS) {
+            return RET_INVALID_PARAMS;
+        }
+        cmd->rounds = (unsigned) rounds;
+    }
+    return RET_NO_ERROR;
+}
+
+// Recognize the command and check its arguments, loading the credentials file. The device is not touched here.
+static int parse_cmd(int argc, char *const *argv, struct Command *cmd) {
+    if (argc == 1) {
+        cmd->type = COMMAND_HELP;
+        return RET_NO_ERROR;
+    }
+    switch (argv[1][0]) {
+        case 'v':
+            cmd->type = COMMAND_VERSION;
+            return RET_NO_ERROR;
+        case 'i':// id | info
+            cmd->type = (strnlen(argv[1], 10) == 2 && argv[1][1] == 'd') ? COMMAND_ID : COMMAND_INFO;
+            return RET_NO_ERROR;
+        case 'c':
+            if (argc != 3) break;
+            cmd->type = COMMAND_CHECK;
+            cmd->code = argv[2];
+            return validate_hotp_code(cmd->code);
+        case 'n':
+            if (strcmp(argv[1], "nk3-latency") == 0 && argc <= 3) {
+                cmd->type = COMMAND_NK3_LATENCY;
+                return parse_rounds(argc, argv, cmd);
+            }
+            if (strcmp(argv[1], "nk3-change-pin") != 0 || argc != 4) break;
+            cmd->type = COMMAND_CHANGE_PIN;
+            cmd->pin = argv[2];
+            cmd->new_pin = argv[3];
+            if (validate_pin(cmd->pin) != RET_NO_ERROR) {
+                return RET_TOO_LONG_PIN;
+            }
+            return validate_pin(cmd->new_pin);
+        case 's':
+            if (strcmp(argv[1], "set-many") == 0) {
+                if (argc != 4) break;
+                cmd->type = COMMAND_SET_MANY;
+                cmd->pin = argv[3];
+                if (validate_pin(cmd->pin) != RET_NO_ERROR) {
+                    return RET_TOO_LONG_PIN;
+                }
+                return credential_list_load(argv[2], &cmd->credentials);
+            }
+            if (argc != 4 && argc != 5) break;
+            cmd->type = COMMAND_SET;
+            cmd->secret = argv[2];
+            cmd->pin = argv[3];
+            if (validate_base32_secret(cmd->secret) != RET_NO_ERROR) {
+                printf("ERR: Too long or badly formatted base32 string. It should be not longer than %lu characters.\n",
+                       (unsigned long) BASE32_LEN(HOTP_SECRET_SIZE_BYTES));
+                return RET_BADLY_FORMATTED_BASE32_STRING;
+            }
+            if (validate_pin(cmd->pin) != RET_NO_ERROR) {
+                return RET_TOO_LONG_PIN;
+            }
+            if (argc == 5) {
+                return validate_counter(argv[4], &cmd->counter);
+            }
+            return RET_NO_ERROR;
+        case 'h':
+            if (strcmp(argv[1], "hid-latency") != 0 || argc > 3) break;
+            cmd->type = COMMAND_HID_LATENCY;
+            return parse_rounds(argc, argv, cmd);
+        case 'p':
+            if (strcmp(argv[1], "provision") != 0 || (argc != 3 && argc != 4)) break;
+            cmd->type = COMMAND_PROVISION;
+            cmd->manifest = argv[2];
+            cmd->log = argc == 4 ? argv[3] : NULL;
+            return RET_NO_ERROR;
+        case 'r':
+            if (strncmp(argv[1], "reset", 15) == 0) {
+                if (argc != 2 && argc != 3) break;
+                cmd->type = COMMAND_RESET;
+                cmd->new_pin = argc == 3 ? argv[2] : NULL;
+                return cmd->new_pin != NULL ? validate_pin(cmd->new_pin) : RET_NO_ERROR;
+            } else if (strncmp(argv[1], "regenerate", 15) == 0) {
+                if (argc != 3) break;
+                cmd->type = COMMAND_REGENERATE;
+                cmd->pin = argv[2];
+                return validate_pin(cmd->pin);
+            }
+            break;
+        default:
+            break;
+    }
+    return RET_INVALID_PARAMS;
+}
+
+// Run the status queries over each HID backend in turn, and report the time spent on the feature reports
+static int compare_hid_backends(unsigned rounds) {
+    static const HidBackend backends[] = {HID_BACKEND_HIDRAW, HID_BACKEND_HIDAPI};
+    const HidBackend requested = hid_backend;
+    // only the HID devices have the choice, and the cache might point to a CCID one
+    transport = CONNECTION_HID;
+    HidBackend fastest = HID_BACKEND_AUTO;
+    double fastest_us = 0;
+    for (size_t i = 0; i < LEN_ARR(backends); ++i) {
+        if (requested != HID_BACKEND_AUTO && requested != backends[i]) {
+            continue;
+        }
+        hid_backend = backends[i];
+        const int res = connect_device();
+        if (res == RET_TIMEOUT) {
+            return res;
+        }
+        if (res != RET_NO_ERROR) {
+            printf("%s: could not connect\n", HID_BACKEND_NAMES[backends[i]]);
+            continue;
+        }
+        dev.hid_stats = (struct HidTransferStats){0};
+        const int64_t start = monotonic_us();
+        for (unsigned round = 0; round < rounds; ++round) {
+            struct FullResponseStatus status = {};
+            device_get_status(&dev, &status);
+        }
+        const int64_t total_us = monotonic_us() - start;
+        const struct HidTransferStats stats = dev.hid_stats;
+        device_disconnect(&dev);
+
+        const double report_us = stats.transfers != 0 ? (double) stats.transfer_us / stats.transfers : 0;
+        printf("%s: %u status queries in %.1f ms, %u feature reports taking %.0f us each\n",
+               HID_BACKEND_NAMES[backends[i]], rounds, total_us / 1000.0, stats.transfers, report_us);
+        if (stats.transfers != 0 && (fastest == HID_BACKEND_AUTO || report_us < fastest_us)) {
+            fastest = backends[i];
+            fastest_us = report_us;
+        }
+    }
+    hid_backend = requested;
+    if (fastest == HID_BACKEND_AUTO) {
+        return RET_COMM_ERROR;
+    }
+    printf("Faster feature reports: %s\n", HID_BACKEND_NAMES[fastest]);
+    return RET_NO_ERROR;
+}
+
+// Select the Secrets App over each Nitrokey 3 backend in turn, the first exchange of all its operations
+static int compare_ccid_backends(unsigned rounds) {
+    static const CcidBackend backends[] = {CCID_BACKEND_LIBUSB, CCID_BACKEND_PCSC, CCID_BACKEND_CTAPHID};
+    const CcidBackend requested = ccid_backend;
+    transport = CONNECTION_CCID;
+    CcidBackend fastest = CCID_BACKEND_AUTO;
+    double fastest_us = 0;
+    for (size_t i = 0; i < LEN_ARR(backends); ++i) {
+        if ((requested != CCID_BACKEND_AUTO && requested != backends[i]) ||
+            (backends[i] == CCID_BACKEND_PCSC && !pcsc_supported())) {
+            continue;
+        }
+        ccid_backend = backends[i];
+        const int res = connect_device();
+        if (res == RET_TIMEOUT) {
+            return res;
+        }
+        if (res != RET_NO_ERROR) {
+            printf("%s: could not connect\n", CCID_BACKEND_NAMES[backends[i]]);
+            continue;
+        }
+        unsigned selected = 0;
+        const int64_t start = monotonic_us();
+        for (unsigned round = 0; round < rounds; ++round) {
+            IccResult result = {};
+            if (send_select_ccid(&dev, &result) == RET_NO_ERROR && result.data_status_code == 0x9000) {
+                selected++;
+            }
+        }
+        const int64_t total_us = monotonic_us() - start;
+        device_disconnect(&dev);
+
+        const double select_us = (double) total_us / rounds;
+        printf("%s: %u of %u Secrets App selections in %.1f ms, %.0f us each\n",
+               CCID_BACKEND_NAMES[backends[i]], selected, rounds, total_us / 1000.0, select_us);
+        if (selected == rounds && (fastest == CCID_BACKEND_AUTO || select_us < fastest_us)) {
+            fastest = backends[i];
+            fastest_us = select_us;
+        }
+    }
+    ccid_backend = requested;
+    if (fastest == CCID_BACKEND_AUTO) {
+        return RET_COMM_ERROR;
+    }
+    printf("Faster Secrets App access: %s\n", CCID_BACKEND_NAMES[fastest]);
+    return RET_NO_ERROR;
+}
+
+// Check the code, and record the outcome in the metrics file, if requested
+static int check_code(const char *code) {
+    if (metrics_path != NULL && dev.connection_type == CONNECTION_HID && dev.card_serial == 0) {
+        // The Secrets App reports the serial on connection. The Nitrokey Pro is asked once, before the check,
+        // as it may not answer anymore after a failed one.
+        struct FullResponseStatus status = {};
+        device_get_status(&dev, &status);
+    }
+    struct VerifyDetails details;
+    const int res = check_code_on_device_detailed(&dev, code, &details);
+    if (metrics_path == NULL) {
+        return res;
+    }
+    const struct VerificationMetrics metrics = {
+            .serial = dev.card_serial,
+            .model = device_find_model(dev.dev_info.vid, dev.dev_info.pid),
+            .transport = dev.connection_type,
+            .result = res,
+            .details = details,
+    };
+    if (metrics_append_verification(metrics_path, &metrics) != RET_NO_ERROR) {
+        fprintf(stderr, "Could not append the metrics to %s\n", metrics_path);
+    }
+    return res;
+}
+
+// Write the credentials in one session, and print the outcome of each
+static int set_credentials(const char *admin_PIN, const struct CredentialList *list) {
+    int *results = calloc(list->count, sizeof(*results));
+    if (results == NULL) {
+        return RET_NO_MEMORY;
+    }
+    const int res = set_credentials_on_device_ccid(&dev, admin_PIN, list->entries, list->count, results);
+    size_t written = 0;
+    if (res != RET_UNKNOWN_DEVICE) {
+        for (size_t i = 0; i < list->count; ++i) {
+            printf("\t%s: %s\n", list->entries[i].name, res_to_error_string(results[i]));
+            written += results[i] == RET_NO_ERROR;
+        }
+        printf("Written %zu of %zu credentials\n", written, list->count);
+    }
+    free(results);
+    return res;
+}
+
+// Provision all attached keys from the manifest, and write the per-key log to the file or to stdout
+static int provision_keys(const char *manifest_path, const char *log_path) {
+    struct ProvisionManifest manifest;
+    int res = provision_manifest_load(manifest_path, &manifest);
+    if (res != RET_NO_ERROR) {
+        return res;
+    }
+    FILE *log = stdout;
+    if (log_path != NULL && (log = fopen(log_path, "w")) == NULL) {
+        printf("Could not open the log %s: %s\n", log_path, strerror(errno));
+        provision_manifest_free(&manifest);
+        return RET_INVALID_PARAMS;
+    }
+
+    // the children connect with the same settings as the other commands
+    device_set_hid_backend(&dev, hid_backend);
+    device_set_ccid_backend(&dev, ccid_backend, pcsc_reader);
+    device_set_location(&dev, device_path, device_fd);
+    device_set_connection_hints(&dev, transport, model);
+    const size_t results_size = device_count_available(&dev) + manifest.count;
+    struct ProvisionResult *results = calloc(results_size, sizeof(*results));
+    size_t results_count = 0;
+    const int64_t start = stopwatch_start();
+    res = results != NULL ? provision_all(&manifest, &dev, results, results_size, &results_count) : RET_NO_MEMORY;
+    const int64_t elapsed_ms = stopwatch_stop(start);
+
+    size_t done = 0;
+    for (size_t i = 0; i < results_count; ++i) {
+        done += results[i].state == PROVISION_DONE;
+    }
+    provision_log_write(log, results, results_count);
+    if (log != stdout) {
+        fclose(log);
+    }
+    printf("Provisioned %zu of %zu listed keys in %lld ms\n", done, manifest.count, (long long) elapsed_ms);
+    free(results);
+    provision_manifest_free(&manifest);
+    return res;
+}
+
+static int run_cmd(const struct Command *cmd) {
     int res = RET_INVALID_PARAMS;
-    if (argc > 1) {
-        switch (argv[1][0]) {
-            case 'v':
-                printf("%s\n", VERSION);
-                printf("%s\n", VERSION_GIT);
-                res = RET_NO_ERROR;
-                break;
-            case 'i': {// id | info
-                struct FullResponseStatus status;
-                memset(&status, 0, sizeof(struct FullResponseStatus));
-
-                res = device_get_status(&dev, &status);
-                check_ret((res != RET_NO_ERROR) && (res != RET_NO_PIN_ATTEMPTS), res);
-                if (strnlen(argv[1], 10) == 2 && argv[1][1] == 'd') {
-                    // id command - print ID only
-                    print_card_serial(&status.response_status);
-                } else {
-                    // info command - print status
-                    printf("Connected device status:\n");
-                    printf("\tCard serial: ");
-                    print_card_serial(&status.response_status);
-                    if (status.device_type == Nk3) {
-                        printf("\tFirmware Nitrokey 3: v%d.%d.%d\n",
-                               (status.nk3_extra_info.firmware_version >> 22) & 0b1111111111,
-                               (status.nk3_extra_info.firmware_version >> 6) & 0xFFFF,
-                               status.nk3_extra_info.firmware_version & 0b111111);
-                        printf("\tFirmware Secrets App: v%d.%d\n",
-                               status.response_status.firmware_version_st.major,
-                               status.response_status.firmware_version_st.minor);
-                        if (res != RET_NO_PIN_ATTEMPTS) {
-                            printf("\tSecrets app PIN counter: %d\n",
-                                   status.response_status.retry_user);
-                        } else {
-                            printf("\tSecrets app PIN counter: PIN is not set - set PIN before the first use\n");
-                        }
-                        printf("\tGPG Card counters: Admin %d, User %d\n",
-                               status.nk3_extra_info.pgp_admin_pin_retries,
-                               status.nk3_extra_info.pgp_user_pin_retries);
+    switch (cmd->type) {
+        case COMMAND_HELP:
+            res = RET_NO_ERROR;
+            break;
+        case COMMAND_VERSION:
+            printf("%s\n", VERSION);
+            printf("%s\n", VERSION_GIT);
+            res = RET_NO_ERROR;
+            break;
+        case COMMAND_ID:
+        case COMMAND_INFO: {
+            struct FullResponseStatus status;
+            memset(&status, 0, sizeof(struct FullResponseStatus));
+
+            res = device_get_status(&dev, &status);
+            check_ret((res != RET_NO_ERROR) && (res != RET_NO_PIN_ATTEMPTS), res);
+            if (cmd->type == COMMAND_ID) {
+                // id command - print ID only
+                print_card_serial(&status.response_status);
+            } else {
+                // info command - print status
+                printf("Connected device status:\n");
+                printf("\tCard serial: ");
+                print_card_serial(&status.response_status);
+                if (status.device_type == Nk3) {
+                    printf("\tFirmware Nitrokey 3: v%d.%d.%d\n",
+                           (status.nk3_extra_info.firmware_version >> 22) & 0b1111111111,
+                           (status.nk3_extra_info.firmware_version >> 6) & 0xFFFF,
+                           status.nk3_extra_info.firmware_version & 0b111111);
+                    printf("\tFirmware Secrets App: v%d.%d\n",
+                           status.response_status.firmware_version_st.major,
+                           status.response_status.firmware_version_st.minor);
+                    if (res != RET_NO_PIN_ATTEMPTS) {
+                        printf("\tSecrets app PIN counter: %d\n",
+                               status.response_status.retry_user);
                     } else {
-                        printf("\tFirmware: v%d.%d\n",
-                               status.response_status.firmware_version_st.major,
-                               status.response_status.firmware_version_st.minor);
-                        if (res != RET_NO_PIN_ATTEMPTS) {
-                            printf("\tCard counters: Admin %d, User %d\n",
-                                   status.response_status.retry_admin, status.response_status.retry_user);
-                        } else {
-                            printf("\tCard counters: PIN is not set - set PIN before the first use\n");
-                        }
+                        printf("\tSecrets app PIN counter: PIN is not set - set PIN before the first use\n");
                     }
-                }
-                if (res == RET_NO_PIN_ATTEMPTS) {
-                    // Ignore if PIN is not set here
-                    res = RET_NO_ERROR;
-                }
-            } break;
-            case 'c':
-                if (argc != 3) break;
-                res = check_code_on_device(&dev, argv[2]);
-                break;
-            case 'n':
-                if (strcmp(argv[1], "nk3-change-pin") != 0 || argc != 4) break;
-                res = nk3_change_pin(&dev, argv[2], argv[3]);
-                break;
-            case 's':
-                if (argc != 4 && argc != 5) break;
-                {
-                    uint64_t counter = 0;
-                    if (argc == 5) {
-                        counter = strtol10_s(argv[4]);
+                    printf("\tGPG Card counters: Admin %d, User %d\n",
+                           status.nk3_extra_info.pgp_admin_pin_retries,
+                           status.nk3_extra_info.pgp_user_pin_retries);
+                } else {
+                    printf("\tFirmware: v%d.%d\n",
+                           status.response_status.firmware_version_st.major,
+                           status.response_status.firmware_version_st.minor);
+                    if (res != RET_NO_PIN_ATTEMPTS) {
+                        printf("\tCard counters: Admin %d, User %d\n",
+                               status.response_status.retry_admin, status.response_status.retry_user);
+                    } else {
+                        printf("\tCard counters: PIN is not set - set PIN before the first use\n");
                     }
-                    res = set_secret_on_device(&dev, argv[2], argv[3], counter);
                 }
-                break;
-            case 'r':
-                if (strncmp(argv[1], "reset", 15) == 0) {
-                    if (argc != 2 && argc != 3) break;
-                    res = nk3_reset(&dev, argc == 3 ? argv[2] : NULL);
-                } else if (strncmp(argv[1], "regenerate", 15) == 0) {
-                    if (argc != 3) break;
-                    res = regenerate_AES_key(&dev, argv[2]);
-                }
-                break;
-            default:
-                break;
-        }
-    }
-    if (argc == 1) {
-        print_help(argv[0]);
-        res = RET_NO_ERROR;
-    } else if (res == RET_INVALID_PARAMS) {
-        print_help(argv[0]);
+            }
+            if (res == RET_NO_PIN_ATTEMPTS) {
+                // Ignore if PIN is not set here
+                res = RET_NO_ERROR;
+            }
+        } break;
+        case COMMAND_CHECK:
+            res = check_code(cmd->code);
+            break;
+        case COMMAND_CHANGE_PIN:
+            res = nk3_change_pin(&dev, cmd->pin, cmd->new_pin);
+            break;
+        case COMMAND_SET:
+            res = set_secret_on_device(&dev, cmd->secret, cmd->pin, cmd->counter);
+            break;
+        case COMMAND_SET_MANY:
+            res = set_credentials(cmd->pin, &cmd->credentials);
+            break;
+        case COMMAND_RESET:
+            res = nk3_reset(&dev, cmd->new_pin);
+            break;
+        case COMMAND_REGENERATE:
+            res = regenerate_AES_key(&dev, cmd->pin);
+            break;
+        case COMMAND_HID_LATENCY:
+            res = compare_hid_backends(cmd->rounds);
+            break;
+        case COMMAND_NK3_LATENCY:
+            res = compare_ccid_backends(cmd->rounds);
+            break;
+        case COMMAND_PROVISION:
+            res = provision_keys(cmd->manifest, cmd->log);
+            break;
     }
     return res;
 }
@@ -0,0 +1,67 @@
+/*
+ * Copyright (c) 2023 Nitrokey GmbH
+ *
+ * This file is part of Nitrokey HOTP verification project.
+ *
+ * Nitrokey HOTP verification is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * Nitrokey HOTP verification is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Nitrokey HOTP verification. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0
+ */
+
+#include "metrics.h"
+#include "return_codes.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define METRICS_HEADER "time\tserial\tmodel\ttransport\tresult\tdrift\tlatency_us\n"
+#define METRICS_LINE_SIZE 256
+
+static const char *TRANSPORT_NAMES[CONNECTION_LENGTH] = {
+        [CONNECTION_UNKNOWN] = "unknown",
+        [CONNECTION_HID] = "hid",
+        [CONNECTION_CCID] = "ccid",
+};
+
+static const char *result_name(int result) {
+    if (result == RET_VALIDATION_PASSED) return "passed";
+    if (result == RET_VALIDATION_FAILED) return "failed";
+    return "error";
+}
+
+int metrics_append_verification(const char *path, const struct VerificationMetrics *metrics) {
+    char line[sizeof METRICS_HEADER + METRICS_LINE_SIZE];
+    char drift[16] = "-";
+    if (metrics->details.drift != VERIFY_DRIFT_UNKNOWN) {
+        snprintf(drift, sizeof drift, "%d", metrics->details.drift);
+    }
+
+    const int fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        return RET_NOT_FOUND;
+    }
+    struct stat st;
+    const bool empty = fstat(fd, &st) == 0 && st.st_size == 0;
+    // a single write keeps the lines of the concurrent runs apart
+    const int length = snprintf(line, sizeof line, "%s%lld\t0x%X\t%s\t%s\t%s\t%s\t%lld\n", empty ? METRICS_HEADER : "",
+                                (long long) time(NULL), metrics->serial,
+                                metrics->model != NULL ? metrics->model->name : "unknown",
+                                TRANSPORT_NAMES[metrics->transport], result_name(metrics->result), drift,
+                                (long long) metrics->details.latency_us);
+    const bool written = length > 0 && (size_t) length < sizeof line && write(fd, line, (size_t) length) == length;
+    close(fd);
+    return written ? RET_NO_ERROR : RET_NOT_FOUND;
+}
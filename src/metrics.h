@@ -0,0 +1,50 @@
+/*
+ * Copyright (c) 2023 Nitrokey GmbH
+ *
+ * This file is part of Nitrokey HOTP verification project.
+ *
+ * Nitrokey HOTP verification is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * Nitrokey HOTP verification is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Nitrokey HOTP verification. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0
+ */
+
+#ifndef NITROKEY_HOTP_VERIFICATION_METRICS_H
+#define NITROKEY_HOTP_VERIFICATION_METRICS_H
+
+#include "device.h"
+#include "operations.h"
+#include <stdint.h>
+
+/**
+ * Verification telemetry, appended to a tab separated file with one line per check:
+ *
+ *     time  serial  model  transport  result  drift  latency_us
+ *
+ * The time is in seconds since the epoch, the drift is - when unknown. Following the drift of each key
+ * shows the counters getting close to the end of the device's look-ahead window, before the checks fail.
+ */
+
+struct VerificationMetrics {
+    uint32_t serial;
+    const VidPid *model;
+    ConnectionType transport;
+    // return code of the check
+    int result;
+    struct VerifyDetails details;
+};
+
+// Append the line, preceded by the header when the file is empty. RET_NO_ERROR, or RET_NOT_FOUND if not written.
+int metrics_append_verification(const char *path, const struct VerificationMetrics *metrics);
+
+#endif//NITROKEY_HOTP_VERIFICATION_METRICS_H
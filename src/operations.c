@@ -28,6 +28,7 @@
 #include "operations_ccid.h"
 #include "random_data.h"
 #include "return_codes.h"
+#include "session.h"
 #include "settings.h"
 #include "structs.h"
 #include "utils.h"
@@ -52,22 +53,42 @@ bool verify_base32(const char *string, size_t len) {
     return true;
 }
 
-int set_secret_on_device(struct Device *dev, const char *OTP_secret_base32, const char *admin_PIN, const uint64_t hotp_counter) {
+int validate_base32_secret(const char *OTP_secret_base32) {
+    const size_t base32_string_length_limit = BASE32_LEN(HOTP_SECRET_SIZE_BYTES);
+    if (OTP_secret_base32 == nullptr) {
+        return RET_BADLY_FORMATTED_BASE32_STRING;
+    }
+    // one more character is read to tell the too long strings apart
+    const size_t OTP_secret_base32_length = strnlen(OTP_secret_base32, base32_string_length_limit + 1);
+    if (!(OTP_secret_base32_length > 0 && OTP_secret_base32_length <= base32_string_length_limit && verify_base32(OTP_secret_base32, OTP_secret_base32_length))) {
+        return RET_BADLY_FORMATTED_BASE32_STRING;
+    }
+    return RET_NO_ERROR;
+}
+
+int validate_pin(const char *PIN) {
+    if (PIN == nullptr) {
+        return RET_INVALID_PARAMS;
+    }
+    if (strnlen(PIN, MAX_PIN_SIZE_CCID + 1) > MAX_PIN_SIZE_CCID) {
+        return RET_TOO_LONG_PIN;
+    }
+    return RET_NO_ERROR;
+}
+
+static int set_secret_on_device_impl(struct Device *dev, const char *OTP_secret_base32, const char *admin_PIN, const uint64_t hotp_counter) {
     rassert(OTP_secret_base32 != nullptr);
     rassert(dev != nullptr);
-    rassert(admin_PIN != nullptr);
     int res;
     //Make sure secret is parsable
-    const size_t base32_string_length_limit = BASE32_LEN(HOTP_SECRET_SIZE_BYTES);
-    const size_t OTP_secret_base32_length = strnlen(OTP_secret_base32, base32_string_length_limit);
-    if (!(OTP_secret_base32 != nullptr && OTP_secret_base32_length > 0 && OTP_secret_base32_length <= base32_string_length_limit && verify_base32(OTP_secret_base32, OTP_secret_base32_length))) {
-        printf("ERR: Too long or badly formatted base32 string. It should be not longer than %lu characters.\n", base32_string_length_limit);
+    if (validate_base32_secret(OTP_secret_base32) != RET_NO_ERROR) {
+        message_print(MESSAGE_INFO, "ERR: Too long or badly formatted base32 string. It should be not longer than %lu characters.\n", (unsigned long) BASE32_LEN(HOTP_SECRET_SIZE_BYTES));
         return RET_BADLY_FORMATTED_BASE32_STRING;
     }
 
     if (dev->connection_type == CONNECTION_CCID) {
 #ifdef CCID_AUTHENTICATE
-        if (strnlen(admin_PIN, 30) > 0) {
+        if (admin_PIN != nullptr && strnlen(admin_PIN, 30) > 0) {
             set_pin_ccid(dev, admin_PIN);
             check_ret(authenticate_ccid(dev, admin_PIN), RET_WRONG_PIN);
         }
@@ -78,14 +99,14 @@ int set_secret_on_device(struct Device *dev, const char *OTP_secret_base32, cons
 
 
     //Decode base32 to binary
-    uint8_t binary_secret_buf[HOTP_SECRET_SIZE_BYTES] = {0};//handling 40 bytes -> 320 bits
+    uint8_t binary_secret_buf[BASE32_DECODE_SIZE(BASE32_LEN(HOTP_SECRET_SIZE_BYTES))] = {0};//handling 40 bytes -> 320 bits
     const size_t decoded_length = base32_decode((const unsigned char *) OTP_secret_base32, binary_secret_buf);
     rassert(decoded_length <= HOTP_SECRET_SIZE_BYTES);
 
     rassert(dev->connection_type == CONNECTION_HID);
     //Write binary secret to the Device's HOTP#3 slot
-    //But authenticate first
-    res = authenticate_admin(dev, admin_PIN, dev->admin_temporary_password);
+    //But authenticate first, or reuse the open session
+    res = session_authenticate_admin(dev, admin_PIN);
     if (res != RET_NO_ERROR) { return res; }
 
     //going on with Pro v0.8 write protocol
@@ -132,6 +153,15 @@ int set_secret_on_device(struct Device *dev, const char *OTP_secret_base32, cons
     return RET_NO_ERROR;
 }
 
+int set_secret_on_device(struct Device *dev, const char *OTP_secret_base32, const char *admin_PIN, const uint64_t hotp_counter) {
+    const int res = set_secret_on_device_impl(dev, OTP_secret_base32, admin_PIN, hotp_counter);
+    if (res == dev_wrong_password || res == not_authorized) {
+        // the temporary password is not accepted anymore
+        session_end(dev);
+    }
+    return res;
+}
+
 #define MAX_NUMBERS_DIGITS (30)
 /**
  * Safe strtol - with copying and terminating string before conversion
@@ -153,6 +183,30 @@ bool validate_number(const char *buf) {
     return true;
 }
 
+int validate_hotp_code(const char *HOTP_code_to_verify) {
+    if (HOTP_code_to_verify == nullptr || HOTP_code_to_verify[0] == '\0' || !validate_number(HOTP_code_to_verify)) {
+        return RET_BADLY_FORMATTED_HOTP_CODE;
+    }
+    const long conversion_results = strtol10_s(HOTP_code_to_verify);
+    if (conversion_results < HOTP_MIN_INT || conversion_results >= HOTP_MAX_INT) return RET_BADLY_FORMATTED_HOTP_CODE;
+    return RET_NO_ERROR;
+}
+
+int validate_counter(const char *counter_string, uint64_t *counter) {
+    rassert(counter != nullptr);
+    // the counter is sent to the devices as a 32-bit value
+    const size_t len = strnlen(counter_string, MAX_NUMBERS_DIGITS + 1);
+    if (len == 0 || len > 10 || !validate_number(counter_string)) {
+        return RET_INVALID_PARAMS;
+    }
+    const unsigned long long value = strtoull(counter_string, NULL, 10);
+    if (value >= 0xFFFFFFFF) {
+        return RET_INVALID_PARAMS;
+    }
+    *counter = value;
+    return RET_NO_ERROR;
+}
+
 int check_code_on_device_ccid(struct Device *dev, uint32_t HOTP_code_to_verify) {
     rassert(dev->connection_type == CONNECTION_CCID);
     int res = verify_code_ccid(dev, HOTP_code_to_verify);
@@ -181,15 +235,20 @@ int check_code_on_device_ccid(struct Device *dev, uint32_t HOTP_code_to_verify)
     return res;
 }
 
-int check_code_on_device(struct Device *dev, const char *HOTP_code_to_verify) {
+int check_code_on_device_detailed(struct Device *dev, const char *HOTP_code_to_verify, struct VerifyDetails *details) {
     int res;
     cmd_query_verify_code verify_code = {};
-    if (!validate_number(HOTP_code_to_verify)) return RET_BADLY_FORMATTED_HOTP_CODE;
+    details->drift = VERIFY_DRIFT_UNKNOWN;
+    details->latency_us = 0;
+    if (validate_hotp_code(HOTP_code_to_verify) != RET_NO_ERROR) return RET_BADLY_FORMATTED_HOTP_CODE;
     const long conversion_results = strtol10_s(HOTP_code_to_verify);
-    if (conversion_results < HOTP_MIN_INT || conversion_results >= HOTP_MAX_INT) return RET_BADLY_FORMATTED_HOTP_CODE;
+    const int64_t start = monotonic_us();
 
     if (dev->connection_type == CONNECTION_CCID) {
-        return check_code_on_device_ccid(dev, conversion_results);
+        // the Secrets App does not tell, which counter value matched
+        res = check_code_on_device_ccid(dev, conversion_results);
+        details->latency_us = monotonic_us() - start;
+        return res;
     }
 
     rassert(dev->connection_type == CONNECTION_HID);
@@ -197,24 +256,34 @@ int check_code_on_device(struct Device *dev, const char *HOTP_code_to_verify) {
     res = device_send(dev, (uint8_t *) &verify_code, sizeof(verify_code), VERIFY_OTP_CODE);
     if (res != RET_NO_ERROR) return res;
     res = device_receive_buf(dev);
+    details->latency_us = monotonic_us() - start;
     if (res != RET_NO_ERROR) return res;
     if ((res = dev->packet_response.response_st.last_command_status) != 0) { return res; }
 
-#ifdef _DEBUG
-    printf("\nDevice responded: %s\n",
-           dev->packet_response.response_st.payload[0] ? "HOTP code correct!" : "HOTP code incorrect!");
-#endif
+    const bool passed = dev->packet_response.response_st.payload[0] != 0;
+    if (passed) {
+        // count of the counter values skipped before the matching one
+        details->drift = dev->packet_response.response_st.payload[1];
+    }
 
 #ifdef _DEBUG
-    const uint8_t HOTP_counters_difference = dev->packet_response.response_st.payload[1];
-    if (HOTP_counters_difference != 0) {
-        printf("\nCounters differs by %d\n", HOTP_counters_difference);
+    printf("\nDevice responded: %s\n", passed ? "HOTP code correct!" : "HOTP code incorrect!");
+    if (details->drift > 0) {
+        printf("\nCounters differs by %d\n", details->drift);
     }
 #endif
 
-    return dev->packet_response.response_st.payload[0] ? RET_VALIDATION_PASSED : RET_VALIDATION_FAILED;
+    return passed ? RET_VALIDATION_PASSED : RET_VALIDATION_FAILED;
+}
+
+int check_code_on_device(struct Device *dev, const char *HOTP_code_to_verify) {
+    struct VerifyDetails details;
+    return check_code_on_device_detailed(dev, HOTP_code_to_verify, &details);
 }
 
+// Status reads failing while the Nitrokey Pro generates the keys, before giving up
+static const struct RetryPolicy key_generation_polls = {.max_attempts = 20};
+
 int regenerate_AES_key_Pro(struct Device *dev, const char *const admin_password) {
     if (dev->dev_info.name_short != 'P' && dev->dev_info.name_short != 'L') {
         return RET_UNKNOWN_DEVICE;
@@ -236,19 +305,22 @@ int regenerate_AES_key_Pro(struct Device *dev, const char *const admin_password)
         return res;
     }
     uint8_t status = dev->packet_response.response_st.device_status;
-    usleep(1 * 1000 * 1000);
-    uint16_t errors_cnt = 20;
+    if (!deadline_sleep(dev->deadline, 1 * 1000 * 1000)) {
+        return RET_TIMEOUT;
+    }
+    int failed_polls = 0;
     while (status == 1) {
-        usleep(1 * 1000 * 1000);
-        fprintf(stderr, ".");
-        fflush(stderr);
+        if (!deadline_sleep(dev->deadline, 1 * 1000 * 1000)) {
+            return RET_TIMEOUT;
+        }
+        message_print(MESSAGE_PROGRESS, ".");
         res = device_receive_buf(dev);
         if (res != RET_NO_ERROR) {
-            errors_cnt--;
-            printf("error: %d\n", errors_cnt);
-        }
-        if (errors_cnt == 0) {
-            return res;
+            // only the status is read again, the polls are spaced already
+            if (!retry_next_attempt(dev, &key_generation_polls, "aes_key_status", COMMAND_IDEMPOTENT, res, ++failed_polls)) {
+                return res;
+            }
+            continue;
         }
         status = dev->packet_response.response_st.device_status;
     }
@@ -256,7 +328,7 @@ int regenerate_AES_key_Pro(struct Device *dev, const char *const admin_password)
     if (res != 0) {
         return RET_COMM_ERROR;
     }
-    printf("Please reconnect your device\n");
+    message_print(MESSAGE_INFO, "Please reconnect your device\n");
     return RET_NO_ERROR;
 }
 
@@ -280,9 +352,10 @@ int regenerate_AES_key_Storage(struct Device *dev, const char *const admin_passw
     }
     uint8_t status = dev->packet_response.response_st.storage_status.device_status;
     while (status == NK_STORAGE_BUSY) {
-        usleep(100 * 1000);
-        fprintf(stderr, ".");
-        fflush(stderr);
+        if (!deadline_sleep(dev->deadline, 100 * 1000)) {
+            return RET_TIMEOUT;
+        }
+        message_print(MESSAGE_PROGRESS, ".");
         res = device_receive_buf(dev);
         if (res != RET_NO_ERROR)
             return res;
@@ -296,6 +369,8 @@ int regenerate_AES_key_Storage(struct Device *dev, const char *const admin_passw
 }
 
 int regenerate_AES_key(struct Device *dev, const char *const admin_password) {
+    // new keys invalidate the authentication state on the device
+    session_end(dev);
     switch (dev->dev_info.name_short) {
         case 'S': {
             return regenerate_AES_key_Storage(dev, admin_password);
@@ -35,8 +35,30 @@ static const int NK_STORAGE_BUSY = 2;
 
 int set_secret_on_device(struct Device *dev, const char *OTP_secret_base32, const char *admin_PIN, const uint64_t hotp_counter);
 int check_code_on_device(struct Device *dev, const char *HOTP_code_to_verify);
+
+#define VERIFY_DRIFT_UNKNOWN (-1)
+
+// Verification details, for following the counters of the devices over time
+struct VerifyDetails {
+    // Count of the counter values the device skipped to find the matching code, 0 when it was the expected one.
+    // VERIFY_DRIFT_UNKNOWN for the failed checks, and on the Nitrokey 3, which does not report it.
+    int drift;
+    // time spent on the exchange with the device
+    int64_t latency_us;
+};
+
+// check_code_on_device(), which reports the counter drift and the latency as well
+int check_code_on_device_detailed(struct Device *dev, const char *HOTP_code_to_verify, struct VerifyDetails *details);
 bool verify_base32(const char *string, size_t len);
 
+// Argument checks, done without touching the device. Return RET_NO_ERROR for the valid arguments.
+int validate_hotp_code(const char *HOTP_code_to_verify);
+int validate_base32_secret(const char *OTP_secret_base32);
+// Checks the length against the longest PIN of all supported devices
+int validate_pin(const char *PIN);
+// Parse the initial HOTP counter, a decimal number below 2^32-1
+int validate_counter(const char *counter_string, uint64_t *counter);
+
 long strtol10_s(const char *string);
 
 int regenerate_AES_key(struct Device *dev, const char *const admin_password);
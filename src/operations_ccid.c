@@ -22,8 +22,11 @@
 #include "operations_ccid.h"
 #include "base32.h"
 #include "ccid.h"
+#include "ctaphid.h"
 #include "device.h"
+#include "min.h"
 #include "return_codes.h"
+#include "session.h"
 #include "settings.h"
 #include "tlv.h"
 #include "utils.h"
@@ -31,51 +34,44 @@
 #include <stdlib.h>
 #include <string.h>
 
+// Key TLV value: the kind and algorithm, the digits, and the secret decoded in place
+#define KEY_TLV_SIZE (2 + BASE32_DECODE_SIZE(BASE32_LEN(HOTP_SECRET_SIZE_BYTES)))
 
-int nk3_reset(struct Device *dev, const char *new_pin) {
-    libusb_device *usb_dev;
-    struct libusb_device_descriptor usb_desc;
-
-    if (!dev->mp_devhandle_ccid) {
-        // Not an NK3
-        printf("No Nitrokey 3 found. No operation performed\n");
-        return RET_NO_ERROR;
-    }
-
-    usb_dev = libusb_get_device(dev->mp_devhandle_ccid);
-
-    int r = libusb_get_device_descriptor(usb_dev, &usb_desc);
-
-    if (r < 0) {
-        return r;
-    }
 
+// The identifiers are taken on connecting, over libusb and PC/SC alike
+static bool connected_to_nk3(const struct Device *dev) {
+    return dev->connection_type == CONNECTION_CCID &&
+           dev->dev_info.vid == NITROKEY_USB_VID && dev->dev_info.pid == NITROKEY_3_USB_PID;
+}
 
-    if (usb_desc.idVendor != NITROKEY_USB_VID || usb_desc.idProduct != NITROKEY_3_USB_PID) {
-        printf("No Nitrokey 3 found. No operation performed\n");
+int nk3_reset(struct Device *dev, const char *new_pin) {
+    if (!connected_to_nk3(dev)) {
+        message_print(MESSAGE_INFO, "No Nitrokey 3 found. No operation performed\n");
         return RET_NO_ERROR;
     }
+    int r;
 
 
-    uint8_t buf[10];
+    // the reset removes the PIN along with the verified state
+    session_end(dev);
     // encode
-    uint32_t icc_actual_length = iso7816_compose(buf, sizeof buf, Ins_Reset, 0xDE, 0xAD, 0, 0, NULL, 0);
-
-    // encode ccid wrapper
-    icc_actual_length = icc_compose(dev->ccid_buffer_out, sizeof dev->ccid_buffer_out,
-                                    0x6F, icc_actual_length,
-                                    0, 0, 0, buf);
+    uint32_t icc_actual_length = icc_pack_apdu_for_sending(&dev->ccid_buffer_out, Ins_Reset, 0xDE, 0xAD, 0);
+    if (icc_actual_length == 0) {
+        return RET_NO_MEMORY;
+    }
     // send
     IccResult iccResult;
-    r = ccid_process_single(dev->mp_devhandle_ccid, dev->ccid_buffer_in, sizeof dev->ccid_buffer_in,
-                            dev->ccid_buffer_out, icc_actual_length, &iccResult);
+    r = ccid_process_single(dev, dev->ccid_buffer_out.data, icc_actual_length, &iccResult);
     if (r != 0) {
         return r;
     }
     // check status code
     if (iccResult.data_status_code != 0x9000) {
+        dev->secrets_app.known = false;
         return 1;
     }
+    dev->secrets_app.known = true;
+    dev->secrets_app.pin_set = false;
 
     if (new_pin != NULL) {
         set_pin_ccid(dev, new_pin);
@@ -96,13 +92,15 @@ int set_pin_ccid(struct Device *dev, const char *admin_PIN) {
 
     clean_buffers(dev);
     // encode
-    uint32_t icc_actual_length = icc_pack_tlvs_for_sending(dev->ccid_buffer_out, sizeof dev->ccid_buffer_out,
+    uint32_t icc_actual_length = icc_pack_tlvs_for_sending(&dev->ccid_buffer_out,
                                                            tlvs, ARR_LEN(tlvs), Ins_SetPIN);
+    if (icc_actual_length == 0) {
+        return RET_NO_MEMORY;
+    }
 
     // send
     IccResult iccResult;
-    int r = ccid_process_single(dev->mp_devhandle_ccid, dev->ccid_buffer_in, sizeof dev->ccid_buffer_in,
-                                dev->ccid_buffer_out, icc_actual_length, &iccResult);
+    int r = ccid_process_single(dev, dev->ccid_buffer_out.data, icc_actual_length, &iccResult);
 
     if (r != 0) {
         return r;
@@ -111,30 +109,15 @@ int set_pin_ccid(struct Device *dev, const char *admin_PIN) {
     if (iccResult.data_status_code != 0x9000) {
         return 1;
     }
+    dev->secrets_app.known = true;
+    dev->secrets_app.pin_set = true;
 
     return 0;
 }
 
 int nk3_change_pin(struct Device *dev, const char *old_pin, const char *new_pin) {
-    libusb_device *usb_dev;
-    struct libusb_device_descriptor usb_desc;
-
-    if (!dev->mp_devhandle_ccid) {
-        printf("No Nitrokey 3 found. No operation performed\n");
-        return RET_NO_ERROR;
-    }
-
-    usb_dev = libusb_get_device(dev->mp_devhandle_ccid);
-
-    int r = libusb_get_device_descriptor(usb_dev, &usb_desc);
-
-    if (r < 0) {
-        return r;
-    }
-
-
-    if (usb_desc.idVendor != NITROKEY_USB_VID || usb_desc.idProduct != NITROKEY_3_USB_PID) {
-        printf("No Nitrokey 3 found. No operation performed\n");
+    if (!connected_to_nk3(dev)) {
+        message_print(MESSAGE_INFO, "No Nitrokey 3 found. No operation performed\n");
         return RET_NO_ERROR;
     }
 
@@ -152,13 +135,17 @@ int nk3_change_pin(struct Device *dev, const char *old_pin, const char *new_pin)
                     .v_str = new_pin,
             },
     };
+    // the session was opened with the old PIN
+    session_end(dev);
     // encode
-    uint32_t icc_actual_length = icc_pack_tlvs_for_sending(dev->ccid_buffer_out, sizeof dev->ccid_buffer_out,
+    uint32_t icc_actual_length = icc_pack_tlvs_for_sending(&dev->ccid_buffer_out,
                                                            tlvs, ARR_LEN(tlvs), Ins_ChangePIN);
+    if (icc_actual_length == 0) {
+        return RET_NO_MEMORY;
+    }
     // send
     IccResult iccResult;
-    r = ccid_process_single(dev->mp_devhandle_ccid, dev->ccid_buffer_in, sizeof dev->ccid_buffer_in,
-                            dev->ccid_buffer_out, icc_actual_length, &iccResult);
+    int r = ccid_process_single(dev, dev->ccid_buffer_out.data, icc_actual_length, &iccResult);
     if (r != 0) {
         return r;
     }
@@ -183,12 +170,14 @@ int authenticate_ccid(struct Device *dev, const char *admin_PIN) {
 
     clean_buffers(dev);
     // encode
-    uint32_t icc_actual_length = icc_pack_tlvs_for_sending(dev->ccid_buffer_out, sizeof dev->ccid_buffer_out,
+    uint32_t icc_actual_length = icc_pack_tlvs_for_sending(&dev->ccid_buffer_out,
                                                            tlvs, ARR_LEN(tlvs), Ins_VerifyPIN);
+    if (icc_actual_length == 0) {
+        return RET_NO_MEMORY;
+    }
     // send
     IccResult iccResult;
-    int r = ccid_process_single(dev->mp_devhandle_ccid, dev->ccid_buffer_in, sizeof dev->ccid_buffer_in,
-                                dev->ccid_buffer_out, icc_actual_length, &iccResult);
+    int r = ccid_process_single(dev, dev->ccid_buffer_out.data, icc_actual_length, &iccResult);
     if (r != 0) {
         return r;
     }
@@ -199,6 +188,9 @@ int authenticate_ccid(struct Device *dev, const char *admin_PIN) {
         return RET_WRONG_PIN;
     }
     if (iccResult.data_status_code == 0x6982) {
+        // PIN is not set
+        dev->secrets_app.known = true;
+        dev->secrets_app.pin_set = false;
         return RET_SECURITY_STATUS_NOT_SATISFIED;
     }
     if (iccResult.data_status_code != 0x9000) {
@@ -212,33 +204,40 @@ int authenticate_ccid(struct Device *dev, const char *admin_PIN) {
 // Attempt to authenticate with admin_PIN. If the PIN is not set (status code 0x6982), create the PIN
 // with the given value
 int authenticate_or_set_ccid(struct Device *dev, const char *admin_PIN) {
+    if (dev->secrets_app.known && !dev->secrets_app.pin_set) {
+        // the verification would fail on the missing PIN - set it right away
+        check_ret(set_pin_ccid(dev, admin_PIN), RET_SECURITY_STATUS_NOT_SATISFIED);
+        return authenticate_ccid(dev, admin_PIN);
+    }
     int r = authenticate_ccid(dev, admin_PIN);
     if (r == RET_SECURITY_STATUS_NOT_SATISFIED) {
         check_ret(set_pin_ccid(dev, admin_PIN), RET_SECURITY_STATUS_NOT_SATISFIED);
         return authenticate_ccid(dev, admin_PIN);
     }
 
-    return RET_NO_ERROR;
+    return r;
 }
 
 
-int delete_secret_on_device_ccid(struct Device *dev) {
+static int delete_credential_ccid(struct Device *dev, const char *name) {
     TLV tlvs[] = {
             {
                     .tag = Tag_CredentialId,
-                    .length = SLOT_NAME_LEN,
+                    .length = strlen(name),
                     .type = 'S',
-                    .v_str = SLOT_NAME,
+                    .v_str = name,
             }};
 
     clean_buffers(dev);
     // encode
-    uint32_t icc_actual_length = icc_pack_tlvs_for_sending(dev->ccid_buffer_out, sizeof dev->ccid_buffer_out,
+    uint32_t icc_actual_length = icc_pack_tlvs_for_sending(&dev->ccid_buffer_out,
                                                            tlvs, ARR_LEN(tlvs), Ins_Delete);
+    if (icc_actual_length == 0) {
+        return RET_NO_MEMORY;
+    }
     // send
     IccResult iccResult;
-    int r = ccid_process_single(dev->mp_devhandle_ccid, dev->ccid_buffer_in, sizeof dev->ccid_buffer_in,
-                                dev->ccid_buffer_out, icc_actual_length, &iccResult);
+    int r = ccid_process_single(dev, dev->ccid_buffer_out.data, icc_actual_length, &iccResult);
     if (r != 0) {
         return r;
     }
@@ -252,11 +251,60 @@ int delete_secret_on_device_ccid(struct Device *dev) {
     return r;
 }
 
+int delete_secret_on_device_ccid(struct Device *dev) {
+    return delete_credential_ccid(dev, SLOT_NAME);
+}
+
+// Put, which the firmware without overwrite support refused with OperationBlocked for the existing credential,
+// is sent again after deleting it. On the other errors the credential is left as it is.
+static bool put_refused_overwrite(uint16_t status_code) {
+    return status_code == 0x6983;
+}
+
+// Result of Put by its status code
+static int put_result(struct Device *dev, uint16_t status_code) {
+    if (status_code == 0x6a82) {
+        return RET_NO_PIN_ATTEMPTS;
+    }
+    if (status_code == 0x6982) {
+        session_end(dev);
+        return RET_SECURITY_STATUS_NOT_SATISFIED;
+    }
+    if (status_code != 0x9000) {
+        return RET_VALIDATION_FAILED;
+    }
+    return RET_NO_ERROR;
+}
+
+// Send Put with the given credential, and return the status code of its response
+static int put_credential_ccid(struct Device *dev, TLV *tlvs, int tlvs_count, uint16_t *status_code) {
+    clean_buffers(dev);
+    // encode
+    uint32_t icc_actual_length = icc_pack_tlvs_for_sending(&dev->ccid_buffer_out,
+                                                           tlvs, tlvs_count, Ins_Put);
+    if (icc_actual_length == 0) {
+        return RET_NO_MEMORY;
+    }
+
+    // send
+    IccResult iccResult;
+    int r = ccid_process_single(dev, dev->ccid_buffer_out.data, icc_actual_length, &iccResult);
+    if (r != 0) {
+        return r;
+    }
+    *status_code = iccResult.data_status_code;
+    return RET_NO_ERROR;
+}
+
+// The write takes as few exchanges as possible: Put alone within an open session, VerifyPIN and Put with the PIN set,
+// and SetPIN, VerifyPIN and Put on the first use. The credential is deleted only, if Put refuses to overwrite it.
 int set_secret_on_device_ccid(struct Device *dev, const char *admin_PIN, const char *OTP_secret_base32, const uint64_t hotp_counter) {
     // Decode base32 secret
-    uint8_t binary_secret_buf[HOTP_SECRET_SIZE_BYTES + 2] = {0};
-    const size_t decoded_length = base32_decode((const unsigned char *) OTP_secret_base32, binary_secret_buf + 2) + 2;
-    rassert(decoded_length <= HOTP_SECRET_SIZE_BYTES);
+    uint8_t binary_secret_buf[KEY_TLV_SIZE] = {0};
+    const size_t secret_length = base32_decode((const unsigned char *) OTP_secret_base32, binary_secret_buf + 2);
+    // the 2 bytes of the kind and digits come on top of the secret
+    rassert(secret_length <= HOTP_SECRET_SIZE_BYTES);
+    const size_t decoded_length = secret_length + 2;
 
     binary_secret_buf[0] = Kind_HotpReverse | Algo_Sha1;
     binary_secret_buf[1] = (HOTP_CODE_USE_8_DIGITS) ? 8 : 6;
@@ -267,18 +315,14 @@ int set_secret_on_device_ccid(struct Device *dev, const char *admin_PIN, const c
     rassert(hotp_counter < 0xFFFFFFFF);
     uint32_t initial_counter_value = hotp_counter;
 
-    int r = delete_secret_on_device_ccid(dev);
-    if (r != 0) {
+    // authenticate with the PIN, or reuse the open session
+    int r = session_authenticate_admin(dev, admin_PIN);
+    if (r == RET_SESSION_EXPIRED) {
         return r;
     }
-
-#ifdef CCID_SECRETS_AUTHENTICATE_OR_CREATE_PIN
-    if (strnlen(admin_PIN, 30) > 0) {
-        if (authenticate_or_set_ccid(dev, admin_PIN) != RET_NO_ERROR) {
-            return RET_SECURITY_STATUS_NOT_SATISFIED;
-        }
+    if (r != RET_NO_ERROR) {
+        return RET_SECURITY_STATUS_NOT_SATISFIED;
     }
-#endif
     TLV tlvs[] = {
             {
                     .tag = Tag_CredentialId,
@@ -306,33 +350,133 @@ int set_secret_on_device_ccid(struct Device *dev, const char *admin_PIN, const c
             },
     };
 
+    uint16_t status_code = 0;
+    r = put_credential_ccid(dev, tlvs, ARR_LEN(tlvs), &status_code);
+    if (r != RET_NO_ERROR) {
+        return r;
+    }
+    if (put_refused_overwrite(status_code)) {
+        // the existing credential was not overwritten - delete it and try again
+        r = delete_secret_on_device_ccid(dev);
+        if (r != 0) {
+            return r;
+        }
+        r = put_credential_ccid(dev, tlvs, ARR_LEN(tlvs), &status_code);
+        if (r != RET_NO_ERROR) {
+            return r;
+        }
+    }
 
-    clean_buffers(dev);
-    // encode
-    uint32_t icc_actual_length = icc_pack_tlvs_for_sending(dev->ccid_buffer_out, sizeof dev->ccid_buffer_out,
-                                                           tlvs, ARR_LEN(tlvs), Ins_Put);
+    return put_result(dev, status_code);
+}
 
-    // send
-    IccResult iccResult;
-    r = ccid_process_single(dev->mp_devhandle_ccid, dev->ccid_buffer_in, sizeof dev->ccid_buffer_in,
-                            dev->ccid_buffer_out, icc_actual_length, &iccResult);
+/**
+ * Encode the credential for Put. The decoded secret is kept in key, and the properties in properties,
+ * which the TLVs point to. Returns the count of the TLVs, the initial counter is left out for TOTP.
+ */
+static int credential_tlvs(const struct Credential *credential, uint8_t key[KEY_TLV_SIZE],
+                           uint8_t properties[2], TLV tlvs[4]) {
+    const size_t decoded_length = base32_decode((const unsigned char *) credential->secret, key + 2);
+    rassert(decoded_length <= HOTP_SECRET_SIZE_BYTES);
+    key[0] = credential->kind | credential->algorithm;
+    key[1] = credential->digits;
+    properties[0] = Tag_Properties;
+    properties[1] = credential->touch ? 0x02 : 0x00;
+
+    tlvs[0] = (TLV){.tag = Tag_CredentialId, .length = strlen(credential->name), .type = 'S', .v_str = credential->name};
+    tlvs[1] = (TLV){.tag = Tag_Key, .length = decoded_length + 2, .type = 'R', .v_data = key};
+    tlvs[2] = (TLV){.tag = Tag_Properties, .length = 2, .type = 'B', .v_data = properties};
+    if (credential->kind == Kind_Totp) {
+        return 3;
+    }
+    tlvs[3] = (TLV){.tag = Tag_InitialCounter, .length = 4, .type = 'I', .v_raw = credential->counter};
+    return 4;
+}
 
+// The Put of the credential, which overwrite was refused, is sent again after deleting it
+static int put_again(struct Device *dev, const struct Credential *credential, uint16_t *status_code) {
+    uint8_t key[KEY_TLV_SIZE] = {0};
+    uint8_t properties[2];
+    TLV tlvs[4];
+    const int tlvs_count = credential_tlvs(credential, key, properties, tlvs);
+    int r = delete_credential_ccid(dev, credential->name);
+    if (r == 0) {
+        r = put_credential_ccid(dev, tlvs, tlvs_count, status_code);
+    }
+    secure_zero(key, sizeof key);
+    return r;
+}
 
-    if (r != 0) {
-        return r;
+int set_credentials_on_device_ccid(struct Device *dev, const char *admin_PIN, const struct Credential credentials[],
+                                   size_t count, int results[]) {
+    if (!connected_to_nk3(dev)) {
+        message_print(MESSAGE_INFO, "No Nitrokey 3 found. No operation performed\n");
+        return RET_UNKNOWN_DEVICE;
     }
-    // check status code
-    if (iccResult.data_status_code == 0x6a82) {
-        return RET_NO_PIN_ATTEMPTS;
+    for (size_t i = 0; i < count; ++i) {
+        results[i] = RET_SECURITY_STATUS_NOT_SATISFIED;
     }
-    if (iccResult.data_status_code == 0x6982) {
-        return RET_SECURITY_STATUS_NOT_SATISFIED;
+    int r = session_authenticate_admin(dev, admin_PIN);
+    if (r == RET_SESSION_EXPIRED) {
+        return r;
     }
-    if (iccResult.data_status_code != 0x9000) {
-        return RET_VALIDATION_FAILED;
+    if (r != RET_NO_ERROR) {
+        return RET_SECURITY_STATUS_NOT_SATISFIED;
     }
 
-    return RET_NO_ERROR;
+    int first_error = RET_NO_ERROR;
+    for (size_t first = 0; first < count; first += CCID_BATCH_MAX_MESSAGES) {
+        const int batch_count = (int) min(count - first, CCID_BATCH_MAX_MESSAGES);
+        // the Puts are sent back to back, without waiting for each response when pipelining is allowed
+        clean_buffers(dev);
+        uint32_t length = 0;
+        for (int i = 0; i < batch_count; ++i) {
+            uint8_t key[KEY_TLV_SIZE] = {0};
+            uint8_t properties[2];
+            TLV tlvs[4];
+            const int tlvs_count = credential_tlvs(&credentials[first + i], key, properties, tlvs);
+            length = icc_append_tlvs(&dev->ccid_buffer_out, length, tlvs, tlvs_count, Ins_Put);
+            secure_zero(key, sizeof key);
+            if (length == 0) {
+                return RET_NO_MEMORY;
+            }
+        }
+        IccResult batch_results[CCID_BATCH_MAX_MESSAGES] = {};
+        r = ccid_process_batch(dev, dev->ccid_buffer_out.data, length, batch_results, batch_count);
+        if (r != 0) {
+            for (size_t i = first; i < count; ++i) {
+                results[i] = r;
+            }
+            return r;
+        }
+        // the results point to the input buffer, which is reused by a repeated Put
+        uint16_t status_codes[CCID_BATCH_MAX_MESSAGES] = {};
+        for (int i = 0; i < batch_count; ++i) {
+            status_codes[i] = batch_results[i].data_status_code;
+        }
+
+        for (int i = 0; i < batch_count; ++i) {
+            const struct Credential *credential = &credentials[first + i];
+            if (put_refused_overwrite(status_codes[i])) {
+                r = put_again(dev, credential, &status_codes[i]);
+                if (r != RET_NO_ERROR) {
+                    for (size_t j = first + i; j < count; ++j) {
+                        results[j] = r;
+                    }
+                    return r;
+                }
+            }
+            results[first + i] = put_result(dev, status_codes[i]);
+            if (results[first + i] != RET_NO_ERROR && first_error == RET_NO_ERROR) {
+                first_error = results[first + i];
+            }
+        }
+        if (first_error == RET_SECURITY_STATUS_NOT_SATISFIED) {
+            // the PIN is not verified anymore, the next Puts would be refused as well
+            return first_error;
+        }
+    }
+    return first_error;
 }
 
 int verify_code_ccid(struct Device *dev, const uint32_t code_to_verify) {
@@ -356,13 +500,15 @@ int verify_code_ccid(struct Device *dev, const uint32_t code_to_verify) {
 
     clean_buffers(dev);
     // encode
-    uint32_t icc_actual_length = icc_pack_tlvs_for_sending(dev->ccid_buffer_out, sizeof dev->ccid_buffer_out,
+    uint32_t icc_actual_length = icc_pack_tlvs_for_sending(&dev->ccid_buffer_out,
                                                            tlvs, ARR_LEN(tlvs), Ins_VerifyCode);
+    if (icc_actual_length == 0) {
+        return RET_NO_MEMORY;
+    }
 
     // send
     IccResult iccResult;
-    r = ccid_process_single(dev->mp_devhandle_ccid, dev->ccid_buffer_in, sizeof dev->ccid_buffer_in,
-                            dev->ccid_buffer_out, icc_actual_length, &iccResult);
+    r = ccid_process_single(dev, dev->ccid_buffer_out.data, icc_actual_length, &iccResult);
     if (r != 0) {
         return r;
     }
@@ -379,102 +525,65 @@ int verify_code_ccid(struct Device *dev, const uint32_t code_to_verify) {
     return RET_VALIDATION_PASSED;
 }
 
-int status_ccid(libusb_device_handle *handle, struct FullResponseStatus *full_response) {
+int status_ccid(struct Device *dev, struct FullResponseStatus *full_response) {
     rassert(full_response != NULL);
     struct ResponseStatus *response = &full_response->response_status;
-    rassert(handle != NULL);
-    uint8_t buf[1024] = {};
+    rassert(dev != NULL);
+    rassert(dev->connection_type == CONNECTION_CCID);
     IccResult iccResult = {};
     bool pin_counter_is_error = false;
     int r;
-    libusb_device *usb_dev;
-    struct libusb_device_descriptor usb_desc;
-
-    usb_dev = libusb_get_device(handle);
-
-    r = libusb_get_device_descriptor(usb_dev, &usb_desc);
-
-    if (r < 0) {
-        return r;
-    }
 
-
-    if (usb_desc.idVendor == NITROKEY_USB_VID || usb_desc.idProduct == NITROKEY_3_USB_PID) {
+    if (connected_to_nk3(dev)) {
         full_response->device_type = Nk3;
-    } else if (usb_desc.idVendor == NITROKEY_USB_VID || usb_desc.idProduct == NITROKEY_PRO_USB_PID) {
-        full_response->device_type = NkPro2;
-    } else if (usb_desc.idVendor == NITROKEY_USB_VID || usb_desc.idProduct == NITROKEY_STORAGE_USB_PID) {
-        full_response->device_type = NkStorage;
-    } else if (usb_desc.idVendor == LIBREM_KEY_USB_VID || usb_desc.idProduct == LIBREM_KEY_USB_PID) {
-        full_response->device_type = LibremKey;
     }
 
-    if (full_response->device_type == Nk3) {
-        r = send_select_nk3_admin_ccid(handle, buf, sizeof buf, &iccResult);
-        if (r != RET_NO_ERROR) {
-            return r;
-        }
-
-        uint8_t data_iso[MAX_CCID_BUFFER_SIZE] = {};
-        uint32_t iso_actual_length = iso7816_compose(
-                data_iso, sizeof data_iso,
-                0x61, 0, 0, 0, 4, NULL, 0);
-
-        // encode ccid wrapper
-        uint32_t icc_actual_length = icc_compose(buf, sizeof buf,
-                                                 0x6F, iso_actual_length,
-                                                 0, 0, 0, data_iso);
-        int transferred;
-        r = ccid_send(handle, &transferred, buf, icc_actual_length);
-        if (r != 0) {
-            return r;
-        }
-
-        r = ccid_receive(handle, &transferred, buf, sizeof buf);
+    if (full_response->device_type == Nk3 && dev->ccid_backend_connected == CCID_BACKEND_CTAPHID) {
+        // only the Secrets App is tunneled, the firmware version has a vendor command, and OpenPGP is out of reach
+        uint8_t version[4];
+        size_t version_length = 0;
+        r = ctaphid_call(dev, CTAPHID_VENDOR_VERSION, NULL, 0, version, sizeof version, &version_length);
         if (r != 0) {
             return r;
         }
-
-        IccResult iccResult = parse_icc_result(buf, transferred);
-        rassert(iccResult.data_status_code == 0x9000);
-        rassert(iccResult.data_len == 6);
-        full_response->nk3_extra_info.firmware_version = be32toh(*(uint32_t *) iccResult.data);
-    }
-
-    if (full_response->device_type == Nk3) {
-        r = send_select_nk3_pgp_ccid(handle, buf, sizeof buf, &iccResult);
-        if (r != RET_NO_ERROR) {
-            return r;
+        if (version_length != sizeof version) {
+            return RET_COMM_ERROR;
         }
-
-        uint8_t data_iso[MAX_CCID_BUFFER_SIZE] = {};
-        uint32_t iso_actual_length = iso7816_compose(
-                data_iso, sizeof data_iso,
-                0xCA, 0, 0xC4, 0, 0xFF, NULL, 0);
-
-        // encode ccid wrapper
-        uint32_t icc_actual_length = icc_compose(buf, sizeof buf,
-                                                 0x6F, iso_actual_length,
-                                                 0, 0, 0, data_iso);
-        int transferred;
-        r = ccid_send(handle, &transferred, buf, icc_actual_length);
+        full_response->nk3_extra_info.firmware_version = load_be32(version);
+    } else if (full_response->device_type == Nk3) {
+        // the admin and OpenPGP status queries do not depend on each other - exchange them at once
+        uint8_t batch[SMALL_CCID_BUFFER_SIZE] = {};
+        uint32_t batch_length = 0;
+        batch_length = icc_append_select(batch, sizeof batch, batch_length, Application_Admin);
+        batch_length = icc_append_apdu(batch, sizeof batch, batch_length, 0x61, 0, 0, 4);
+        batch_length = icc_append_select(batch, sizeof batch, batch_length, Application_Pgp);
+        batch_length = icc_append_apdu(batch, sizeof batch, batch_length, 0xCA, 0, 0xC4, 0xFF);
+        rassert(batch_length > 0);
+
+        // selecting any application resets the verified PIN state on the device
+        session_end(dev);
+        IccResult results[4] = {};
+        r = ccid_process_batch(dev, batch, batch_length, results, ARR_LEN(results));
         if (r != 0) {
             return r;
         }
 
-        r = ccid_receive(handle, &transferred, buf, sizeof buf);
-        if (r != 0) {
-            return r;
+        // the answers come from the device, which is not trusted to keep to the format
+        const IccResult *version = &results[1];
+        if (version->data_status_code != 0x9000 || version->data_len != 6) {
+            return RET_COMM_ERROR;
         }
+        full_response->nk3_extra_info.firmware_version = load_be32(version->data);
 
-        IccResult iccResult = parse_icc_result(buf, transferred);
-        rassert(iccResult.data_status_code == 0x9000);
-        rassert(iccResult.data_len == 9);
-        full_response->nk3_extra_info.pgp_user_pin_retries = iccResult.data[4];
-        full_response->nk3_extra_info.pgp_admin_pin_retries = iccResult.data[6];
+        const IccResult *pgp_status = &results[3];
+        if (pgp_status->data_status_code != 0x9000 || pgp_status->data_len != 9) {
+            return RET_COMM_ERROR;
+        }
+        full_response->nk3_extra_info.pgp_user_pin_retries = pgp_status->data[4];
+        full_response->nk3_extra_info.pgp_admin_pin_retries = pgp_status->data[6];
     }
 
-    r = send_select_ccid(handle, buf, sizeof buf, &iccResult);
+    r = send_select_ccid(dev, &iccResult);
     if (r != RET_NO_ERROR) {
         return r;
     }
@@ -484,7 +593,7 @@ int status_ccid(libusb_device_handle *handle, struct FullResponseStatus *full_re
 
     TLV counter_tlv = {};
     r = get_tlv(iccResult.data, iccResult.data_len, Tag_PINCounter, &counter_tlv);
-    if (!(r == RET_NO_ERROR && counter_tlv.tag == Tag_PINCounter)) {
+    if (!(r == RET_NO_ERROR && counter_tlv.tag == Tag_PINCounter && counter_tlv.length >= 1)) {
         // PIN counter not found - comm error (ignore) or PIN not set
         pin_counter_is_error = true;
     } else {
@@ -494,8 +603,8 @@ int status_ccid(libusb_device_handle *handle, struct FullResponseStatus *full_re
 
     TLV serial_tlv = {};
     r = get_tlv(iccResult.data, iccResult.data_len, Tag_SerialNumber, &serial_tlv);
-    if (r == RET_NO_ERROR && serial_tlv.tag == Tag_SerialNumber) {
-        response->card_serial_u32 = be32toh(*(uint32_t *) serial_tlv.v_data);
+    if (r == RET_NO_ERROR && serial_tlv.tag == Tag_SerialNumber && serial_tlv.length >= 4) {
+        response->card_serial_u32 = load_be32(serial_tlv.v_data);
     } else {
         // ignore errors - unsupported or hidden serial_tlv number
         response->card_serial_u32 = 0;
@@ -503,11 +612,11 @@ int status_ccid(libusb_device_handle *handle, struct FullResponseStatus *full_re
 
     TLV version_tlv = {};
     r = get_tlv(iccResult.data, iccResult.data_len, Tag_Version, &version_tlv);
-    if (!(r == RET_NO_ERROR && version_tlv.tag == Tag_Version)) {
+    if (!(r == RET_NO_ERROR && version_tlv.tag == Tag_Version && version_tlv.length >= 2)) {
         response->firmware_version = 0;
         return RET_COMM_ERROR;
     }
-    response->firmware_version = be16toh(*(uint16_t *) version_tlv.v_data);
+    response->firmware_version = load_be16(version_tlv.v_data);
 
     if (pin_counter_is_error == true) {
         return RET_NO_PIN_ATTEMPTS;
@@ -2,6 +2,7 @@
 #ifndef NITROKEY_HOTP_VERIFICATION_OPERATIONS_CCID_H
 #define NITROKEY_HOTP_VERIFICATION_OPERATIONS_CCID_H
 
+#include "credentials.h"
 #include "device.h"
 #include <libusb.h>
 
@@ -9,8 +10,15 @@ int set_pin_ccid(struct Device *dev, const char *admin_PIN);
 int authenticate_ccid(struct Device *dev, const char *admin_PIN);
 int authenticate_or_set_ccid(struct Device *dev, const char *admin_PIN);
 int set_secret_on_device_ccid(struct Device *dev, const char *admin_PIN, const char *OTP_secret_base32, const uint64_t hotp_counter);
+/**
+ * Write the credentials to the Secrets App in one authenticated session, with their Puts sent in batches.
+ * results gets the outcome of each credential, RET_NO_ERROR for the written ones. Returns the first failure,
+ * or the error, which stopped the writing, and RET_UNKNOWN_DEVICE for other devices than the Nitrokey 3.
+ */
+int set_credentials_on_device_ccid(struct Device *dev, const char *admin_PIN, const struct Credential credentials[],
+                                   size_t count, int results[]);
 int verify_code_ccid(struct Device *dev, const uint32_t code_to_verify);
-int status_ccid(libusb_device_handle *handle, struct FullResponseStatus *full_response);
+int status_ccid(struct Device *dev, struct FullResponseStatus *full_response);
 int nk3_change_pin(struct Device *dev, const char *old_pin, const char *new_pin);
 // new_pin can be `null`
 //
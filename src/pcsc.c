@@ -0,0 +1,223 @@
+/*
+ * Copyright (c) 2023 Nitrokey GmbH
+ *
+ * This file is part of Nitrokey HOTP verification project.
+ *
+ * Nitrokey HOTP verification is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * Nitrokey HOTP verification is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Nitrokey HOTP verification. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0
+ */
+
+#include "pcsc.h"
+#include "return_codes.h"
+#include "utils.h"
+
+#ifdef FEATURE_USE_PCSC
+
+#include "ccid.h"
+#include "min.h"
+#include "settings.h"
+#include <stdlib.h>
+#include <string.h>
+#ifdef __APPLE__
+#include <PCSC/winscard.h>
+#include <PCSC/wintypes.h>
+#else
+#include <winscard.h>
+#endif
+
+struct PcscConnection {
+    SCARDCONTEXT context;
+    SCARDHANDLE card;
+    DWORD protocol;
+    // CCID message of the last response, read by pcsc_receive() from the offset
+    uint8_t response[CCID_HEADER_SIZE + MAX_CCID_BUFFER_SIZE];
+    size_t response_length;
+    size_t response_offset;
+};
+
+bool pcsc_supported(void) {
+    return true;
+}
+
+// Lock of the reader by its name, which pcscd keeps unique among the connected readers
+static int lock_reader(struct DeviceLock *lock, const char *reader) {
+    char key[DEVICE_LOCK_KEY_SIZE];
+    device_lock_name_key(key, "pcsc", reader);
+    return device_lock_try(lock, key);
+}
+
+static char *list_readers(SCARDCONTEXT context) {
+    DWORD length = 0;
+    LONG rv = SCardListReaders(context, NULL, NULL, &length);
+    if (rv != SCARD_S_SUCCESS || length == 0) {
+        LOG("No PC/SC readers: %s\n", pcsc_stringify_error(rv));
+        return NULL;
+    }
+    char *readers = malloc(length);
+    if (readers == NULL) {
+        return NULL;
+    }
+    rv = SCardListReaders(context, NULL, readers, &length);
+    if (rv != SCARD_S_SUCCESS) {
+        LOG("No PC/SC readers: %s\n", pcsc_stringify_error(rv));
+        free(readers);
+        return NULL;
+    }
+    return readers;
+}
+
+// Connect to the card in the reader, and start the transaction
+static LONG connect_reader(struct PcscConnection *c, const char *reader) {
+    LONG rv = SCardConnect(c->context, reader, SCARD_SHARE_SHARED, SCARD_PROTOCOL_T0 | SCARD_PROTOCOL_T1,
+                           &c->card, &c->protocol);
+    if (rv != SCARD_S_SUCCESS) {
+        return rv;
+    }
+    rv = SCardBeginTransaction(c->card);
+    if (rv != SCARD_S_SUCCESS) {
+        SCardDisconnect(c->card, SCARD_LEAVE_CARD);
+    }
+    return rv;
+}
+
+int pcsc_connect(struct PcscConnection **connection, const char *reader_filter, struct DeviceLock *lock) {
+    rassert(connection != NULL);
+    rassert(reader_filter != NULL);
+    *connection = NULL;
+    struct PcscConnection *c = calloc(1, sizeof(*c));
+    if (c == NULL) {
+        return RET_NO_MEMORY;
+    }
+    LONG rv = SCardEstablishContext(SCARD_SCOPE_SYSTEM, NULL, NULL, &c->context);
+    if (rv != SCARD_S_SUCCESS) {
+        LOG("PC/SC is not available: %s\n", pcsc_stringify_error(rv));
+        free(c);
+        return RET_COMM_ERROR;
+    }
+
+    char *readers = list_readers(c->context);
+    bool connected = false, busy = false;
+    // the names are separated with NUL, and the list ends with an empty one
+    for (const char *reader = readers; reader != NULL && *reader != '\0' && !connected; reader += strlen(reader) + 1) {
+        if (strstr(reader, reader_filter) == NULL) {
+            continue;
+        }
+        if (lock_reader(lock, reader) == RET_DEVICE_BUSY) {
+            busy = true;
+            continue;
+        }
+        rv = connect_reader(c, reader);
+        connected = rv == SCARD_S_SUCCESS;
+        if (!connected) {
+            // used exclusively by a client, which does not take the locks
+            busy = busy || rv == SCARD_E_SHARING_VIOLATION;
+            LOG("Could not connect to %s: %s\n", reader, pcsc_stringify_error(rv));
+            device_lock_release(lock);
+        }
+    }
+    free(readers);
+    if (!connected) {
+        SCardReleaseContext(c->context);
+        free(c);
+        return busy ? RET_DEVICE_BUSY : RET_COMM_ERROR;
+    }
+    *connection = c;
+    return RET_NO_ERROR;
+}
+
+int pcsc_send(struct PcscConnection *c, const uint8_t *message, size_t length) {
+    rassert(c != NULL);
+    const uint8_t *apdu;
+    uint32_t apdu_length;
+    if (ccid_xfrblock_apdu(message, length, &apdu, &apdu_length) != 0) {
+        return RET_COMM_ERROR;
+    }
+
+    const SCARD_IO_REQUEST *pci = c->protocol == SCARD_PROTOCOL_T0 ? SCARD_PCI_T0 : SCARD_PCI_T1;
+    DWORD received = sizeof(c->response) - CCID_HEADER_SIZE;
+    c->response_length = 0;
+    c->response_offset = 0;
+    const LONG rv = SCardTransmit(c->card, pci, apdu, apdu_length, NULL, c->response + CCID_HEADER_SIZE, &received);
+    if (rv != SCARD_S_SUCCESS) {
+        LOG("Error sending data: %s\n", pcsc_stringify_error(rv));
+        // pcscd noticed the card or the reader gone
+        const bool removed = rv == SCARD_W_REMOVED_CARD || rv == SCARD_E_NO_SMARTCARD ||
+                             rv == SCARD_E_READER_UNAVAILABLE || rv == SCARD_E_NO_READERS_AVAILABLE;
+        return removed ? RET_CONNECTION_LOST : RET_COMM_ERROR;
+    }
+
+    ccid_datablock_header(c->response, message, 0, received);
+    c->response_length = CCID_HEADER_SIZE + received;
+    return 0;
+}
+
+int pcsc_receive(struct PcscConnection *c, uint8_t *data, int length, int *actual_length) {
+    rassert(c != NULL);
+    rassert(length >= 0);
+    *actual_length = 0;
+    if (c->response_offset == c->response_length) {
+        LOG("No response waiting to be read\n");
+        return RET_COMM_ERROR;
+    }
+    const size_t n = min((size_t) length, c->response_length - c->response_offset);
+    memmove(data, c->response + c->response_offset, n);
+    c->response_offset += n;
+    *actual_length = (int) n;
+    return 0;
+}
+
+void pcsc_disconnect(struct PcscConnection *c) {
+    if (c == NULL) {
+        return;
+    }
+    SCardEndTransaction(c->card, SCARD_LEAVE_CARD);
+    SCardDisconnect(c->card, SCARD_LEAVE_CARD);
+    SCardReleaseContext(c->context);
+    free(c);
+}
+
+#else
+
+bool pcsc_supported(void) {
+    return false;
+}
+
+int pcsc_connect(struct PcscConnection **connection, const char *reader_filter, struct DeviceLock *lock) {
+    unused(reader_filter);
+    unused(lock);
+    *connection = NULL;
+    return RET_COMM_ERROR;
+}
+
+int pcsc_send(struct PcscConnection *connection, const uint8_t *message, size_t length) {
+    unused(connection);
+    unused(message);
+    unused(length);
+    return RET_COMM_ERROR;
+}
+
+int pcsc_receive(struct PcscConnection *connection, uint8_t *data, int length, int *actual_length) {
+    unused(connection);
+    unused(data);
+    unused(length);
+    *actual_length = 0;
+    return RET_COMM_ERROR;
+}
+
+void pcsc_disconnect(struct PcscConnection *connection) {
+    unused(connection);
+}
+
+#endif
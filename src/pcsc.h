@@ -0,0 +1,55 @@
+/*
+ * Copyright (c) 2023 Nitrokey GmbH
+ *
+ * This file is part of Nitrokey HOTP verification project.
+ *
+ * Nitrokey HOTP verification is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * Nitrokey HOTP verification is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Nitrokey HOTP verification. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0
+ */
+
+#ifndef NITROKEY_HOTP_VERIFICATION_PCSC_H
+#define NITROKEY_HOTP_VERIFICATION_PCSC_H
+
+#include "device_lock.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * CCID exchanges over the PC/SC API, for the hosts where pcscd owns the Nitrokey 3 reader and its
+ * interface can not be claimed with libusb. The CCID messages composed by the core are unwrapped, their
+ * APDUs sent with SCardTransmit(), and the responses wrapped back into the CCID messages ccid_receive()
+ * expects, so the rest of the CCID path stays the same.
+ * SCardTransmit() returns once the card answers, so the touch confirmation is waited for in the call.
+ * Available when built with FEATURE_USE_PCSC, pcsc_supported() returns false otherwise.
+ */
+
+struct PcscConnection;
+
+bool pcsc_supported(void);
+/**
+ * Connect to the card in the first free reader, which name contains the filter, and start a transaction,
+ * keeping the other PC/SC clients away until disconnected. Returns RET_DEVICE_BUSY, if only the readers
+ * used by other callers were found, and RET_COMM_ERROR, if none.
+ */
+int pcsc_connect(struct PcscConnection **connection, const char *reader_filter, struct DeviceLock *lock);
+// Send the APDU of the CCID XfrBlock message, and keep its response for pcsc_receive().
+// Both return 0 on success, like the transfers of ccid.c. RET_CONNECTION_LOST means the card or the reader was removed.
+int pcsc_send(struct PcscConnection *connection, const uint8_t *message, size_t length);
+// Read the response as a CCID DataBlock message, with the slot and bSeq of the message sent
+int pcsc_receive(struct PcscConnection *connection, uint8_t *data, int length, int *actual_length);
+void pcsc_disconnect(struct PcscConnection *connection);
+
+#endif//NITROKEY_HOTP_VERIFICATION_PCSC_H
@@ -0,0 +1,304 @@
+/*
+ * Copyright (c) 2023 Nitrokey GmbH
+ *
+ * This file is part of Nitrokey HOTP verification project.
+ *
+ * Nitrokey HOTP verification is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * Nitrokey HOTP verification is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Nitrokey HOTP verification. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0
+ */
+
+#include "provision.h"
+#include "hotp.h"
+#include "min.h"
+#include "operations.h"
+#include "return_codes.h"
+#include "secret_file.h"
+#include "utils.h"
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+static const char *STATE_NAMES[] = {
+        [PROVISION_DONE] = "provisioned",
+        [PROVISION_FAILED] = "failed",
+        [PROVISION_NOT_LISTED] = "not-listed",
+        [PROVISION_NOT_ATTACHED] = "not-attached",
+};
+
+static const char *parse_manifest_line(char *line, struct ProvisionEntry *entry) {
+    char *saveptr = NULL;
+    const char *fields[4] = {0};
+    const char *field = strtok_r(line, SECRET_FILE_SEPARATORS, &saveptr);
+    size_t count = 0;
+    for (; field != NULL && count < LEN_ARR(fields); ++count) {
+        fields[count] = field;
+        field = strtok_r(NULL, SECRET_FILE_SEPARATORS, &saveptr);
+    }
+    if (count != LEN_ARR(fields) || field != NULL) {
+        return "expected: <serial> <base32 secret> <counter> <admin PIN>";
+    }
+
+    char *end = NULL;
+    errno = 0;
+    const unsigned long long serial = strtoull(fields[0], &end, 0);
+    if (errno != 0 || end == fields[0] || *end != '\0' || serial == 0 || serial > UINT32_MAX || fields[0][0] == '-') {
+        return "invalid serial";
+    }
+    entry->serial = (uint32_t) serial;
+    if (validate_base32_secret(fields[1]) != RET_NO_ERROR) {
+        return "invalid base32 secret";
+    }
+    if (validate_counter(fields[2], &entry->counter) != RET_NO_ERROR) {
+        return "invalid counter";
+    }
+    if (validate_pin(fields[3]) != RET_NO_ERROR) {
+        return "invalid admin PIN";
+    }
+    strncpy(entry->secret, fields[1], sizeof(entry->secret) - 1);
+    strncpy(entry->pin, fields[3], sizeof(entry->pin) - 1);
+    return NULL;
+}
+
+static const struct ProvisionEntry *find_entry(const struct ProvisionManifest *manifest, uint32_t serial) {
+    for (size_t i = 0; i < manifest->count; ++i) {
+        if (manifest->entries[i].serial == serial) {
+            return &manifest->entries[i];
+        }
+    }
+    return NULL;
+}
+
+// Parser of the manifest lines for secret_file_load()
+static const char *parse_manifest_entry(char *line, void *entry, const void *entries, size_t count) {
+    struct ProvisionEntry *key = entry;
+    const char *error = parse_manifest_line(line, key);
+    const struct ProvisionEntry *listed = entries;
+    for (size_t i = 0; error == NULL && i < count; ++i) {
+        if (listed[i].serial == key->serial) {
+            error = "duplicate serial";
+        }
+    }
+    return error;
+}
+
+static const struct SecretFileFormat MANIFEST_FORMAT = {
+        .name = "manifest",
+        .title = "Manifest",
+        .empty_message = "Manifest %s lists no keys\n",
+        .entry_size = sizeof(struct ProvisionEntry),
+        .parse = parse_manifest_entry,
+};
+
+int provision_manifest_load(const char *path, struct ProvisionManifest *manifest) {
+    memset(manifest, 0, sizeof(*manifest));
+    void *entries = NULL;
+    const int r = secret_file_load(path, &MANIFEST_FORMAT, &entries, &manifest->count);
+    manifest->entries = entries;
+    return r;
+}
+
+void provision_manifest_free(struct ProvisionManifest *manifest) {
+    secret_entries_free(manifest->entries, manifest->count, sizeof(*manifest->entries));
+    manifest->entries = NULL;
+    manifest->count = 0;
+}
+
+// The first code the device should accept, calculated the way the connected model stores the secret
+static uint32_t first_code(const struct Device *dev, const struct ProvisionEntry *entry) {
+    uint8_t key[BASE32_DECODE_SIZE(BASE32_LEN(HOTP_SECRET_SIZE_BYTES))] = {0};
+    size_t key_length = base32_decode((const unsigned char *) entry->secret, key);
+    if (dev->connection_type == CONNECTION_HID) {
+        // the HID devices keep the first 20 bytes only
+        key_length = min(key_length, 20);
+    }
+    const uint32_t code = hotp_calculate(key, key_length, entry->counter, HOTP_CODE_USE_8_DIGITS ? 8 : 6);
+    secure_zero(key, sizeof key);
+    return code;
+}
+
+void provision_device(struct Device *dev, const struct ProvisionManifest *manifest, struct ProvisionResult *result) {
+    struct FullResponseStatus status = {0};
+    result->state = PROVISION_FAILED;
+    result->status = device_get_status(dev, &status);
+    if (result->status != RET_NO_ERROR && result->status != RET_NO_PIN_ATTEMPTS) {
+        return;
+    }
+    result->serial = status.response_status.card_serial_u32;
+    const struct ProvisionEntry *entry = find_entry(manifest, result->serial);
+    if (entry == NULL) {
+        result->state = PROVISION_NOT_LISTED;
+        result->status = RET_NOT_FOUND;
+        return;
+    }
+
+    int64_t start = stopwatch_start();
+    result->status = set_secret_on_device(dev, entry->secret, entry->pin, entry->counter);
+    result->write_ms = stopwatch_stop(start);
+    if (result->status != RET_NO_ERROR) {
+        return;
+    }
+
+    const unsigned digits = HOTP_CODE_USE_8_DIGITS ? 8 : 6;
+    char code[16];
+    snprintf(code, sizeof code, "%0*u", (int) digits, (unsigned) first_code(dev, entry));
+    start = stopwatch_start();
+    result->status = check_code_on_device(dev, code);
+    result->verify_ms = stopwatch_stop(start);
+    if (result->status == RET_VALIDATION_PASSED) {
+        result->state = PROVISION_DONE;
+        result->status = RET_NO_ERROR;
+    }
+}
+
+// Child process: take one free device, provision it, report, and keep the device until all children are done.
+// Holding the device keeps the other children from taking it again.
+static void provision_child(const struct ProvisionManifest *manifest, const struct Device *settings,
+                            int result_fd, int release_fd) {
+    struct Device *dev = malloc(sizeof(*dev));
+    struct ProvisionResult result = {0};
+    result.state = PROVISION_FAILED;
+    if (dev == NULL) {
+        result.status = RET_NO_MEMORY;
+    } else {
+        *dev = *settings;
+        const int64_t start = stopwatch_start();
+        result.status = device_connect(dev);
+        result.connect_ms = stopwatch_stop(start);
+        if (result.status == RET_NO_ERROR) {
+            provision_device(dev, manifest, &result);
+        }
+    }
+    // a write of this size to a pipe is atomic
+    const ssize_t written = write(result_fd, &result, sizeof result);
+    unused(written);
+    close(result_fd);
+
+    char c;
+    while (read(release_fd, &c, 1) < 0 && errno == EINTR) {
+    }
+    if (dev != NULL) {
+        device_disconnect(dev);
+        free(dev);
+    }
+    fflush(NULL);
+    // skip the atexit handlers of the parent
+    _exit(0);
+}
+
+// Fork a child for each of the available devices, and collect their results. Returns the count of children started.
+static size_t provision_attached(const struct ProvisionManifest *manifest, const struct Device *settings,
+                                 size_t available, struct ProvisionResult *results, size_t *results_count) {
+    int result_pipe[2], release_pipe[2];
+    if (pipe(result_pipe) != 0) {
+        return 0;
+    }
+    if (pipe(release_pipe) != 0) {
+        close(result_pipe[0]);
+        close(result_pipe[1]);
+        return 0;
+    }
+    // the children inherit the buffered output otherwise
+    fflush(NULL);
+
+    size_t started = 0;
+    for (; started < available; ++started) {
+        const pid_t pid = fork();
+        if (pid < 0) {
+            break;
+        }
+        if (pid == 0) {
+            close(result_pipe[0]);
+            close(release_pipe[1]);
+            provision_child(manifest, settings, result_pipe[1], release_pipe[0]);
+        }
+    }
+    close(result_pipe[1]);
+    close(release_pipe[0]);
+
+    struct ProvisionResult result;
+    size_t got = 0;
+    while (*results_count < started) {
+        const ssize_t r = read(result_pipe[0], (uint8_t *) &result + got, sizeof result - got);
+        if (r < 0 && errno == EINTR) {
+            continue;
+        }
+        if (r <= 0) {
+            break;
+        }
+        got += (size_t) r;
+        if (got == sizeof result) {
+            results[(*results_count)++] = result;
+            got = 0;
+        }
+    }
+    // closing the release pipe lets the children disconnect
+    close(result_pipe[0]);
+    close(release_pipe[1]);
+    for (size_t i = 0; i < started; ++i) {
+        while (wait(NULL) < 0 && errno == EINTR) {
+        }
+    }
+    return started;
+}
+
+int provision_all(const struct ProvisionManifest *manifest, const struct Device *settings,
+                  struct ProvisionResult *results, size_t results_size, size_t *results_count) {
+    *results_count = 0;
+    rassert(results_size >= manifest->count);
+    struct Device probe = *settings;
+    // a device attached after the results were sized waits for the next run
+    const size_t available = min(device_count_available(&probe), results_size - manifest->count);
+    const size_t started = available != 0 ? provision_attached(manifest, settings, available, results, results_count) : 0;
+
+    int res = started == available ? RET_NO_ERROR : RET_NO_MEMORY;
+    size_t done = 0;
+    for (size_t i = 0; i < *results_count; ++i) {
+        if (results[i].state == PROVISION_DONE) {
+            done++;
+        } else if (results[i].state == PROVISION_FAILED && res == RET_NO_ERROR) {
+            res = results[i].status;
+        }
+    }
+    for (size_t i = 0; i < manifest->count; ++i) {
+        bool attached = false;
+        for (size_t j = 0; j < *results_count && !attached; ++j) {
+            attached = results[j].serial == manifest->entries[i].serial;
+        }
+        if (!attached) {
+            results[(*results_count)++] = (struct ProvisionResult){
+                    .serial = manifest->entries[i].serial,
+                    .state = PROVISION_NOT_ATTACHED,
+                    .status = RET_NOT_FOUND,
+            };
+        }
+    }
+    if (res == RET_NO_ERROR && done == 0) {
+        res = RET_NOT_FOUND;
+    }
+    return res;
+}
+
+void provision_log_write(FILE *log, const struct ProvisionResult *results, size_t count) {
+    fprintf(log, "serial\tresult\tstatus\tconnect_ms\twrite_ms\tverify_ms\n");
+    for (size_t i = 0; i < count; ++i) {
+        const struct ProvisionResult *r = &results[i];
+        fprintf(log, "0x%X\t%s\t%s\t%lld\t%lld\t%lld\n", r->serial, STATE_NAMES[r->state],
+                res_to_error_string(r->status), (long long) r->connect_ms, (long long) r->write_ms,
+                (long long) r->verify_ms);
+    }
+    fflush(log);
+}
@@ -0,0 +1,91 @@
+/*
+ * Copyright (c) 2023 Nitrokey GmbH
+ *
+ * This file is part of Nitrokey HOTP verification project.
+ *
+ * Nitrokey HOTP verification is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * Nitrokey HOTP verification is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Nitrokey HOTP verification. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0
+ */
+
+#ifndef NITROKEY_HOTP_VERIFICATION_PROVISION_H
+#define NITROKEY_HOTP_VERIFICATION_PROVISION_H
+
+#include "base32.h"
+#include "device.h"
+#include "settings.h"
+#include <stdint.h>
+#include <stdio.h>
+
+/**
+ * Provisioning of many keys at once, from a manifest with one key per line:
+ *
+ *     <serial> <base32 secret> <counter> <admin PIN>
+ *
+ * The serial is the one printed by the id command, like 0x1A2B3C4D. Empty lines and the ones starting
+ * with # are skipped. Each attached key is handled by its own child process, so the keys are written in
+ * parallel, and the device locks make each process take a different key.
+ */
+
+struct ProvisionEntry {
+    uint32_t serial;
+    char secret[BASE32_LEN(HOTP_SECRET_SIZE_BYTES) + 1];
+    char pin[MAX_PIN_SIZE_CCID + 1];
+    uint64_t counter;
+};
+
+struct ProvisionManifest {
+    struct ProvisionEntry *entries;
+    size_t count;
+};
+
+typedef enum {
+    // the secret was written, and the device accepted the code calculated on the host
+    PROVISION_DONE,
+    PROVISION_FAILED,
+    // an attached key, which serial is not listed
+    PROVISION_NOT_LISTED,
+    // a listed key, which is not attached
+    PROVISION_NOT_ATTACHED,
+} ProvisionState;
+
+struct ProvisionResult {
+    uint32_t serial;
+    ProvisionState state;
+    // return code of the failed step
+    int status;
+    int64_t connect_ms;
+    int64_t write_ms;
+    int64_t verify_ms;
+};
+
+// Returns RET_INVALID_PARAMS and prints the line, if the manifest is malformed
+int provision_manifest_load(const char *path, struct ProvisionManifest *manifest);
+void provision_manifest_free(struct ProvisionManifest *manifest);
+
+// Provision the connected device, if its serial is in the manifest, and verify it with the first code
+void provision_device(struct Device *dev, const struct ProvisionManifest *manifest, struct ProvisionResult *result);
+
+/**
+ * Provision all available devices in parallel. Each child process connects with a copy of the settings device.
+ * Results of the attached keys come first, followed by the listed keys, which are not attached.
+ * The results array has to fit the manifest entries, the rest of it limits the count of devices provisioned.
+ */
+int provision_all(const struct ProvisionManifest *manifest, const struct Device *settings,
+                  struct ProvisionResult *results, size_t results_size, size_t *results_count);
+
+// Tab separated log, one line per result after the header
+void provision_log_write(FILE *log, const struct ProvisionResult *results, size_t count);
+
+#endif//NITROKEY_HOTP_VERIFICATION_PROVISION_H
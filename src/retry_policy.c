@@ -0,0 +1,123 @@
+/*
+ * Copyright (c) 2023 Nitrokey GmbH
+ *
+ * This file is part of Nitrokey HOTP verification project.
+ *
+ * Nitrokey HOTP verification is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * Nitrokey HOTP verification is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Nitrokey HOTP verification. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0
+ */
+
+#include "retry_policy.h"
+#include "ccid.h"
+#include "command_id.h"
+#include "device.h"
+#include "flight_recorder.h"
+#include "return_codes.h"
+#include "settings.h"
+#include "trace.h"
+#include "utils.h"
+
+const struct RetryPolicy retry_policy_default = {
+        .max_attempts = RETRY_ATTEMPTS,
+        .backoff_us = RETRY_BACKOFF_US,
+        .backoff_max_us = RETRY_BACKOFF_MAX_US,
+};
+
+const struct RetryPolicy retry_policy_none = {
+        .max_attempts = 1,
+};
+
+CommandKind retry_classify_hid_command(uint8_t command_id) {
+    switch (command_id) {
+        case GET_STATUS:
+        case READ_SLOT_NAME:
+        case READ_SLOT:
+        case GET_PASSWORD_RETRY_COUNT:
+        case GET_USER_PASSWORD_RETRY_COUNT:
+        case GET_DEVICE_STATUS:
+            return COMMAND_IDEMPOTENT;
+        default:
+            // GET_CODE and VERIFY_OTP_CODE advance the HOTP counter, the authentication uses up a PIN attempt
+            return COMMAND_NOT_IDEMPOTENT;
+    }
+}
+
+CommandKind retry_classify_ccid_message(const uint8_t *message, size_t length) {
+    if (length < CCID_HEADER_SIZE || message[0] != PC_TO_RDR_XFRBLOCK) {
+        return COMMAND_IDEMPOTENT;
+    }
+    if (length < CCID_HEADER_SIZE + 4) {
+        return COMMAND_NOT_IDEMPOTENT;
+    }
+    const uint8_t ins = message[CCID_HEADER_SIZE + 1];
+    const uint8_t p1 = message[CCID_HEADER_SIZE + 2];
+    switch (ins) {
+        case Ins_Select:
+            // CalculateAll shares the instruction code, and is not a SELECT by application identifier
+            return p1 == 0x04 ? COMMAND_IDEMPOTENT : COMMAND_NOT_IDEMPOTENT;
+        case Ins_List:
+        // the firmware version of the Nitrokey 3 admin application
+        case 0x61:
+        // OpenPGP GET DATA
+        case 0xCA:
+            return COMMAND_IDEMPOTENT;
+        default:
+            // the continuation of a response moves on to its next part, the rest changes the device state
+            return COMMAND_NOT_IDEMPOTENT;
+    }
+}
+
+bool retry_error_is_transient(int result) {
+    // the transfer failed, or a malformed or unexpected message arrived. A timeout means the deadline has passed,
+    // and a lost connection, that the device did not answer the polls.
+    return result == RET_COMM_ERROR;
+}
+
+const struct RetryPolicy *device_retry_policy(const struct Device *dev) {
+    return dev->retry_policy.max_attempts != 0 ? &dev->retry_policy : &retry_policy_default;
+}
+
+bool retry_next_attempt(struct Device *dev, const struct RetryPolicy *policy, const char *what, CommandKind kind,
+                        int result, int attempt) {
+    rassert(attempt > 0);
+    if (!retry_error_is_transient(result)) {
+        return false;
+    }
+    if (kind == COMMAND_NOT_IDEMPOTENT) {
+        LOG("Not repeating %s, which could have reached the device\n", what);
+        dev->retry_stats.refused++;
+        return false;
+    }
+    if (attempt >= policy->max_attempts) {
+        LOG("Giving up %s after %d attempts\n", what, attempt);
+        dev->retry_stats.exhausted++;
+        return false;
+    }
+    uint64_t backoff_us = policy->backoff_us;
+    for (int i = 1; i < attempt && backoff_us < policy->backoff_max_us; ++i) {
+        backoff_us *= 2;
+    }
+    if (backoff_us > policy->backoff_max_us) {
+        backoff_us = policy->backoff_max_us;
+    }
+    if (backoff_us > 0 && !deadline_sleep(dev->deadline, (int64_t) backoff_us)) {
+        dev->retry_stats.exhausted++;
+        return false;
+    }
+    dev->retry_stats.retries++;
+    TRACE_PROBE(retry, what, attempt);
+    flight_record(dev->flight_id, "retry", what, attempt, NULL, 0, 0);
+    return true;
+}
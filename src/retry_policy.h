@@ -0,0 +1,89 @@
+/*
+ * Copyright (c) 2023 Nitrokey GmbH
+ *
+ * This file is part of Nitrokey HOTP verification project.
+ *
+ * Nitrokey HOTP verification is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * Nitrokey HOTP verification is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Nitrokey HOTP verification. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0
+ */
+
+#ifndef NITROKEY_HOTP_VERIFICATION_RETRY_POLICY_H
+#define NITROKEY_HOTP_VERIFICATION_RETRY_POLICY_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct Device;
+
+/**
+ * Retries of the exchanges failing with a transient USB error, like a stalled or interrupted transfer.
+ *
+ * A command, which did not reach the device, is sent again whatever it does. Once it could have reached the
+ * device, it is sent again only when repeating it is safe: a status query or SELECT can be, a code verification
+ * cannot, as it advances the HOTP counter, and neither can a PIN check, which uses up an attempt. The error of
+ * such a command is returned instead, and the caller decides.
+ *
+ * The attempts are bounded, and spaced by a backoff doubled for each next one, within the deadline of the operation.
+ */
+
+typedef enum {
+    // repeating the command leaves the device as after the first one
+    COMMAND_IDEMPOTENT,
+    // the command changes the device state, and is sent again only if it did not reach the device
+    COMMAND_NOT_IDEMPOTENT,
+} CommandKind;
+
+struct RetryPolicy {
+    // attempts of an exchange, the first one included; 1 disables the retries
+    uint8_t max_attempts;
+    // wait before the first retry, doubled for each next one up to backoff_max_us
+    uint32_t backoff_us;
+    uint32_t backoff_max_us;
+};
+
+// Retries on the device since connecting
+struct RetryStats {
+    uint32_t retries;
+    // failures, which used up the attempts
+    uint32_t exhausted;
+    // failures not retried, as the command could have been executed and was not safe to repeat
+    uint32_t refused;
+};
+
+// RETRY_ATTEMPTS and the backoff of settings.h, used when the device has no policy set
+extern const struct RetryPolicy retry_policy_default;
+extern const struct RetryPolicy retry_policy_none;
+
+CommandKind retry_classify_hid_command(uint8_t command_id);
+// Kind of the APDU carried by the CCID message, messages without one are queries of the reader
+CommandKind retry_classify_ccid_message(const uint8_t *message, size_t length);
+// The result is an error, which trying again could get past
+bool retry_error_is_transient(int result);
+
+// The policy set for the device with device_set_retry_policy(), or the default one
+const struct RetryPolicy *device_retry_policy(const struct Device *dev);
+
+/**
+ * Decide about another attempt, after the given one failed with the result, and wait the backoff before it.
+ * Counts the retry, or the refused or exhausted failure, in dev->retry_stats.
+ * @param what name of the retried step, for the trace and the flight recorder
+ * @param attempt the failed attempt, from 1
+ * @return true, if the step is to be tried again
+ */
+bool retry_next_attempt(struct Device *dev, const struct RetryPolicy *policy, const char *what, CommandKind kind,
+                        int result, int attempt);
+
+#endif//NITROKEY_HOTP_VERIFICATION_RETRY_POLICY_H
@@ -38,6 +38,12 @@ const char *res_to_error_string(int res) {
     if (res == RET_NO_PIN_ATTEMPTS) return "Device does not show PIN attempts counter";
     if (res == RET_SLOT_NOT_CONFIGURED) return "HOTP slot is not configured";
     if (res == RET_SECURITY_STATUS_NOT_SATISFIED) return "Touch was not recognized, or there was other problem with the authentication";
+    if (res == RET_NO_MEMORY) return "Could not allocate memory for the communication buffers";
+    if (res == RET_TIMEOUT) return "Operation did not finish within the given time";
+    if (res == RET_TOUCH_REQUIRED) return "Device is waiting for the touch confirmation";
+    if (res == RET_SESSION_EXPIRED) return "Authenticated session is not open or has expired";
+    if (res == RET_DEVICE_BUSY) return "Device is used by another process";
+    if (res == RET_NOT_FOUND) return "Not found";
     return "Unknown error";
 }
 
@@ -54,5 +60,8 @@ int res_to_exit_code(int res) {
     if (res == RET_TOO_LONG_PIN) return EXIT_BAD_FORMAT;
     if (res == RET_BADLY_FORMATTED_HOTP_CODE) return EXIT_BAD_FORMAT;
     if (res == RET_CONNECTION_LOST) return EXIT_CONNECTION_LOST;
+    if (res == RET_TIMEOUT) return EXIT_TIMEOUT;
+    if (res == RET_DEVICE_BUSY) return EXIT_CONNECTION_ERROR;
+    if (res == RET_TOUCH_REQUIRED) return EXIT_TOUCH_REQUIRED;
     return EXIT_OTHER_ERROR;
 }
@@ -40,6 +40,11 @@ enum {
     RET_SECURITY_STATUS_NOT_SATISFIED,
     RET_SLOT_NOT_CONFIGURED,
     RET_NOT_FOUND,
+    RET_NO_MEMORY,
+    RET_TIMEOUT,
+    RET_TOUCH_REQUIRED,
+    RET_SESSION_EXPIRED,
+    RET_DEVICE_BUSY,
 };
 
 enum {
@@ -52,6 +57,8 @@ enum {
     EXIT_SLOT_NOT_PROGRAMMED = 6,
     EXIT_BAD_FORMAT = 7,
     EXIT_CONNECTION_LOST = 8,
+    EXIT_TIMEOUT = 9,
+    EXIT_TOUCH_REQUIRED = 10,
     EXIT_INVALID_PARAMS = 100,
 };
 
@@ -0,0 +1,116 @@
+/*
+ * Copyright (c) 2023 Nitrokey GmbH
+ *
+ * This file is part of Nitrokey HOTP verification project.
+ *
+ * Nitrokey HOTP verification is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * Nitrokey HOTP verification is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Nitrokey HOTP verification. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0
+ */
+
+#include "secret_file.h"
+#include "return_codes.h"
+#include "utils.h"
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Make room for one more entry. Not realloc(), which would leave the secrets read so far behind in the freed block.
+static int secret_entries_grow(uint8_t **entries, size_t count, size_t *allocated, size_t entry_size) {
+    if (count < *allocated) {
+        return RET_NO_ERROR;
+    }
+    const size_t grown = *allocated != 0 ? *allocated * 2 : 16;
+    uint8_t *grown_entries = malloc(grown * entry_size);
+    if (grown_entries == NULL) {
+        return RET_NO_MEMORY;
+    }
+    if (*entries != NULL) {
+        memcpy(grown_entries, *entries, count * entry_size);
+        secure_zero(*entries, count * entry_size);
+        free(*entries);
+    }
+    *entries = grown_entries;
+    *allocated = grown;
+    return RET_NO_ERROR;
+}
+
+int secret_file_load(const char *path, const struct SecretFileFormat *format, void **out_entries, size_t *out_count) {
+    *out_entries = NULL;
+    *out_count = 0;
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        printf("Could not open the %s %s: %s\n", format->name, path, strerror(errno));
+        return RET_INVALID_PARAMS;
+    }
+
+    uint8_t *entries = NULL;
+    size_t count = 0;
+    size_t allocated = 0;
+    char line[SECRET_FILE_LINE_SIZE];
+    unsigned line_number = 0;
+    const char *error = NULL;
+    int r = RET_NO_ERROR;
+    while (error == NULL && r == RET_NO_ERROR && fgets(line, sizeof line, f) != NULL) {
+        line_number++;
+        if (strchr(line, '\n') == NULL && !feof(f)) {
+            error = "line too long";
+            break;
+        }
+        const size_t skip = strspn(line, SECRET_FILE_SEPARATORS);
+        if (line[skip] == '\0' || line[skip] == '#') {
+            continue;
+        }
+
+        r = secret_entries_grow(&entries, count, &allocated, format->entry_size);
+        if (r != RET_NO_ERROR) {
+            break;
+        }
+        // parsed in place, so no copy of the secrets is left on the stack
+        uint8_t *entry = entries + count * format->entry_size;
+        memset(entry, 0, format->entry_size);
+        error = format->parse(line, entry, entries, count);
+        if (error != NULL) {
+            secure_zero(entry, format->entry_size);
+        } else {
+            count++;
+        }
+    }
+    secure_zero(line, sizeof line);
+    fclose(f);
+
+    if (r == RET_NO_ERROR && error != NULL) {
+        printf("%s %s, line %u: %s\n", format->title, path, line_number, error);
+        r = RET_INVALID_PARAMS;
+    } else if (r == RET_NO_ERROR && count == 0) {
+        printf(format->empty_message, path);
+        r = RET_INVALID_PARAMS;
+    }
+    if (r != RET_NO_ERROR) {
+        secret_entries_free(entries, count, format->entry_size);
+        return r;
+    }
+    *out_entries = entries;
+    *out_count = count;
+    return RET_NO_ERROR;
+}
+
+void secret_entries_free(void *entries, size_t count, size_t entry_size) {
+    if (entries != NULL) {
+        secure_zero(entries, count * entry_size);
+    }
+    free(entries);
+}
@@ -0,0 +1,56 @@
+/*
+ * Copyright (c) 2023 Nitrokey GmbH
+ *
+ * This file is part of Nitrokey HOTP verification project.
+ *
+ * Nitrokey HOTP verification is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * Nitrokey HOTP verification is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Nitrokey HOTP verification. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0
+ */
+
+#ifndef NITROKEY_HOTP_VERIFICATION_SECRET_FILE_H
+#define NITROKEY_HOTP_VERIFICATION_SECRET_FILE_H
+
+#include <stddef.h>
+
+/**
+ * Reader of the files listing secrets with one entry per line, like the provisioning manifest and the credentials.
+ * Empty lines and the ones starting with # are skipped. The lines and the entries are wiped before their memory
+ * is released, so the secrets are not left behind in the freed blocks.
+ */
+
+#define SECRET_FILE_LINE_SIZE 512
+#define SECRET_FILE_SEPARATORS " \t\r\n"
+
+struct SecretFileFormat {
+    // name of the file within the messages, like "manifest", and at their start, like "Manifest"
+    const char *name;
+    const char *title;
+    // printed with the path, when the file lists no entries
+    const char *empty_message;
+    size_t entry_size;
+    // Fill the zeroed entry from the line, and check it against the count of entries read before.
+    // Returns NULL, or the error printed with the line number.
+    const char *(*parse)(char *line, void *entry, const void *entries, size_t count);
+};
+
+/**
+ * Read the entries of the file to an array, released with secret_entries_free()
+ * @return RET_NO_ERROR, RET_NO_MEMORY, or RET_INVALID_PARAMS with the reason printed, if the file cannot be opened,
+ * is malformed or lists no entries
+ */
+int secret_file_load(const char *path, const struct SecretFileFormat *format, void **out_entries, size_t *out_count);
+void secret_entries_free(void *entries, size_t count, size_t entry_size);
+
+#endif//NITROKEY_HOTP_VERIFICATION_SECRET_FILE_H
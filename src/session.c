@@ -0,0 +1,80 @@
+/*
+ * Copyright (c) 2023 Nitrokey GmbH
+ *
+ * This file is part of Nitrokey HOTP verification project.
+ *
+ * Nitrokey HOTP verification is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * Nitrokey HOTP verification is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Nitrokey HOTP verification. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0
+ */
+
+#include "session.h"
+#include "dev_commands.h"
+#include "device.h"
+#include "operations_ccid.h"
+#include "return_codes.h"
+#include "settings.h"
+#include <string.h>
+
+static int authenticate_with_pin(struct Device *dev, const char *admin_PIN) {
+    if (dev->connection_type == CONNECTION_HID) {
+        return authenticate_admin(dev, admin_PIN, dev->admin_temporary_password);
+    }
+#ifdef CCID_SECRETS_AUTHENTICATE_OR_CREATE_PIN
+    if (strnlen(admin_PIN, MAX_PIN_SIZE_CCID) > 0) {
+        return authenticate_or_set_ccid(dev, admin_PIN);
+    }
+#endif
+    return RET_NO_ERROR;
+}
+
+int session_begin(struct Device *dev, const char *admin_PIN, int64_t ttl_ms) {
+    session_end(dev);
+    if (admin_PIN == NULL) {
+        return RET_INVALID_PARAMS;
+    }
+    const int res = authenticate_with_pin(dev, admin_PIN);
+    if (res != RET_NO_ERROR) {
+        session_end(dev);
+        return res;
+    }
+    dev->session.active = true;
+    dev->session.expiry = deadline_in(ttl_ms);
+    return RET_NO_ERROR;
+}
+
+void session_end(struct Device *dev) {
+    dev->session.active = false;
+    memset(dev->admin_temporary_password, 0, sizeof(dev->admin_temporary_password));
+    memset(dev->user_temporary_password, 0, sizeof(dev->user_temporary_password));
+}
+
+bool session_is_active(struct Device *dev) {
+    if (dev->session.active && deadline_expired(dev->session.expiry)) {
+        session_end(dev);
+    }
+    return dev->session.active;
+}
+
+int session_authenticate_admin(struct Device *dev, const char *admin_PIN) {
+    if (admin_PIN == NULL) {
+        return session_is_active(dev) ? RET_NO_ERROR : RET_SESSION_EXPIRED;
+    }
+    // an open session stays open, since a successful authentication refreshes its credentials
+    const int res = authenticate_with_pin(dev, admin_PIN);
+    if (res != RET_NO_ERROR) {
+        session_end(dev);
+    }
+    return res;
+}
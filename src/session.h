@@ -0,0 +1,63 @@
+/*
+ * Copyright (c) 2023 Nitrokey GmbH
+ *
+ * This file is part of Nitrokey HOTP verification project.
+ *
+ * Nitrokey HOTP verification is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * Nitrokey HOTP verification is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Nitrokey HOTP verification. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0
+ */
+
+#ifndef NITROKEY_HOTP_VERIFICATION_SESSION_H
+#define NITROKEY_HOTP_VERIFICATION_SESSION_H
+
+#include "utils.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+struct Device;
+
+/**
+ * Admin authentication, established once and reused by the following admin operations on the same connection.
+ * On HID the session holds the temporary admin password registered with FIRST_AUTHENTICATE, on CCID it stands
+ * for the verified PIN state of the Secrets App.
+ *
+ * The session ends, when:
+ * - its time to live runs out,
+ * - the device is disconnected,
+ * - any application is selected over CCID, which resets the verified state on the device,
+ * - the device reports a wrong PIN or missing authorization,
+ * - the device is reset, its PIN changed or its AES keys regenerated.
+ */
+struct Session {
+    bool active;
+    struct Deadline expiry;
+};
+
+/**
+ * Authenticate with the admin PIN and open the session. ttl_ms of 0 keeps it open until one of the other
+ * conditions ends it.
+ */
+int session_begin(struct Device *dev, const char *admin_PIN, int64_t ttl_ms);
+// Close the session, and wipe the temporary passwords
+void session_end(struct Device *dev);
+bool session_is_active(struct Device *dev);
+
+/**
+ * Authenticate before an admin operation. With the PIN given, authenticate with it, as without a session.
+ * With a NULL PIN, use the open session, or return RET_SESSION_EXPIRED, if there is none.
+ */
+int session_authenticate_admin(struct Device *dev, const char *admin_PIN);
+
+#endif//NITROKEY_HOTP_VERIFICATION_SESSION_H
@@ -37,8 +37,18 @@
 #define MAX_PIN_ATTEMPT_COUNTER_CCID 8
 #define MAX_PIN_ATTEMPT_COUNTER_HID 3
 #define MAX_PIN_SIZE_CCID 128
-#define MAX_CCID_BUFFER_SIZE 3072
+// CCID message of the longest extended-length response, joined from the parts fetched with GET RESPONSE:
+// the 10-byte header, 65536 bytes of data and the status word, followed by the header and the last bulk packet
+// of the part being received
+#define MAX_CCID_BUFFER_SIZE (10 + 65536 + 2 + 10 + 64)
 #define SMALL_CCID_BUFFER_SIZE 128
+// CCID messages sent before reading their responses. The CCID specification allows one per slot,
+// increase only for readers known to queue the commands.
+#define CCID_PIPELINE_DEPTH 1
+// Longest wait for a device used by another process, when the operation has no deadline
+#define DEVICE_ARBITRATION_TIMEOUT_MS (30 * 1000)
+// Interval of checking, whether the earlier callers have been served, or the device was released
+#define DEVICE_ARBITRATION_POLL_US (2 * 1000)
 
 // Ask for PIN, if the HOTP slot is PIN-encrypted
 // #define FEATURE_CCID_ASK_FOR_PIN_ON_ERROR
@@ -52,4 +62,16 @@
 // Allow CCID use
 #define FEATURE_USE_CCID
 
+// PC/SC readers taken for the Nitrokey 3, when connecting over PC/SC. FEATURE_USE_PCSC is set by the build.
+#define PCSC_READER_FILTER "Nitrokey 3"
+// Longest wait for a CTAPHID report of the Nitrokey 3, when the operation has no deadline
+#define CTAPHID_RESPONSE_TIMEOUT_MS (2 * 1000)
+// Events kept by the flight recorder, the oldest ones are overwritten
+#define FLIGHT_RECORDER_SIZE 256
+// Attempts of an exchange failing with a transient USB error, see retry_policy.h
+#define RETRY_ATTEMPTS 3
+// Wait before the first retry, doubled for each next one up to the maximum
+#define RETRY_BACKOFF_US (20 * 1000)
+#define RETRY_BACKOFF_MAX_US (200 * 1000)
+
 #endif//NITROKEY_HOTP_VERIFICATION_SETTINGS_H
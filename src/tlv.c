@@ -55,7 +55,7 @@ int process_TLV(uint8_t *buf, const TLV *t) {
             i += t->length;
             break;
         default:
-            printf("invalid op %d \n", t->type);
+            message_print(MESSAGE_INFO, "invalid op %d \n", t->type);
             rassert(false);
             break;
     }
@@ -64,6 +64,15 @@ int process_TLV(uint8_t *buf, const TLV *t) {
 }
 
 
+size_t tlvs_encoded_length(const TLV *data, int count) {
+    size_t length = 0;
+    for (int i = 0; i < count; ++i) {
+        // raw bytes are copied without the tag and length
+        length += (data[i].type == 'B' ? 0 : 2) + data[i].length;
+    }
+    return length;
+}
+
 int process_all(uint8_t *buf, TLV *data, int count) {
     int idx = 0;
     int idx_old = 0;
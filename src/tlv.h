@@ -39,6 +39,8 @@ typedef struct {
 } TLV;
 
 int process_all(uint8_t *buf, TLV data[], int count);
+// Number of bytes process_all() will write for the given TLVs
+size_t tlvs_encoded_length(const TLV data[], int count);
 int get_tlv(uint8_t *buf, size_t buf_size, int tag, TLV *out_TLV);
 
 #endif// NITROKEY_HOTP_VERIFICATION_TLV_H
\ No newline at end of file
@@ -0,0 +1,63 @@
+/*
+ * Copyright (c) 2023 Nitrokey GmbH
+ *
+ * This file is part of Nitrokey HOTP verification project.
+ *
+ * Nitrokey HOTP verification is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * Nitrokey HOTP verification is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Nitrokey HOTP verification. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0
+ */
+
+#ifndef NITROKEY_HOTP_VERIFICATION_TRACE_H
+#define NITROKEY_HOTP_VERIFICATION_TRACE_H
+
+/**
+ * USDT (SystemTap SDT) probes of the provider hotp_verification, placed on each device exchange.
+ * When the build finds <sys/sdt.h> (HAVE_SYS_SDT_H), a probe is a single nop with its arguments described
+ * in the .note.stapsdt section, so it costs nothing until a tracer attaches to it. Otherwise the probes
+ * compile to nothing, and their arguments are not evaluated.
+ *
+ * Probes and their arguments:
+ *  connect(connection_type, vid, pid, result)           device_connect() finished
+ *  disconnect(connection_type)
+ *  hid_send(command_id, result)                         feature report with the command sent, retries included
+ *  hid_receive(command_id, last_command_status, result) response taken, after the polls of the device
+ *  ccid_send(bSeq, ins, length, result)                 CCID message sent, ins of its APDU or 0
+ *  ccid_receive(bSeq, bStatus, sw, length, result)      CCID message received, sw is its status word or 0
+ *  touch_wait_start(ccid_backend)
+ *  touch_wait_end(result)                               touch confirmed, or the wait ended with an error
+ *  retry(what, attempt)                                 the named step is tried again, from attempt 1,
+ *                                                       see retry_policy.h for the transient errors
+ *
+ * The result is 0 or a RET_* code, as returned by the traced function. E.g. the latency of the CCID exchanges:
+ *  bpftrace -e 'usdt:./hotp_verification:hotp_verification:ccid_send { @start[arg0] = nsecs; }
+ *      usdt:./hotp_verification:hotp_verification:ccid_receive /@start[arg0]/ {
+ *          @us = hist((nsecs - @start[arg0]) / 1000); delete(@start[arg0]); }'
+ */
+
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+#define TRACE_PROBE(name, ...) STAP_PROBEV(hotp_verification, name, __VA_ARGS__)
+#else
+// never called, it only keeps the variables passed to the probes used
+static inline void trace_probe_disabled(const char *name, ...) {
+    (void) name;
+}
+#define TRACE_PROBE(name, ...)                           \
+    do {                                                 \
+        if (0) trace_probe_disabled(#name, __VA_ARGS__); \
+    } while (0)
+#endif
+
+#endif//NITROKEY_HOTP_VERIFICATION_TRACE_H
@@ -19,20 +19,186 @@
 * SPDX-License-Identifier: GPL-3.0
 */
 
+#include "utils.h"
+#include <errno.h>
 #include <inttypes.h>
+#include <sched.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <string.h>
 #include <time.h>
 
-int64_t millis() {
+static void console_message(MessageKind kind, const char *text, void *user_data) {
+    unused(user_data);
+    FILE *stream = kind == MESSAGE_PROGRESS ? stderr : stdout;
+    fputs(text, stream);
+    fflush(stream);
+}
+
+static _Thread_local bool messages_redirected = false;
+static _Thread_local MessageHandler message_handler = NULL;
+static _Thread_local void *message_user_data = NULL;
+
+void messages_set_handler(MessageHandler handler, void *user_data) {
+    messages_redirected = true;
+    message_handler = handler;
+    message_user_data = user_data;
+}
+
+void messages_to_console(void) {
+    messages_redirected = false;
+    message_handler = NULL;
+    message_user_data = NULL;
+}
+
+void message_print(MessageKind kind, const char *format, ...) {
+    const MessageHandler handler = messages_redirected ? message_handler : console_message;
+    if (handler == NULL) {
+        return;
+    }
+    char text[256];
+    va_list args;
+    va_start(args, format);
+    vsnprintf(text, sizeof text, format, args);
+    va_end(args);
+    handler(kind, text, messages_redirected ? message_user_data : NULL);
+}
+
+static int64_t system_now_us(void) {
     struct timespec now;
-    timespec_get(&now, TIME_UTC);
-    return ((int64_t) now.tv_sec) * 1000 + ((int64_t) now.tv_nsec) / 1000000;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return ((int64_t) now.tv_sec) * 1000000 + ((int64_t) now.tv_nsec) / 1000;
+}
+
+static void system_sleep_us(int64_t micro_seconds) {
+    struct timespec duration = {.tv_sec = micro_seconds / 1000000, .tv_nsec = (micro_seconds % 1000000) * 1000};
+    while (nanosleep(&duration, &duration) != 0 && errno == EINTR) {
+    }
+}
+
+const struct Clock system_clock = {system_now_us, system_sleep_us};
+
+// Each thread passes its own time by its waits, like the threads sleeping in parallel on the system clock.
+// Otherwise a thread polling for a lock would run out the deadlines of the others.
+static _Atomic int64_t virtual_advanced_us = 0;
+static _Thread_local int64_t thread_slept_us = 0;
+static _Atomic int64_t virtual_slept_us = 0;
+
+static int64_t virtual_clock_now_us(void) {
+    return atomic_load(&virtual_advanced_us) + thread_slept_us;
+}
+
+static void virtual_clock_sleep_us(int64_t micro_seconds) {
+    atomic_fetch_add(&virtual_slept_us, micro_seconds);
+    thread_slept_us += micro_seconds;
+    // let the thread, which is waited for, run
+    sched_yield();
+}
+
+const struct Clock virtual_clock = {virtual_clock_now_us, virtual_clock_sleep_us};
+
+static const struct Clock *current_clock = &system_clock;
+
+void clock_set(const struct Clock *clock) {
+    current_clock = clock != NULL ? clock : &system_clock;
+}
+
+int64_t clock_now_us(void) {
+    return current_clock->now_us();
+}
+
+void clock_sleep_us(int64_t micro_seconds) {
+    if (micro_seconds > 0) {
+        current_clock->sleep_us(micro_seconds);
+    }
+}
+
+void virtual_clock_reset(void) {
+    atomic_store(&virtual_advanced_us, 0);
+    atomic_store(&virtual_slept_us, 0);
+    thread_slept_us = 0;
+}
+
+int64_t virtual_clock_slept_us(void) {
+    return atomic_load(&virtual_slept_us);
+}
+
+void virtual_clock_advance(int64_t micro_seconds) {
+    atomic_fetch_add(&virtual_advanced_us, micro_seconds);
+}
+
+static int64_t millis(void) {
+    return clock_now_us() / 1000;
+}
+
+int64_t stopwatch_start() {
+    return millis();
+}
+
+int64_t stopwatch_stop(int64_t start) {
+    return millis() - start;
+}
+
+int64_t monotonic_us(void) {
+    return clock_now_us();
 }
 
-static int64_t g_milis = 0;
-void stopwatch_start() {
-    g_milis = millis();
+struct Deadline deadline_in(int64_t budget_ms) {
+    struct Deadline deadline = {0};
+    if (budget_ms > 0) {
+        deadline.end_ms = millis() + budget_ms;
+    }
+    return deadline;
 }
 
-int64_t stopwatch_stop() {
-    return millis() - g_milis;
+int64_t deadline_remaining_ms(struct Deadline deadline) {
+    if (deadline.end_ms == 0) {
+        return DEADLINE_UNLIMITED;
+    }
+    const int64_t remaining = deadline.end_ms - millis();
+    return remaining > 0 ? remaining : 0;
+}
+
+bool deadline_expired(struct Deadline deadline) {
+    return deadline_remaining_ms(deadline) == 0;
+}
+
+struct Deadline deadline_earlier(struct Deadline a, struct Deadline b) {
+    if (a.end_ms == 0) {
+        return b;
+    }
+    if (b.end_ms == 0) {
+        return a;
+    }
+    return a.end_ms < b.end_ms ? a : b;
+}
+
+bool deadline_sleep(struct Deadline deadline, int64_t micro_seconds) {
+    const int64_t remaining = deadline_remaining_ms(deadline);
+    if (remaining == 0) {
+        return false;
+    }
+    if (remaining != DEADLINE_UNLIMITED && remaining * 1000 < micro_seconds) {
+        micro_seconds = remaining * 1000;
+    }
+    clock_sleep_us(micro_seconds);
+    return true;
+}
+
+uint16_t load_be16(const uint8_t *bytes) {
+    return (uint16_t) ((bytes[0] << 8) | bytes[1]);
+}
+
+uint32_t load_be32(const uint8_t *bytes) {
+    return ((uint32_t) bytes[0] << 24) | ((uint32_t) bytes[1] << 16) | ((uint32_t) bytes[2] << 8) | bytes[3];
+}
+
+// Called through a volatile pointer, so the call cannot be proven dead and removed
+static void *(*const volatile memset_secure)(void *, int, size_t) = memset;
+
+void secure_zero(void *data, size_t size) {
+    if (data != NULL && size > 0) {
+        memset_secure(data, 0, size);
+    }
 }
@@ -22,9 +22,29 @@
 #ifndef NITROKEY_HOTP_VERIFICATION_UTILS_H
 #define NITROKEY_HOTP_VERIFICATION_UTILS_H
 
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h> // for printf for rassert
 #include <stdlib.h>// for exit for rassert
 
+/**
+ * Messages of the core for the user, like the transfer warnings, the hints and the progress dots.
+ * They are written to the console by default, the progress to stderr and the rest to stdout, as the command
+ * line tool shows them. The library passes them to the handler set by its user instead, or drops them.
+ * The handler is kept per thread, like the virtual time, so each thread routes the messages of its own calls.
+ */
+typedef enum {
+    MESSAGE_INFO,
+    MESSAGE_PROGRESS,
+} MessageKind;
+typedef void (*MessageHandler)(MessageKind kind, const char *text, void *user_data);
+// Route the messages of the calling thread to the handler, or drop them for NULL
+void messages_set_handler(MessageHandler handler, void *user_data);
+// Write the messages of the calling thread to the console again
+void messages_to_console(void);
+void message_print(MessageKind kind, const char *format, ...) __attribute__((format(printf, 2, 3)));
+
 #define STRINGIFY_HELPER(X) #X
 #define STRINGIFY(X) STRINGIFY_HELPER(X)
 // Critical exit if condition is not true
@@ -34,10 +54,10 @@
         exit(1);                                                 \
     }
 // Return error code if condition is true, or X != 0 (where 0 is the typical success code)
-#define check_ret(x, ret)                          \
-    if ((x) != 0) {                                \
-        printf("Call failed: " STRINGIFY(x) "\n"); \
-        return (ret);                              \
+#define check_ret(x, ret)                                             \
+    if ((x) != 0) {                                                   \
+        message_print(MESSAGE_INFO, "Call failed: " STRINGIFY(x) "\n"); \
+        return (ret);                                                 \
     }
 #define LEN_ARR(x) (sizeof(x) / sizeof(x[0]))
 #define unused(x) ((void) (x))
@@ -50,8 +70,62 @@
     } while (0)
 #endif
 
-int64_t stopwatch_stop();
-void stopwatch_start();
+/**
+ * Source of the time for the stopwatches, deadlines and waits. Each wait of the tool goes through clock_sleep_us(),
+ * so the system clock can be replaced with the virtual one, which only advances its time by the wait.
+ * The paths waiting for the device then run instantly in the tests and benchmarks, which can still check
+ * the time they would have taken.
+ */
+struct Clock {
+    // monotonic time in microseconds
+    int64_t (*now_us)(void);
+    void (*sleep_us)(int64_t micro_seconds);
+};
+extern const struct Clock system_clock;
+extern const struct Clock virtual_clock;
+// Switch to the given clock, or to the system clock for NULL. Not synchronized, call it before taking any deadline.
+void clock_set(const struct Clock *clock);
+int64_t clock_now_us(void);
+void clock_sleep_us(int64_t micro_seconds);
+// Reset the virtual time of the calling thread, the advances and the count of the time slept to zero.
+// Each thread passes its own virtual time with its waits, the threads started later begin at zero.
+void virtual_clock_reset(void);
+// Microseconds slept on the virtual clock since its reset, by all threads together
+int64_t virtual_clock_slept_us(void);
+// Move the virtual time of all threads forward without sleeping, e.g. by the time of a transfer modelled by the caller
+void virtual_clock_advance(int64_t micro_seconds);
+
+// Returns the start timestamp, which should be passed to stopwatch_stop() to get the elapsed milliseconds
+int64_t stopwatch_start();
+int64_t stopwatch_stop(int64_t start);
+// Monotonic timestamp in microseconds, for measuring intervals shorter than the stopwatch resolution
+int64_t monotonic_us(void);
+
+/**
+ * Point in time, by which the whole operation has to finish. Each wait, retry and transfer timeout
+ * is cut to the time left. The zero-initialized value means no limit.
+ */
+struct Deadline {
+    int64_t end_ms;
+};
+#define DEADLINE_UNLIMITED INT64_MAX
+
+// Deadline budget_ms milliseconds from now, or no limit for a non-positive budget
+struct Deadline deadline_in(int64_t budget_ms);
+// Milliseconds left, 0 once passed, or DEADLINE_UNLIMITED
+int64_t deadline_remaining_ms(struct Deadline deadline);
+bool deadline_expired(struct Deadline deadline);
+// The one, which passes first
+struct Deadline deadline_earlier(struct Deadline a, struct Deadline b);
+// Sleep, but not past the deadline. Returns false without sleeping, if the deadline has already passed.
+bool deadline_sleep(struct Deadline deadline, int64_t micro_seconds);
+
+// Big-endian integers read byte by byte, at any alignment in the response buffers
+uint16_t load_be16(const uint8_t *bytes);
+uint32_t load_be32(const uint8_t *bytes);
+
+// Zero the memory holding a secret, also right before it is freed, where the compiler could drop a memset()
+void secure_zero(void *data, size_t size);
 
 
 #endif//NITROKEY_HOTP_VERIFICATION_UTILS_H
@@ -43,19 +43,19 @@ TEST_CASE("test ccid status", "[main]") {
     struct Device dev = {};
     int res = device_connect(&dev);
     REQUIRE(res == RET_NO_ERROR);
-    int counter;
-    uint16_t firmware_version;
-    uint32_t serial;
-    int status_res = status_ccid(dev.mp_devhandle_ccid, &counter, &firmware_version, &serial);
+    struct FullResponseStatus status = {};
+    int status_res = status_ccid(&dev, &status);
+    const int counter = status.response_status.retry_admin;
     if (status_res == RET_NO_ERROR) {
         REQUIRE((0 <= counter && counter <= 8));
-    } else if (status_res == RET_NO_PIN_ATTEMPTS) {
-        REQUIRE(counter == -1);
     }
+    const uint16_t firmware_version = status.response_status.firmware_version;
+    const uint32_t serial = status.response_status.card_serial_u32;
     REQUIRE((firmware_version != 0 && firmware_version != 0xFFFF));
     INFO("Current serial number " << serial);
     INFO("SN is supported by the Secrets App since 0.11");
     REQUIRE((serial != 0 && serial != 0xFFFFFFFF));
+    device_disconnect(&dev);
 }
 
 TEST_CASE("test tlv", "[Helper]") {
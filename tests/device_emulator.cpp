@@ -0,0 +1,1418 @@
+/*
+ * Copyright (c) 2023 Nitrokey GmbH
+ *
+ * This file is part of Nitrokey HOTP verification project.
+ *
+ * Nitrokey HOTP verification is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * Nitrokey HOTP verification is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Nitrokey HOTP verification. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0
+ */
+
+#include "device_emulator.h"
+#include <algorithm>
+#include <cerrno>
+#include <atomic>
+#include <climits>
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+extern "C" {
+#include <hidapi/hidapi.h>
+#include <libusb.h>
+#include <ftw.h>
+#include <linux/hidraw.h>
+#include <linux/input.h>
+#include <stdarg.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#ifdef FEATURE_USE_PCSC
+#include <winscard.h>
+#endif
+#include "../src/utils.h"
+}
+
+namespace {
+
+    typedef std::vector<uint8_t> Bytes;
+
+    // SHA-1 and HMAC-SHA-1, enough to calculate the RFC 4226 HOTP codes
+    struct Sha1 {
+        uint32_t h[5] = {0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0};
+
+        static uint32_t rol(uint32_t x, int n) { return (x << n) | (x >> (32 - n)); }
+
+        void block(const uint8_t *p) {
+            uint32_t w[80];
+            for (int i = 0; i < 16; i++) w[i] = (p[4 * i] << 24) | (p[4 * i + 1] << 16) | (p[4 * i + 2] << 8) | p[4 * i + 3];
+            for (int i = 16; i < 80; i++) w[i] = rol(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+            uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+            for (int i = 0; i < 80; i++) {
+                uint32_t f, k;
+                if (i < 20) {
+                    f = (b & c) | (~b & d);
+                    k = 0x5A827999;
+                } else if (i < 40) {
+                    f = b ^ c ^ d;
+                    k = 0x6ED9EBA1;
+                } else if (i < 60) {
+                    f = (b & c) | (b & d) | (c & d);
+                    k = 0x8F1BBCDC;
+                } else {
+                    f = b ^ c ^ d;
+                    k = 0xCA62C1D6;
+                }
+                const uint32_t t = rol(a, 5) + f + e + k + w[i];
+                e = d;
+                d = c;
+                c = rol(b, 30);
+                b = a;
+                a = t;
+            }
+            h[0] += a;
+            h[1] += b;
+            h[2] += c;
+            h[3] += d;
+            h[4] += e;
+        }
+
+        static Bytes digest(const Bytes &msg) {
+            Sha1 s;
+            Bytes m = msg;
+            const uint64_t bits = (uint64_t) msg.size() * 8;
+            m.push_back(0x80);
+            while (m.size() % 64 != 56) m.push_back(0);
+            for (int i = 7; i >= 0; i--) m.push_back((uint8_t) (bits >> (8 * i)));
+            for (size_t i = 0; i < m.size(); i += 64) s.block(&m[i]);
+            Bytes out;
+            for (uint32_t v: s.h)
+                for (int i = 3; i >= 0; i--) out.push_back((uint8_t) (v >> (8 * i)));
+            return out;
+        }
+    };
+
+    Bytes hmac_sha1(Bytes key, const Bytes &msg) {
+        if (key.size() > 64) key = Sha1::digest(key);
+        key.resize(64, 0);
+        Bytes inner, outer;
+        for (uint8_t k: key) {
+            inner.push_back(k ^ 0x36);
+            outer.push_back(k ^ 0x5c);
+        }
+        inner.insert(inner.end(), msg.begin(), msg.end());
+        const Bytes inner_digest = Sha1::digest(inner);
+        outer.insert(outer.end(), inner_digest.begin(), inner_digest.end());
+        return Sha1::digest(outer);
+    }
+
+    uint32_t hotp(const Bytes &secret, uint64_t counter, int digits) {
+        Bytes msg;
+        for (int i = 7; i >= 0; i--) msg.push_back((uint8_t) (counter >> (8 * i)));
+        const Bytes mac = hmac_sha1(secret, msg);
+        const int offset = mac[19] & 0x0F;
+        const uint32_t bin = ((mac[offset] & 0x7F) << 24) | (mac[offset + 1] << 16) | (mac[offset + 2] << 8) | mac[offset + 3];
+        uint32_t mod = 1;
+        for (int i = 0; i < digits; i++) mod *= 10;
+        return bin % mod;
+    }
+
+    uint32_t be32(const uint8_t *p) { return (p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3]; }
+
+    void push_be32(Bytes &b, uint32_t v) {
+        for (int i = 3; i >= 0; i--) b.push_back((uint8_t) (v >> (8 * i)));
+    }
+
+    // Secrets App TLVs; the properties tag carries its single byte value without length, as in YKOATH
+    std::map<uint8_t, Bytes> parse_tlvs(const uint8_t *data, size_t len) {
+        std::map<uint8_t, Bytes> out;
+        size_t i = 0;
+        while (i < len) {
+            const uint8_t tag = data[i++];
+            if (tag == 0x78) {
+                if (i < len) out[tag] = Bytes(1, data[i++]);
+                continue;
+            }
+            if (i >= len) break;
+            const size_t l = data[i++];
+            if (i + l > len) break;
+            out[tag] = Bytes(data + i, data + i + l);
+            i += l;
+        }
+        return out;
+    }
+
+    const Bytes AID_SECRETS = {0xa0, 0x00, 0x00, 0x05, 0x27, 0x21, 0x01};
+    const Bytes AID_ADMIN = {0xa0, 0x00, 0x00, 0x08, 0x47, 0x00, 0x00, 0x00, 0x01};
+    const Bytes AID_PGP = {0xd2, 0x76, 0x00, 0x01, 0x24, 0x01};
+
+    const size_t HID_REPORT_LENGTH = 65;
+    const uint8_t HID_GET_STATUS = 0x00;
+    const uint8_t HID_GET_PASSWORD_RETRY_COUNT = 0x09;
+    const uint8_t HID_GET_USER_PASSWORD_RETRY_COUNT = 0x0F;
+    const uint8_t HID_VERIFY_OTP_CODE = 0x18;
+    const uint8_t HID_NEW_AES_KEY = 0x6b;
+    const uint8_t HID_STATUS_WRONG_PASSWORD = 4;
+    const char HID_ADMIN_PASSWORD[] = "12345678";
+    const uint8_t HID_STATUS_UNKNOWN_COMMAND = 9;
+
+    // CRC-32 of the STM32 hardware unit, over the little-endian 32-bit words, as checked by the core
+    uint32_t stm_crc(const uint8_t *data, size_t size) {
+        uint32_t crc = 0xffffffff;
+        for (size_t i = 0; i + 4 <= size; i += 4) {
+            crc ^= data[i] | (data[i + 1] << 8) | (data[i + 2] << 16) | ((uint32_t) data[i + 3] << 24);
+            for (int b = 0; b < 32; b++) crc = (crc & 0x80000000) ? (crc << 1) ^ 0x04C11DB7 : (crc << 1);
+        }
+        return crc;
+    }
+
+    void put_le32(uint8_t *p, uint32_t v) {
+        for (int i = 0; i < 4; i++) p[i] = (uint8_t) (v >> (8 * i));
+    }
+
+    void put_be32(uint8_t *p, uint32_t v) {
+        for (int i = 0; i < 4; i++) p[i] = (uint8_t) (v >> (8 * (3 - i)));
+    }
+
+    // CTAPHID reports of the FIDO interface, without the report ID
+    const size_t CTAP_REPORT_LENGTH = 64;
+    const uint8_t CTAP_INIT = 0x06;
+    const uint8_t CTAP_KEEPALIVE = 0x3B;
+    const uint8_t CTAP_ERROR = 0x3F;
+    const uint8_t CTAP_VENDOR_VERSION = 0x61;
+    const uint8_t CTAP_VENDOR_SECRETS = 0x70;
+
+    const int HOTP_VERIFICATION_WINDOW = 10;
+    const uint8_t MAX_PIN_COUNTER = 8;
+
+    struct Credential {
+        uint8_t kind_algo;
+        uint8_t digits;
+        Bytes secret;
+        uint32_t counter;
+        bool touch;
+    };
+
+    struct EmulatedDevice;
+}// namespace
+
+struct libusb_context {
+    int unused;
+};
+
+struct libusb_device {
+    EmulatedDevice *emulated;
+};
+
+struct libusb_device_handle {
+    EmulatedDevice *emulated;
+};
+
+struct hid_device_ {
+    EmulatedDevice *emulated;
+};
+
+namespace {
+
+    struct EmulatedDevice {
+        std::mutex lock;
+        uint16_t vid;
+        uint16_t pid;
+        std::string node_path;
+        // on the emulated bus 1
+        uint8_t address = 0;
+        // pulled out with emulator::unplug(), its handles stay open on the core side
+        bool unplugged = false;
+        // Nitrokey Pro answering the HID feature reports, over HIDAPI and its hidraw node
+        bool hid = false;
+        std::string hidraw_path;
+        uint8_t hid_query[HID_REPORT_LENGTH] = {};
+        bool hid_queried = false;
+        // HOTP slot checked by VERIFY_OTP_CODE, empty when not programmed
+        Credential hid_hotp = {};
+        // status reads left, for which the device reports itself busy with the last command
+        unsigned hid_busy_reads = 0;
+        uint8_t hid_command_status = 0;
+        // Nitrokey 3 answering the Secrets App commands tunneled over CTAPHID as well
+        bool ctaphid = false;
+        uint32_t last_cid = 0;
+        std::deque<Bytes> ctap_in_reports;
+        // the message being received
+        Bytes ctap_message;
+        uint32_t ctap_cid = 0;
+        uint8_t ctap_command = 0;
+        size_t ctap_length = 0;
+        uint8_t ctap_seq = 0;
+        uint32_t held_cid = 0;
+        uint32_t serial;
+        libusb_device usb;
+
+        enum { App_None,
+               App_Secrets,
+               App_Admin,
+               App_Pgp } selected = App_None;
+        bool pin_set = false;
+        std::string pin;
+        uint8_t pin_counter = MAX_PIN_COUNTER;
+        bool authenticated = false;
+        std::map<std::string, Credential> credentials;
+        bool reject_overwrite = false;
+        // status word of the next Put, 0 to handle it, see emulator::refuse_put()
+        uint16_t put_refusal = 0;
+        bool inject_stray = false;
+        int stray_seq_delta = 0;
+        // the most response data sent at once, 0 for no limit, see emulator::limit_response()
+        size_t response_limit = 0;
+        Bytes remaining_response;
+        // dwMaxCCIDMessageLength of the CCID class descriptor, see emulator::set_max_ccid_message()
+        uint32_t max_ccid_message = emulator::DEFAULT_MAX_CCID_MESSAGE;
+        unsigned usb_faults[(size_t) emulator::UsbFault::Count] = {};
+
+        libusb_device_handle *claimed_by = nullptr;
+        // name of the reader when pcscd serves the device, which then keeps its interface claimed
+        std::string reader;
+        // the PC/SC card handle in a transaction, zero when none
+        long pcsc_transaction = 0;
+        std::deque<Bytes> in_frames;
+        size_t in_offset = 0;
+        bool have_seq = false;
+        uint8_t last_seq = 0;
+
+        // touch emulation: the response is held back behind time extension frames
+        bool touch_all = false;
+        unsigned time_extensions = 3;
+        unsigned extensions_left = 0;
+        bool holding = false;
+        Bytes held_response;
+        uint8_t held_slot = 0, held_seq = 0;
+
+        emulator::DeviceStats stats = {};
+
+        static Bytes sw(Bytes data, uint16_t status) {
+            data.push_back(status >> 8);
+            data.push_back(status & 0xFF);
+            return data;
+        }
+
+        Bytes select(const Bytes &aid) {
+            authenticated = false;
+            if (aid == AID_SECRETS) {
+                selected = App_Secrets;
+                Bytes r = {0x79, 0x03, 0x04, 0x0D, 0x00,
+                           0x71, 0x08, 1, 2, 3, 4, 5, 6, 7, 8};
+                if (pin_set) {
+                    r.insert(r.end(), {0x82, 0x01, pin_counter});
+                }
+                r.insert(r.end(), {0x8F, 0x04});
+                push_be32(r, serial);
+                return sw(r, 0x9000);
+            }
+            if (aid == AID_ADMIN) {
+                selected = App_Admin;
+                return sw({}, 0x9000);
+            }
+            if (aid == AID_PGP) {
+                selected = App_Pgp;
+                return sw({}, 0x9000);
+            }
+            selected = App_None;
+            return sw({}, 0x6A82);
+        }
+
+        Bytes verify_pin(const std::map<uint8_t, Bytes> &t) {
+            stats.pin_verifications++;
+            if (!pin_set) return sw({}, 0x6982);
+            if (pin_counter == 0) return sw({}, 0x6983);
+            auto p = t.find(0x80);
+            if (p == t.end()) return sw({}, 0x6A80);
+            if (std::string(p->second.begin(), p->second.end()) != pin) {
+                pin_counter--;
+                return sw({}, 0x6300);
+            }
+            pin_counter = MAX_PIN_COUNTER;
+            authenticated = true;
+            return sw({}, 0x9000);
+        }
+
+        Bytes secrets_command(uint8_t ins, uint8_t p1, uint8_t p2, const Bytes &data, bool &touch) {
+            const auto t = parse_tlvs(data.data(), data.size());
+            auto name_of = [&t]() {
+                auto n = t.find(0x71);
+                return n == t.end() ? std::string() : std::string(n->second.begin(), n->second.end());
+            };
+            switch (ins) {
+                case 0x01: {// Put
+                    auto key = t.find(0x73);
+                    if (pin_set && !authenticated) return sw({}, 0x6982);
+                    if (name_of().empty() || key == t.end() || key->second.size() < 2) return sw({}, 0x6A80);
+                    if (put_refusal != 0) {
+                        const uint16_t status = put_refusal;
+                        put_refusal = 0;
+                        return sw({}, status);
+                    }
+                    // OperationBlocked, as the Secrets App without overwrite support answers
+                    if (reject_overwrite && credentials.count(name_of())) return sw({}, 0x6983);
+                    Credential c = {};
+                    c.kind_algo = key->second[0];
+                    c.digits = key->second[1];
+                    c.secret = Bytes(key->second.begin() + 2, key->second.end());
+                    auto counter = t.find(0x7A);
+                    if (counter != t.end() && counter->second.size() == 4) c.counter = be32(counter->second.data());
+                    auto props = t.find(0x78);
+                    c.touch = props != t.end() && (props->second[0] & 0x02);
+                    credentials[name_of()] = c;
+                    return sw({}, 0x9000);
+                }
+                case 0xA1: {// List
+                    if (pin_set && !authenticated) return sw({}, 0x6982);
+                    Bytes r;
+                    for (const auto &c: credentials) {
+                        r.push_back(0x72);
+                        r.push_back((uint8_t) (c.first.size() + 1));
+                        r.push_back(c.second.kind_algo);
+                        r.insert(r.end(), c.first.begin(), c.first.end());
+                    }
+                    return sw(r, 0x9000);
+                }
+                case 0x02: {// Delete
+                    return sw({}, credentials.erase(name_of()) ? 0x9000 : 0x6A82);
+                }
+                case 0x04: {// Reset
+                    if (p1 != 0xDE || p2 != 0xAD) return sw({}, 0x6A86);
+                    credentials.clear();
+                    pin_set = false;
+                    pin.clear();
+                    pin_counter = MAX_PIN_COUNTER;
+                    authenticated = false;
+                    return sw({}, 0x9000);
+                }
+                case 0xB1: {// VerifyCode
+                    auto it = credentials.find(name_of());
+                    auto response = t.find(0x75);
+                    if (it == credentials.end()) return sw({}, 0x6A82);
+                    if (response == t.end() || response->second.size() != 4) return sw({}, 0x6A80);
+                    Credential &c = it->second;
+                    touch = c.touch;
+                    const uint32_t code = be32(response->second.data());
+                    for (int i = 0; i < HOTP_VERIFICATION_WINDOW; i++) {
+                        if (hotp(c.secret, c.counter + i, c.digits) == code) {
+                            c.counter += i + 1;
+                            return sw({}, 0x9000);
+                        }
+                    }
+                    return sw({}, 0x6300);
+                }
+                case 0xB2:// VerifyPIN
+                    return verify_pin(t);
+                case 0xB3: {// ChangePIN
+                    auto n = t.find(0x81);
+                    const Bytes r = verify_pin(t);
+                    if (r != sw({}, 0x9000)) return r;
+                    if (n == t.end()) return sw({}, 0x6A80);
+                    pin = std::string(n->second.begin(), n->second.end());
+                    return r;
+                }
+                case 0xB4: {// SetPIN
+                    if (pin_set) return sw({}, 0x6982);
+                    auto p = t.find(0x80);
+                    if (p == t.end()) return sw({}, 0x6A80);
+                    pin = std::string(p->second.begin(), p->second.end());
+                    pin_set = true;
+                    pin_counter = MAX_PIN_COUNTER;
+                    return sw({}, 0x9000);
+                }
+                default:
+                    return sw({}, 0x6D00);
+            }
+        }
+
+        // Keep the data over the response limit for GET RESPONSE, and tell its length with the status 61xx
+        Bytes limit_response(Bytes response) {
+            if (response_limit == 0 || response.size() - 2 <= response_limit) return response;
+            remaining_response.assign(response.begin() + response_limit, response.end());
+            response.resize(response_limit);
+            const size_t remaining = remaining_response.size() - 2;
+            return sw(response, 0x6100 | (remaining > 0xFF ? 0 : remaining));
+        }
+
+        Bytes apdu(const uint8_t *a, size_t len, bool &touch) {
+            if (len < 4) return sw({}, 0x6700);
+            const uint8_t ins = a[1], p1 = a[2], p2 = a[3];
+            Bytes data;
+            // three bytes after the header starting with zero are the extended Le alone
+            if (len > 5 && !(a[4] == 0 && len == 7)) {
+                const bool extended = a[4] == 0;
+                const size_t offset = extended ? 7 : 5;
+                const size_t lc = extended ? (a[5] << 8) | a[6] : a[4];
+                if (len < offset || offset + lc > len) return sw({}, 0x6700);
+                data.assign(a + offset, a + offset + lc);
+                if (extended) stats.extended_apdus++;
+            }
+            if (ins == 0xC0) {
+                if (remaining_response.empty()) return sw({}, 0x6985);
+                stats.get_responses++;
+                Bytes rest;
+                rest.swap(remaining_response);
+                return limit_response(rest);
+            }
+            remaining_response.clear();
+            return limit_response(dispatch(ins, p1, p2, data, touch));
+        }
+
+        Bytes dispatch(uint8_t ins, uint8_t p1, uint8_t p2, const Bytes &data, bool &touch) {
+            if (ins == 0xA4 && p1 == 0x04) return select(data);
+            switch (selected) {
+                case App_Secrets:
+                    return secrets_command(ins, p1, p2, data, touch);
+                case App_Admin:
+                    if (ins != 0x61) return sw({}, 0x6D00);
+                    {
+                        Bytes r;
+                        push_be32(r, (1u << 22) | (7u << 6) | 2u);
+                        return sw(r, 0x9000);
+                    }
+                case App_Pgp:
+                    if (ins != 0xCA || p2 != 0xC4) return sw({}, 0x6A88);
+                    return sw({0x00, 0x7F, 0x7F, 0x7F, 0x03, 0x00, 0x03}, 0x9000);
+                default:
+                    return sw({}, 0x6D00);
+            }
+        }
+
+        static Bytes frame(uint8_t slot, uint8_t seq, uint8_t status, const Bytes &data) {
+            Bytes f = {0x80, 0, 0, 0, 0, slot, seq, status, 0, 0};
+            const uint32_t l = (uint32_t) data.size();
+            for (int i = 0; i < 4; i++) f[1 + i] = (uint8_t) (l >> (8 * i));
+            f.insert(f.end(), data.begin(), data.end());
+            return f;
+        }
+
+        int bulk_out(const uint8_t *data, int length) {
+            if (length < 10 || data[0] != 0x6F) return LIBUSB_ERROR_IO;
+            const uint32_t l = data[1] | (data[2] << 8) | (data[3] << 16) | ((uint32_t) data[4] << 24);
+            if (l + 10 > (uint32_t) length) return LIBUSB_ERROR_IO;
+            const uint8_t slot = data[5], seq = data[6];
+            if (have_seq && seq != (uint8_t) (last_seq + 1)) {
+                stats.sequence_errors++;
+            }
+            have_seq = true;
+            last_seq = seq;
+            stats.exchanges++;
+
+            bool touch = false;
+            const Bytes response = apdu(data + 10, l, touch);
+            if (touch || touch_all) {
+                // time extension requests, while the user is touching the device
+                holding = true;
+                extensions_left = time_extensions;
+                held_response = response;
+                held_slot = slot;
+                held_seq = seq;
+                return LIBUSB_SUCCESS;
+            }
+            if (inject_stray) {
+                inject_stray = false;
+                in_frames.push_back(frame(slot, (uint8_t) (seq + stray_seq_delta), 0x00, sw({}, 0x9000)));
+            }
+            in_frames.push_back(frame(slot, seq, 0x00, response));
+            stats.max_queued_responses = std::max(stats.max_queued_responses, (unsigned) in_frames.size());
+            return LIBUSB_SUCCESS;
+        }
+
+        // The next transfer of the kind is to fail
+        bool take_fault(emulator::UsbFault fault) {
+            unsigned &left = usb_faults[(size_t) fault];
+            if (left == 0) return false;
+            left--;
+            return true;
+        }
+
+        // The HID transfers fail like the hidraw ioctl() does, HIDAPI reports only the -1
+        static int io_error() {
+            errno = EIO;
+            return -1;
+        }
+
+        static int removed() {
+            errno = ENODEV;
+            return -1;
+        }
+
+        int hid_set_report(const uint8_t *data, size_t length) {
+            if (!hid || length != HID_REPORT_LENGTH) return -1;
+            if (unplugged) return removed();
+            if (take_fault(emulator::UsbFault::HidSetReport)) return io_error();
+            memcpy(hid_query, data, length);
+            hid_queried = true;
+            stats.exchanges++;
+            hid_command_status = 0;
+            if (hid_query[1] == HID_NEW_AES_KEY) {
+                if (strncmp((const char *) hid_query + 2, HID_ADMIN_PASSWORD, 20) != 0) {
+                    hid_command_status = HID_STATUS_WRONG_PASSWORD;
+                } else {
+                    hid_busy_reads = emulator::AES_KEY_GENERATION_READS;
+                    stats.aes_keys_generated++;
+                }
+            }
+            return (int) length;
+        }
+
+        // Answer the last query like the Nitrokey Pro firmware v0.15, for the commands of the status and the AES key regeneration
+        int hid_get_report(uint8_t *data, size_t length) {
+            if (!hid || length != HID_REPORT_LENGTH) return -1;
+            if (unplugged) return removed();
+            if (take_fault(emulator::UsbFault::HidGetReport)) return io_error();
+            memset(data, 0, length);
+            if (hid_queried) {
+                const uint8_t command = hid_query[1];
+                data[2] = command;
+                memcpy(data + 3, hid_query + HID_REPORT_LENGTH - 4, 4);
+                data[7] = hid_command_status;
+                uint8_t *payload = data + 8;
+                if (hid_busy_reads > 0) {
+                    hid_busy_reads--;
+                    data[1] = 1;
+                } else if (command == HID_NEW_AES_KEY) {
+                    // done, without a payload
+                } else if (command == HID_GET_PASSWORD_RETRY_COUNT || command == HID_GET_USER_PASSWORD_RETRY_COUNT) {
+                    payload[0] = 3;
+                } else if (command == HID_GET_STATUS) {
+                    payload[0] = 15;
+                    payload[1] = 0;
+                    put_le32(payload + 2, serial);
+                    memset(payload + 6, 0xFF, 3);
+                } else if (command == HID_VERIFY_OTP_CODE) {
+                    // the code matched, and the count of the counter values skipped to find it
+                    const uint32_t code = hid_query[2] | (hid_query[3] << 8) | (hid_query[4] << 16) | ((uint32_t) hid_query[5] << 24);
+                    for (int i = 0; i < HOTP_VERIFICATION_WINDOW && !hid_hotp.secret.empty(); i++) {
+                        if (hotp(hid_hotp.secret, hid_hotp.counter + i, hid_hotp.digits) == code) {
+                            hid_hotp.counter += i + 1;
+                            payload[0] = 1;
+                            payload[1] = (uint8_t) i;
+                            break;
+                        }
+                    }
+                } else {
+                    data[7] = HID_STATUS_UNKNOWN_COMMAND;
+                }
+            }
+            put_le32(data + HID_REPORT_LENGTH - 4, stm_crc(data + 1, HID_REPORT_LENGTH - 5));
+            return (int) length;
+        }
+
+        void ctap_queue(uint32_t cid, uint8_t command, const Bytes &payload) {
+            Bytes report(CTAP_REPORT_LENGTH, 0);
+            put_be32(report.data(), cid);
+            report[4] = 0x80 | command;
+            report[5] = (uint8_t) (payload.size() >> 8);
+            report[6] = (uint8_t) payload.size();
+            size_t sent = std::min(payload.size(), CTAP_REPORT_LENGTH - 7);
+            std::copy(payload.begin(), payload.begin() + sent, report.begin() + 7);
+            ctap_in_reports.push_back(report);
+            for (uint8_t seq = 0; sent < payload.size(); ++seq) {
+                const size_t n = std::min(payload.size() - sent, CTAP_REPORT_LENGTH - 5);
+                report.assign(CTAP_REPORT_LENGTH, 0);
+                put_be32(report.data(), cid);
+                report[4] = seq;
+                std::copy(payload.begin() + sent, payload.begin() + sent + n, report.begin() + 5);
+                sent += n;
+                ctap_in_reports.push_back(report);
+            }
+        }
+
+        // The response to the Secrets App command, with the status word first
+        Bytes ctap_secrets(const Bytes &apdu, bool &touch) {
+            Bytes r;
+            // only the Secrets App is reachable over CTAPHID
+            if (apdu.size() >= 5 && apdu[1] == 0xA4 && apdu[2] == 0x04 &&
+                Bytes(apdu.begin() + 5, apdu.end()) != AID_SECRETS) {
+                r = sw({}, 0x6A82);
+            } else {
+                r = this->apdu(apdu.data(), apdu.size(), touch);
+            }
+            std::rotate(r.begin(), r.end() - 2, r.end());
+            return r;
+        }
+
+        void ctap_execute(uint32_t cid, uint8_t command, const Bytes &message) {
+            stats.exchanges++;
+            if (command == CTAP_INIT) {
+                if (message.size() != 8) return ctap_queue(cid, CTAP_ERROR, {0x03});
+                Bytes r = message;
+                push_be32(r, 0x100 + ++last_cid);
+                r.insert(r.end(), {2, 1, 7, 2, 0x05});
+                return ctap_queue(cid, CTAP_INIT, r);
+            }
+            if (cid == 0xFFFFFFFF || cid <= 0x100 || cid > 0x100 + last_cid) return ctap_queue(cid, CTAP_ERROR, {0x0B});
+            if (command == CTAP_VENDOR_VERSION) {
+                Bytes r;
+                push_be32(r, (1u << 22) | (7u << 6) | 2u);
+                return ctap_queue(cid, command, r);
+            }
+            if (command != CTAP_VENDOR_SECRETS) return ctap_queue(cid, CTAP_ERROR, {0x01});
+            bool touch = false;
+            const Bytes response = ctap_secrets(message, touch);
+            if (inject_stray) {
+                // traffic of another client on its own channel
+                inject_stray = false;
+                ctap_queue(cid + stray_seq_delta, CTAP_VENDOR_SECRETS, {0x90, 0x00});
+            }
+            if (touch || touch_all) {
+                holding = true;
+                extensions_left = time_extensions;
+                held_response = response;
+                held_cid = cid;
+                return;
+            }
+            ctap_queue(cid, command, response);
+        }
+
+        int ctap_write(const uint8_t *data, size_t length) {
+            if (!ctaphid || length != CTAP_REPORT_LENGTH + 1 || data[0] != 0) return -1;
+            if (unplugged) return removed();
+            const uint8_t *report = data + 1;
+            const uint32_t cid = be32(report);
+            if (report[4] & 0x80) {
+                ctap_cid = cid;
+                ctap_command = report[4] & 0x7F;
+                ctap_length = (report[5] << 8) | report[6];
+                ctap_message.assign(report + 7, report + 7 + std::min(ctap_length, CTAP_REPORT_LENGTH - 7));
+                ctap_seq = 0;
+            } else {
+                if (cid != ctap_cid || report[4] != ctap_seq++) {
+                    ctap_queue(cid, CTAP_ERROR, {0x04});
+                    return (int) length;
+                }
+                const size_t n = std::min(ctap_length - ctap_message.size(), CTAP_REPORT_LENGTH - 5);
+                ctap_message.insert(ctap_message.end(), report + 5, report + 5 + n);
+            }
+            if (ctap_message.size() == ctap_length) ctap_execute(ctap_cid, ctap_command, ctap_message);
+            return (int) length;
+        }
+
+        // Nothing waiting reads as a timeout right away
+        int ctap_read(uint8_t *data, size_t length) {
+            if (!ctaphid) return -1;
+            if (unplugged) return removed();
+            if (ctap_in_reports.empty() && holding) {
+                if (extensions_left > 0) {
+                    if (extensions_left != emulator::NEVER_TOUCHED) extensions_left--;
+                    ctap_queue(held_cid, CTAP_KEEPALIVE, {0x02});
+                } else {
+                    holding = false;
+                    ctap_queue(held_cid, CTAP_VENDOR_SECRETS, held_response);
+                }
+            }
+            if (ctap_in_reports.empty()) return 0;
+            const size_t n = std::min(length, CTAP_REPORT_LENGTH);
+            memcpy(data, ctap_in_reports.front().data(), n);
+            ctap_in_reports.pop_front();
+            return (int) n;
+        }
+
+        int bulk_in(uint8_t *data, int length, int *actual_length) {
+            if (in_frames.empty() && holding) {
+                if (extensions_left > 0) {
+                    if (extensions_left != emulator::NEVER_TOUCHED) extensions_left--;
+                    in_frames.push_back(frame(held_slot, held_seq, 0x80, {}));
+                } else {
+                    holding = false;
+                    in_frames.push_back(frame(held_slot, held_seq, 0x00, held_response));
+                }
+            }
+            if (in_frames.empty()) {
+                *actual_length = 0;
+                return LIBUSB_ERROR_TIMEOUT;
+            }
+            const Bytes &f = in_frames.front();
+            const size_t n = std::min((size_t) length, f.size() - in_offset);
+            memcpy(data, f.data() + in_offset, n);
+            *actual_length = (int) n;
+            in_offset += n;
+            if (in_offset == f.size()) {
+                in_frames.pop_front();
+                in_offset = 0;
+            }
+            return LIBUSB_SUCCESS;
+        }
+    };
+
+    // The emulated bus is private to the test process, so are the device lock files of the core
+    struct PrivateRuntimeDirectory {
+        char path[64] = "/tmp/hotp-emulated-run-XXXXXX";
+
+        PrivateRuntimeDirectory() {
+            if (mkdtemp(path) != nullptr) setenv("XDG_RUNTIME_DIR", path, 1);
+        }
+
+        // Template for mkstemp() of a file in the directory, so it is removed with the directory at the latest
+        std::string file_template(const char *name) const {
+            return std::string(path) + "/" + name + "-XXXXXX";
+        }
+
+        ~PrivateRuntimeDirectory() {
+            nftw(
+                    path, [](const char *file, const struct stat *, int, struct FTW *) { return remove(file); }, 8,
+                    FTW_DEPTH | FTW_PHYS);
+        }
+    } runtime_directory;
+
+    std::mutex registry_lock;
+    std::vector<std::unique_ptr<EmulatedDevice>> devices;
+    std::atomic<int> open_contexts{0};
+    std::atomic<int> hidapi_users{0};
+    std::atomic<int> device_list_calls{0};
+    std::atomic<int> pcsc_contexts{0};
+#ifdef FEATURE_USE_PCSC
+    // the connected PC/SC card handles, under the registry lock
+    std::map<SCARDHANDLE, EmulatedDevice *> pcsc_cards;
+    SCARDHANDLE last_pcsc_card = 0;
+#endif
+
+}// namespace
+
+namespace emulator {
+
+    void reset() {
+        std::lock_guard<std::mutex> g(registry_lock);
+        for (auto &d: devices) {
+            if (!d->node_path.empty()) unlink(d->node_path.c_str());
+            if (!d->hidraw_path.empty()) unlink(d->hidraw_path.c_str());
+        }
+        devices.clear();
+    }
+
+    std::string device_node(size_t index) {
+        std::lock_guard<std::mutex> g(registry_lock);
+        EmulatedDevice &d = *devices.at(index);
+        std::lock_guard<std::mutex> dg(d.lock);
+        if (d.node_path.empty()) {
+            std::string path = runtime_directory.file_template("usb");
+            const int fd = mkstemp(&path[0]);
+            if (fd < 0) return std::string();
+            const uint8_t descriptor[18] = {18, 0x01, 0x00, 0x02, 0, 0, 0, 64,
+                                            (uint8_t) d.vid, (uint8_t) (d.vid >> 8),
+                                            (uint8_t) d.pid, (uint8_t) (d.pid >> 8),
+                                            0, 1, 1, 2, 3, 1};
+            const bool written = write(fd, descriptor, sizeof descriptor) == (ssize_t) sizeof descriptor;
+            close(fd);
+            if (!written) return std::string();
+            d.node_path = path;
+        }
+        return d.node_path;
+    }
+
+    std::string hidraw_node(size_t index) {
+        std::lock_guard<std::mutex> g(registry_lock);
+        EmulatedDevice &d = *devices.at(index);
+        std::lock_guard<std::mutex> dg(d.lock);
+        if (d.hidraw_path.empty()) {
+            std::string path = runtime_directory.file_template("hidraw");
+            const int fd = mkstemp(&path[0]);
+            if (fd < 0) return std::string();
+            close(fd);
+            d.hidraw_path = path;
+        }
+        return d.hidraw_path;
+    }
+
+    size_t add_pro(uint32_t card_serial) {
+        std::lock_guard<std::mutex> g(registry_lock);
+        auto d = std::unique_ptr<EmulatedDevice>(new EmulatedDevice());
+        d->vid = 0x20a0;
+        d->pid = 0x4108;
+        d->serial = card_serial;
+        d->hid = true;
+        d->usb.emulated = d.get();
+        d->address = (uint8_t) (devices.size() + 1);
+        devices.push_back(std::move(d));
+        return devices.size() - 1;
+    }
+
+    size_t add_nk3(uint32_t serial) {
+        std::lock_guard<std::mutex> g(registry_lock);
+        auto d = std::unique_ptr<EmulatedDevice>(new EmulatedDevice());
+        d->vid = 0x20a0;
+        d->pid = 0x42b2;
+        d->serial = serial;
+        d->ctaphid = true;
+        d->usb.emulated = d.get();
+        d->address = (uint8_t) (devices.size() + 1);
+        devices.push_back(std::move(d));
+        return devices.size() - 1;
+    }
+
+    void attach_to_pcscd(size_t index) {
+        std::lock_guard<std::mutex> g(registry_lock);
+        EmulatedDevice &d = *devices.at(index);
+        std::lock_guard<std::mutex> dg(d.lock);
+        // pcscd numbers the readers with two digits at least
+        std::string number = std::to_string(index);
+        number.insert(0, number.size() < 2 ? 2 - number.size() : 0, '0');
+        d.reader = "Nitrokey Nitrokey 3 [CCID/ICCD Interface] " + number + " 00";
+    }
+
+    void program_hotp(size_t index, const std::string &secret, uint32_t counter) {
+        std::lock_guard<std::mutex> g(registry_lock);
+        EmulatedDevice &d = *devices.at(index);
+        std::lock_guard<std::mutex> dg(d.lock);
+        d.hid_hotp.secret = Bytes(secret.begin(), secret.end());
+        d.hid_hotp.counter = counter;
+        d.hid_hotp.digits = 6;
+    }
+
+    void require_touch(size_t index, unsigned time_extensions) {
+        std::lock_guard<std::mutex> g(registry_lock);
+        EmulatedDevice &d = *devices.at(index);
+        std::lock_guard<std::mutex> dg(d.lock);
+        d.touch_all = true;
+        d.time_extensions = time_extensions;
+    }
+
+    void reject_overwrite(size_t index) {
+        std::lock_guard<std::mutex> g(registry_lock);
+        EmulatedDevice &d = *devices.at(index);
+        std::lock_guard<std::mutex> dg(d.lock);
+        d.reject_overwrite = true;
+    }
+
+    void refuse_put(size_t index, uint16_t status) {
+        std::lock_guard<std::mutex> g(registry_lock);
+        EmulatedDevice &d = *devices.at(index);
+        std::lock_guard<std::mutex> dg(d.lock);
+        d.put_refusal = status;
+    }
+
+    void inject_usb_errors(size_t index, UsbFault fault, unsigned count) {
+        std::lock_guard<std::mutex> g(registry_lock);
+        EmulatedDevice &d = *devices.at(index);
+        std::lock_guard<std::mutex> dg(d.lock);
+        d.usb_faults[(size_t) fault] = count;
+    }
+
+    void set_max_ccid_message(size_t index, uint32_t length) {
+        std::lock_guard<std::mutex> g(registry_lock);
+        EmulatedDevice &d = *devices.at(index);
+        std::lock_guard<std::mutex> dg(d.lock);
+        d.max_ccid_message = length;
+    }
+
+    void limit_response(size_t index, size_t length) {
+        std::lock_guard<std::mutex> g(registry_lock);
+        EmulatedDevice &d = *devices.at(index);
+        std::lock_guard<std::mutex> dg(d.lock);
+        d.response_limit = length;
+    }
+
+    void unplug(size_t index) {
+        std::lock_guard<std::mutex> g(registry_lock);
+        EmulatedDevice &d = *devices.at(index);
+        std::lock_guard<std::mutex> dg(d.lock);
+        d.unplugged = true;
+        if (!d.node_path.empty()) unlink(d.node_path.c_str());
+        if (!d.hidraw_path.empty()) unlink(d.hidraw_path.c_str());
+    }
+
+    void inject_stray_response(size_t index, int seq_delta) {
+        std::lock_guard<std::mutex> g(registry_lock);
+        EmulatedDevice &d = *devices.at(index);
+        std::lock_guard<std::mutex> dg(d.lock);
+        d.inject_stray = true;
+        d.stray_seq_delta = seq_delta;
+    }
+
+    DeviceStats device_stats(size_t index) {
+        std::lock_guard<std::mutex> g(registry_lock);
+        EmulatedDevice &d = *devices.at(index);
+        std::lock_guard<std::mutex> dg(d.lock);
+        return d.stats;
+    }
+
+    size_t credential_count(size_t index) {
+        std::lock_guard<std::mutex> g(registry_lock);
+        EmulatedDevice &d = *devices.at(index);
+        std::lock_guard<std::mutex> dg(d.lock);
+        return d.credentials.size();
+    }
+
+    bool stored_credential(size_t index, const std::string &name, StoredCredential &out) {
+        std::lock_guard<std::mutex> g(registry_lock);
+        EmulatedDevice &d = *devices.at(index);
+        std::lock_guard<std::mutex> dg(d.lock);
+        auto it = d.credentials.find(name);
+        if (it == d.credentials.end()) return false;
+        const Credential &c = it->second;
+        out = StoredCredential{c.kind_algo, c.digits, std::string(c.secret.begin(), c.secret.end()), c.counter, c.touch};
+        return true;
+    }
+
+    GlobalStats global_stats() {
+        return GlobalStats{open_contexts.load(), hidapi_users.load(), device_list_calls.load(), pcsc_contexts.load()};
+    }
+
+    VirtualClock::VirtualClock() {
+        clock_set(&virtual_clock);
+        virtual_clock_reset();
+    }
+
+    VirtualClock::~VirtualClock() {
+        clock_set(nullptr);
+    }
+
+    int64_t elapsed_ms(std::chrono::steady_clock::time_point start) {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+    }
+
+}// namespace emulator
+
+namespace {
+
+    // The emulated device, which node the descriptor was opened from
+    EmulatedDevice *device_by_fd(int fd, std::string EmulatedDevice::*node) {
+        char link[64], target[PATH_MAX] = {};
+        snprintf(link, sizeof link, "/proc/self/fd/%d", fd);
+        if (readlink(link, target, sizeof target - 1) < 0) return nullptr;
+        // the node of an unplugged device is gone, its open descriptors still lead to it
+        const std::string path = target;
+        const std::string deleted = " (deleted)";
+        const std::string node_path = path.size() > deleted.size() && path.compare(path.size() - deleted.size(), deleted.size(), deleted) == 0
+                                              ? path.substr(0, path.size() - deleted.size())
+                                              : path;
+        std::lock_guard<std::mutex> g(registry_lock);
+        for (auto &d: devices) {
+            if (!(d.get()->*node).empty() && d.get()->*node == node_path) return d.get();
+        }
+        return nullptr;
+    }
+
+}// namespace
+
+extern "C" {
+
+int libusb_init(libusb_context **ctx) {
+    *ctx = new libusb_context();
+    open_contexts++;
+    return LIBUSB_SUCCESS;
+}
+
+void libusb_exit(libusb_context *ctx) {
+    if (ctx == nullptr) return;
+    delete ctx;
+    open_contexts--;
+}
+
+int libusb_init_context(libusb_context **ctx, const struct libusb_init_option[], int) {
+    return libusb_init(ctx);
+}
+
+int libusb_wrap_sys_device(libusb_context *, intptr_t sys_dev, libusb_device_handle **dev_handle) {
+    EmulatedDevice *found = device_by_fd((int) sys_dev, &EmulatedDevice::node_path);
+    if (found == nullptr) return LIBUSB_ERROR_NOT_FOUND;
+    return libusb_open(&found->usb, dev_handle);
+}
+
+ssize_t libusb_get_device_list(libusb_context *, libusb_device ***list) {
+    device_list_calls++;
+    std::lock_guard<std::mutex> g(registry_lock);
+    *list = new libusb_device *[devices.size() + 1];
+    size_t count = 0;
+    for (auto &d: devices) {
+        if (!d->unplugged) (*list)[count++] = &d->usb;
+    }
+    (*list)[count] = nullptr;
+    return (ssize_t) count;
+}
+
+void libusb_free_device_list(libusb_device **list, int) {
+    delete[] list;
+}
+
+int libusb_get_device_descriptor(libusb_device *dev, struct libusb_device_descriptor *desc) {
+    memset(desc, 0, sizeof(*desc));
+    desc->idVendor = dev->emulated->vid;
+    desc->idProduct = dev->emulated->pid;
+    return LIBUSB_SUCCESS;
+}
+
+int libusb_open(libusb_device *dev, libusb_device_handle **dev_handle) {
+    std::lock_guard<std::mutex> g(dev->emulated->lock);
+    if (dev->emulated->unplugged) return LIBUSB_ERROR_NO_DEVICE;
+    *dev_handle = new libusb_device_handle{dev->emulated};
+    dev->emulated->stats.open_handles++;
+    return LIBUSB_SUCCESS;
+}
+
+void libusb_close(libusb_device_handle *dev_handle) {
+    EmulatedDevice *d = dev_handle->emulated;
+    {
+        std::lock_guard<std::mutex> g(d->lock);
+        if (d->claimed_by == dev_handle) d->claimed_by = nullptr;
+        d->stats.open_handles--;
+    }
+    delete dev_handle;
+}
+
+libusb_device *libusb_get_device(libusb_device_handle *dev_handle) {
+    return &dev_handle->emulated->usb;
+}
+
+uint8_t libusb_get_bus_number(libusb_device *) {
+    return 1;
+}
+
+uint8_t libusb_get_device_address(libusb_device *dev) {
+    return dev->emulated->address;
+}
+
+namespace {
+    // Configuration descriptor of the emulated device, with the CCID class descriptor of its single interface
+    struct EmulatedConfig {
+        libusb_config_descriptor config;
+        libusb_interface interface;
+        libusb_interface_descriptor setting;
+        uint8_t ccid_descriptor[54];
+    };
+}// namespace
+
+int libusb_get_active_config_descriptor(libusb_device *dev, struct libusb_config_descriptor **config) {
+    EmulatedDevice *d = dev->emulated;
+    std::lock_guard<std::mutex> g(d->lock);
+    auto *c = new EmulatedConfig();
+    c->ccid_descriptor[0] = sizeof c->ccid_descriptor;
+    c->ccid_descriptor[1] = 0x21;
+    for (int i = 0; i < 4; ++i) {
+        // dwMaxCCIDMessageLength
+        c->ccid_descriptor[44 + i] = (uint8_t) (d->max_ccid_message >> (8 * i));
+    }
+    c->setting.bInterfaceClass = 0x0B;
+    c->setting.extra = c->ccid_descriptor;
+    c->setting.extra_length = sizeof c->ccid_descriptor;
+    c->interface.altsetting = &c->setting;
+    c->interface.num_altsetting = 1;
+    c->config.bNumInterfaces = 1;
+    c->config.interface = &c->interface;
+    *config = &c->config;
+    return LIBUSB_SUCCESS;
+}
+
+void libusb_free_config_descriptor(struct libusb_config_descriptor *config) {
+    delete reinterpret_cast<EmulatedConfig *>(config);
+}
+
+int libusb_claim_interface(libusb_device_handle *dev_handle, int) {
+    EmulatedDevice *d = dev_handle->emulated;
+    std::lock_guard<std::mutex> g(d->lock);
+    if (!d->reader.empty()) return LIBUSB_ERROR_BUSY;
+    if (d->claimed_by != nullptr && d->claimed_by != dev_handle) return LIBUSB_ERROR_BUSY;
+    d->claimed_by = dev_handle;
+    d->in_frames.clear();
+    d->in_offset = 0;
+    d->have_seq = false;
+    d->selected = EmulatedDevice::App_None;
+    d->authenticated = false;
+    return LIBUSB_SUCCESS;
+}
+
+int libusb_release_interface(libusb_device_handle *dev_handle, int) {
+    EmulatedDevice *d = dev_handle->emulated;
+    std::lock_guard<std::mutex> g(d->lock);
+    if (d->claimed_by != dev_handle) return LIBUSB_ERROR_NOT_FOUND;
+    d->claimed_by = nullptr;
+    return LIBUSB_SUCCESS;
+}
+
+int libusb_set_interface_alt_setting(libusb_device_handle *, int, int) {
+    return LIBUSB_SUCCESS;
+}
+
+int libusb_bulk_transfer(libusb_device_handle *dev_handle, unsigned char endpoint, unsigned char *data, int length,
+                         int *actual_length, unsigned int) {
+    EmulatedDevice *d = dev_handle->emulated;
+    std::lock_guard<std::mutex> g(d->lock);
+    if (d->unplugged) {
+        *actual_length = 0;
+        return LIBUSB_ERROR_NO_DEVICE;
+    }
+    if (d->claimed_by != dev_handle) return LIBUSB_ERROR_IO;
+    if (endpoint & 0x80) {
+        if (d->take_fault(emulator::UsbFault::BulkIn)) {
+            if (!d->in_frames.empty()) {
+                d->in_frames.pop_front();
+                d->in_offset = 0;
+            }
+            *actual_length = 0;
+            return LIBUSB_ERROR_IO;
+        }
+        return d->bulk_in(data, length, actual_length);
+    }
+    if (d->take_fault(emulator::UsbFault::BulkOut)) {
+        *actual_length = 0;
+        return LIBUSB_ERROR_IO;
+    }
+    *actual_length = length;
+    return d->bulk_out(data, length);
+}
+
+const char *libusb_strerror(int errcode) {
+    return errcode == LIBUSB_SUCCESS ? "Success" : "Emulated libusb error";
+}
+
+int hid_init(void) {
+    hidapi_users++;
+    return 0;
+}
+
+int hid_exit(void) {
+    hidapi_users--;
+    return 0;
+}
+
+hid_device *hid_open(unsigned short vid, unsigned short pid, const wchar_t *) {
+    std::lock_guard<std::mutex> g(registry_lock);
+    for (auto &d: devices) {
+        if ((d->hid || d->ctaphid) && !d->unplugged && d->vid == vid && d->pid == pid) {
+            std::lock_guard<std::mutex> dg(d->lock);
+            d->stats.open_handles++;
+            return new hid_device{d.get()};
+        }
+    }
+    return nullptr;
+}
+
+static std::string hid_path(const EmulatedDevice &d) {
+    char path[16];
+    snprintf(path, sizeof(path), "0001:%04x:00", d.address);
+    return path;
+}
+
+hid_device *hid_open_path(const char *path) {
+    std::lock_guard<std::mutex> g(registry_lock);
+    for (auto &d: devices) {
+        if ((d->hid || d->ctaphid) && !d->unplugged && hid_path(*d) == path) {
+            std::lock_guard<std::mutex> dg(d->lock);
+            d->stats.open_handles++;
+            return new hid_device{d.get()};
+        }
+    }
+    return nullptr;
+}
+
+// Zero vid or pid matches any, like in HIDAPI
+struct hid_device_info *hid_enumerate(unsigned short vid, unsigned short pid) {
+    std::lock_guard<std::mutex> g(registry_lock);
+    struct hid_device_info *list = nullptr;
+    for (auto it = devices.rbegin(); it != devices.rend(); ++it) {
+        const EmulatedDevice &d = **it;
+        if (!(d.hid || d.ctaphid) || d.unplugged) continue;
+        if ((vid != 0 && d.vid != vid) || (pid != 0 && d.pid != pid)) continue;
+        struct hid_device_info *info = static_cast<struct hid_device_info *>(calloc(1, sizeof(*info)));
+        info->path = strdup(hid_path(d).c_str());
+        info->vendor_id = d.vid;
+        info->product_id = d.pid;
+        info->next = list;
+        list = info;
+    }
+    return list;
+}
+
+void hid_free_enumeration(struct hid_device_info *list) {
+    while (list != nullptr) {
+        struct hid_device_info *next = list->next;
+        free(list->path);
+        free(list);
+        list = next;
+    }
+}
+
+void hid_close(hid_device *device) {
+    {
+        std::lock_guard<std::mutex> dg(device->emulated->lock);
+        device->emulated->stats.open_handles--;
+    }
+    delete device;
+}
+
+int hid_send_feature_report(hid_device *device, const unsigned char *data, size_t length) {
+    std::lock_guard<std::mutex> dg(device->emulated->lock);
+    return device->emulated->hid_set_report(data, length);
+}
+
+int hid_get_feature_report(hid_device *device, unsigned char *data, size_t length) {
+    std::lock_guard<std::mutex> dg(device->emulated->lock);
+    return device->emulated->hid_get_report(data, length);
+}
+
+int hid_write(hid_device *device, const unsigned char *data, size_t length) {
+    std::lock_guard<std::mutex> dg(device->emulated->lock);
+    return device->emulated->ctap_write(data, length);
+}
+
+int hid_read_timeout(hid_device *device, unsigned char *data, size_t length, int) {
+    std::lock_guard<std::mutex> dg(device->emulated->lock);
+    return device->emulated->ctap_read(data, length);
+}
+
+// The hidraw requests on the emulated nodes are answered here, the rest goes to the kernel
+int ioctl(int fd, unsigned long request, ...) {
+    va_list args;
+    va_start(args, request);
+    void *argument = va_arg(args, void *);
+    va_end(args);
+
+    EmulatedDevice *d = _IOC_TYPE(request) == 'H' ? device_by_fd(fd, &EmulatedDevice::hidraw_path) : nullptr;
+    if (d == nullptr) {
+        return (int) syscall(SYS_ioctl, fd, request, argument);
+    }
+    std::lock_guard<std::mutex> dg(d->lock);
+    if (d->unplugged) {
+        errno = ENODEV;
+        return -1;
+    }
+    if (request == HIDIOCGRAWINFO) {
+        struct hidraw_devinfo *info = static_cast<struct hidraw_devinfo *>(argument);
+        info->bustype = BUS_USB;
+        info->vendor = (int16_t) d->vid;
+        info->product = (int16_t) d->pid;
+        return 0;
+    }
+    if (request == HIDIOCSFEATURE(_IOC_SIZE(request))) {
+        return d->hid_set_report(static_cast<const uint8_t *>(argument), _IOC_SIZE(request));
+    }
+    if (request == HIDIOCGFEATURE(_IOC_SIZE(request))) {
+        return d->hid_get_report(static_cast<uint8_t *>(argument), _IOC_SIZE(request));
+    }
+    errno = ENOTTY;
+    return -1;
+}
+
+#ifdef FEATURE_USE_PCSC
+
+// pcscd stand-in, which serves the emulated Nitrokey 3 devices attached to it as its readers
+
+const SCARD_IO_REQUEST g_rgSCardT0Pci = {SCARD_PROTOCOL_T0, sizeof(SCARD_IO_REQUEST)};
+const SCARD_IO_REQUEST g_rgSCardT1Pci = {SCARD_PROTOCOL_T1, sizeof(SCARD_IO_REQUEST)};
+
+LONG SCardEstablishContext(DWORD, LPCVOID, LPCVOID, LPSCARDCONTEXT phContext) {
+    *phContext = ++pcsc_contexts;
+    return SCARD_S_SUCCESS;
+}
+
+LONG SCardReleaseContext(SCARDCONTEXT) {
+    pcsc_contexts--;
+    return SCARD_S_SUCCESS;
+}
+
+LONG SCardListReaders(SCARDCONTEXT, LPCSTR, LPSTR mszReaders, LPDWORD pcchReaders) {
+    std::lock_guard<std::mutex> g(registry_lock);
+    std::string list;
+    for (auto &d: devices) {
+        if (!d->reader.empty() && !d->unplugged) list += d->reader + '\0';
+    }
+    if (list.empty()) return SCARD_E_NO_READERS_AVAILABLE;
+    list += '\0';
+    if (mszReaders != nullptr) {
+        if (*pcchReaders < list.size()) return SCARD_E_INSUFFICIENT_BUFFER;
+        memcpy(mszReaders, list.data(), list.size());
+    }
+    *pcchReaders = list.size();
+    return SCARD_S_SUCCESS;
+}
+
+LONG SCardConnect(SCARDCONTEXT, LPCSTR szReader, DWORD, DWORD dwPreferredProtocols, LPSCARDHANDLE phCard,
+                  LPDWORD pdwActiveProtocol) {
+    std::lock_guard<std::mutex> g(registry_lock);
+    for (auto &d: devices) {
+        if (d->reader != szReader || d->unplugged) continue;
+        if (!(dwPreferredProtocols & SCARD_PROTOCOL_T1)) return SCARD_E_SHARING_VIOLATION;
+        std::lock_guard<std::mutex> dg(d->lock);
+        d->selected = EmulatedDevice::App_None;
+        d->authenticated = false;
+        *phCard = ++last_pcsc_card;
+        *pdwActiveProtocol = SCARD_PROTOCOL_T1;
+        pcsc_cards[*phCard] = d.get();
+        d->stats.open_handles++;
+        return SCARD_S_SUCCESS;
+    }
+    return SCARD_E_UNKNOWN_READER;
+}
+
+LONG SCardDisconnect(SCARDHANDLE hCard, DWORD) {
+    std::lock_guard<std::mutex> g(registry_lock);
+    auto card = pcsc_cards.find(hCard);
+    if (card == pcsc_cards.end()) return SCARD_E_INVALID_HANDLE;
+    EmulatedDevice *d = card->second;
+    std::lock_guard<std::mutex> dg(d->lock);
+    if (d->pcsc_transaction == hCard) d->pcsc_transaction = 0;
+    d->stats.open_handles--;
+    pcsc_cards.erase(card);
+    return SCARD_S_SUCCESS;
+}
+
+// Another card handle in a transaction is refused here, instead of waiting for its end like pcscd
+LONG SCardBeginTransaction(SCARDHANDLE hCard) {
+    std::lock_guard<std::mutex> g(registry_lock);
+    auto card = pcsc_cards.find(hCard);
+    if (card == pcsc_cards.end()) return SCARD_E_INVALID_HANDLE;
+    EmulatedDevice *d = card->second;
+    std::lock_guard<std::mutex> dg(d->lock);
+    if (d->pcsc_transaction != 0 && d->pcsc_transaction != hCard) return SCARD_E_SHARING_VIOLATION;
+    d->pcsc_transaction = hCard;
+    return SCARD_S_SUCCESS;
+}
+
+LONG SCardEndTransaction(SCARDHANDLE hCard, DWORD) {
+    std::lock_guard<std::mutex> g(registry_lock);
+    auto card = pcsc_cards.find(hCard);
+    if (card == pcsc_cards.end()) return SCARD_E_INVALID_HANDLE;
+    EmulatedDevice *d = card->second;
+    std::lock_guard<std::mutex> dg(d->lock);
+    if (d->pcsc_transaction == hCard) d->pcsc_transaction = 0;
+    return SCARD_S_SUCCESS;
+}
+
+// The touch is awaited within the call, like pcscd does with the time extension frames of the device
+LONG SCardTransmit(SCARDHANDLE hCard, const SCARD_IO_REQUEST *, LPCBYTE pbSendBuffer, DWORD cbSendLength,
+                   SCARD_IO_REQUEST *, LPBYTE pbRecvBuffer, LPDWORD pcbRecvLength) {
+    EmulatedDevice *d;
+    {
+        std::lock_guard<std::mutex> g(registry_lock);
+        auto card = pcsc_cards.find(hCard);
+        if (card == pcsc_cards.end()) return SCARD_E_INVALID_HANDLE;
+        d = card->second;
+    }
+    std::lock_guard<std::mutex> dg(d->lock);
+    if (d->unplugged) return SCARD_W_REMOVED_CARD;
+    if (d->pcsc_transaction != 0 && d->pcsc_transaction != hCard) return SCARD_E_SHARING_VIOLATION;
+    d->stats.exchanges++;
+    bool touch = false;
+    const Bytes response = d->apdu(pbSendBuffer, cbSendLength, touch);
+    if ((touch || d->touch_all) && d->time_extensions == emulator::NEVER_TOUCHED) return SCARD_E_TIMEOUT;
+    if (*pcbRecvLength < response.size()) return SCARD_E_INSUFFICIENT_BUFFER;
+    memcpy(pbRecvBuffer, response.data(), response.size());
+    *pcbRecvLength = response.size();
+    return SCARD_S_SUCCESS;
+}
+
+const char *pcsc_stringify_error(const LONG pcscError) {
+    return pcscError == SCARD_S_SUCCESS ? "Command successful." : "Emulated PC/SC error";
+}
+
+#endif
+}
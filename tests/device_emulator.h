@@ -0,0 +1,163 @@
+/*
+ * Copyright (c) 2023 Nitrokey GmbH
+ *
+ * This file is part of Nitrokey HOTP verification project.
+ *
+ * Nitrokey HOTP verification is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * Nitrokey HOTP verification is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Nitrokey HOTP verification. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0
+ */
+
+#ifndef NITROKEY_HOTP_VERIFICATION_DEVICE_EMULATOR_H
+#define NITROKEY_HOTP_VERIFICATION_DEVICE_EMULATOR_H
+
+/**
+ * Emulated devices for the tests, which do not need the hardware.
+ *
+ * device_emulator.cpp provides its own definitions of the libusb and HIDAPI functions used by the core,
+ * so test binaries link against it instead of the real libraries. Each emulated Nitrokey 3 answers
+ * CCID messages like the Secrets App, including HOTP verification, and the same commands tunneled over its CTAPHID
+ * interface with HIDAPI. The emulated Nitrokey Pro answers the status, HOTP verification and AES key regeneration
+ * commands over HIDAPI, and over its hidraw node with the ioctl() defined here as well.
+ * With FEATURE_USE_PCSC the PC/SC functions are defined too, standing in for pcscd with a virtual reader like vpcd.
+ * XDG_RUNTIME_DIR points to a directory of the test process, so the device locks are not shared with
+ * the other tests running in parallel.
+ */
+
+#include <chrono>
+#include <climits>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+namespace emulator {
+
+    struct DeviceStats {
+        unsigned exchanges;
+        // CCID messages, which bSeq was not the previous one incremented by one
+        unsigned sequence_errors;
+        // libusb, HIDAPI and PC/SC handles open on the device
+        unsigned open_handles;
+        // VerifyPIN commands received by the Secrets App
+        unsigned pin_verifications;
+        // the most responses queued at once, more than one when messages were sent ahead
+        unsigned max_queued_responses;
+        // AES keys regenerated on the Nitrokey Pro
+        unsigned aes_keys_generated;
+        // APDUs received with the extended Lc
+        unsigned extended_apdus;
+        // GET RESPONSE commands answered with the data left by the previous response
+        unsigned get_responses;
+    };
+
+    // Credential stored by the Secrets App
+    struct StoredCredential {
+        // Kind_* | Algo_*
+        uint8_t kind_algo;
+        uint8_t digits;
+        std::string secret;
+        uint32_t counter;
+        bool touch;
+    };
+
+    struct GlobalStats {
+        int open_contexts;
+        int hidapi_users;
+        // bus enumerations with libusb_get_device_list()
+        int device_list_calls;
+        // PC/SC contexts established and not released yet
+        int pcsc_contexts;
+    };
+
+    // Remove all emulated devices
+    void reset();
+    // Attach an emulated Nitrokey 3, returns its index
+    size_t add_nk3(uint32_t serial);
+    // Attach an emulated Nitrokey Pro, returns its index
+    size_t add_pro(uint32_t card_serial);
+
+    // Let pcscd serve the emulated Nitrokey 3: its CCID interface is busy for libusb, and it is listed as a PC/SC reader
+    void attach_to_pcscd(size_t index);
+
+    // Status reads, for which the emulated Nitrokey Pro reports itself busy after accepting NEW_AES_KEY
+    const unsigned AES_KEY_GENERATION_READS = 3;
+
+    // Program the HOTP slot of an emulated Nitrokey Pro with the binary secret, for its VERIFY_OTP_CODE
+    void program_hotp(size_t index, const std::string &secret, uint32_t counter);
+
+    // Time extension count of a touch, which is never confirmed
+    const unsigned NEVER_TOUCHED = UINT_MAX;
+    // Require touch for every command. The device answers after the given count of time extension frames.
+    void require_touch(size_t index, unsigned time_extensions);
+    // Refuse Put for an already existing credential name, like firmware without overwrite support
+    void reject_overwrite(size_t index);
+    // Answer the next Put with the status word, like a device out of memory or refusing the data
+    void refuse_put(size_t index, uint16_t status);
+    // Put an extra response before the answer to the next message, with its bSeq shifted by seq_delta.
+    // Over CTAPHID the response goes to the channel shifted by seq_delta, like to another client.
+    void inject_stray_response(size_t index, int seq_delta);
+
+    enum class UsbFault {
+        // the bulk OUT transfer fails before the CCID message reaches the device
+        BulkOut,
+        // the bulk IN transfer fails, and the response it carried is lost
+        BulkIn,
+        // the HID SET_REPORT fails before the query reaches the device
+        HidSetReport,
+        // the HID GET_REPORT fails, the response stays to be read again
+        HidGetReport,
+        Count,
+    };
+    // Fail the next count transfers of the kind with an I/O error, like a flaky cable or hub
+    void inject_usb_errors(size_t index, UsbFault fault, unsigned count);
+
+    // dwMaxCCIDMessageLength, which the emulated CCID interface announces unless set otherwise
+    const uint32_t DEFAULT_MAX_CCID_MESSAGE = 3072;
+    // Announce the longest CCID message of the reader in the class descriptor of the interface
+    void set_max_ccid_message(size_t index, uint32_t length);
+
+    // Answer with at most length bytes of data at once, the rest is left for GET RESPONSE after the status 61xx,
+    // like a card behind a reader limited to the short APDUs
+    void limit_response(size_t index, size_t length);
+
+    // Pull the device out: it is no longer listed, and every transfer on its open handles fails
+    // like on a removed device, with LIBUSB_ERROR_NO_DEVICE, ENODEV and SCARD_W_REMOVED_CARD
+    void unplug(size_t index);
+
+    // Create a file standing in for the USB device node, which reads as its device descriptor.
+    // libusb_wrap_sys_device() recognizes the descriptors opened from it. Removed by reset(), or at the exit of the test process.
+    std::string device_node(size_t index);
+
+    // Create a file standing in for the hidraw node of the HID device. Removed by reset(), or at the exit of the test process.
+    std::string hidraw_node(size_t index);
+
+    DeviceStats device_stats(size_t index);
+    // Count of the credentials stored by the Secrets App of the emulated Nitrokey 3
+    size_t credential_count(size_t index);
+    // Copy the credential of the name to out, returns false if there is none
+    bool stored_credential(size_t index, const std::string &name, StoredCredential &out);
+    GlobalStats global_stats();
+
+    // Run the test on the virtual clock, and switch back to the system clock afterwards
+    struct VirtualClock {
+        VirtualClock();
+        ~VirtualClock();
+    };
+
+    // Real time passed since start, for the paths which must not sleep on the system clock
+    int64_t elapsed_ms(std::chrono::steady_clock::time_point start);
+
+}// namespace emulator
+
+#endif//NITROKEY_HOTP_VERIFICATION_DEVICE_EMULATOR_H
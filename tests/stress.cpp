@@ -0,0 +1,308 @@
+/*
+ * Copyright (c) 2023 Nitrokey GmbH
+ *
+ * This file is part of Nitrokey HOTP verification project.
+ *
+ * Nitrokey HOTP verification is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * Nitrokey HOTP verification is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Nitrokey HOTP verification. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0
+ */
+
+/**
+ * Soak and throughput harness for the set/check/status cycles on the emulated devices.
+ *
+ * Each worker thread takes its own emulated Nitrokey 3, and runs the cycles, reconnecting every --churn cycles
+ * (0 keeps the connection). --with-pro adds a worker checking codes on an emulated Nitrokey Pro; the set is done
+ * by the emulator there, as it does not answer the HID slot programming. The waits of the core go to the virtual
+ * clock, unless --real-clock is given, so the HID polls do not limit the rate.
+ *
+ * Reports the operations per second, the latency percentiles of each operation, the RSS growth after a warm-up,
+ * and the handles and file descriptors left open. Exits with 1 on failed operations, leaks, or RSS growth over
+ * --max-rss-growth-kb. Build it with the address sanitizer to catch the memory errors on the way; its quarantine
+ * holds the freed memory, so raise the RSS limit then, the leaks are reported by the sanitizer itself.
+ */
+
+#include "device_emulator.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+extern "C" {
+#include "../src/device.h"
+#include "../src/operations.h"
+#include "../src/return_codes.h"
+#include "../src/utils.h"
+#include <dirent.h>
+#include <unistd.h>
+}
+
+static const char *base32_secret = "GEZDGNBVGY3TQOJQGEZDGNBVGY3TQOJQ";
+static const char *binary_secret = "12345678901234567890";
+static const char *admin_PIN = "12345678";
+static const char *first_code = "755224";
+static const uint32_t NK3_SERIAL_BASE = 0x3000;
+static const uint32_t PRO_SERIAL = 0x5000;
+
+struct Options {
+    size_t threads = 4;
+    unsigned cycles = 1000;
+    unsigned churn = 1;
+    bool with_pro = false;
+    bool real_clock = false;
+    long max_rss_growth_kb = 4096;
+};
+
+enum Operation {
+    OP_CONNECT,
+    OP_DISCONNECT,
+    OP_SET,
+    OP_CHECK,
+    OP_STATUS,
+    OP_COUNT
+};
+static const char *OPERATION_NAMES[OP_COUNT] = {"connect", "disconnect", "set", "check", "status"};
+
+struct Worker {
+    bool pro = false;
+    // emulated Nitrokey Pro of the worker
+    size_t pro_index = 0;
+    unsigned failures[OP_COUNT] = {};
+    // microseconds, reserved ahead, so the measurement does not grow the RSS
+    std::vector<int64_t> latency_us[OP_COUNT];
+};
+
+static void print_usage(const char *name) {
+    printf("Usage: %s [--threads=N] [--cycles=N] [--churn=N] [--with-pro] [--real-clock] [--max-rss-growth-kb=N]\n",
+           name);
+}
+
+static bool parse_number(const char *text, long long min_value, long long *value) {
+    char *end = nullptr;
+    *value = strtoll(text, &end, 10);
+    return end != text && *end == '\0' && *value >= min_value;
+}
+
+static bool parse_options(int argc, char *argv[], Options *options) {
+    for (int i = 1; i < argc; ++i) {
+        const std::string arg = argv[i];
+        const size_t eq = arg.find('=');
+        const std::string name = arg.substr(0, eq);
+        const char *value = eq == std::string::npos ? "" : argv[i] + eq + 1;
+        long long number = 0;
+        if (name == "--threads" && parse_number(value, 1, &number)) {
+            options->threads = (size_t) number;
+        } else if (name == "--cycles" && parse_number(value, 1, &number)) {
+            options->cycles = (unsigned) number;
+        } else if (name == "--churn" && parse_number(value, 0, &number)) {
+            options->churn = (unsigned) number;
+        } else if (name == "--max-rss-growth-kb" && parse_number(value, 0, &number)) {
+            options->max_rss_growth_kb = (long) number;
+        } else if (arg == "--with-pro") {
+            options->with_pro = true;
+        } else if (arg == "--real-clock") {
+            options->real_clock = true;
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
+
+static long rss_kb() {
+    long pages = 0, resident = 0;
+    FILE *statm = fopen("/proc/self/statm", "r");
+    if (statm == nullptr) return -1;
+    const int read = fscanf(statm, "%ld %ld", &pages, &resident);
+    fclose(statm);
+    return read == 2 ? resident * (sysconf(_SC_PAGESIZE) / 1024) : -1;
+}
+
+static int open_fds() {
+    DIR *dir = opendir("/proc/self/fd");
+    if (dir == nullptr) return -1;
+    int count = 0;
+    while (readdir(dir) != nullptr) count++;
+    closedir(dir);
+    // ., .. and the descriptor of the listing itself
+    return count - 3;
+}
+
+template<typename F>
+static int timed(Worker &worker, Operation op, F call) {
+    const auto start = std::chrono::steady_clock::now();
+    const int res = call();
+    const auto elapsed = std::chrono::steady_clock::now() - start;
+    worker.latency_us[op].push_back(std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count());
+    return res;
+}
+
+static bool connect_worker(Worker &worker, struct Device *dev) {
+    if (worker.pro) {
+        device_set_connection_hints(dev, CONNECTION_HID, 'P');
+    } else {
+        device_set_connection_hints(dev, CONNECTION_CCID, '3');
+    }
+    const bool connected = timed(worker, OP_CONNECT, [&] { return device_connect(dev); }) == RET_NO_ERROR;
+    worker.failures[OP_CONNECT] += !connected;
+    return connected;
+}
+
+static void disconnect_worker(Worker &worker, struct Device *dev) {
+    worker.failures[OP_DISCONNECT] += timed(worker, OP_DISCONNECT, [&] { return device_disconnect(dev); }) != RET_NO_ERROR;
+}
+
+// A set, a check of the first code and a status query
+static void run_cycle(Worker &worker, struct Device *dev) {
+    if (worker.pro) {
+        // the emulated Nitrokey Pro is programmed directly, the core only checks the code
+        emulator::program_hotp(worker.pro_index, binary_secret, 0);
+    } else {
+        const int res = timed(worker, OP_SET, [&] { return set_secret_on_device(dev, base32_secret, admin_PIN, 0); });
+        worker.failures[OP_SET] += res != RET_NO_ERROR;
+    }
+    const int res = timed(worker, OP_CHECK, [&] { return check_code_on_device(dev, first_code); });
+    worker.failures[OP_CHECK] += res != RET_VALIDATION_PASSED;
+    struct FullResponseStatus status = {};
+    const int status_res = timed(worker, OP_STATUS, [&] { return device_get_status(dev, &status); });
+    worker.failures[OP_STATUS] += status_res != RET_NO_ERROR && status_res != RET_NO_PIN_ATTEMPTS;
+}
+
+static void run_worker(Worker &worker, const Options &options, unsigned cycles) {
+    struct Device dev = {};
+    bool connected = false;
+    for (unsigned cycle = 0; cycle < cycles; ++cycle) {
+        if (!connected) {
+            connected = connect_worker(worker, &dev);
+            if (!connected) {
+                continue;
+            }
+        }
+        run_cycle(worker, &dev);
+        if (options.churn > 0 && (cycle + 1) % options.churn == 0) {
+            disconnect_worker(worker, &dev);
+            connected = false;
+        }
+    }
+    if (connected) {
+        disconnect_worker(worker, &dev);
+    }
+}
+
+static void run_phase(std::vector<Worker> &workers, const Options &options, unsigned cycles) {
+    std::vector<std::thread> threads;
+    for (auto &worker: workers) {
+        threads.emplace_back([&worker, &options, cycles] { run_worker(worker, options, cycles); });
+    }
+    for (auto &thread: threads) {
+        thread.join();
+    }
+}
+
+static int64_t percentile(const std::vector<int64_t> &sorted, unsigned p) {
+    return sorted.empty() ? 0 : sorted[std::min(sorted.size() - 1, sorted.size() * p / 100)];
+}
+
+int main(int argc, char *argv[]) {
+    Options options;
+    if (!parse_options(argc, argv, &options)) {
+        print_usage(argv[0]);
+        return 2;
+    }
+    if (!options.real_clock) {
+        clock_set(&virtual_clock);
+        virtual_clock_reset();
+    }
+
+    emulator::reset();
+    std::vector<Worker> workers(options.threads + (options.with_pro ? 1 : 0));
+    for (size_t i = 0; i < options.threads; ++i) {
+        emulator::add_nk3(NK3_SERIAL_BASE + (uint32_t) i);
+    }
+    if (options.with_pro) {
+        workers.back().pro = true;
+        workers.back().pro_index = emulator::add_pro(PRO_SERIAL);
+    }
+
+    // the first allocations of the core and the libraries are not counted as growth
+    const unsigned warmup_cycles = std::max(1u, options.cycles / 10);
+    run_phase(workers, options, warmup_cycles);
+    unsigned failures = 0;
+    for (auto &worker: workers) {
+        for (auto &failed: worker.failures) {
+            failures += failed;
+            failed = 0;
+        }
+        for (auto &latencies: worker.latency_us) {
+            latencies.clear();
+            latencies.reserve(options.cycles);
+        }
+    }
+    const long rss_before = rss_kb();
+    const int fds_before = open_fds();
+    const int64_t slept_before = virtual_clock_slept_us();
+
+    const auto start = std::chrono::steady_clock::now();
+    run_phase(workers, options, options.cycles);
+    const double elapsed_s = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    const long rss_growth = rss_kb() - rss_before;
+    const int fds_after = open_fds();
+
+    printf("%zu Nitrokey 3 workers%s, %u cycles each after %u warm-up cycles, reconnecting every %u cycles\n",
+           options.threads, options.with_pro ? " and a Nitrokey Pro worker" : "", options.cycles, warmup_cycles,
+           options.churn);
+    printf("%-12s %8s %8s %8s %8s %8s %8s\n", "operation", "count", "failed", "p50 us", "p90 us", "p99 us", "max us");
+    size_t operations = 0;
+    for (int op = 0; op < OP_COUNT; ++op) {
+        std::vector<int64_t> all;
+        unsigned failed = 0;
+        for (auto &worker: workers) {
+            all.insert(all.end(), worker.latency_us[op].begin(), worker.latency_us[op].end());
+            failed += worker.failures[op];
+        }
+        std::sort(all.begin(), all.end());
+        operations += all.size();
+        failures += failed;
+        printf("%-12s %8zu %8u %8lld %8lld %8lld %8lld\n", OPERATION_NAMES[op], all.size(), failed,
+               (long long) percentile(all, 50), (long long) percentile(all, 90), (long long) percentile(all, 99),
+               (long long) (all.empty() ? 0 : all.back()));
+    }
+    printf("Throughput: %.0f operations/s (%zu in %.3f s)\n", operations / elapsed_s, operations, elapsed_s);
+    if (!options.real_clock) {
+        printf("Waits on the virtual clock: %.3f s\n", (virtual_clock_slept_us() - slept_before) / 1e6);
+    }
+
+    unsigned leaked_handles = 0;
+    for (size_t i = 0; i < workers.size(); ++i) {
+        leaked_handles += emulator::device_stats(i).open_handles;
+    }
+    const auto global = emulator::global_stats();
+    leaked_handles += global.open_contexts + global.hidapi_users;
+    printf("RSS growth: %ld kB (limit %ld kB)\n", rss_growth, options.max_rss_growth_kb);
+    printf("Open file descriptors: %d before, %d after\n", fds_before, fds_after);
+    printf("Leaked handles: %u\n", leaked_handles);
+    printf("Failed operations: %u\n", failures);
+
+    const bool passed = failures == 0 && leaked_handles == 0 && fds_after <= fds_before &&
+                        rss_growth <= options.max_rss_growth_kb;
+    printf("%s\n", passed ? "PASSED" : "FAILED");
+    clock_set(nullptr);
+    return passed ? 0 : 1;
+}
@@ -0,0 +1,198 @@
+/*
+ * Copyright (c) 2023 Nitrokey GmbH
+ *
+ * This file is part of Nitrokey HOTP verification project.
+ *
+ * Nitrokey HOTP verification is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * Nitrokey HOTP verification is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Nitrokey HOTP verification. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0
+ */
+
+#include "catch.hpp"
+#include "device_emulator.h"
+#include <cstring>
+#include <string>
+#include <vector>
+
+extern "C" {
+#include "../src/ccid.h"
+#include "../src/device.h"
+#include "../src/operations.h"
+#include "../src/return_codes.h"
+#include "../src/tlv.h"
+#include "../src/utils.h"
+}
+
+using Bytes = std::vector<uint8_t>;
+
+static const char *base32_secret = "GEZDGNBVGY3TQOJQGEZDGNBVGY3TQOJQ";
+
+static Bytes compose(uint32_t le, size_t data_len) {
+    Bytes data(data_len, 0x5A);
+    Bytes apdu(16 + data_len);
+    const uint32_t length = iso7816_compose(apdu.data(), (uint32_t) apdu.size(), Ins_Put, 1, 2, 0, le, data.data(), data_len);
+    apdu.resize(length);
+    return apdu;
+}
+
+TEST_CASE("APDU lengths take the extended form only when needed", "[apdu]") {
+    SECTION("short") {
+        CHECK(compose(0, 0) == Bytes{0x00, Ins_Put, 1, 2});
+        CHECK(compose(0xFF, 0) == Bytes{0x00, Ins_Put, 1, 2, 0xFF});
+        // 256 is encoded as zero
+        CHECK(compose(256, 0) == Bytes{0x00, Ins_Put, 1, 2, 0x00});
+        const Bytes apdu = compose(4, 255);
+        REQUIRE(apdu.size() == 4 + 1 + 255 + 1);
+        CHECK(apdu[4] == 0xFF);
+        CHECK(apdu.back() == 4);
+        CHECK(iso7816_lc_size(255, 4) == 1);
+    }
+    SECTION("extended Lc") {
+        const Bytes apdu = compose(0, 300);
+        REQUIRE(apdu.size() == 4 + 3 + 300);
+        CHECK(Bytes(apdu.begin() + 4, apdu.begin() + 7) == Bytes{0x00, 0x01, 0x2C});
+        CHECK(apdu[7] == 0x5A);
+        CHECK(iso7816_lc_size(300, 0) == 3);
+    }
+    SECTION("extended Le follows the extended Lc with 2 bytes") {
+        const Bytes apdu = compose(1024, 10);
+        REQUIRE(apdu.size() == 4 + 3 + 10 + 2);
+        CHECK(Bytes(apdu.begin() + 4, apdu.begin() + 7) == Bytes{0x00, 0x00, 0x0A});
+        CHECK(Bytes(apdu.end() - 2, apdu.end()) == Bytes{0x04, 0x00});
+        CHECK(iso7816_lc_size(10, 1024) == 3);
+    }
+    SECTION("extended Le alone takes 3 bytes") {
+        CHECK(compose(257, 0) == Bytes{0x00, Ins_Put, 1, 2, 0x00, 0x01, 0x01});
+        CHECK(compose(65536, 0) == Bytes{0x00, Ins_Put, 1, 2, 0x00, 0x00, 0x00});
+    }
+    SECTION("nothing is truncated") {
+        uint8_t data[300] = {};
+        uint8_t apdu[300] = {};
+        CHECK(iso7816_compose(apdu, sizeof apdu, Ins_Put, 0, 0, 0, 0, data, sizeof data) == 0);
+        CHECK(compose(65537, 0).empty());
+        CHECK(compose(0, 65536).empty());
+    }
+}
+
+TEST_CASE("CCID messages carry the data over 255 bytes", "[apdu]") {
+    Bytes apdu = compose(0, 300);
+    Bytes message(CCID_HEADER_SIZE + apdu.size());
+    const uint32_t length = icc_compose(message.data(), (uint32_t) message.size(), PC_TO_RDR_XFRBLOCK, apdu.size(), 0, 0, 0x0102, apdu.data());
+    REQUIRE(length == message.size());
+    CHECK(Bytes(message.begin() + 1, message.begin() + 5) == Bytes{0x33, 0x01, 0x00, 0x00});
+    CHECK(message[8] == 0x02);
+    CHECK(message[9] == 0x01);
+
+    // a response of 300 bytes, at an odd address
+    Bytes response(1 + CCID_HEADER_SIZE + 302, 0x11);
+    uint8_t *frame = response.data() + 1;
+    const uint8_t header[CCID_HEADER_SIZE] = {RDR_TO_PC_DATABLOCK, 0x2E, 0x01, 0, 0, 0, 0, 0, 0, 0};
+    memcpy(frame, header, sizeof header);
+    frame[CCID_HEADER_SIZE + 300] = 0x90;
+    frame[CCID_HEADER_SIZE + 301] = 0x00;
+    const IccResult result = parse_icc_result(frame, response.size() - 1);
+    CHECK(result.data_len == 302);
+    CHECK(result.data_status_code == 0x9000);
+}
+
+TEST_CASE("Responses over the limit of the reader are joined from GET RESPONSE", "[emulated][apdu]") {
+    emulator::reset();
+    const size_t index = emulator::add_nk3(0x4711);
+    struct Device dev = {};
+    device_set_connection_hints(&dev, CONNECTION_CCID, '3');
+    REQUIRE(device_connect(&dev) == RET_NO_ERROR);
+    REQUIRE(set_secret_on_device(&dev, base32_secret, "12345678", 0) == RET_NO_ERROR);
+
+    IccResult whole = {};
+    REQUIRE(send_select_ccid(&dev, &whole) == RET_NO_ERROR);
+    const Bytes expected(whole.data, whole.data + whole.data_len);
+    REQUIRE(expected.size() > 10);
+
+    emulator::limit_response(index, 4);
+    IccResult joined = {};
+    REQUIRE(send_select_ccid(&dev, &joined) == RET_NO_ERROR);
+    CHECK(emulator::device_stats(index).get_responses == (expected.size() - 2 + 3) / 4 - 1);
+    CHECK(joined.data_status_code == 0x9000);
+    CHECK(Bytes(joined.data, joined.data + joined.data_len) == expected);
+
+    struct FullResponseStatus status = {};
+    CHECK(device_get_status(&dev, &status) == RET_NO_ERROR);
+    CHECK(status.response_status.card_serial_u32 == 0x4711);
+    CHECK(status.response_status.retry_admin == 8);
+    CHECK(check_code_on_device(&dev, "755224") == RET_VALIDATION_PASSED);
+    device_disconnect(&dev);
+}
+
+TEST_CASE("A command over 255 bytes is sent in a single extended APDU", "[emulated][apdu]") {
+    emulator::reset();
+    const size_t index = emulator::add_nk3(0x4711);
+    struct Device dev = {};
+    device_set_connection_hints(&dev, CONNECTION_CCID, '3');
+    REQUIRE(device_connect(&dev) == RET_NO_ERROR);
+
+    const std::string name(200, 'n');
+    uint8_t key[102] = {0x11, 6};
+    TLV tlvs[] = {
+            {.tag = Tag_CredentialId, .length = (uint8_t) name.size(), .type = 'S', .v_str = name.c_str()},
+            {.tag = Tag_Key, .length = sizeof key, .type = 'R', .v_data = key},
+    };
+    const uint32_t length = icc_pack_tlvs_for_sending(&dev.ccid_buffer_out, tlvs, 2, Ins_Put);
+    REQUIRE(length == CCID_HEADER_SIZE + 4 + 3 + 2 + name.size() + 2 + sizeof key);
+    const auto exchanges = emulator::device_stats(index).exchanges;
+    IccResult result = {};
+    REQUIRE(ccid_process_single(&dev, dev.ccid_buffer_out.data, length, &result) == 0);
+    CHECK(result.data_status_code == 0x9000);
+    CHECK(emulator::device_stats(index).exchanges == exchanges + 1);
+    CHECK(emulator::device_stats(index).extended_apdus == 1);
+    device_disconnect(&dev);
+}
+
+TEST_CASE("Responses are limited by the reader, and joined from GET RESPONSE beyond it", "[emulated][apdu]") {
+    emulator::reset();
+    const size_t index = emulator::add_nk3(0x4711);
+    struct Device dev = {};
+    device_set_connection_hints(&dev, CONNECTION_CCID, '3');
+    REQUIRE(device_connect(&dev) == RET_NO_ERROR);
+    CHECK(dev.ccid_max_message_length == emulator::DEFAULT_MAX_CCID_MESSAGE);
+
+    // the list of the credentials takes 125 bytes for each
+    const size_t credentials = 40;
+    uint8_t key[22] = {0x11, 6};
+    for (size_t i = 0; i < credentials; ++i) {
+        const std::string name = std::to_string(100 + i) + std::string(119, 'n');
+        TLV tlvs[] = {
+                {.tag = Tag_CredentialId, .length = (uint8_t) name.size(), .type = 'S', .v_str = name.c_str()},
+                {.tag = Tag_Key, .length = sizeof key, .type = 'R', .v_data = key},
+        };
+        const uint32_t length = icc_pack_tlvs_for_sending(&dev.ccid_buffer_out, tlvs, 2, Ins_Put);
+        IccResult result = {};
+        REQUIRE(ccid_process_single(&dev, dev.ccid_buffer_out.data, length, &result) == 0);
+        REQUIRE(result.data_status_code == 0x9000);
+    }
+
+    emulator::limit_response(index, 255);
+    uint32_t length = icc_pack_apdu_for_sending(&dev.ccid_buffer_out, Ins_List, 0, 0, 0);
+    IccResult joined = {};
+    REQUIRE(ccid_process_single(&dev, dev.ccid_buffer_out.data, length, &joined) == 0);
+    CHECK(joined.data_status_code == 0x9000);
+    CHECK(joined.data_len == credentials * 125 + 2);
+    CHECK(joined.data_len > emulator::DEFAULT_MAX_CCID_MESSAGE);
+
+    // the same list in a single message is longer than the reader sends
+    emulator::limit_response(index, 0);
+    length = icc_pack_apdu_for_sending(&dev.ccid_buffer_out, Ins_List, 0, 0, 0);
+    IccResult whole = {};
+    CHECK(ccid_process_single(&dev, dev.ccid_buffer_out.data, length, &whole) == RET_COMM_ERROR);
+    device_disconnect(&dev);
+}
@@ -0,0 +1,217 @@
+/*
+ * Copyright (c) 2023 Nitrokey GmbH
+ *
+ * This file is part of Nitrokey HOTP verification project.
+ *
+ * Nitrokey HOTP verification is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * Nitrokey HOTP verification is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Nitrokey HOTP verification. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0
+ */
+
+#include "catch.hpp"
+#include "device_emulator.h"
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <fcntl.h>
+#include <mutex>
+#include <string>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+extern "C" {
+#include "../src/device.h"
+#include "../src/return_codes.h"
+}
+
+static std::string queue_directory(const char *key) {
+    return std::string(getenv("XDG_RUNTIME_DIR")) + "/hotp-verification/queue/" + key;
+}
+
+TEST_CASE("Busy device is handed over in the order of arrival", "[emulated][arbitration]") {
+    emulator::reset();
+    emulator::add_nk3(0x4242);
+    struct Device holder = {};
+    device_set_connection_hints(&holder, CONNECTION_CCID, 0);
+    REQUIRE(device_connect(&holder) == RET_NO_ERROR);
+
+    const size_t waiters_count = 4;
+    std::mutex order_lock;
+    std::vector<size_t> order;
+    std::atomic<int> failures{0};
+    std::vector<std::thread> waiters;
+    for (size_t i = 0; i < waiters_count; ++i) {
+        waiters.emplace_back([&, i]() {
+            struct Device dev = {};
+            device_set_connection_hints(&dev, CONNECTION_CCID, 0);
+            if (device_connect(&dev) != RET_NO_ERROR) {
+                failures++;
+                return;
+            }
+            {
+                std::lock_guard<std::mutex> g(order_lock);
+                order.push_back(i);
+            }
+            struct FullResponseStatus status = {};
+            device_get_status(&dev, &status);
+            if (status.response_status.card_serial_u32 != 0x4242) failures++;
+            device_disconnect(&dev);
+        });
+        // let each waiter join the queue, before the next one comes
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    }
+    device_disconnect(&holder);
+    for (auto &t: waiters) {
+        t.join();
+    }
+
+    CHECK(failures == 0);
+    REQUIRE(order.size() == waiters_count);
+    for (size_t i = 0; i < waiters_count; ++i) {
+        CHECK(order[i] == i);
+    }
+    CHECK(emulator::device_stats(0).open_handles == 0);
+}
+
+TEST_CASE("Waiting for a busy device ends with the deadline", "[emulated][arbitration]") {
+    emulator::reset();
+    const int64_t budget_ms = 200;
+    struct Device holder = {};
+    struct Device waiter = {};
+
+    SECTION("CCID") {
+        emulator::add_nk3(0x1);
+        device_set_connection_hints(&holder, CONNECTION_CCID, 0);
+        device_set_connection_hints(&waiter, CONNECTION_CCID, 0);
+    }
+
+    SECTION("HID") {
+        emulator::add_pro(0x2);
+        device_set_connection_hints(&holder, CONNECTION_HID, 'P');
+        device_set_connection_hints(&waiter, CONNECTION_HID, 'P');
+    }
+
+    REQUIRE(device_connect(&holder) == RET_NO_ERROR);
+    waiter.deadline = deadline_in(budget_ms);
+    const auto start = std::chrono::steady_clock::now();
+    CHECK(device_connect(&waiter) == RET_TIMEOUT);
+    CHECK(emulator::elapsed_ms(start) >= budget_ms - 20);
+    CHECK(emulator::elapsed_ms(start) < budget_ms + 300);
+
+    // the device is taken right after its release
+    device_disconnect(&holder);
+    waiter.deadline = deadline_in(budget_ms);
+    CHECK(device_connect(&waiter) == RET_NO_ERROR);
+    device_disconnect(&waiter);
+}
+
+TEST_CASE("Queue skips the waiters, which ended without leaving it", "[emulated][arbitration]") {
+    emulator::reset();
+    emulator::add_nk3(0x3);
+    struct Device dev = {};
+    device_set_connection_hints(&dev, CONNECTION_CCID, 0);
+    // creates the lock directory, and names the lock of the device
+    REQUIRE(device_connect(&dev) == RET_NO_ERROR);
+    const std::string directory = queue_directory(dev.lock.key);
+    device_disconnect(&dev);
+
+    mkdir((directory + "/..").c_str(), 0700);
+    mkdir(directory.c_str(), 0700);
+    const std::string earlier = directory + "/0";
+    const int fd = open(earlier.c_str(), O_RDWR | O_CREAT, 0600);
+    REQUIRE(fd >= 0);
+
+    SECTION("live waiter is waited for") {
+        REQUIRE(flock(fd, LOCK_EX) == 0);
+        dev.deadline = deadline_in(100);
+        CHECK(device_connect(&dev) == RET_TIMEOUT);
+        CHECK(access(earlier.c_str(), F_OK) == 0);
+        unlink(earlier.c_str());
+    }
+
+    SECTION("unlocked file is removed") {
+        dev.deadline = deadline_in(100);
+        REQUIRE(device_connect(&dev) == RET_NO_ERROR);
+        CHECK(access(earlier.c_str(), F_OK) != 0);
+        device_disconnect(&dev);
+    }
+    close(fd);
+}
+
+TEST_CASE("Waiting for a busy device does not hold up the callers of another one", "[emulated][arbitration]") {
+    emulator::reset();
+    emulator::add_nk3(0x4);
+    emulator::add_pro(0x5);
+    struct Device holder = {};
+    device_set_connection_hints(&holder, CONNECTION_CCID, '3');
+    REQUIRE(device_connect(&holder) == RET_NO_ERROR);
+
+    // queued for the Nitrokey 3, until the holder releases it
+    std::atomic<int> waiter_result{-1};
+    std::thread waiter([&]() {
+        struct Device dev = {};
+        device_set_connection_hints(&dev, CONNECTION_CCID, '3');
+        dev.deadline = deadline_in(2000);
+        waiter_result = device_connect(&dev);
+        device_disconnect(&dev);
+    });
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+
+    // the Nitrokey Pro is free, and taken right away
+    struct Device other = {};
+    device_set_connection_hints(&other, CONNECTION_HID, 'P');
+    other.deadline = deadline_in(1000);
+    const auto start = std::chrono::steady_clock::now();
+    CHECK(device_connect(&other) == RET_NO_ERROR);
+    CHECK(emulator::elapsed_ms(start) < 500);
+    device_disconnect(&other);
+
+    device_disconnect(&holder);
+    waiter.join();
+    CHECK(waiter_result == RET_NO_ERROR);
+}
+
+TEST_CASE("Keys of the same HID model are counted and taken one by one", "[emulated][arbitration]") {
+    emulator::reset();
+    emulator::add_pro(0x6);
+    emulator::add_pro(0x7);
+    struct Device first = {};
+    device_set_connection_hints(&first, CONNECTION_HID, 'P');
+    CHECK(device_count_available(&first) == 2);
+
+    // the second caller gets the other key, instead of waiting for the first one
+    struct Device second = {};
+    device_set_connection_hints(&second, CONNECTION_HID, 'P');
+    second.deadline = deadline_in(1000);
+    REQUIRE(device_connect(&first) == RET_NO_ERROR);
+    const auto start = std::chrono::steady_clock::now();
+    REQUIRE(device_connect(&second) == RET_NO_ERROR);
+    CHECK(emulator::elapsed_ms(start) < 500);
+
+    struct FullResponseStatus first_status = {}, second_status = {};
+    device_get_status(&first, &first_status);
+    device_get_status(&second, &second_status);
+    CHECK(first_status.response_status.card_serial_u32 != second_status.response_status.card_serial_u32);
+
+    // a third caller finds both keys taken
+    struct Device third = {};
+    device_set_connection_hints(&third, CONNECTION_HID, 'P');
+    CHECK(device_connect(&third) == RET_DEVICE_BUSY);
+
+    device_disconnect(&second);
+    device_disconnect(&first);
+}
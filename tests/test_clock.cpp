@@ -0,0 +1,98 @@
+/*
+ * Copyright (c) 2023 Nitrokey GmbH
+ *
+ * This file is part of Nitrokey HOTP verification project.
+ *
+ * Nitrokey HOTP verification is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * Nitrokey HOTP verification is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Nitrokey HOTP verification. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0
+ */
+
+#include "catch.hpp"
+#include "device_emulator.h"
+#include <chrono>
+
+extern "C" {
+#include "../src/device.h"
+#include "../src/operations.h"
+#include "../src/return_codes.h"
+#include "../src/utils.h"
+}
+
+static const char *base32_secret = "GEZDGNBVGY3TQOJQGEZDGNBVGY3TQOJQ";
+static const char *admin_PIN = "12345678";
+// Real time allowed for a path, which would sleep for seconds on the system clock
+static const int64_t real_limit_ms = 500;
+// device_receive() waits before each status read
+static const int64_t hid_poll_us = 200 * 1000;
+// device_connect() waits after each model not found
+static const int64_t connection_delay_us = 500 * 1000;
+
+TEST_CASE("The AES key regeneration waits on the virtual clock", "[emulated][clock]") {
+    emulator::reset();
+    const size_t index = emulator::add_pro(0x5151);
+    emulator::VirtualClock clock;
+    struct Device dev = {};
+    REQUIRE(device_connect(&dev) == RET_NO_ERROR);
+    const auto start = std::chrono::steady_clock::now();
+    virtual_clock_reset();
+
+    SECTION("accepted") {
+        REQUIRE(regenerate_AES_key(&dev, admin_PIN) == RET_NO_ERROR);
+        CHECK(emulator::device_stats(index).aes_keys_generated == 1);
+        // a poll for each busy status read and the last one, then a second for the device to settle
+        CHECK(virtual_clock_slept_us() == (emulator::AES_KEY_GENERATION_READS + 1) * hid_poll_us + 1000 * 1000);
+    }
+
+    SECTION("wrong admin PIN") {
+        CHECK(regenerate_AES_key(&dev, "00000000") == RET_WRONG_PIN);
+        CHECK(emulator::device_stats(index).aes_keys_generated == 0);
+        CHECK(virtual_clock_slept_us() == hid_poll_us);
+    }
+
+    CHECK(emulator::elapsed_ms(start) < real_limit_ms);
+    device_disconnect(&dev);
+}
+
+TEST_CASE("The deadlines pass on the virtual clock", "[emulated][clock]") {
+    emulator::reset();
+    emulator::VirtualClock clock;
+    const int64_t budget_ms = 60 * 1000;
+
+    SECTION("touch is never confirmed") {
+        const size_t index = emulator::add_nk3(0x1234);
+        struct Device dev = {};
+        REQUIRE(device_connect(&dev) == RET_NO_ERROR);
+        REQUIRE(set_secret_on_device(&dev, base32_secret, admin_PIN, 0) == RET_NO_ERROR);
+        emulator::require_touch(index, emulator::NEVER_TOUCHED);
+        const auto start = std::chrono::steady_clock::now();
+        virtual_clock_reset();
+        dev.deadline = deadline_in(budget_ms);
+        REQUIRE(check_code_on_device(&dev, "755224") == RET_TIMEOUT);
+        CHECK(emulator::elapsed_ms(start) < real_limit_ms);
+        // the last wait is cut to the deadline
+        CHECK(virtual_clock_slept_us() == budget_ms * 1000);
+        device_disconnect(&dev);
+    }
+
+    SECTION("no device is present") {
+        struct Device dev = {};
+        const auto start = std::chrono::steady_clock::now();
+        REQUIRE(device_connect(&dev) == RET_COMM_ERROR);
+        CHECK(emulator::elapsed_ms(start) < real_limit_ms);
+        CHECK(virtual_clock_slept_us() > 0);
+        CHECK(virtual_clock_slept_us() % connection_delay_us == 0);
+        CHECK(emulator::global_stats().open_contexts == 0);
+    }
+}
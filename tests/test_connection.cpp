@@ -0,0 +1,176 @@
+/*
+ * Copyright (c) 2023 Nitrokey GmbH
+ *
+ * This file is part of Nitrokey HOTP verification project.
+ *
+ * Nitrokey HOTP verification is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * Nitrokey HOTP verification is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Nitrokey HOTP verification. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0
+ */
+
+#include "catch.hpp"
+#include "device_emulator.h"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fcntl.h>
+#include <string>
+#include <unistd.h>
+
+extern "C" {
+#include "../src/connection_cache.h"
+#include "../src/device.h"
+#include "../src/operations.h"
+#include "../src/return_codes.h"
+}
+
+TEST_CASE("Connection hints skip probing the other transports", "[emulated][connection]") {
+    emulator::reset();
+    emulator::add_nk3(0x1234);
+    struct Device dev = {};
+
+    SECTION("CCID hint connects without the HID probe") {
+        device_set_connection_hints(&dev, CONNECTION_CCID, 0);
+        const auto start = std::chrono::steady_clock::now();
+        REQUIRE(device_connect(&dev) == RET_NO_ERROR);
+        const auto elapsed = std::chrono::steady_clock::now() - start;
+        // a single HID probe sleeps for 500 ms
+        CHECK(elapsed < std::chrono::milliseconds(400));
+        CHECK(dev.connection_type == CONNECTION_CCID);
+        CHECK(dev.dev_info.pid == NITROKEY_3_USB_PID);
+        device_disconnect(&dev);
+    }
+
+    SECTION("model hint selects the transport") {
+        device_set_connection_hints(&dev, CONNECTION_UNKNOWN, '3');
+        const auto start = std::chrono::steady_clock::now();
+        REQUIRE(device_connect(&dev) == RET_NO_ERROR);
+        CHECK(std::chrono::steady_clock::now() - start < std::chrono::milliseconds(400));
+        CHECK(dev.connection_type == CONNECTION_CCID);
+        device_disconnect(&dev);
+    }
+
+    SECTION("a model not available over the transport fails right away") {
+        device_set_connection_hints(&dev, CONNECTION_HID, '3');
+        const auto start = std::chrono::steady_clock::now();
+        CHECK(device_connect(&dev) == RET_COMM_ERROR);
+        CHECK(std::chrono::steady_clock::now() - start < std::chrono::milliseconds(400));
+        device_set_connection_hints(&dev, CONNECTION_CCID, 'P');
+        CHECK(device_connect(&dev) == RET_COMM_ERROR);
+    }
+}
+
+TEST_CASE("Device given by its USB node skips the enumeration", "[emulated][connection]") {
+    emulator::reset();
+    emulator::add_nk3(0x1111);
+    const size_t index = emulator::add_nk3(0x2222);
+    const std::string node = emulator::device_node(index);
+    REQUIRE(!node.empty());
+    struct Device dev = {};
+    const int list_calls = emulator::global_stats().device_list_calls;
+
+    SECTION("path") {
+        device_set_location(&dev, node.c_str(), -1);
+        REQUIRE(device_connect(&dev) == RET_NO_ERROR);
+        CHECK(dev.connection_type == CONNECTION_CCID);
+    }
+
+    SECTION("inherited file descriptor") {
+        const int fd = open(node.c_str(), O_RDWR);
+        REQUIRE(fd >= 0);
+        device_set_location(&dev, nullptr, fd);
+        REQUIRE(device_connect(&dev) == RET_NO_ERROR);
+        CHECK(dev.connection_type == CONNECTION_CCID);
+        close(fd);
+    }
+
+    SECTION("hints are respected") {
+        device_set_location(&dev, node.c_str(), -1);
+        device_set_connection_hints(&dev, CONNECTION_HID, 0);
+        CHECK(device_connect(&dev) == RET_UNKNOWN_DEVICE);
+        device_set_connection_hints(&dev, CONNECTION_UNKNOWN, 'P');
+        CHECK(device_connect(&dev) == RET_UNKNOWN_DEVICE);
+        return;
+    }
+
+    // the second device was opened, without looking at the bus
+    struct FullResponseStatus status = {};
+    device_get_status(&dev, &status);
+    CHECK(status.response_status.card_serial_u32 == 0x2222);
+    CHECK(emulator::global_stats().device_list_calls == list_calls);
+    device_disconnect(&dev);
+    CHECK(emulator::device_stats(index).open_handles == 0);
+}
+
+TEST_CASE("Node which is not a supported device is refused", "[connection]") {
+    char path[] = "/tmp/hotp-verification-node-XXXXXX";
+    const int fd = mkstemp(path);
+    REQUIRE(fd >= 0);
+    REQUIRE(write(fd, "not a descriptor", 16) == 16);
+    close(fd);
+    struct Device dev = {};
+    device_set_location(&dev, path, -1);
+    CHECK(device_connect(&dev) == RET_UNKNOWN_DEVICE);
+    device_set_location(&dev, "/nonexistent/usb/node", -1);
+    CHECK(device_connect(&dev) == RET_COMM_ERROR);
+    unlink(path);
+}
+
+TEST_CASE("Last connected device is remembered in the cache file", "[connection]") {
+    char directory[] = "/tmp/hotp-verification-test-XXXXXX";
+    REQUIRE(mkdtemp(directory) != nullptr);
+    const std::string base = std::string(directory) + "/cache";
+    setenv("XDG_CACHE_HOME", base.c_str(), 1);
+
+    char path[FILENAME_MAX] = {};
+    REQUIRE(connection_cache_path(path, sizeof path));
+    CHECK(std::string(path) == base + "/hotp-verification/last-device");
+
+    struct ConnectionCache cache = {};
+    CHECK(connection_cache_load(&cache) == RET_NOT_FOUND);
+
+    const struct ConnectionCache stored = {CONNECTION_CCID, NITROKEY_USB_VID, NITROKEY_3_USB_PID};
+    // the cache directories are created on demand
+    REQUIRE(connection_cache_store(&stored) == RET_NO_ERROR);
+    REQUIRE(connection_cache_load(&cache) == RET_NO_ERROR);
+    CHECK(cache.transport == CONNECTION_CCID);
+    CHECK(cache.vid == NITROKEY_USB_VID);
+    CHECK(cache.pid == NITROKEY_3_USB_PID);
+    const VidPid *model = device_find_model(cache.vid, cache.pid);
+    REQUIRE(model != nullptr);
+    CHECK(model->name_short == '3');
+
+    SECTION("malformed cache is ignored") {
+        FILE *f = fopen(path, "w");
+        REQUIRE(f != nullptr);
+        fputs("usb 20a0:42b2\n", f);
+        fclose(f);
+        CHECK(connection_cache_load(&cache) == RET_NOT_FOUND);
+    }
+
+    SECTION("relative XDG_CACHE_HOME falls back to HOME") {
+        const char *home = getenv("HOME");
+        const std::string saved_home = home != nullptr ? home : "";
+        setenv("XDG_CACHE_HOME", "relative", 1);
+        setenv("HOME", directory, 1);
+        const bool found = connection_cache_path(path, sizeof path);
+        setenv("HOME", saved_home.c_str(), 1);
+        REQUIRE(found);
+        CHECK(std::string(path) == std::string(directory) + "/.cache/hotp-verification/last-device");
+    }
+
+    unsetenv("XDG_CACHE_HOME");
+    const std::string cleanup = std::string("rm -rf ") + directory;
+    CHECK(system(cleanup.c_str()) == 0);
+}
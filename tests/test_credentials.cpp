@@ -0,0 +1,282 @@
+/*
+ * Copyright (c) 2023 Nitrokey GmbH
+ *
+ * This file is part of Nitrokey HOTP verification project.
+ *
+ * Nitrokey HOTP verification is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * Nitrokey HOTP verification is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Nitrokey HOTP verification. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0
+ */
+
+
+#include "catch.hpp"
+#include "device_emulator.h"
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+extern "C" {
+#include "../src/base32.h"
+#include "../src/ccid.h"
+#include "../src/credentials.h"
+#include "../src/device.h"
+#include "../src/operations.h"
+#include "../src/operations_ccid.h"
+#include "../src/return_codes.h"
+#include "../src/session.h"
+}
+
+// RFC 4226 secret "12345678901234567890"
+static const char *RFC_SECRET = "GEZDGNBVGY3TQOJQGEZDGNBVGY3TQOJQ";
+static const char *admin_PIN = "12345678";
+
+static std::string write_credentials(const std::string &content) {
+    char path[] = "/tmp/hotp-credentials-XXXXXX";
+    const int fd = mkstemp(path);
+    REQUIRE(fd >= 0);
+    REQUIRE(write(fd, content.data(), content.size()) == (ssize_t) content.size());
+    close(fd);
+    return path;
+}
+
+static struct Credential hotp_credential(const std::string &name, uint32_t counter) {
+    struct Credential credential = {};
+    strncpy(credential.name, name.c_str(), sizeof(credential.name) - 1);
+    strncpy(credential.secret, RFC_SECRET, sizeof(credential.secret) - 1);
+    credential.kind = Kind_Hotp;
+    credential.algorithm = Algo_Sha1;
+    credential.digits = 6;
+    credential.counter = counter;
+    return credential;
+}
+
+TEST_CASE("Credentials file parsing", "[credentials]") {
+    struct CredentialList list;
+
+    SECTION("kinds, algorithms and the touch flag") {
+        const std::string path = write_credentials("# name secret kind algorithm digits counter [touch]\n"
+                                                   "\n"
+                                                   "mail GEZDGNBVGY3TQOJQGEZDGNBVGY3TQOJQ hotp sha1 6 5\n"
+                                                   "  vpn\tGEZDGNBVGY3TQOJQ totp sha256 8 0 touch  \n"
+                                                   "login GEZDGNBVGY3TQOJQ hotp-reverse sha512 7 42\n");
+        REQUIRE(credential_list_load(path.c_str(), &list) == RET_NO_ERROR);
+        REQUIRE(list.count == 3);
+        CHECK(std::string(list.entries[0].name) == "mail");
+        CHECK(std::string(list.entries[0].secret) == RFC_SECRET);
+        CHECK(list.entries[0].kind == Kind_Hotp);
+        CHECK(list.entries[0].algorithm == Algo_Sha1);
+        CHECK(list.entries[0].digits == 6);
+        CHECK(list.entries[0].counter == 5);
+        CHECK_FALSE(list.entries[0].touch);
+        CHECK(std::string(list.entries[1].name) == "vpn");
+        CHECK(list.entries[1].kind == Kind_Totp);
+        CHECK(list.entries[1].algorithm == Algo_Sha256);
+        CHECK(list.entries[1].digits == 8);
+        CHECK(list.entries[1].touch);
+        CHECK(list.entries[2].kind == Kind_HotpReverse);
+        CHECK(list.entries[2].algorithm == Algo_Sha512);
+        CHECK(list.entries[2].counter == 42);
+        credential_list_free(&list);
+        CHECK(list.entries == nullptr);
+        CHECK(list.count == 0);
+        unlink(path.c_str());
+    }
+
+    SECTION("malformed lines are refused") {
+        const std::string bad[] = {
+                "mail GEZDGNBVGY3TQOJQ hotp sha1 6\n",
+                "mail GEZDGNBVGY3TQOJQ hotp sha1 6 0 touch extra\n",
+                "mail not-base32 hotp sha1 6 0\n",
+                "mail GEZDGNBVGY3TQOJQ motp sha1 6 0\n",
+                "mail GEZDGNBVGY3TQOJQ hotp md5 6 0\n",
+                "mail GEZDGNBVGY3TQOJQ hotp sha1 9 0\n",
+                "mail GEZDGNBVGY3TQOJQ hotp sha1 6 -1\n",
+                "mail GEZDGNBVGY3TQOJQ hotp sha1 6 0 press\n",
+                "mail GEZDGNBVGY3TQOJQ totp sha1 6 1\n",
+                "mail GEZDGNBVGY3TQOJQ hotp sha1 6 0\nmail GEZDGNBVGY3TQOJQ totp sha1 6 0\n",
+                std::string(CREDENTIAL_NAME_MAX_LENGTH + 1, 'n') + " GEZDGNBVGY3TQOJQ hotp sha1 6 0\n",
+                "# no credentials\n",
+        };
+        for (const auto &content: bad) {
+            const std::string path = write_credentials(content);
+            CHECK(credential_list_load(path.c_str(), &list) == RET_INVALID_PARAMS);
+            CHECK(list.entries == nullptr);
+            unlink(path.c_str());
+        }
+        CHECK(credential_list_load("/nonexistent/credentials", &list) == RET_INVALID_PARAMS);
+    }
+}
+
+TEST_CASE("Credentials are written in one session", "[emulated][credentials]") {
+    emulator::reset();
+    const size_t index = emulator::add_nk3(0x4711);
+    struct Device dev = {};
+    device_set_connection_hints(&dev, CONNECTION_CCID, '3');
+    REQUIRE(device_connect(&dev) == RET_NO_ERROR);
+    REQUIRE(set_secret_on_device(&dev, RFC_SECRET, admin_PIN, 0) == RET_NO_ERROR);
+    const unsigned pin_verifications = emulator::device_stats(index).pin_verifications;
+
+    // more than fit in one batch
+    std::vector<struct Credential> credentials;
+    for (uint32_t i = 0; i < CCID_BATCH_MAX_MESSAGES + 3; ++i) {
+        credentials.push_back(hotp_credential("credential-" + std::to_string(i), i));
+    }
+    credentials[1].kind = Kind_Totp;
+    credentials[1].algorithm = Algo_Sha256;
+    credentials[1].digits = 8;
+    credentials[1].counter = 0;
+    credentials[2].touch = true;
+
+    SECTION("back to back") {}
+    SECTION("sent ahead, when the reader queues them") {
+        dev.ccid_pipeline_depth = 4;
+    }
+
+    std::vector<int> results(credentials.size(), -1);
+    CHECK(set_credentials_on_device_ccid(&dev, admin_PIN, credentials.data(), credentials.size(), results.data()) == RET_NO_ERROR);
+    for (int result: results) {
+        CHECK(result == RET_NO_ERROR);
+    }
+    // the slot of the check command is kept
+    CHECK(emulator::credential_count(index) == credentials.size() + 1);
+    CHECK(emulator::device_stats(index).pin_verifications <= pin_verifications + 1);
+    CHECK(emulator::device_stats(index).sequence_errors == 0);
+
+    emulator::StoredCredential stored = {};
+    REQUIRE(emulator::stored_credential(index, "credential-0", stored));
+    CHECK(stored.kind_algo == (Kind_Hotp | Algo_Sha1));
+    CHECK(stored.digits == 6);
+    CHECK(stored.secret == "12345678901234567890");
+    CHECK(stored.counter == 0);
+    CHECK_FALSE(stored.touch);
+    REQUIRE(emulator::stored_credential(index, "credential-1", stored));
+    CHECK(stored.kind_algo == (Kind_Totp | Algo_Sha256));
+    CHECK(stored.digits == 8);
+    REQUIRE(emulator::stored_credential(index, "credential-2", stored));
+    CHECK(stored.touch);
+    REQUIRE(emulator::stored_credential(index, "credential-10", stored));
+    CHECK(stored.counter == 10);
+
+    CHECK(check_code_on_device(&dev, "755224") == RET_VALIDATION_PASSED);
+    device_disconnect(&dev);
+}
+
+TEST_CASE("Credentials, which overwrite is refused, are deleted and written again", "[emulated][credentials]") {
+    emulator::reset();
+    const size_t index = emulator::add_nk3(0x4711);
+    struct Device dev = {};
+    device_set_connection_hints(&dev, CONNECTION_CCID, '3');
+    REQUIRE(device_connect(&dev) == RET_NO_ERROR);
+    REQUIRE(set_secret_on_device(&dev, RFC_SECRET, admin_PIN, 0) == RET_NO_ERROR);
+
+    struct Credential credentials[] = {hotp_credential("first", 1), hotp_credential("second", 2)};
+    int results[2] = {};
+    REQUIRE(set_credentials_on_device_ccid(&dev, admin_PIN, credentials, 2, results) == RET_NO_ERROR);
+
+    emulator::reject_overwrite(index);
+    credentials[0].counter = 100;
+    credentials[1].digits = 8;
+    CHECK(set_credentials_on_device_ccid(&dev, admin_PIN, credentials, 2, results) == RET_NO_ERROR);
+    CHECK(results[0] == RET_NO_ERROR);
+    CHECK(results[1] == RET_NO_ERROR);
+    emulator::StoredCredential stored = {};
+    REQUIRE(emulator::stored_credential(index, "first", stored));
+    CHECK(stored.counter == 100);
+    REQUIRE(emulator::stored_credential(index, "second", stored));
+    CHECK(stored.digits == 8);
+    device_disconnect(&dev);
+}
+
+TEST_CASE("Credentials are not deleted, when Put fails for another reason", "[emulated][credentials]") {
+    emulator::reset();
+    const size_t index = emulator::add_nk3(0x4711);
+    struct Device dev = {};
+    device_set_connection_hints(&dev, CONNECTION_CCID, '3');
+    REQUIRE(device_connect(&dev) == RET_NO_ERROR);
+    REQUIRE(set_secret_on_device(&dev, RFC_SECRET, admin_PIN, 0) == RET_NO_ERROR);
+
+    struct Credential credential = hotp_credential("mail", 1);
+    int result = -1;
+    REQUIRE(set_credentials_on_device_ccid(&dev, admin_PIN, &credential, 1, &result) == RET_NO_ERROR);
+
+    for (const uint16_t status: {0x6700, 0x6A80, 0x6A84}) {
+        CAPTURE(status);
+        emulator::refuse_put(index, status);
+        credential.counter = 100;
+        CHECK(set_credentials_on_device_ccid(&dev, admin_PIN, &credential, 1, &result) == RET_VALIDATION_FAILED);
+        CHECK(result == RET_VALIDATION_FAILED);
+        emulator::StoredCredential stored = {};
+        REQUIRE(emulator::stored_credential(index, "mail", stored));
+        CHECK(stored.counter == 1);
+    }
+    // the HOTP slot of the check command is kept the same way
+    emulator::refuse_put(index, 0x6A84);
+    CHECK(set_secret_on_device(&dev, RFC_SECRET, admin_PIN, 5) == RET_VALIDATION_FAILED);
+    CHECK(emulator::credential_count(index) == 2);
+    device_disconnect(&dev);
+}
+
+TEST_CASE("Credentials with the longest secret are written", "[emulated][credentials]") {
+    emulator::reset();
+    const size_t index = emulator::add_nk3(0x4711);
+    struct Device dev = {};
+    device_set_connection_hints(&dev, CONNECTION_CCID, '3');
+    REQUIRE(device_connect(&dev) == RET_NO_ERROR);
+    REQUIRE(set_secret_on_device(&dev, RFC_SECRET, admin_PIN, 0) == RET_NO_ERROR);
+
+    // 64 characters, decoded to the 40 bytes of HOTP_SECRET_SIZE_BYTES
+    const std::string longest_secret = std::string(RFC_SECRET) + RFC_SECRET;
+    REQUIRE(longest_secret.size() == BASE32_LEN(HOTP_SECRET_SIZE_BYTES));
+    const std::string path = write_credentials("long " + longest_secret + " hotp sha1 6 0\n");
+    struct CredentialList list;
+    REQUIRE(credential_list_load(path.c_str(), &list) == RET_NO_ERROR);
+    unlink(path.c_str());
+
+    int result = -1;
+    CHECK(set_credentials_on_device_ccid(&dev, admin_PIN, list.entries, list.count, &result) == RET_NO_ERROR);
+    CHECK(result == RET_NO_ERROR);
+    credential_list_free(&list);
+    emulator::StoredCredential stored = {};
+    REQUIRE(emulator::stored_credential(index, "long", stored));
+    CHECK(stored.secret == "1234567890123456789012345678901234567890");
+    device_disconnect(&dev);
+}
+
+TEST_CASE("Credentials are refused without the PIN, and by other devices", "[emulated][credentials]") {
+    emulator::reset();
+    struct Credential credential = hotp_credential("mail", 0);
+    int result = RET_NO_ERROR;
+
+    SECTION("a wrong PIN") {
+        const size_t index = emulator::add_nk3(0x4711);
+        struct Device dev = {};
+        REQUIRE(device_connect(&dev) == RET_NO_ERROR);
+        REQUIRE(set_secret_on_device(&dev, RFC_SECRET, admin_PIN, 0) == RET_NO_ERROR);
+        session_end(&dev);
+        CHECK(set_credentials_on_device_ccid(&dev, "87654321", &credential, 1, &result) == RET_SECURITY_STATUS_NOT_SATISFIED);
+        CHECK(result == RET_SECURITY_STATUS_NOT_SATISFIED);
+        CHECK(emulator::credential_count(index) == 1);
+        device_disconnect(&dev);
+    }
+
+    SECTION("a Nitrokey Pro") {
+        emulator::add_pro(0x4711);
+        struct Device dev = {};
+        REQUIRE(device_connect(&dev) == RET_NO_ERROR);
+        CHECK(set_credentials_on_device_ccid(&dev, admin_PIN, &credential, 1, &result) == RET_UNKNOWN_DEVICE);
+        device_disconnect(&dev);
+    }
+}
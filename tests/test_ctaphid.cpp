@@ -0,0 +1,108 @@
+/*
+ * Copyright (c) 2023 Nitrokey GmbH
+ *
+ * This file is part of Nitrokey HOTP verification project.
+ *
+ * Nitrokey HOTP verification is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * Nitrokey HOTP verification is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Nitrokey HOTP verification. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0
+ */
+
+#include "catch.hpp"
+#include "device_emulator.h"
+#include <vector>
+
+extern "C" {
+#include "../src/device.h"
+#include "../src/operations.h"
+#include "../src/return_codes.h"
+}
+
+static const char *base32_secret = "GEZDGNBVGY3TQOJQGEZDGNBVGY3TQOJQ";
+static const char *admin_PIN = "12345678";
+
+static void record_event(TouchEvent event, void *user_data) {
+    static_cast<std::vector<TouchEvent> *>(user_data)->push_back(event);
+}
+
+static void connect_ctaphid(struct Device *dev) {
+    device_set_connection_hints(dev, CONNECTION_CCID, '3');
+    device_set_hid_backend(dev, HID_BACKEND_HIDAPI);
+    device_set_ccid_backend(dev, CCID_BACKEND_CTAPHID, NULL);
+    REQUIRE(device_connect(dev) == RET_NO_ERROR);
+    REQUIRE(dev->ccid_backend_connected == CCID_BACKEND_CTAPHID);
+}
+
+TEST_CASE("Secrets App is reached over CTAPHID", "[emulated][ctaphid]") {
+    emulator::reset();
+    const size_t index = emulator::add_nk3(0x4343);
+    struct Device dev = {};
+    connect_ctaphid(&dev);
+
+    REQUIRE(set_secret_on_device(&dev, base32_secret, admin_PIN, 0) == RET_NO_ERROR);
+    CHECK(check_code_on_device(&dev, "755224") == RET_VALIDATION_PASSED);
+    CHECK(check_code_on_device(&dev, "755224") == RET_VALIDATION_FAILED);
+    struct FullResponseStatus status = {};
+    REQUIRE(device_get_status(&dev, &status) == RET_NO_ERROR);
+    CHECK(status.device_type == Nk3);
+    CHECK(status.response_status.card_serial_u32 == 0x4343);
+    CHECK(status.nk3_extra_info.firmware_version == ((1u << 22) | (7u << 6) | 2u));
+    device_disconnect(&dev);
+    CHECK(emulator::global_stats().hidapi_users == 0);
+
+    // the credential is the same over the CCID interface
+    struct Device ccid = {};
+    device_set_connection_hints(&ccid, CONNECTION_CCID, '3');
+    REQUIRE(device_connect(&ccid) == RET_NO_ERROR);
+    CHECK(ccid.ccid_backend_connected == CCID_BACKEND_LIBUSB);
+    CHECK(check_code_on_device(&ccid, "287082") == RET_VALIDATION_PASSED);
+    device_disconnect(&ccid);
+    CHECK(emulator::device_stats(index).open_handles == 0);
+}
+
+TEST_CASE("Touch over CTAPHID is reported like over CCID", "[emulated][ctaphid]") {
+    const unsigned keepalives = 3;
+    emulator::reset();
+    const size_t index = emulator::add_nk3(0x4444);
+    struct Device dev = {};
+    connect_ctaphid(&dev);
+    REQUIRE(set_secret_on_device(&dev, base32_secret, admin_PIN, 0) == RET_NO_ERROR);
+    std::vector<TouchEvent> events;
+
+    SECTION("confirmed") {
+        emulator::require_touch(index, keepalives);
+        device_set_touch_handler(&dev, record_event, &events, false);
+        REQUIRE(check_code_on_device(&dev, "755224") == RET_VALIDATION_PASSED);
+        const std::vector<TouchEvent> expected = {TOUCH_REQUIRED, TOUCH_WAITING, TOUCH_WAITING, TOUCH_RECEIVED};
+        CHECK(events == expected);
+    }
+    SECTION("never confirmed") {
+        emulator::require_touch(index, emulator::NEVER_TOUCHED);
+        dev.deadline = deadline_in(200);
+        CHECK(check_code_on_device(&dev, "755224") == RET_TIMEOUT);
+    }
+    device_disconnect(&dev);
+}
+
+TEST_CASE("Reports of the other CTAPHID channels are skipped", "[emulated][ctaphid]") {
+    emulator::reset();
+    const size_t index = emulator::add_nk3(0x4545);
+    struct Device dev = {};
+    connect_ctaphid(&dev);
+    REQUIRE(set_secret_on_device(&dev, base32_secret, admin_PIN, 0) == RET_NO_ERROR);
+    emulator::inject_stray_response(index, 1);
+    CHECK(check_code_on_device(&dev, "755224") == RET_VALIDATION_PASSED);
+    CHECK(check_code_on_device(&dev, "287082") == RET_VALIDATION_PASSED);
+    device_disconnect(&dev);
+}
@@ -0,0 +1,85 @@
+/*
+ * Copyright (c) 2023 Nitrokey GmbH
+ *
+ * This file is part of Nitrokey HOTP verification project.
+ *
+ * Nitrokey HOTP verification is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * Nitrokey HOTP verification is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Nitrokey HOTP verification. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0
+ */
+
+#include "catch.hpp"
+#include "device_emulator.h"
+#include <chrono>
+#include <thread>
+
+extern "C" {
+#include "../src/device.h"
+#include "../src/operations.h"
+#include "../src/return_codes.h"
+}
+
+static const char *base32_secret = "GEZDGNBVGY3TQOJQGEZDGNBVGY3TQOJQ";
+static const char *admin_PIN = "12345678";
+// Allowance over the budget for the last sleep and transfer, which are cut but not skipped
+static const int64_t slack_ms = 250;
+
+TEST_CASE("Waiting for touch ends with the deadline", "[emulated][deadline]") {
+    emulator::reset();
+    const size_t index = emulator::add_nk3(0x1234);
+    struct Device dev = {};
+    REQUIRE(device_connect(&dev) == RET_NO_ERROR);
+    REQUIRE(set_secret_on_device(&dev, base32_secret, admin_PIN, 0) == RET_NO_ERROR);
+
+    SECTION("touch is never confirmed") {
+        emulator::require_touch(index, emulator::NEVER_TOUCHED);
+        const int64_t budget_ms = 300;
+        const auto start = std::chrono::steady_clock::now();
+        dev.deadline = deadline_in(budget_ms);
+        REQUIRE(check_code_on_device(&dev, "755224") == RET_TIMEOUT);
+        const int64_t elapsed = emulator::elapsed_ms(start);
+        // the deadline has a millisecond resolution
+        CHECK(elapsed >= budget_ms - 1);
+        CHECK(elapsed < budget_ms + slack_ms);
+    }
+
+    SECTION("touch is confirmed within the budget") {
+        emulator::require_touch(index, 5);
+        dev.deadline = deadline_in(2000);
+        REQUIRE(check_code_on_device(&dev, "755224") == RET_VALIDATION_PASSED);
+    }
+
+    SECTION("a passed deadline stops the next operation before any transfer") {
+        dev.deadline = deadline_in(1);
+        const auto exchanges = emulator::device_stats(index).exchanges;
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+        REQUIRE(check_code_on_device(&dev, "755224") == RET_TIMEOUT);
+        CHECK(emulator::device_stats(index).exchanges == exchanges);
+    }
+
+    device_disconnect(&dev);
+    CHECK(emulator::device_stats(index).open_handles == 0);
+}
+
+TEST_CASE("Connecting ends with the deadline, when no device is present", "[emulated][deadline]") {
+    emulator::reset();
+    struct Device dev = {};
+    const int64_t budget_ms = 300;
+    dev.deadline = deadline_in(budget_ms);
+    const auto start = std::chrono::steady_clock::now();
+    REQUIRE(device_connect(&dev) == RET_TIMEOUT);
+    CHECK(emulator::elapsed_ms(start) < budget_ms + slack_ms);
+    CHECK(emulator::global_stats().open_contexts == 0);
+    CHECK(emulator::global_stats().hidapi_users == 0);
+}
@@ -0,0 +1,157 @@
+/*
+ * Copyright (c) 2023 Nitrokey GmbH
+ *
+ * This file is part of Nitrokey HOTP verification project.
+ *
+ * Nitrokey HOTP verification is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * Nitrokey HOTP verification is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Nitrokey HOTP verification. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0
+ */
+
+#include "catch.hpp"
+#include "device_emulator.h"
+
+extern "C" {
+#include "../src/ccid.h"
+#include "../src/device.h"
+#include "../src/operations.h"
+#include "../src/return_codes.h"
+#include "../src/utils.h"
+}
+
+static const char *base32_secret = "GEZDGNBVGY3TQOJQGEZDGNBVGY3TQOJQ";
+static const char *binary_secret = "12345678901234567890";
+static const char *admin_PIN = "12345678";
+
+TEST_CASE("An unplugged Nitrokey Pro is reported without polling it", "[emulated][disconnect]") {
+    emulator::reset();
+    const size_t index = emulator::add_pro(0x5151);
+    emulator::program_hotp(index, binary_secret, 0);
+    emulator::VirtualClock clock;
+    const std::string node = emulator::hidraw_node(index);
+    struct Device dev = {};
+
+    SECTION("over HIDAPI") {
+        device_set_hid_backend(&dev, HID_BACKEND_HIDAPI);
+    }
+    SECTION("over hidraw") {
+        device_set_location(&dev, node.c_str(), -1);
+    }
+    REQUIRE(device_connect(&dev) == RET_NO_ERROR);
+    CHECK(device_count_available(&dev) == 1);
+    emulator::unplug(index);
+    virtual_clock_reset();
+    const auto exchanges = emulator::device_stats(index).exchanges;
+
+    struct FullResponseStatus status = {};
+    CHECK(device_get_status(&dev, &status) == RET_CONNECTION_LOST);
+    CHECK(dev.removed);
+    CHECK(check_code_on_device(&dev, "755224") == RET_CONNECTION_LOST);
+    CHECK(dev.retry_stats.retries == 0);
+    CHECK(virtual_clock_slept_us() == 0);
+    CHECK(emulator::device_stats(index).exchanges == exchanges);
+    device_disconnect(&dev);
+    CHECK(emulator::device_stats(index).open_handles == 0);
+    CHECK(device_connect(&dev) != RET_NO_ERROR);
+}
+
+TEST_CASE("An unplugged Nitrokey Pro is reported, while another one of the model is left", "[emulated][disconnect]") {
+    emulator::reset();
+    const size_t first = emulator::add_pro(0x5151);
+    const size_t second = emulator::add_pro(0x5252);
+    emulator::VirtualClock clock;
+    struct Device dev = {};
+    device_set_hid_backend(&dev, HID_BACKEND_HIDAPI);
+    REQUIRE(device_connect(&dev) == RET_NO_ERROR);
+    struct FullResponseStatus status = {};
+    REQUIRE(device_get_status(&dev, &status) == RET_NO_ERROR);
+    const size_t connected = status.response_status.card_serial_u32 == 0x5151 ? first : second;
+    emulator::unplug(connected);
+
+    CHECK(device_get_status(&dev, &status) == RET_CONNECTION_LOST);
+    CHECK(dev.removed);
+    CHECK(dev.retry_stats.retries == 0);
+    device_disconnect(&dev);
+
+    // the other one is still taken
+    REQUIRE(device_connect(&dev) == RET_NO_ERROR);
+    CHECK(device_get_status(&dev, &status) == RET_NO_ERROR);
+    CHECK(status.response_status.card_serial_u32 == (connected == first ? 0x5252u : 0x5151u));
+    device_disconnect(&dev);
+}
+
+TEST_CASE("A failed transfer of a present device is not taken for a removal", "[emulated][disconnect]") {
+    emulator::reset();
+    const size_t index = emulator::add_pro(0x5151);
+    emulator::VirtualClock clock;
+    struct Device dev = {};
+    device_set_hid_backend(&dev, HID_BACKEND_HIDAPI);
+    REQUIRE(device_connect(&dev) == RET_NO_ERROR);
+    emulator::inject_usb_errors(index, emulator::UsbFault::HidGetReport, 1);
+    struct FullResponseStatus status = {};
+    CHECK(device_get_status(&dev, &status) == RET_NO_ERROR);
+    CHECK_FALSE(dev.removed);
+    CHECK(dev.retry_stats.retries == 1);
+    device_disconnect(&dev);
+}
+
+TEST_CASE("An unplugged Nitrokey 3 is reported without retrying", "[emulated][disconnect]") {
+    emulator::reset();
+    const size_t index = emulator::add_nk3(0x4711);
+    emulator::VirtualClock clock;
+    struct Device dev = {};
+    device_set_connection_hints(&dev, CONNECTION_CCID, '3');
+
+    SECTION("over CCID") {
+    }
+    SECTION("over CTAPHID") {
+        device_set_hid_backend(&dev, HID_BACKEND_HIDAPI);
+        device_set_ccid_backend(&dev, CCID_BACKEND_CTAPHID, NULL);
+    }
+    REQUIRE(device_connect(&dev) == RET_NO_ERROR);
+    REQUIRE(set_secret_on_device(&dev, base32_secret, admin_PIN, 0) == RET_NO_ERROR);
+    emulator::unplug(index);
+    virtual_clock_reset();
+    const auto exchanges = emulator::device_stats(index).exchanges;
+
+    CHECK(check_code_on_device(&dev, "755224") == RET_CONNECTION_LOST);
+    CHECK(dev.removed);
+    IccResult result = {};
+    CHECK(send_select_ccid(&dev, &result) == RET_CONNECTION_LOST);
+    CHECK(dev.retry_stats.retries == 0);
+    CHECK(virtual_clock_slept_us() == 0);
+    CHECK(emulator::device_stats(index).exchanges == exchanges);
+    device_disconnect(&dev);
+    CHECK(emulator::device_stats(index).open_handles == 0);
+}
+
+TEST_CASE("A reconnected device is used again", "[emulated][disconnect]") {
+    emulator::reset();
+    const size_t first = emulator::add_nk3(0x4711);
+    emulator::add_nk3(0x4712);
+    emulator::VirtualClock clock;
+    struct Device dev = {};
+    device_set_connection_hints(&dev, CONNECTION_CCID, '3');
+    REQUIRE(device_connect(&dev) == RET_NO_ERROR);
+    emulator::unplug(first);
+    IccResult result = {};
+    CHECK(send_select_ccid(&dev, &result) == RET_CONNECTION_LOST);
+    device_disconnect(&dev);
+
+    REQUIRE(device_connect(&dev) == RET_NO_ERROR);
+    CHECK_FALSE(dev.removed);
+    CHECK(send_select_ccid(&dev, &result) == RET_NO_ERROR);
+    CHECK(result.data_status_code == 0x9000);
+    device_disconnect(&dev);
+}
@@ -0,0 +1,220 @@
+/*
+ * Copyright (c) 2023 Nitrokey GmbH
+ *
+ * This file is part of Nitrokey HOTP verification project.
+ *
+ * Nitrokey HOTP verification is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * Nitrokey HOTP verification is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Nitrokey HOTP verification. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0
+ */
+
+#include "catch.hpp"
+#include "device_emulator.h"
+#include <atomic>
+#include <csignal>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+extern "C" {
+#include "../src/ccid.h"
+#include "../src/device.h"
+#include "../src/flight_recorder.h"
+#include "../src/operations.h"
+#include "../src/return_codes.h"
+#include "../src/settings.h"
+#include <sys/wait.h>
+#include <unistd.h>
+}
+
+static const char *base32_secret = "GEZDGNBVGY3TQOJQGEZDGNBVGY3TQOJQ";
+static const char *admin_PIN = "12345678";
+
+static std::vector<FlightRecord> snapshot() {
+    std::vector<FlightRecord> records(FLIGHT_RECORDER_SIZE);
+    records.resize(flight_recorder_snapshot(records.data(), records.size()));
+    return records;
+}
+
+static size_t count_events(const std::vector<FlightRecord> &records, const std::string &event) {
+    size_t count = 0;
+    for (const auto &record: records) {
+        count += event == record.event;
+    }
+    return count;
+}
+
+// Read everything written to the pipe by the function, run in a child process
+template<typename F>
+static std::string output_of(F function, int *status) {
+    int fds[2];
+    REQUIRE(pipe(fds) == 0);
+    const pid_t pid = fork();
+    REQUIRE(pid >= 0);
+    if (pid == 0) {
+        close(fds[0]);
+        function(fds[1]);
+        _exit(0);
+    }
+    close(fds[1]);
+    std::string output;
+    char buffer[512];
+    ssize_t n;
+    while ((n = read(fds[0], buffer, sizeof buffer)) > 0) {
+        output.append(buffer, (size_t) n);
+    }
+    close(fds[0]);
+    waitpid(pid, status, 0);
+    return output;
+}
+
+TEST_CASE("The exchanges are recorded without the PINs and secrets", "[emulated][flight_recorder]") {
+    emulator::reset();
+    flight_recorder_clear();
+
+    SECTION("Nitrokey 3") {
+        emulator::add_nk3(0x1234);
+        struct Device dev = {};
+        REQUIRE(device_connect(&dev) == RET_NO_ERROR);
+        REQUIRE(set_secret_on_device(&dev, base32_secret, admin_PIN, 0) == RET_NO_ERROR);
+        REQUIRE(check_code_on_device(&dev, "755224") == RET_VALIDATION_PASSED);
+        device_disconnect(&dev);
+
+        const auto records = snapshot();
+        REQUIRE(!records.empty());
+        CHECK(count_events(records, "connect") == 1);
+        CHECK(dev.flight_id != 0);
+        for (const auto &record: records) {
+            CHECK(record.device == dev.flight_id);
+        }
+        CHECK(std::string(records.back().event) == "disconnect");
+        CHECK(count_events(records, "ccid_send") == count_events(records, "ccid_receive"));
+        for (const auto &record: records) {
+            if (std::string(record.event) == "ccid_send" && record.length > CCID_HEADER_SIZE) {
+                // the CCID header and the APDU header only
+                CHECK(record.captured == CCID_HEADER_SIZE + 5);
+            }
+            if (std::string(record.event) == "ccid_receive" && record.length >= CCID_HEADER_SIZE + 2) {
+                CHECK(record.captured == CCID_HEADER_SIZE + 2);
+            }
+        }
+    }
+
+    SECTION("Nitrokey Pro") {
+        emulator::add_pro(0x5151);
+        struct Device dev = {};
+        REQUIRE(device_connect(&dev) == RET_NO_ERROR);
+        REQUIRE(regenerate_AES_key(&dev, admin_PIN) == RET_NO_ERROR);
+        device_disconnect(&dev);
+
+        const auto records = snapshot();
+        REQUIRE(count_events(records, "hid_send") == 1);
+        CHECK(count_events(records, "hid_receive") == 1);
+        // the polls of the device busy with the key
+        CHECK(count_events(records, "retry") >= emulator::AES_KEY_GENERATION_READS);
+        for (const auto &record: records) {
+            if (std::string(record.event) == "hid_send") {
+                CHECK(record.captured == 2);
+                CHECK(record.data[1] == 0x6b);
+            }
+        }
+    }
+
+    int status = 0;
+    const std::string dump = output_of([](int fd) { flight_recorder_dump(fd); }, &status);
+    CHECK(dump.find("Recent device events") == 0);
+    CHECK(dump.find(" us device ") != std::string::npos);
+    CHECK(dump.find(" connect ") != std::string::npos);
+    // the admin PIN in hex, as sent in the payloads
+    CHECK(dump.find("31 32 33 34 35 36 37 38") == std::string::npos);
+    CHECK(dump.find("31 32 33 34") == std::string::npos);
+}
+
+TEST_CASE("The flight recorder keeps the newest events", "[flight_recorder]") {
+    flight_recorder_clear();
+    CHECK(flight_recorder_count() == 0);
+    const uint8_t frame[] = {1, 2, 3};
+    for (int i = 0; i < FLIGHT_RECORDER_SIZE + 10; ++i) {
+        flight_record(0, "test", nullptr, i, frame, sizeof frame, sizeof frame);
+    }
+    CHECK(flight_recorder_count() == FLIGHT_RECORDER_SIZE);
+    const auto records = snapshot();
+    REQUIRE(records.size() == FLIGHT_RECORDER_SIZE);
+    CHECK(records.front().code == 10);
+    CHECK(records.back().code == FLIGHT_RECORDER_SIZE + 9);
+    CHECK(records.back().captured == sizeof frame);
+
+    flight_recorder_clear();
+    int status = 0;
+    CHECK(output_of([](int fd) { flight_recorder_dump(fd); }, &status).empty());
+}
+
+TEST_CASE("The flight recorder is dumped on a signal", "[flight_recorder]") {
+    flight_recorder_clear();
+    int status = 0;
+    const std::string dump = output_of(
+            [](int fd) {
+                dup2(fd, STDERR_FILENO);
+                flight_recorder_install_signal_handlers();
+                const uint8_t header[] = {0x6f, 0xab};
+                flight_record(7, "ccid_send", nullptr, 0, header, 64, sizeof header);
+                raise(SIGTERM);
+            },
+            &status);
+    REQUIRE(WIFSIGNALED(status));
+    CHECK(WTERMSIG(status) == SIGTERM);
+    CHECK(dump.find(" us device 7 ccid_send, code 0, 64 bytes: 6f ab\n") != std::string::npos);
+}
+
+TEST_CASE("The flight recorder keeps whole records of concurrent writers", "[flight_recorder]") {
+    flight_recorder_clear();
+    const uint32_t first_device = flight_recorder_new_device();
+    const int writers_count = 4;
+    std::atomic<bool> stop{false};
+    std::vector<std::thread> writers;
+    for (int w = 0; w < writers_count; ++w) {
+        writers.emplace_back([&stop, w, first_device]() {
+            // each field of a record tells its writer, a mixed record would not agree with itself
+            uint8_t frame[FLIGHT_RECORD_DATA_SIZE];
+            memset(frame, w, sizeof frame);
+            while (!stop) {
+                flight_record(first_device + w, "test", nullptr, w, frame, sizeof frame, sizeof frame);
+                std::this_thread::yield();
+            }
+        });
+    }
+    // the ring is filled, before it is read while overwritten
+    while (flight_recorder_count() < FLIGHT_RECORDER_SIZE) {
+        std::this_thread::yield();
+    }
+    size_t checked = 0, mixed = 0;
+    for (int round = 0; round < 200; ++round) {
+        for (const auto &record: snapshot()) {
+            const bool whole = record.code >= 0 && record.code < writers_count &&
+                               record.device == first_device + (uint32_t) record.code &&
+                               record.captured == FLIGHT_RECORD_DATA_SIZE && record.data[0] == record.code &&
+                               record.data[FLIGHT_RECORD_DATA_SIZE - 1] == record.code;
+            mixed += !whole;
+            checked++;
+        }
+    }
+    stop = true;
+    for (auto &writer: writers) {
+        writer.join();
+    }
+    CHECK(checked > 0);
+    CHECK(mixed == 0);
+    flight_recorder_clear();
+}
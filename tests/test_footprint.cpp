@@ -0,0 +1,121 @@
+/*
+ * Copyright (c) 2023 Nitrokey GmbH
+ *
+ * This file is part of Nitrokey HOTP verification project.
+ *
+ * Nitrokey HOTP verification is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * Nitrokey HOTP verification is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Nitrokey HOTP verification. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0
+ */
+
+#include "catch.hpp"
+#include "device_emulator.h"
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <pthread.h>
+
+extern "C" {
+#include "../src/device.h"
+#include "../src/operations.h"
+#include "../src/operations_ccid.h"
+#include "../src/return_codes.h"
+}
+
+static const size_t painted_stack_size = 256 * 1024;
+// Limits for a single command, with a margin over the measured use. The address sanitizer adds redzones to each frame.
+#if defined(__SANITIZE_ADDRESS__)
+static const size_t stack_limit = 32 * 1024;
+#else
+static const size_t stack_limit = 16 * 1024;
+#endif
+// Largest frame exchanged in the emulated session is below 128 bytes, and both buffers are sized to their frames
+static const size_t heap_limit = 512;
+static const uint8_t paint = 0xA5;
+
+struct PaintedCall {
+    std::function<int()> call;
+    int result;
+};
+
+static void *run_painted_call(void *arg) {
+    auto *c = static_cast<PaintedCall *>(arg);
+    c->result = c->call();
+    return nullptr;
+}
+
+__attribute__((no_sanitize_address)) static size_t untouched_bytes(const uint8_t *stack, size_t size) {
+    size_t i = 0;
+    while (i < size && stack[i] == paint) i++;
+    return i;
+}
+
+// Run the call on a thread with a painted stack, and return how much of that stack was used
+static size_t measure_stack(const std::function<int()> &call, int &result) {
+    void *stack = nullptr;
+    REQUIRE(posix_memalign(&stack, 4096, painted_stack_size) == 0);
+    memset(stack, paint, painted_stack_size);
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstack(&attr, stack, painted_stack_size);
+    PaintedCall c = {call, 0};
+    pthread_t thread;
+    REQUIRE(pthread_create(&thread, &attr, run_painted_call, &c) == 0);
+    pthread_join(thread, nullptr);
+    pthread_attr_destroy(&attr);
+
+    const size_t used = painted_stack_size - untouched_bytes(static_cast<uint8_t *>(stack), painted_stack_size);
+    free(stack);
+    result = c.result;
+    return used;
+}
+
+TEST_CASE("Peak stack and buffer use of each command", "[emulated][footprint]") {
+    // No frame buffers are kept in the device structure itself
+    REQUIRE(sizeof(struct Device) < 1024);
+
+    emulator::reset();
+    emulator::add_nk3(0x1234);
+    struct Device dev = {};
+
+    struct {
+        const char *name;
+        std::function<int()> call;
+        int expected;
+    } commands[] = {
+            {"connect", [&]() { return device_connect(&dev); }, RET_NO_ERROR},
+            // the fresh key has no PIN set yet
+            {"status", [&]() { struct FullResponseStatus s = {}; return device_get_status(&dev, &s); }, RET_NO_PIN_ATTEMPTS},
+            {"set", [&]() { return set_secret_on_device(&dev, "GEZDGNBVGY3TQOJQGEZDGNBVGY3TQOJQ", "12345678", 0); }, RET_NO_ERROR},
+            {"check", [&]() { return check_code_on_device(&dev, "755224"); }, RET_VALIDATION_PASSED},
+            {"change-pin", [&]() { return nk3_change_pin(&dev, "12345678", "87654321"); }, RET_NO_ERROR},
+            {"reset", [&]() { return nk3_reset(&dev, "12345678"); }, RET_NO_ERROR},
+            {"disconnect", [&]() { return device_disconnect(&dev); }, RET_NO_ERROR},
+    };
+
+    for (auto &command: commands) {
+        int result = 0;
+        const size_t stack = measure_stack(command.call, result);
+        const size_t heap = dev.ccid_buffer_in.capacity + dev.ccid_buffer_out.capacity;
+        INFO(command.name << ": stack " << stack << " B, buffers " << heap << " B");
+        CHECK(result == command.expected);
+        CHECK(stack < stack_limit);
+        CHECK(heap < heap_limit);
+    }
+    // buffers are released on disconnect
+    CHECK(dev.ccid_buffer_in.data == nullptr);
+    CHECK(dev.ccid_buffer_out.data == nullptr);
+}
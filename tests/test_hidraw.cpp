@@ -0,0 +1,114 @@
+/*
+ * Copyright (c) 2023 Nitrokey GmbH
+ *
+ * This file is part of Nitrokey HOTP verification project.
+ *
+ * Nitrokey HOTP verification is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * Nitrokey HOTP verification is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Nitrokey HOTP verification. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0
+ */
+
+#include "catch.hpp"
+#include "device_emulator.h"
+#include <fcntl.h>
+#include <string>
+#include <unistd.h>
+
+extern "C" {
+#include "../src/device.h"
+#include "../src/return_codes.h"
+}
+
+static void check_pro_status(struct Device *dev, uint32_t card_serial) {
+    struct FullResponseStatus status = {};
+    REQUIRE(device_get_status(dev, &status) == RET_NO_ERROR);
+    CHECK(status.response_status.card_serial_u32 == card_serial);
+    CHECK(status.response_status.firmware_version_st.minor == 15);
+    CHECK(status.response_status.retry_admin == 3);
+    CHECK(status.response_status.retry_user == 3);
+}
+
+TEST_CASE("Feature reports go over the hidraw node", "[emulated][hidraw]") {
+    emulator::reset();
+    const size_t index = emulator::add_pro(0x5151);
+    const std::string node = emulator::hidraw_node(index);
+    REQUIRE(!node.empty());
+    struct Device dev = {};
+
+    SECTION("path") {
+        device_set_location(&dev, node.c_str(), -1);
+        REQUIRE(device_connect(&dev) == RET_NO_ERROR);
+        CHECK(dev.connection_type == CONNECTION_HID);
+        CHECK(dev.hid_backend_connected == HID_BACKEND_HIDRAW);
+        CHECK(dev.dev_info.pid == NITROKEY_PRO_USB_PID);
+        check_pro_status(&dev, 0x5151);
+        // a send and a get for each of the three commands
+        CHECK(dev.hid_stats.transfers == 6);
+        CHECK(emulator::device_stats(index).exchanges == 3);
+        CHECK(device_disconnect(&dev) == RET_NO_ERROR);
+    }
+
+    SECTION("inherited file descriptor is left open") {
+        const int fd = open(node.c_str(), O_RDWR);
+        REQUIRE(fd >= 0);
+        device_set_location(&dev, nullptr, fd);
+        REQUIRE(device_connect(&dev) == RET_NO_ERROR);
+        check_pro_status(&dev, 0x5151);
+        CHECK(device_disconnect(&dev) == RET_NO_ERROR);
+        CHECK(fcntl(fd, F_GETFD) != -1);
+        close(fd);
+    }
+
+    SECTION("HIDAPI can not use the hidraw node") {
+        device_set_hid_backend(&dev, HID_BACKEND_HIDAPI);
+        device_set_location(&dev, node.c_str(), -1);
+        CHECK(device_connect(&dev) == RET_INVALID_PARAMS);
+    }
+
+    SECTION("hidraw node of a CCID device is refused") {
+        const std::string nk3_node = emulator::hidraw_node(emulator::add_nk3(0x3333));
+        device_set_location(&dev, nk3_node.c_str(), -1);
+        CHECK(device_connect(&dev) == RET_UNKNOWN_DEVICE);
+    }
+}
+
+TEST_CASE("Backend is chosen at runtime", "[emulated][hidraw]") {
+    emulator::reset();
+    emulator::add_pro(0x6161);
+    struct Device dev = {};
+    device_set_connection_hints(&dev, CONNECTION_HID, 'P');
+
+    SECTION("HIDAPI talks to the same device") {
+        device_set_hid_backend(&dev, HID_BACKEND_HIDAPI);
+        REQUIRE(device_connect(&dev) == RET_NO_ERROR);
+        CHECK(dev.hid_backend_connected == HID_BACKEND_HIDAPI);
+        check_pro_status(&dev, 0x6161);
+        CHECK(dev.hid_stats.transfers == 6);
+        CHECK(dev.hid_stats.transfer_us >= 0);
+        CHECK(device_disconnect(&dev) == RET_NO_ERROR);
+        CHECK(emulator::global_stats().hidapi_users == 0);
+    }
+
+    SECTION("auto falls back to HIDAPI without a hidraw node") {
+        REQUIRE(device_connect(&dev) == RET_NO_ERROR);
+        CHECK(dev.hid_backend_connected == HID_BACKEND_HIDAPI);
+        device_disconnect(&dev);
+    }
+
+    SECTION("hidraw only does not fall back") {
+        device_set_hid_backend(&dev, HID_BACKEND_HIDRAW);
+        CHECK(device_connect(&dev) == RET_COMM_ERROR);
+        CHECK(dev.mp_devhandle == nullptr);
+    }
+}
@@ -0,0 +1,177 @@
+/*
+ * Copyright (c) 2023 Nitrokey GmbH
+ *
+ * This file is part of Nitrokey HOTP verification project.
+ *
+ * Nitrokey HOTP verification is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * Nitrokey HOTP verification is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Nitrokey HOTP verification. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0
+ */
+
+
+#include "catch.hpp"
+#include "device_emulator.h"
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+extern "C" {
+#include "../src/hotpverify.h"
+}
+
+static const char *base32_secret = "GEZDGNBVGY3TQOJQGEZDGNBVGY3TQOJQ";
+static const char *admin_PIN = "12345678";
+
+using Messages = std::vector<std::pair<hotpverify_message_kind, std::string>>;
+
+static void collect_message(enum hotpverify_message_kind kind, const char *text, void *user_data) {
+    static_cast<Messages *>(user_data)->emplace_back(kind, text);
+}
+
+// Standard output and error of the process go to a temporary file, until read back
+class ConsoleCapture {
+public:
+    ConsoleCapture() {
+        fflush(stdout);
+        fflush(stderr);
+        file = tmpfile();
+        saved_out = dup(STDOUT_FILENO);
+        saved_err = dup(STDERR_FILENO);
+        dup2(fileno(file), STDOUT_FILENO);
+        dup2(fileno(file), STDERR_FILENO);
+    }
+
+    std::string read() {
+        fflush(stdout);
+        fflush(stderr);
+        dup2(saved_out, STDOUT_FILENO);
+        dup2(saved_err, STDERR_FILENO);
+        close(saved_out);
+        close(saved_err);
+        std::string content;
+        rewind(file);
+        for (int c; (c = fgetc(file)) != EOF;) {
+            content.push_back((char) c);
+        }
+        fclose(file);
+        return content;
+    }
+
+private:
+    FILE *file;
+    int saved_out;
+    int saved_err;
+};
+
+TEST_CASE("Library verifies the codes on the emulated device without printing", "[emulated][library]") {
+    emulator::reset();
+    emulator::add_nk3(0x4711);
+    Messages messages;
+    hotpverify_context *ctx = hotpverify_new();
+    REQUIRE(ctx != nullptr);
+    REQUIRE(hotpverify_set_message_handler(ctx, collect_message, &messages) == HOTPVERIFY_OK);
+
+    ConsoleCapture console;
+    const int connected = hotpverify_connect(ctx);
+    const int bad_secret = hotpverify_set_secret(ctx, "not base32!", admin_PIN, 0);
+    const int set = hotpverify_set_secret(ctx, base32_secret, admin_PIN, 0);
+    struct hotpverify_status status = {};
+    const int status_read = hotpverify_get_status(ctx, &status);
+    const int valid = hotpverify_check_code(ctx, "755224");
+    const int invalid = hotpverify_check_code(ctx, "755224");
+    const int unsupported = hotpverify_regenerate_aes_key(ctx, admin_PIN);
+    const int disconnected = hotpverify_disconnect(ctx);
+    const std::string printed = console.read();
+
+    CHECK(connected == HOTPVERIFY_OK);
+    CHECK(bad_secret == HOTPVERIFY_ERR_BAD_FORMAT);
+    CHECK(set == HOTPVERIFY_OK);
+    CHECK(status_read == HOTPVERIFY_OK);
+    CHECK(status.model == HOTPVERIFY_MODEL_NITROKEY_3);
+    CHECK(status.serial == 0x4711);
+    CHECK(valid == HOTPVERIFY_CODE_VALID);
+    // the counter has moved past the code
+    CHECK(invalid == HOTPVERIFY_CODE_INVALID);
+    CHECK(unsupported == HOTPVERIFY_ERR_UNSUPPORTED);
+    CHECK(disconnected == HOTPVERIFY_OK);
+    CHECK(printed.empty());
+
+    bool bad_secret_reported = false;
+    for (const auto &message: messages) {
+        bad_secret_reported |= message.first == HOTPVERIFY_MESSAGE_INFO && message.second.find("base32") != std::string::npos;
+    }
+    CHECK(bad_secret_reported);
+    hotpverify_free(ctx);
+}
+
+TEST_CASE("Library refuses the arguments the device operations do not take", "[emulated][library]") {
+    emulator::reset();
+    emulator::add_nk3(0x4711);
+    hotpverify_context *ctx = hotpverify_new();
+    REQUIRE(ctx != nullptr);
+    REQUIRE(hotpverify_connect(ctx) == HOTPVERIFY_OK);
+
+    // 64 characters are the longest secret
+    const std::string longest_secret = std::string(base32_secret) + base32_secret;
+    const std::string long_PIN(129, '1');
+    CHECK(hotpverify_set_secret(ctx, (longest_secret + "A").c_str(), admin_PIN, 0) == HOTPVERIFY_ERR_INVALID_PARAMS);
+    CHECK(hotpverify_set_secret(ctx, base32_secret, admin_PIN, 0xFFFFFFFF) == HOTPVERIFY_ERR_INVALID_PARAMS);
+    CHECK(hotpverify_set_secret(ctx, base32_secret, long_PIN.c_str(), 0) == HOTPVERIFY_ERR_INVALID_PARAMS);
+    CHECK(hotpverify_session_begin(ctx, long_PIN.c_str(), 0) == HOTPVERIFY_ERR_INVALID_PARAMS);
+    CHECK(hotpverify_nk3_change_pin(ctx, admin_PIN, long_PIN.c_str()) == HOTPVERIFY_ERR_INVALID_PARAMS);
+    CHECK(hotpverify_nk3_reset(ctx, long_PIN.c_str()) == HOTPVERIFY_ERR_INVALID_PARAMS);
+
+    CHECK(hotpverify_set_secret(ctx, longest_secret.c_str(), admin_PIN, 0xFFFFFFFE) == HOTPVERIFY_OK);
+    CHECK(hotpverify_is_connected(ctx));
+    hotpverify_free(ctx);
+}
+
+TEST_CASE("Library reports the counter drift of the accepted codes", "[emulated][library]") {
+    emulator::reset();
+    const size_t index = emulator::add_pro(0x5151);
+    emulator::program_hotp(index, "12345678901234567890", 0);
+    hotpverify_context *ctx = hotpverify_new();
+    REQUIRE(ctx != nullptr);
+    REQUIRE(hotpverify_connect(ctx) == HOTPVERIFY_OK);
+
+    struct hotpverify_check_details details = {};
+    // RFC 4226 code of the counter 2
+    CHECK(hotpverify_check_code_detailed(ctx, "359152", &details) == HOTPVERIFY_CODE_VALID);
+    CHECK(details.drift == 2);
+    CHECK(details.latency_us > 0);
+    CHECK(hotpverify_check_code_detailed(ctx, "359152", &details) == HOTPVERIFY_CODE_INVALID);
+    CHECK(details.drift == HOTPVERIFY_DRIFT_UNKNOWN);
+    CHECK(hotpverify_check_code_detailed(ctx, "359152", nullptr) == HOTPVERIFY_ERR_INVALID_PARAMS);
+    hotpverify_free(ctx);
+}
+
+TEST_CASE("Library drops the messages without a handler", "[emulated][library]") {
+    emulator::reset();
+    hotpverify_context *ctx = hotpverify_new();
+    REQUIRE(ctx != nullptr);
+
+    ConsoleCapture console;
+    // no device attached
+    hotpverify_set_timeout(ctx, 500);
+    const int connected = hotpverify_connect(ctx);
+    const std::string printed = console.read();
+
+    CHECK(connected != HOTPVERIFY_OK);
+    CHECK_FALSE(hotpverify_is_connected(ctx));
+    CHECK(printed.empty());
+    hotpverify_free(ctx);
+}
@@ -0,0 +1,114 @@
+/*
+ * Copyright (c) 2023 Nitrokey GmbH
+ *
+ * This file is part of Nitrokey HOTP verification project.
+ *
+ * Nitrokey HOTP verification is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * Nitrokey HOTP verification is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Nitrokey HOTP verification. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0
+ */
+
+#include "catch.hpp"
+#include "device_emulator.h"
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <unistd.h>
+
+extern "C" {
+#include "../src/metrics.h"
+#include "../src/operations.h"
+#include "../src/return_codes.h"
+}
+
+static std::string read_file(const std::string &path) {
+    std::ifstream f(path);
+    std::stringstream s;
+    s << f.rdbuf();
+    return s.str();
+}
+
+TEST_CASE("Nitrokey Pro reports the counter drift of the accepted codes", "[emulated][metrics]") {
+    emulator::reset();
+    const size_t index = emulator::add_pro(0x5151);
+    emulator::program_hotp(index, "12345678901234567890", 0);
+    struct Device dev = {};
+    device_set_connection_hints(&dev, CONNECTION_HID, 'P');
+    REQUIRE(device_connect(&dev) == RET_NO_ERROR);
+    // the Nitrokey Pro tells its serial in the status only
+    CHECK(dev.card_serial == 0);
+    struct FullResponseStatus status = {};
+    REQUIRE(device_get_status(&dev, &status) == RET_NO_ERROR);
+    CHECK(dev.card_serial == 0x5151);
+
+    struct VerifyDetails details;
+    // RFC 4226 codes of the counters 2 and 3
+    REQUIRE(check_code_on_device_detailed(&dev, "359152", &details) == RET_VALIDATION_PASSED);
+    CHECK(details.drift == 2);
+    CHECK(details.latency_us > 0);
+    REQUIRE(check_code_on_device_detailed(&dev, "969429", &details) == RET_VALIDATION_PASSED);
+    CHECK(details.drift == 0);
+    REQUIRE(check_code_on_device_detailed(&dev, "969429", &details) == RET_VALIDATION_FAILED);
+    CHECK(details.drift == VERIFY_DRIFT_UNKNOWN);
+    CHECK(check_code_on_device_detailed(&dev, "x", &details) == RET_BADLY_FORMATTED_HOTP_CODE);
+    device_disconnect(&dev);
+}
+
+TEST_CASE("Nitrokey 3 does not report the counter drift", "[emulated][metrics]") {
+    emulator::reset();
+    emulator::add_nk3(0x4242);
+    struct Device dev = {};
+    REQUIRE(device_connect(&dev) == RET_NO_ERROR);
+    // taken from the SELECT of the Secrets App on connection
+    CHECK(dev.card_serial == 0x4242);
+    REQUIRE(set_secret_on_device(&dev, "GEZDGNBVGY3TQOJQGEZDGNBVGY3TQOJQ", "12345678", 0) == RET_NO_ERROR);
+
+    struct VerifyDetails details;
+    REQUIRE(check_code_on_device_detailed(&dev, "287082", &details) == RET_VALIDATION_PASSED);
+    CHECK(details.drift == VERIFY_DRIFT_UNKNOWN);
+    CHECK(details.latency_us > 0);
+    device_disconnect(&dev);
+}
+
+TEST_CASE("Verification metrics are appended below a single header", "[metrics]") {
+    char path[] = "/tmp/hotp-metrics-XXXXXX";
+    const int fd = mkstemp(path);
+    REQUIRE(fd >= 0);
+    close(fd);
+
+    struct VerificationMetrics metrics = {};
+    metrics.serial = 0x5151;
+    metrics.model = device_find_model(NITROKEY_USB_VID, NITROKEY_PRO_USB_PID);
+    metrics.transport = CONNECTION_HID;
+    metrics.result = RET_VALIDATION_PASSED;
+    metrics.details.drift = 3;
+    metrics.details.latency_us = 1500;
+    REQUIRE(metrics_append_verification(path, &metrics) == RET_NO_ERROR);
+    metrics.result = RET_VALIDATION_FAILED;
+    metrics.details.drift = VERIFY_DRIFT_UNKNOWN;
+    REQUIRE(metrics_append_verification(path, &metrics) == RET_NO_ERROR);
+
+    std::istringstream lines(read_file(path));
+    std::string line;
+    REQUIRE(std::getline(lines, line));
+    CHECK(line == "time\tserial\tmodel\ttransport\tresult\tdrift\tlatency_us");
+    REQUIRE(std::getline(lines, line));
+    CHECK(line.find("\t0x5151\tNitrokey Pro\thid\tpassed\t3\t1500") != std::string::npos);
+    REQUIRE(std::getline(lines, line));
+    CHECK(line.find("\tfailed\t-\t1500") != std::string::npos);
+    CHECK(!std::getline(lines, line));
+    unlink(path);
+
+    CHECK(metrics_append_verification("/nonexistent/metrics", &metrics) == RET_NOT_FOUND);
+}
@@ -0,0 +1,129 @@
+/*
+ * Copyright (c) 2023 Nitrokey GmbH
+ *
+ * This file is part of Nitrokey HOTP verification project.
+ *
+ * Nitrokey HOTP verification is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * Nitrokey HOTP verification is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Nitrokey HOTP verification. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0
+ */
+
+#include "catch.hpp"
+#include "device_emulator.h"
+
+extern "C" {
+#include "../src/operations.h"
+#include "../src/return_codes.h"
+}
+
+static const char *base32_secret = "GEZDGNBVGY3TQOJQGEZDGNBVGY3TQOJQ";
+
+TEST_CASE("Nitrokey 3 served by pcscd is reached over PC/SC", "[emulated][pcsc]") {
+    emulator::reset();
+    const size_t index = emulator::add_nk3(0x3131);
+    emulator::attach_to_pcscd(index);
+    struct Device dev = {};
+    device_set_connection_hints(&dev, CONNECTION_CCID, 0);
+    REQUIRE(device_connect(&dev) == RET_NO_ERROR);
+    CHECK(dev.ccid_backend_connected == CCID_BACKEND_PCSC);
+
+    REQUIRE(set_secret_on_device(&dev, base32_secret, "12345678", 0) == RET_NO_ERROR);
+    CHECK(check_code_on_device(&dev, "755224") == RET_VALIDATION_PASSED);
+    CHECK(check_code_on_device(&dev, "755224") == RET_VALIDATION_FAILED);
+    struct FullResponseStatus status = {};
+    REQUIRE(device_get_status(&dev, &status) == RET_NO_ERROR);
+    CHECK(status.response_status.card_serial_u32 == 0x3131);
+    device_disconnect(&dev);
+
+    CHECK(dev.ccid_backend_connected == CCID_BACKEND_AUTO);
+    CHECK(emulator::device_stats(index).open_handles == 0);
+    CHECK(emulator::global_stats().pcsc_contexts == 0);
+    CHECK(emulator::global_stats().open_contexts == 0);
+}
+
+TEST_CASE("CCID backend can be forced", "[emulated][pcsc]") {
+    emulator::reset();
+    const size_t index = emulator::add_nk3(0x3232);
+    struct Device dev = {};
+    device_set_connection_hints(&dev, CONNECTION_CCID, 0);
+
+    SECTION("PC/SC without pcscd serving the device") {
+        device_set_ccid_backend(&dev, CCID_BACKEND_PCSC, NULL);
+        CHECK(device_connect(&dev) == RET_COMM_ERROR);
+    }
+    SECTION("libusb with the interface claimed by pcscd") {
+        emulator::attach_to_pcscd(index);
+        device_set_ccid_backend(&dev, CCID_BACKEND_LIBUSB, NULL);
+        dev.deadline = deadline_in(200);
+        CHECK(device_connect(&dev) == RET_TIMEOUT);
+    }
+    SECTION("libusb") {
+        device_set_ccid_backend(&dev, CCID_BACKEND_LIBUSB, NULL);
+        REQUIRE(device_connect(&dev) == RET_NO_ERROR);
+        CHECK(dev.ccid_backend_connected == CCID_BACKEND_LIBUSB);
+        device_disconnect(&dev);
+    }
+    CHECK(emulator::global_stats().pcsc_contexts == 0);
+    CHECK(emulator::device_stats(index).open_handles == 0);
+}
+
+TEST_CASE("PC/SC readers are filtered by name", "[emulated][pcsc]") {
+    emulator::reset();
+    emulator::attach_to_pcscd(emulator::add_nk3(0x3333));
+    const size_t second = emulator::add_nk3(0x3434);
+    emulator::attach_to_pcscd(second);
+
+    struct Device dev = {};
+    device_set_connection_hints(&dev, CONNECTION_CCID, 0);
+    device_set_ccid_backend(&dev, CCID_BACKEND_PCSC, "Smart Card Reader");
+    CHECK(device_connect(&dev) == RET_COMM_ERROR);
+
+    device_set_ccid_backend(&dev, CCID_BACKEND_PCSC, "Interface] 01");
+    REQUIRE(device_connect(&dev) == RET_NO_ERROR);
+    struct FullResponseStatus status = {};
+    device_get_status(&dev, &status);
+    CHECK(status.response_status.card_serial_u32 == 0x3434);
+
+    // the other reader is taken by the next connection, while this one holds its lock
+    struct Device other = {};
+    device_set_connection_hints(&other, CONNECTION_CCID, 0);
+    device_set_ccid_backend(&other, CCID_BACKEND_PCSC, NULL);
+    REQUIRE(device_connect(&other) == RET_NO_ERROR);
+    device_get_status(&other, &status);
+    CHECK(status.response_status.card_serial_u32 == 0x3333);
+    device_disconnect(&other);
+    device_disconnect(&dev);
+    CHECK(emulator::device_stats(second).open_handles == 0);
+}
+
+TEST_CASE("A card removed from the reader is reported without retrying", "[emulated][pcsc][disconnect]") {
+    emulator::reset();
+    const size_t index = emulator::add_nk3(0x3535);
+    emulator::attach_to_pcscd(index);
+    struct Device dev = {};
+    device_set_connection_hints(&dev, CONNECTION_CCID, 0);
+    device_set_ccid_backend(&dev, CCID_BACKEND_PCSC, NULL);
+    REQUIRE(device_connect(&dev) == RET_NO_ERROR);
+    REQUIRE(set_secret_on_device(&dev, base32_secret, "12345678", 0) == RET_NO_ERROR);
+
+    emulator::unplug(index);
+    const auto exchanges = emulator::device_stats(index).exchanges;
+    CHECK(check_code_on_device(&dev, "755224") == RET_CONNECTION_LOST);
+    CHECK(dev.removed);
+    CHECK(dev.retry_stats.retries == 0);
+    CHECK(check_code_on_device(&dev, "755224") == RET_CONNECTION_LOST);
+    CHECK(emulator::device_stats(index).exchanges == exchanges);
+    device_disconnect(&dev);
+    CHECK(device_connect(&dev) != RET_NO_ERROR);
+}
@@ -0,0 +1,93 @@
+/*
+ * Copyright (c) 2023 Nitrokey GmbH
+ *
+ * This file is part of Nitrokey HOTP verification project.
+ *
+ * Nitrokey HOTP verification is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * Nitrokey HOTP verification is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Nitrokey HOTP verification. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0
+ */
+
+#include "catch.hpp"
+#include "device_emulator.h"
+
+extern "C" {
+#include "../src/device.h"
+#include "../src/operations.h"
+#include "../src/return_codes.h"
+#include "../src/structs.h"
+}
+
+static const char *base32_secret = "GEZDGNBVGY3TQOJQGEZDGNBVGY3TQOJQ";
+static const char *admin_PIN = "12345678";
+
+static void check_nk3_status(struct Device *dev) {
+    struct FullResponseStatus status = {};
+    REQUIRE(device_get_status(dev, &status) == RET_NO_ERROR);
+    CHECK(status.device_type == Nk3);
+    CHECK(status.nk3_extra_info.firmware_version == ((1u << 22) | (7u << 6) | 2u));
+    CHECK(status.nk3_extra_info.pgp_user_pin_retries == 3);
+    CHECK(status.nk3_extra_info.pgp_admin_pin_retries == 3);
+    CHECK(status.response_status.card_serial_u32 == 0x1234);
+}
+
+TEST_CASE("Independent status queries are exchanged at once", "[emulated][pipeline]") {
+    emulator::reset();
+    const size_t index = emulator::add_nk3(0x1234);
+    struct Device dev = {};
+    REQUIRE(device_connect(&dev) == RET_NO_ERROR);
+    // the status reports no PIN attempts otherwise
+    REQUIRE(set_secret_on_device(&dev, base32_secret, admin_PIN, 0) == RET_NO_ERROR);
+
+    SECTION("one message in flight by default") {
+        check_nk3_status(&dev);
+        CHECK(emulator::device_stats(index).max_queued_responses == 1);
+    }
+
+    SECTION("messages sent ahead, when the reader queues them") {
+        dev.ccid_pipeline_depth = 4;
+        check_nk3_status(&dev);
+        CHECK(emulator::device_stats(index).max_queued_responses == 4);
+    }
+
+    CHECK(emulator::device_stats(index).sequence_errors == 0);
+    device_disconnect(&dev);
+}
+
+TEST_CASE("Responses are matched to the messages by the sequence number", "[emulated][pipeline]") {
+    emulator::reset();
+    const size_t index = emulator::add_nk3(0x1234);
+    struct Device dev = {};
+    REQUIRE(device_connect(&dev) == RET_NO_ERROR);
+    REQUIRE(set_secret_on_device(&dev, base32_secret, admin_PIN, 0) == RET_NO_ERROR);
+
+    SECTION("a stale response is dropped") {
+        emulator::inject_stray_response(index, -1);
+        CHECK(check_code_on_device(&dev, "755224") == RET_VALIDATION_PASSED);
+        CHECK(check_code_on_device(&dev, "287082") == RET_VALIDATION_PASSED);
+    }
+
+    SECTION("a stale response is dropped in a batch") {
+        dev.ccid_pipeline_depth = 4;
+        emulator::inject_stray_response(index, -2);
+        check_nk3_status(&dev);
+    }
+
+    SECTION("a response to a message never sent is an error") {
+        emulator::inject_stray_response(index, 5);
+        CHECK(check_code_on_device(&dev, "755224") == RET_COMM_ERROR);
+    }
+
+    device_disconnect(&dev);
+}
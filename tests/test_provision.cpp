@@ -0,0 +1,171 @@
+/*
+ * Copyright (c) 2023 Nitrokey GmbH
+ *
+ * This file is part of Nitrokey HOTP verification project.
+ *
+ * Nitrokey HOTP verification is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * Nitrokey HOTP verification is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Nitrokey HOTP verification. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0
+ */
+
+#include "catch.hpp"
+#include "device_emulator.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+extern "C" {
+#include "../src/hotp.h"
+#include "../src/provision.h"
+#include "../src/return_codes.h"
+}
+
+// RFC 4226 secret "12345678901234567890"
+static const char *RFC_SECRET = "GEZDGNBVGY3TQOJQGEZDGNBVGY3TQOJQ";
+
+static std::string write_manifest(const char *content) {
+    char path[] = "/tmp/hotp-manifest-XXXXXX";
+    const int fd = mkstemp(path);
+    REQUIRE(fd >= 0);
+    REQUIRE(write(fd, content, strlen(content)) == (ssize_t) strlen(content));
+    close(fd);
+    return path;
+}
+
+static const struct ProvisionResult *find_result(const std::vector<ProvisionResult> &results, size_t count, uint32_t serial) {
+    for (size_t i = 0; i < count; ++i) {
+        if (results[i].serial == serial) return &results[i];
+    }
+    return nullptr;
+}
+
+TEST_CASE("Host HOTP calculation matches the RFC 4226 test values", "[provision]") {
+    const uint8_t *key = (const uint8_t *) "12345678901234567890";
+    const uint32_t expected[] = {755224, 287082, 359152, 969429, 338314, 254676, 287922, 162583, 399871, 520489};
+    for (uint64_t counter = 0; counter < sizeof(expected) / sizeof(expected[0]); ++counter) {
+        REQUIRE(hotp_calculate(key, 20, counter, 6) == expected[counter]);
+    }
+    REQUIRE(hotp_calculate(key, 20, 0, 8) == 84755224);
+}
+
+TEST_CASE("Manifest parsing", "[provision]") {
+    struct ProvisionManifest manifest;
+
+    SECTION("comments, empty lines and hexadecimal serials") {
+        const std::string path = write_manifest("# serial secret counter pin\n"
+                                                "\n"
+                                                "0x100 GEZDGNBVGY3TQOJQGEZDGNBVGY3TQOJQ 0 12345678\n"
+                                                "  257\tGEZDGNBVGY3TQOJQ 42 87654321  \n");
+        REQUIRE(provision_manifest_load(path.c_str(), &manifest) == RET_NO_ERROR);
+        REQUIRE(manifest.count == 2);
+        REQUIRE(manifest.entries[0].serial == 0x100);
+        REQUIRE(std::string(manifest.entries[0].secret) == RFC_SECRET);
+        REQUIRE(manifest.entries[0].counter == 0);
+        REQUIRE(manifest.entries[1].serial == 0x101);
+        REQUIRE(manifest.entries[1].counter == 42);
+        REQUIRE(std::string(manifest.entries[1].pin) == "87654321");
+        provision_manifest_free(&manifest);
+        unlink(path.c_str());
+    }
+
+    SECTION("malformed lines are refused") {
+        const char *bad[] = {
+                "0x100 GEZDGNBVGY3TQOJQ 0\n",
+                "0x100 GEZDGNBVGY3TQOJQ 0 12345678 extra\n",
+                "serial GEZDGNBVGY3TQOJQ 0 12345678\n",
+                "0x100 not-base32 0 12345678\n",
+                // one character over the longest secret of 64
+                "0x100 GEZDGNBVGY3TQOJQGEZDGNBVGY3TQOJQGEZDGNBVGY3TQOJQGEZDGNBVGY3TQOJQG 0 12345678\n",
+                "0x100 GEZDGNBVGY3TQOJQ -1 12345678\n",
+                "0x100 GEZDGNBVGY3TQOJQ 0 12345678\n0x100 GEZDGNBVGY3TQOJQ 1 12345678\n",
+                "# no keys\n",
+        };
+        for (auto content: bad) {
+            const std::string path = write_manifest(content);
+            REQUIRE(provision_manifest_load(path.c_str(), &manifest) == RET_INVALID_PARAMS);
+            REQUIRE(manifest.entries == nullptr);
+            unlink(path.c_str());
+        }
+        REQUIRE(provision_manifest_load("/nonexistent/manifest", &manifest) == RET_INVALID_PARAMS);
+    }
+}
+
+TEST_CASE("All attached keys are provisioned in parallel, and checked with their first code", "[emulated][provision]") {
+    emulator::reset();
+    emulator::add_nk3(0x100);
+    emulator::add_nk3(0x101);
+    emulator::add_nk3(0x102);
+    // the second key takes the longest secret, of 40 bytes
+    const std::string path = write_manifest("0x100 GEZDGNBVGY3TQOJQGEZDGNBVGY3TQOJQ 0 12345678\n"
+                                            "0x101 GEZDGNBVGY3TQOJQGEZDGNBVGY3TQOJQGEZDGNBVGY3TQOJQGEZDGNBVGY3TQOJQ 5 23456789\n"
+                                            "0x999 GEZDGNBVGY3TQOJQ 0 12345678\n");
+    struct ProvisionManifest manifest;
+    REQUIRE(provision_manifest_load(path.c_str(), &manifest) == RET_NO_ERROR);
+
+    struct Device settings = {};
+    device_set_connection_hints(&settings, CONNECTION_CCID, 0);
+    REQUIRE(device_count_available(&settings) == 3);
+    std::vector<ProvisionResult> results(3 + manifest.count);
+    size_t count = 0;
+    REQUIRE(provision_all(&manifest, &settings, results.data(), results.size(), &count) == RET_NO_ERROR);
+    REQUIRE(count == 4);
+
+    for (uint32_t serial: {0x100u, 0x101u}) {
+        const ProvisionResult *r = find_result(results, count, serial);
+        REQUIRE(r != nullptr);
+        REQUIRE(r->state == PROVISION_DONE);
+        REQUIRE(r->status == RET_NO_ERROR);
+    }
+    const ProvisionResult *not_listed = find_result(results, count, 0x102);
+    REQUIRE(not_listed != nullptr);
+    REQUIRE(not_listed->state == PROVISION_NOT_LISTED);
+    // the keys not attached follow the attached ones
+    REQUIRE(results[3].serial == 0x999);
+    REQUIRE(results[3].state == PROVISION_NOT_ATTACHED);
+
+    char *log_buffer = nullptr;
+    size_t log_size = 0;
+    FILE *log = open_memstream(&log_buffer, &log_size);
+    provision_log_write(log, results.data(), count);
+    fclose(log);
+    const std::string text(log_buffer, log_size);
+    free(log_buffer);
+    REQUIRE(text.rfind("serial\tresult\tstatus\tconnect_ms\twrite_ms\tverify_ms\n", 0) == 0);
+    REQUIRE(text.find("0x100\tprovisioned\t") != std::string::npos);
+    REQUIRE(text.find("0x102\tnot-listed\t") != std::string::npos);
+    REQUIRE(text.find("0x999\tnot-attached\t") != std::string::npos);
+
+    provision_manifest_free(&manifest);
+    unlink(path.c_str());
+}
+
+TEST_CASE("Provisioning without the attached keys fails, and lists the keys as not attached", "[emulated][provision]") {
+    emulator::reset();
+    const std::string path = write_manifest("0x100 GEZDGNBVGY3TQOJQ 0 12345678\n");
+    struct ProvisionManifest manifest;
+    REQUIRE(provision_manifest_load(path.c_str(), &manifest) == RET_NO_ERROR);
+    struct Device settings = {};
+    device_set_connection_hints(&settings, CONNECTION_CCID, 0);
+    std::vector<ProvisionResult> results(manifest.count + 1);
+    size_t count = 0;
+    REQUIRE(provision_all(&manifest, &settings, results.data(), results.size(), &count) == RET_NOT_FOUND);
+    REQUIRE(count == 1);
+    REQUIRE(results[0].serial == 0x100);
+    REQUIRE(results[0].state == PROVISION_NOT_ATTACHED);
+    provision_manifest_free(&manifest);
+    unlink(path.c_str());
+}
@@ -0,0 +1,172 @@
+/*
+ * Copyright (c) 2023 Nitrokey GmbH
+ *
+ * This file is part of Nitrokey HOTP verification project.
+ *
+ * Nitrokey HOTP verification is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * Nitrokey HOTP verification is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Nitrokey HOTP verification. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0
+ */
+
+#include "catch.hpp"
+#include "device_emulator.h"
+
+extern "C" {
+#include "../src/ccid.h"
+#include "../src/device.h"
+#include "../src/operations.h"
+#include "../src/retry_policy.h"
+#include "../src/return_codes.h"
+#include "../src/settings.h"
+#include "../src/utils.h"
+}
+
+using emulator::UsbFault;
+
+static const char *base32_secret = "GEZDGNBVGY3TQOJQGEZDGNBVGY3TQOJQ";
+static const char *binary_secret = "12345678901234567890";
+static const char *admin_PIN = "12345678";
+
+TEST_CASE("The commands are told apart by their effect on the device", "[retry]") {
+    CHECK(retry_classify_hid_command(GET_STATUS) == COMMAND_IDEMPOTENT);
+    CHECK(retry_classify_hid_command(GET_PASSWORD_RETRY_COUNT) == COMMAND_IDEMPOTENT);
+    CHECK(retry_classify_hid_command(VERIFY_OTP_CODE) == COMMAND_NOT_IDEMPOTENT);
+    CHECK(retry_classify_hid_command(FIRST_AUTHENTICATE) == COMMAND_NOT_IDEMPOTENT);
+    CHECK(retry_classify_hid_command(NEW_AES_KEY) == COMMAND_NOT_IDEMPOTENT);
+
+    uint8_t message[SMALL_CCID_BUFFER_SIZE] = {};
+    const uint32_t select_length = icc_append_select(message, sizeof message, 0, Application_Secrets);
+    CHECK(retry_classify_ccid_message(message, select_length) == COMMAND_IDEMPOTENT);
+    const struct {
+        uint8_t ins;
+        uint8_t p1;
+        CommandKind kind;
+    } apdus[] = {
+            {Ins_List, 0, COMMAND_IDEMPOTENT},
+            {Ins_CalculateAll, 0, COMMAND_NOT_IDEMPOTENT},
+            {Ins_VerifyCode, 0, COMMAND_NOT_IDEMPOTENT},
+            {Ins_VerifyPIN, 0, COMMAND_NOT_IDEMPOTENT},
+            {Ins_Put, 0, COMMAND_NOT_IDEMPOTENT},
+            {Ins_SendRemaining, 0, COMMAND_NOT_IDEMPOTENT},
+    };
+    for (const auto &apdu: apdus) {
+        const uint32_t length = icc_append_apdu(message, sizeof message, 0, apdu.ins, apdu.p1, 0, 0);
+        CAPTURE(apdu.ins);
+        CHECK(retry_classify_ccid_message(message, length) == apdu.kind);
+    }
+}
+
+TEST_CASE("Transient errors on the Nitrokey 3 are retried only where safe", "[emulated][retry]") {
+    emulator::reset();
+    const size_t index = emulator::add_nk3(0x4711);
+    emulator::VirtualClock clock;
+    struct Device dev = {};
+    REQUIRE(device_connect(&dev) == RET_NO_ERROR);
+    REQUIRE(set_secret_on_device(&dev, base32_secret, admin_PIN, 0) == RET_NO_ERROR);
+    const auto exchanges = emulator::device_stats(index).exchanges;
+    virtual_clock_reset();
+    IccResult result = {};
+
+    SECTION("a SELECT with its response lost is sent again") {
+        emulator::inject_usb_errors(index, UsbFault::BulkIn, 1);
+        REQUIRE(send_select_ccid(&dev, &result) == RET_NO_ERROR);
+        CHECK(result.data_status_code == 0x9000);
+        CHECK(dev.retry_stats.retries == 1);
+        CHECK(emulator::device_stats(index).exchanges == exchanges + 2);
+        CHECK(virtual_clock_slept_us() == RETRY_BACKOFF_US);
+    }
+
+    SECTION("a message, which did not reach the device, is sent again whatever it does") {
+        emulator::inject_usb_errors(index, UsbFault::BulkOut, 1);
+        CHECK(check_code_on_device(&dev, "755224") == RET_VALIDATION_PASSED);
+        CHECK(dev.retry_stats.retries == 1);
+        CHECK(dev.retry_stats.refused == 0);
+    }
+
+    SECTION("a verification with its response lost is not repeated, which would burn the next code") {
+        emulator::inject_usb_errors(index, UsbFault::BulkIn, 1);
+        CHECK(check_code_on_device(&dev, "755224") == RET_COMM_ERROR);
+        CHECK(dev.retry_stats.retries == 0);
+        CHECK(dev.retry_stats.refused == 1);
+        CHECK(emulator::device_stats(index).exchanges == exchanges + 1);
+        // the device has taken the first code, the counter moved by one only
+        CHECK(check_code_on_device(&dev, "287082") == RET_VALIDATION_PASSED);
+    }
+
+    SECTION("the attempts are bounded, with a doubled backoff") {
+        emulator::inject_usb_errors(index, UsbFault::BulkIn, 10);
+        CHECK(send_select_ccid(&dev, &result) == RET_COMM_ERROR);
+        CHECK(dev.retry_stats.retries == RETRY_ATTEMPTS - 1);
+        CHECK(dev.retry_stats.exhausted == 1);
+        CHECK(emulator::device_stats(index).exchanges == exchanges + RETRY_ATTEMPTS);
+        CHECK(virtual_clock_slept_us() == RETRY_BACKOFF_US + 2 * RETRY_BACKOFF_US);
+    }
+
+    SECTION("the batch of the status queries is exchanged again") {
+        emulator::inject_usb_errors(index, UsbFault::BulkIn, 1);
+        struct FullResponseStatus status = {};
+        CHECK(device_get_status(&dev, &status) == RET_NO_ERROR);
+        CHECK(dev.retry_stats.retries == 1);
+    }
+
+    SECTION("the retries can be disabled") {
+        device_set_retry_policy(&dev, &retry_policy_none);
+        emulator::inject_usb_errors(index, UsbFault::BulkIn, 1);
+        CHECK(send_select_ccid(&dev, &result) == RET_COMM_ERROR);
+        CHECK(dev.retry_stats.retries == 0);
+        CHECK(dev.retry_stats.exhausted == 1);
+        CHECK(virtual_clock_slept_us() == 0);
+    }
+
+    device_disconnect(&dev);
+}
+
+TEST_CASE("Transient errors on the Nitrokey Pro are retried only where safe", "[emulated][retry]") {
+    emulator::reset();
+    const size_t index = emulator::add_pro(0x5151);
+    emulator::program_hotp(index, binary_secret, 0);
+    emulator::VirtualClock clock;
+    struct Device dev = {};
+    REQUIRE(device_connect(&dev) == RET_NO_ERROR);
+    struct FullResponseStatus status = {};
+
+    SECTION("a failed report read is read again") {
+        emulator::inject_usb_errors(index, UsbFault::HidGetReport, 2);
+        CHECK(device_get_status(&dev, &status) == RET_NO_ERROR);
+        CHECK(status.response_status.card_serial_u32 == 0x5151);
+        CHECK(dev.retry_stats.retries == 2);
+    }
+
+    SECTION("a status query, which failed to be sent, is sent again") {
+        emulator::inject_usb_errors(index, UsbFault::HidSetReport, 1);
+        CHECK(device_get_status(&dev, &status) == RET_NO_ERROR);
+        CHECK(dev.retry_stats.retries == 1);
+    }
+
+    SECTION("a verification, which failed to be sent, is not repeated") {
+        emulator::inject_usb_errors(index, UsbFault::HidSetReport, 1);
+        CHECK(check_code_on_device(&dev, "755224") == RET_CONNECTION_LOST);
+        CHECK(dev.retry_stats.refused == 1);
+        CHECK(check_code_on_device(&dev, "755224") == RET_VALIDATION_PASSED);
+    }
+
+    SECTION("a status query is asked again, once the reads are used up") {
+        emulator::inject_usb_errors(index, UsbFault::HidGetReport, RETRY_ATTEMPTS);
+        CHECK(device_get_status(&dev, &status) == RET_NO_ERROR);
+        CHECK(dev.retry_stats.exhausted == 1);
+        CHECK(dev.retry_stats.retries == RETRY_ATTEMPTS);
+    }
+
+    device_disconnect(&dev);
+}
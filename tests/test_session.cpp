@@ -0,0 +1,94 @@
+/*
+ * Copyright (c) 2023 Nitrokey GmbH
+ *
+ * This file is part of Nitrokey HOTP verification project.
+ *
+ * Nitrokey HOTP verification is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * Nitrokey HOTP verification is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Nitrokey HOTP verification. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0
+ */
+
+#include "catch.hpp"
+#include "device_emulator.h"
+#include <chrono>
+#include <thread>
+
+extern "C" {
+#include "../src/device.h"
+#include "../src/operations.h"
+#include "../src/operations_ccid.h"
+#include "../src/return_codes.h"
+#include "../src/session.h"
+}
+
+static const char *base32_secret = "GEZDGNBVGY3TQOJQGEZDGNBVGY3TQOJQ";
+static const char *admin_PIN = "12345678";
+
+TEST_CASE("Admin operations reuse the authenticated session", "[emulated][session]") {
+    emulator::reset();
+    const size_t index = emulator::add_nk3(0x1234);
+    struct Device dev = {};
+    REQUIRE(device_connect(&dev) == RET_NO_ERROR);
+    // sets the PIN on the first use
+    REQUIRE(set_secret_on_device(&dev, base32_secret, admin_PIN, 0) == RET_NO_ERROR);
+
+    SECTION("consecutive writes skip the authentication") {
+        REQUIRE(session_begin(&dev, admin_PIN, 0) == RET_NO_ERROR);
+        const auto verifications = emulator::device_stats(index).pin_verifications;
+        for (int i = 0; i < 5; ++i) {
+            REQUIRE(set_secret_on_device(&dev, base32_secret, nullptr, 0) == RET_NO_ERROR);
+        }
+        CHECK(emulator::device_stats(index).pin_verifications == verifications);
+        CHECK(check_code_on_device(&dev, "755224") == RET_VALIDATION_PASSED);
+    }
+
+    SECTION("writes without the session are rejected") {
+        CHECK(set_secret_on_device(&dev, base32_secret, nullptr, 0) == RET_SESSION_EXPIRED);
+    }
+
+    SECTION("a wrong PIN does not open the session") {
+        CHECK(session_begin(&dev, "wrong PIN", 0) == RET_WRONG_PIN);
+        CHECK_FALSE(session_is_active(&dev));
+        CHECK(set_secret_on_device(&dev, base32_secret, nullptr, 0) == RET_SESSION_EXPIRED);
+    }
+
+    SECTION("the session expires") {
+        REQUIRE(session_begin(&dev, admin_PIN, 50) == RET_NO_ERROR);
+        REQUIRE(set_secret_on_device(&dev, base32_secret, nullptr, 0) == RET_NO_ERROR);
+        std::this_thread::sleep_for(std::chrono::milliseconds(80));
+        CHECK(set_secret_on_device(&dev, base32_secret, nullptr, 0) == RET_SESSION_EXPIRED);
+    }
+
+    SECTION("selecting another application ends the session") {
+        REQUIRE(session_begin(&dev, admin_PIN, 0) == RET_NO_ERROR);
+        struct FullResponseStatus status = {};
+        device_get_status(&dev, &status);
+        CHECK_FALSE(session_is_active(&dev));
+        CHECK(set_secret_on_device(&dev, base32_secret, nullptr, 0) == RET_SESSION_EXPIRED);
+    }
+
+    SECTION("changing the PIN ends the session") {
+        REQUIRE(session_begin(&dev, admin_PIN, 0) == RET_NO_ERROR);
+        REQUIRE(nk3_change_pin(&dev, admin_PIN, "87654321") == RET_NO_ERROR);
+        CHECK_FALSE(session_is_active(&dev));
+    }
+
+    SECTION("disconnecting ends the session") {
+        REQUIRE(session_begin(&dev, admin_PIN, 0) == RET_NO_ERROR);
+        device_disconnect(&dev);
+        CHECK_FALSE(session_is_active(&dev));
+    }
+
+    device_disconnect(&dev);
+}
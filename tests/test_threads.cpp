@@ -0,0 +1,103 @@
+/*
+ * Copyright (c) 2023 Nitrokey GmbH
+ *
+ * This file is part of Nitrokey HOTP verification project.
+ *
+ * Nitrokey HOTP verification is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * Nitrokey HOTP verification is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Nitrokey HOTP verification. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0
+ */
+
+#include "catch.hpp"
+#include "device_emulator.h"
+#include <atomic>
+#include <set>
+#include <thread>
+#include <vector>
+
+extern "C" {
+#include "../src/device.h"
+#include "../src/operations.h"
+#include "../src/return_codes.h"
+}
+
+static const char *base32_secret = "GEZDGNBVGY3TQOJQGEZDGNBVGY3TQOJQ";
+static const char *admin_PIN = "12345678";
+static const char *RFC_HOTP_codes[] = {
+        "755224",
+        "287082",
+        "359152",
+        "969429",
+        "338314",
+        "254676",
+};
+
+TEST_CASE("Emulated devices are driven from parallel threads", "[emulated][threads]") {
+    const size_t devices_count = 8;
+    const int rounds = 3;
+    emulator::reset();
+    for (size_t i = 0; i < devices_count; ++i) {
+        emulator::add_nk3(0x1000 + i);
+    }
+
+    std::atomic<int> failures{0};
+    // devices are kept connected until every thread has read the status in the first round
+    std::atomic<size_t> first_round_done{0};
+    std::vector<uint32_t> serials(devices_count);
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t < devices_count; ++t) {
+        threads.emplace_back([&, t]() {
+            for (int round = 0; round < rounds; ++round) {
+                struct Device dev = {};
+                if (device_connect(&dev) != RET_NO_ERROR) {
+                    failures++;
+                    if (round == 0) first_round_done++;
+                    return;
+                }
+                struct FullResponseStatus status = {};
+                const int res = device_get_status(&dev, &status);
+                if (res != RET_NO_ERROR && res != RET_NO_PIN_ATTEMPTS) failures++;
+                if (round == 0) {
+                    serials[t] = status.response_status.card_serial_u32;
+                    first_round_done++;
+                    while (first_round_done < devices_count) {
+                        std::this_thread::yield();
+                    }
+                }
+                if (set_secret_on_device(&dev, base32_secret, admin_PIN, 0) != RET_NO_ERROR) failures++;
+                for (auto c: RFC_HOTP_codes) {
+                    if (check_code_on_device(&dev, c) != RET_VALIDATION_PASSED) failures++;
+                }
+                if (check_code_on_device(&dev, RFC_HOTP_codes[0]) != RET_VALIDATION_FAILED) failures++;
+                device_disconnect(&dev);
+            }
+        });
+    }
+    for (auto &t: threads) {
+        t.join();
+    }
+
+    REQUIRE(failures == 0);
+    // each thread got its own device, while all of them were connected
+    REQUIRE(std::set<uint32_t>(serials.begin(), serials.end()).size() == devices_count);
+    for (size_t i = 0; i < devices_count; ++i) {
+        const auto stats = emulator::device_stats(i);
+        INFO("Device " << i);
+        REQUIRE(stats.exchanges > 0);
+        REQUIRE(stats.sequence_errors == 0);
+        REQUIRE(stats.open_handles == 0);
+    }
+    REQUIRE(emulator::global_stats().open_contexts == 0);
+    REQUIRE(emulator::global_stats().hidapi_users == 0);
+}
@@ -0,0 +1,95 @@
+/*
+ * Copyright (c) 2023 Nitrokey GmbH
+ *
+ * This file is part of Nitrokey HOTP verification project.
+ *
+ * Nitrokey HOTP verification is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * Nitrokey HOTP verification is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Nitrokey HOTP verification. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0
+ */
+
+#include "catch.hpp"
+#include "device_emulator.h"
+#include <vector>
+
+extern "C" {
+#include "../src/device.h"
+#include "../src/operations.h"
+#include "../src/return_codes.h"
+}
+
+static const char *base32_secret = "GEZDGNBVGY3TQOJQGEZDGNBVGY3TQOJQ";
+static const char *admin_PIN = "12345678";
+
+static void record_event(TouchEvent event, void *user_data) {
+    static_cast<std::vector<TouchEvent> *>(user_data)->push_back(event);
+}
+
+static std::vector<TouchEvent> expected_events(unsigned time_extensions) {
+    std::vector<TouchEvent> events = {TOUCH_REQUIRED};
+    events.insert(events.end(), time_extensions - 1, TOUCH_WAITING);
+    events.push_back(TOUCH_RECEIVED);
+    return events;
+}
+
+TEST_CASE("Touch progress is reported through the callback", "[emulated][touch]") {
+    const unsigned time_extensions = 4;
+    emulator::reset();
+    const size_t index = emulator::add_nk3(0x1234);
+    struct Device dev = {};
+    REQUIRE(device_connect(&dev) == RET_NO_ERROR);
+    REQUIRE(set_secret_on_device(&dev, base32_secret, admin_PIN, 0) == RET_NO_ERROR);
+    emulator::require_touch(index, time_extensions);
+
+    std::vector<TouchEvent> events;
+
+    SECTION("blocking") {
+        device_set_touch_handler(&dev, record_event, &events, false);
+        REQUIRE(check_code_on_device(&dev, "755224") == RET_VALIDATION_PASSED);
+        CHECK(events == expected_events(time_extensions));
+    }
+
+    SECTION("non-blocking calls resume the waiting exchange") {
+        device_set_touch_handler(&dev, record_event, &events, true);
+        const auto exchanges = emulator::device_stats(index).exchanges;
+        unsigned calls = 0;
+        int res;
+        do {
+            res = check_code_on_device(&dev, "755224");
+            calls++;
+        } while (res == RET_TOUCH_REQUIRED && calls < 100);
+        CHECK(res == RET_VALIDATION_PASSED);
+        CHECK(calls == time_extensions + 1);
+        CHECK(events == expected_events(time_extensions));
+        // the message was sent once
+        CHECK(emulator::device_stats(index).exchanges == exchanges + 1);
+        CHECK(emulator::device_stats(index).sequence_errors == 0);
+        // the next code is checked as usual
+        CHECK(check_code_on_device(&dev, "287082") == RET_TOUCH_REQUIRED);
+    }
+
+    SECTION("a different command waits for the pending touch") {
+        emulator::require_touch(index, emulator::NEVER_TOUCHED);
+        device_set_touch_handler(&dev, record_event, &events, true);
+        REQUIRE(check_code_on_device(&dev, "755224") == RET_TOUCH_REQUIRED);
+        const auto exchanges = emulator::device_stats(index).exchanges;
+        CHECK(check_code_on_device(&dev, "287082") == RET_TOUCH_REQUIRED);
+        CHECK(emulator::device_stats(index).exchanges == exchanges);
+        CHECK(events == std::vector<TouchEvent>{TOUCH_REQUIRED, TOUCH_WAITING});
+    }
+
+    device_disconnect(&dev);
+    CHECK(dev.touch_pending == false);
+    CHECK(emulator::device_stats(index).open_handles == 0);
+}
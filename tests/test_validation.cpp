@@ -0,0 +1,65 @@
+/*
+ * Copyright (c) 2023 Nitrokey GmbH
+ *
+ * This file is part of Nitrokey HOTP verification project.
+ *
+ * Nitrokey HOTP verification is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * Nitrokey HOTP verification is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Nitrokey HOTP verification. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0
+ */
+
+#include "catch.hpp"
+#include "device_emulator.h"
+#include <string>
+
+extern "C" {
+#include "../src/device.h"
+#include "../src/operations.h"
+#include "../src/return_codes.h"
+}
+
+TEST_CASE("Arguments are validated without the device", "[emulated][validation]") {
+    // no device is attached - any I/O attempt would fail with a connection error
+    emulator::reset();
+
+    CHECK(validate_hotp_code("755224") == RET_NO_ERROR);
+    CHECK(validate_hotp_code("12345678") == RET_NO_ERROR);
+    CHECK(validate_hotp_code("") == RET_BADLY_FORMATTED_HOTP_CODE);
+    CHECK(validate_hotp_code("75522a") == RET_BADLY_FORMATTED_HOTP_CODE);
+    CHECK(validate_hotp_code("123456789") == RET_BADLY_FORMATTED_HOTP_CODE);
+
+    CHECK(validate_base32_secret("GEZDGNBVGY3TQOJQGEZDGNBVGY3TQOJQ") == RET_NO_ERROR);
+    CHECK(validate_base32_secret("") == RET_BADLY_FORMATTED_BASE32_STRING);
+    CHECK(validate_base32_secret("gezdgnbv") == RET_BADLY_FORMATTED_BASE32_STRING);
+    CHECK(validate_base32_secret(std::string(65, 'A').c_str()) == RET_BADLY_FORMATTED_BASE32_STRING);
+
+    CHECK(validate_pin("12345678") == RET_NO_ERROR);
+    CHECK(validate_pin(std::string(MAX_PIN_SIZE_CCID, '1').c_str()) == RET_NO_ERROR);
+    CHECK(validate_pin(std::string(MAX_PIN_SIZE_CCID + 1, '1').c_str()) == RET_TOO_LONG_PIN);
+
+    uint64_t counter = 1;
+    CHECK(validate_counter("0", &counter) == RET_NO_ERROR);
+    CHECK(counter == 0);
+    CHECK(validate_counter("4294967294", &counter) == RET_NO_ERROR);
+    CHECK(counter == 4294967294u);
+    CHECK(validate_counter("4294967295", &counter) == RET_INVALID_PARAMS);
+    CHECK(validate_counter("-1", &counter) == RET_INVALID_PARAMS);
+    CHECK(validate_counter("", &counter) == RET_INVALID_PARAMS);
+
+    // the operations refuse the malformed arguments before any exchange
+    struct Device dev = {};
+    dev.connection_type = CONNECTION_CCID;
+    CHECK(check_code_on_device(&dev, "abc") == RET_BADLY_FORMATTED_HOTP_CODE);
+    CHECK(set_secret_on_device(&dev, "not base32", "12345678", 0) == RET_BADLY_FORMATTED_BASE32_STRING);
+}
@@ -0,0 +1,83 @@
+/*
+ * Copyright (c) 2023 Nitrokey GmbH
+ *
+ * This file is part of Nitrokey HOTP verification project.
+ *
+ * Nitrokey HOTP verification is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * any later version.
+ *
+ * Nitrokey HOTP verification is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Nitrokey HOTP verification. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * SPDX-License-Identifier: GPL-3.0
+ */
+
+#include "catch.hpp"
+#include "device_emulator.h"
+
+extern "C" {
+#include "../src/device.h"
+#include "../src/operations.h"
+#include "../src/return_codes.h"
+#include "../src/session.h"
+}
+
+static const char *base32_secret = "GEZDGNBVGY3TQOJQGEZDGNBVGY3TQOJQ";
+static const char *admin_PIN = "12345678";
+
+static unsigned exchanges_of_write(size_t index, struct Device *dev, const char *PIN) {
+    const auto before = emulator::device_stats(index).exchanges;
+    REQUIRE(set_secret_on_device(dev, base32_secret, PIN, 0) == RET_NO_ERROR);
+    return emulator::device_stats(index).exchanges - before;
+}
+
+TEST_CASE("Writing the secret uses the minimal command sequence", "[emulated][write]") {
+    emulator::reset();
+    const size_t index = emulator::add_nk3(0x1234);
+    struct Device dev = {};
+    REQUIRE(device_connect(&dev) == RET_NO_ERROR);
+
+    SECTION("the first write sets the PIN without a failing verification") {
+        // SetPIN, VerifyPIN, Put
+        CHECK(exchanges_of_write(index, &dev, admin_PIN) == 3);
+        CHECK(emulator::device_stats(index).pin_verifications == 1);
+        CHECK(check_code_on_device(&dev, "755224") == RET_VALIDATION_PASSED);
+    }
+
+    SECTION("an existing credential is overwritten in place") {
+        REQUIRE(set_secret_on_device(&dev, base32_secret, admin_PIN, 0) == RET_NO_ERROR);
+        // VerifyPIN, Put
+        CHECK(exchanges_of_write(index, &dev, admin_PIN) == 2);
+        CHECK(check_code_on_device(&dev, "755224") == RET_VALIDATION_PASSED);
+    }
+
+    SECTION("writes within a session skip the authentication") {
+        REQUIRE(set_secret_on_device(&dev, base32_secret, admin_PIN, 0) == RET_NO_ERROR);
+        REQUIRE(session_begin(&dev, admin_PIN, 0) == RET_NO_ERROR);
+        CHECK(exchanges_of_write(index, &dev, nullptr) == 1);
+        session_end(&dev);
+    }
+
+    SECTION("a refused overwrite falls back to delete and put") {
+        REQUIRE(set_secret_on_device(&dev, base32_secret, admin_PIN, 0) == RET_NO_ERROR);
+        emulator::reject_overwrite(index);
+        // VerifyPIN, Put, Delete, Put
+        CHECK(exchanges_of_write(index, &dev, admin_PIN) == 4);
+        CHECK(check_code_on_device(&dev, "755224") == RET_VALIDATION_PASSED);
+    }
+
+    SECTION("a wrong PIN does not write") {
+        REQUIRE(set_secret_on_device(&dev, base32_secret, admin_PIN, 0) == RET_NO_ERROR);
+        CHECK(set_secret_on_device(&dev, base32_secret, "wrong PIN", 0) == RET_SECURITY_STATUS_NOT_SATISFIED);
+        CHECK(check_code_on_device(&dev, "755224") == RET_VALIDATION_PASSED);
+    }
+
+    device_disconnect(&dev);
+}